@@ -0,0 +1,303 @@
+/*
+ * Transfer benchmarks for ST-Link
+ *
+ * Copyright (c) 2011 Andreas Färber
+ *
+ * Licensed under the GNU General Public License (GPL) version 2, or
+ * at your option, any later version.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "stlink.h"
+#include "stlink-libusb.h"
+#include "stlink-emu.h"
+#include "stlink-log.h"
+#include "stlink-poll.h"
+#include "stlink-read.h"
+#include "stlink-session.h"
+#include "stlink-transport.h"
+#include "stm8.h"
+
+#define BENCH_READ_TOTAL    (16 * 1024)
+
+enum {
+    FORMAT_JSON,
+    FORMAT_CSV,
+};
+
+typedef struct BenchResult {
+    const char *name;
+    uint32_t chunk;         // bytes per command, 0 if not applicable
+    int iterations;
+    uint64_t min_us;
+    uint64_t avg_us;
+    uint64_t p50_us;
+    uint64_t p99_us;
+    uint64_t max_us;
+    uint64_t bytes_per_second;
+} BenchResult;
+
+static int format = FORMAT_JSON;
+static int results;
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void bench_summarize(BenchResult *result, uint64_t *samples, int count, uint64_t bytes)
+{
+    qsort(samples, count, sizeof(uint64_t), compare_u64);
+    uint64_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += samples[i];
+    }
+    result->iterations = count;
+    result->min_us = samples[0];
+    result->avg_us = total / count;
+    result->p50_us = samples[count / 2];
+    result->p99_us = samples[(count * 99) / 100];
+    result->max_us = samples[count - 1];
+    result->bytes_per_second = (total > 0) ? bytes * 1000000 / total : 0;
+}
+
+static void bench_print(const BenchResult *result)
+{
+    if (format == FORMAT_CSV) {
+        printf("%s,%" PRIu32 ",%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+               result->name, result->chunk, result->iterations,
+               result->min_us, result->avg_us, result->p50_us, result->p99_us, result->max_us,
+               result->bytes_per_second);
+        return;
+    }
+    printf("%s    {\"name\": \"%s\", \"chunk\": %" PRIu32 ", \"iterations\": %d,"
+           " \"min_us\": %" PRIu64 ", \"avg_us\": %" PRIu64 ", \"p50_us\": %" PRIu64 ","
+           " \"p99_us\": %" PRIu64 ", \"max_us\": %" PRIu64 ", \"bytes_per_second\": %" PRIu64 "}",
+           (results > 0) ? ",\n" : "", result->name, result->chunk, result->iterations,
+           result->min_us, result->avg_us, result->p50_us, result->p99_us, result->max_us,
+           result->bytes_per_second);
+    results++;
+}
+
+typedef int (*bench_fn)(stlink *stl, uint32_t chunk, uint8_t *buf);
+
+// Times fn over the given number of iterations, each moving chunk bytes.
+static int bench_run(stlink *stl, const char *name, bench_fn fn, int iterations,
+                     uint32_t chunk, uint8_t *buf)
+{
+    uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+    if (samples == NULL)
+        return -1;
+    for (int i = 0; i < iterations; i++) {
+        uint64_t start = stlink_time_us();
+        if (fn(stl, chunk, buf) != 0) {
+            fprintf(stderr, "%s: %s failed\n", __func__, name);
+            free(samples);
+            return -1;
+        }
+        samples[i] = stlink_time_us() - start;
+    }
+    BenchResult result = {
+        .name = name,
+        .chunk = chunk,
+    };
+    bench_summarize(&result, samples, iterations, (uint64_t)chunk * iterations);
+    bench_print(&result);
+    free(samples);
+    return 0;
+}
+
+static int bench_get_current_mode(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    return (stlink_get_current_mode(stl) < 0) ? -1 : 0;
+}
+
+static int bench_get_busy(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    uint32_t status;
+    return stlink_swim_get_busy(stl, &status);
+}
+
+static int bench_swim_read(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    return stlink_swim_read_wait(stl, STM8S105_FLASH_START, chunk, buf);
+}
+
+static int bench_swim_write(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    return stlink_swim_write_wait(stl, STM8S105_RAM_START, chunk, buf);
+}
+
+static int bench_read_range(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    uint32_t crc = 0;
+    return stlink_swim_read_range(stl, STM8S105_FLASH_START, chunk, stlink_sink_crc32, &crc);
+}
+
+static int bench_prologue(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    return stlink_swim_prologue(stl, NULL);
+}
+
+static int bench_epilogue(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    return stlink_swim_epilogue(stl, NULL);
+}
+
+static int bench_session(stlink *stl, uint32_t chunk, uint8_t *buf)
+{
+    if (stlink_swim_prologue(stl, NULL) != 0)
+        return -1;
+    return stlink_swim_epilogue(stl, NULL);
+}
+
+static int bench(stlink *stl, int iterations)
+{
+    int ret = bench_run(stl, "get_current_mode", bench_get_current_mode, iterations, 0, NULL);
+    if (ret != 0)
+        return -1;
+
+    int mode = stlink_get_current_mode(stl);
+    if (mode == STLINK_DEV_DFU_MODE) {
+        stlink_exit_dfu_mode(stl);
+        mode = stlink_get_current_mode(stl);
+    }
+    if (mode != -1 && mode != STLINK_DEV_SWIM_MODE) {
+        stlink_swim_enter(stl);
+        mode = stlink_get_current_mode(stl);
+    }
+    if (mode != STLINK_DEV_SWIM_MODE) {
+        fprintf(stderr, "%s: entering SWIM mode failed\n", __func__);
+        return -1;
+    }
+    uint16_t size;
+    if (stlink_swim_get_size(stl, &size) != 0 ||
+        stlink_swim_get_02(stl, 0x01) != 0 ||
+        stlink_swim_do_07(stl) != 0 ||
+        stlink_swim_wait(stl) != 0)
+        return -1;
+
+    uint8_t *buf = malloc(size);
+    if (buf == NULL)
+        return -1;
+    memset(buf, 0xa5, size);
+
+    ret = bench_run(stl, "swim_prologue", bench_prologue, iterations, 0, NULL);
+    ret = ret || bench_run(stl, "swim_get_busy", bench_get_busy, iterations, 0, NULL);
+    for (uint32_t chunk = 1; ret == 0 && chunk <= size; chunk *= 2) {
+        int n = (chunk < BENCH_READ_TOTAL) ? BENCH_READ_TOTAL / chunk : 1;
+        n = (n < iterations) ? n : iterations;
+        ret = bench_run(stl, "swim_read", bench_swim_read, n, chunk, buf);
+    }
+    // RAM is the only region that can be written freely.
+    for (uint32_t chunk = 1; ret == 0 && chunk <= size && chunk <= STM8S105_RAM_SIZE; chunk *= 2) {
+        ret = bench_run(stl, "swim_write", bench_swim_write, iterations, chunk, buf);
+    }
+    ret = ret || bench_run(stl, "read_range", bench_read_range, 1, STM8S105_FLASH_SIZE, NULL);
+    ret = ret || bench_run(stl, "swim_epilogue", bench_epilogue, iterations, 0, NULL);
+    ret = ret || bench_run(stl, "swim_session", bench_session, iterations, 0, NULL);
+
+    free(buf);
+    stlink_swim_exit(stl);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-e] [-l latency_us] [-n iterations] [-o json|csv] [-s serial]\n"
+                    "  -e  use an emulated ST-Link instead of USB\n"
+                    "  -l  per-transfer latency of the emulated ST-Link\n"
+                    "  -n  iterations per measurement\n"
+                    "  -o  output format\n"
+                    "  -s  open the ST-Link with the given serial number\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    bool emulate = false;
+    unsigned int latency_us = 1000;
+    int iterations = 20;
+    stlink_probe_info match;
+    memset(&match, 0, sizeof(match));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "el:n:o:s:")) != -1) {
+        switch (opt) {
+        case 'e':
+            emulate = true;
+            break;
+        case 'l':
+            latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            iterations = strtol(optarg, NULL, 0);
+            if (iterations < 1) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "json") == 0) {
+                format = FORMAT_JSON;
+            } else if (strcmp(optarg, "csv") == 0) {
+                format = FORMAT_CSV;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        case 's':
+            snprintf(match.serial, sizeof(match.serial), "%s", optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // stdout carries the results only.
+    stlink_log_set_level(STLINK_LOG_ERROR);
+
+    libusb_context *usb_context = NULL;
+    stlink *stl;
+    if (emulate) {
+        stl = stlink_emu_open(latency_us);
+    } else {
+        if (libusb_init(&usb_context) != 0) {
+            fprintf(stderr, "USB init failed, exiting.\n");
+            return -1;
+        }
+        stl = stlink_open_probe(usb_context, &match);
+    }
+    if (stl == NULL) {
+        fprintf(stderr, "Opening ST-Link device failed.\n");
+        if (usb_context != NULL)
+            libusb_exit(usb_context);
+        return -1;
+    }
+
+    if (format == FORMAT_CSV) {
+        printf("name,chunk,iterations,min_us,avg_us,p50_us,p99_us,max_us,bytes_per_second\n");
+    } else {
+        printf("{\n  \"transport\": \"%s\",\n", stlink_get_transport_name(stl));
+        if (emulate)
+            printf("  \"latency_us\": %u,\n", latency_us);
+        else
+            printf("  \"serial\": \"%s\",\n", stlink_get_serial(stl));
+        printf("  \"results\": [\n");
+    }
+    int ret = bench(stl, iterations);
+    if (format == FORMAT_JSON)
+        printf("\n  ],\n  \"ok\": %s\n}\n", (ret == 0) ? "true" : "false");
+
+    stlink_close(stl);
+    if (usb_context != NULL)
+        libusb_exit(usb_context);
+    return (ret == 0) ? 0 : -1;
+}
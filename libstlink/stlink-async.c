@@ -0,0 +1,271 @@
+/*
+ * Asynchronous, pipelined command submission
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Each command is split into its CBW, data and CSW transfers, which are all
+ * submitted up front instead of one blocking round trip after another.
+ * The device handles CBWs strictly in order, so up to async_depth commands
+ * can be queued behind each other and complete in submission order.
+ * Retired commands are kept, transfers included, for reuse.
+ */
+
+#include "stlink-libusb.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bswap.h"
+#include "stlink.h"
+#include "stlink-internal.h"
+
+
+enum {
+    ASYNC_CBW,
+    ASYNC_DATA,
+    ASYNC_CSW,
+    ASYNC_TRANSFERS,
+};
+
+struct STLinkAsyncCommand {
+    stlink *stl;
+    STLinkAsyncCommand *next;
+    USBCommandBlockWrapper cbw;
+    USBCommandStatusWrapper csw;
+    struct libusb_transfer *transfers[ASYNC_TRANSFERS];
+    uint8_t inflight; // bitmask of submitted, not yet completed transfers
+    bool failed;
+    uint32_t tag;
+    int transfer_length;
+    stlink_command_cb cb;
+    void *opaque;
+};
+
+// Once one transfer failed, everything queued behind it is out of sync.
+static void async_abort(stlink *stl)
+{
+    for (STLinkAsyncCommand *cmd = stl->async_head; cmd != NULL; cmd = cmd->next) {
+        cmd->failed = true;
+        for (int i = 0; i < ASYNC_TRANSFERS; i++) {
+            if (cmd->inflight & (1 << i)) {
+                stl->ops->cancel_transfer(stl, cmd->transfers[i]);
+            }
+        }
+    }
+}
+
+static void LIBUSB_CALL async_transfer_done(struct libusb_transfer *transfer)
+{
+    STLinkAsyncCommand *cmd = transfer->user_data;
+    int i;
+    for (i = 0; i < ASYNC_TRANSFERS; i++) {
+        if (cmd->transfers[i] == transfer)
+            break;
+    }
+    cmd->inflight &= ~(1 << i);
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED && !cmd->failed) {
+        STLINK_ERR(TRANSPORT, "%s: transfer %d of tag %08" PRIx32 " failed: %d",
+                __func__, i, cmd->tag, transfer->status);
+        async_abort(cmd->stl);
+    }
+}
+
+static int async_status(STLinkAsyncCommand *cmd)
+{
+    if (cmd->failed)
+        return -1;
+
+    struct libusb_transfer *transfer = cmd->transfers[ASYNC_CSW];
+    if (transfer->actual_length != sizeof(cmd->csw)) {
+        STLINK_ERR(TRANSPORT, "%s: received unexpected amount: %d", __func__, transfer->actual_length);
+        return -1;
+    }
+    uint32_t signature = le32_to_cpu(cmd->csw.dCSWSignature);
+    if (signature != USB_CSW_SIGNATURE) {
+        STLINK_ERR(TRANSPORT, "%s: received wrong signature: %04" PRIX32,
+                __func__, signature);
+        return -1;
+    }
+    // Unlike the synchronous path a stale tag means the pipeline is skewed.
+    uint32_t tag = le32_to_cpu(cmd->csw.dCSWTag);
+    if (tag != cmd->tag) {
+        STLINK_ERR(TRANSPORT, "%s: received tag %08" PRIx32 " but expected %08" PRIx32,
+                __func__, tag, cmd->tag);
+        return -1;
+    }
+    if (cmd->csw.bCSWStatus != USB_CSW_STATUS_COMMAND_PASSED) {
+        STLINK_ERR(TRANSPORT, "%s: receiving status: %02x", __func__, cmd->csw.bCSWStatus);
+        return -1;
+    }
+    transfer = cmd->transfers[ASYNC_DATA];
+    if (cmd->transfer_length > 0 && transfer->actual_length != cmd->transfer_length) {
+        STLINK_ERR(TRANSPORT, "%s: transferred unexpected amount: %d", __func__, transfer->actual_length);
+        return -1;
+    }
+    return 0;
+}
+
+static void async_destroy(stlink *stl, STLinkAsyncCommand *cmd)
+{
+    for (int i = 0; i < ASYNC_TRANSFERS; i++) {
+        if (cmd->transfers[i] != NULL)
+            libusb_free_transfer(cmd->transfers[i]);
+    }
+    stlink_mem_free(stl, (uint8_t *)cmd, sizeof(STLinkAsyncCommand));
+}
+
+static void async_free(stlink *stl, STLinkAsyncCommand *cmd)
+{
+    cmd->next = stl->async_free;
+    stl->async_free = cmd;
+}
+
+void stlink_async_free_all(stlink *stl)
+{
+    while (stl->async_free != NULL) {
+        STLinkAsyncCommand *cmd = stl->async_free;
+        stl->async_free = cmd->next;
+        async_destroy(stl, cmd);
+    }
+}
+
+static STLinkAsyncCommand *async_alloc(stlink *stl)
+{
+    STLinkAsyncCommand *cmd = stl->async_free;
+    if (cmd != NULL) {
+        stl->async_free = cmd->next;
+    } else {
+        cmd = (STLinkAsyncCommand *)stlink_mem_alloc(stl, sizeof(STLinkAsyncCommand));
+        if (cmd == NULL)
+            return NULL;
+        memset(&cmd->cbw, 0, sizeof(cmd->cbw));
+        for (int i = 0; i < ASYNC_TRANSFERS; i++) {
+            cmd->transfers[i] = libusb_alloc_transfer(0);
+            if (cmd->transfers[i] == NULL) {
+                while (--i >= 0)
+                    libusb_free_transfer(cmd->transfers[i]);
+                stlink_mem_free(stl, (uint8_t *)cmd, sizeof(STLinkAsyncCommand));
+                return NULL;
+            }
+        }
+    }
+    cmd->stl = stl;
+    cmd->next = NULL;
+    cmd->inflight = 0;
+    cmd->failed = false;
+    return cmd;
+}
+
+// Completes finished commands from the head of the queue, in order.
+static int async_retire(stlink *stl, int *failures)
+{
+    int retired = 0;
+    while (stl->async_head != NULL && stl->async_head->inflight == 0) {
+        STLinkAsyncCommand *cmd = stl->async_head;
+        stl->async_head = cmd->next;
+        if (stl->async_head == NULL)
+            stl->async_tail = NULL;
+        stl->async_pending--;
+
+        int status = async_status(cmd);
+        if (status != 0)
+            (*failures)++;
+        if (cmd->cb != NULL)
+            cmd->cb(stl, status, cmd->opaque);
+        async_free(stl, cmd);
+        retired++;
+    }
+    return retired;
+}
+
+int stlink_wait_commands(stlink *stl, int max_pending)
+{
+    int failures = 0;
+    if (max_pending < 0)
+        max_pending = 0;
+    while (stl->async_pending > max_pending) {
+        if (async_retire(stl, &failures) > 0)
+            continue;
+        struct timeval tv = { .tv_sec = 0, .tv_usec = 100 * 1000 };
+        int ret = stl->ops->handle_events(stl, &tv);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            STLINK_ERR(TRANSPORT, "%s: handling events failed: %d", __func__, ret);
+            return -1;
+        }
+    }
+    return (failures > 0) ? -1 : 0;
+}
+
+int stlink_pending_commands(stlink *stl)
+{
+    return stl->async_pending;
+}
+
+void stlink_set_async_depth(stlink *stl, int depth)
+{
+    stl->async_depth = (depth < 1) ? 1 : depth;
+}
+
+/*
+ * Queues a command without waiting for it.  buffer must stay valid until
+ * cb has been invoked, which happens exactly once from within
+ * stlink_wait_commands() (or a later submit), also if submission failed.
+ */
+int stlink_submit_command(stlink *stl, uint8_t *cdb, uint8_t cdb_length,
+                          uint8_t *buffer, int transfer_length, bool inbound,
+                          stlink_command_cb cb, void *opaque)
+{
+    STLINK_LOG_HEX(STLINK_LOG_DEBUG, STLINK_LOG_CDB, "CDB (async)", cdb, cdb_length);
+    if (stl->async_pending >= stl->async_depth)
+        stlink_wait_commands(stl, stl->async_depth - 1);
+
+    STLinkAsyncCommand *cmd = async_alloc(stl);
+    if (cmd == NULL)
+        return -1;
+    cmd->cb = cb;
+    cmd->opaque = opaque;
+    cmd->transfer_length = transfer_length;
+    uint8_t lun = 0;
+    cmd->tag = stlink_fill_cbw(stl, &cmd->cbw, cdb, cdb_length, lun,
+                               LIBUSB_ENDPOINT_IN, transfer_length);
+
+    // Transfers queued behind others only start once those are done.
+    unsigned int timeout = STLINK_TIMEOUT_MS * stl->async_depth;
+    libusb_fill_bulk_transfer(cmd->transfers[ASYNC_CBW], stl->handle, stl->endpoint_out,
+                              (unsigned char *)&cmd->cbw, sizeof(cmd->cbw),
+                              async_transfer_done, cmd, timeout);
+    if (transfer_length > 0) {
+        libusb_fill_bulk_transfer(cmd->transfers[ASYNC_DATA], stl->handle,
+                                  (!inbound) ? stl->endpoint_out : stl->endpoint_in,
+                                  buffer, transfer_length,
+                                  async_transfer_done, cmd, timeout);
+    }
+    libusb_fill_bulk_transfer(cmd->transfers[ASYNC_CSW], stl->handle, stl->endpoint_in,
+                              (unsigned char *)&cmd->csw, sizeof(cmd->csw),
+                              async_transfer_done, cmd, timeout);
+
+    if (stl->async_tail != NULL)
+        stl->async_tail->next = cmd;
+    else
+        stl->async_head = cmd;
+    stl->async_tail = cmd;
+    stl->async_pending++;
+
+    for (int i = 0; i < ASYNC_TRANSFERS; i++) {
+        if (i == ASYNC_DATA && transfer_length <= 0)
+            continue;
+        int ret = stl->ops->submit_transfer(stl, cmd->transfers[i]);
+        if (ret != LIBUSB_SUCCESS) {
+            STLINK_ERR(TRANSPORT, "%s: submitting transfer %d failed: %d", __func__, i, ret);
+            async_abort(stl);
+            return -1;
+        }
+        cmd->inflight |= 1 << i;
+    }
+    return 0;
+}
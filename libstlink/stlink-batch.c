@@ -0,0 +1,243 @@
+/*
+ * Batched SWIM operations
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Every SWIM operation is followed by a STLINK_SWIM_GET_BUSY poll, reads by
+ * the STLINK_SWIM_READ fetching the data.  A batch submits these through
+ * the asynchronous command path step by step: each operation goes out
+ * together with its first poll and only further polls, if any, cost extra
+ * round trips.  Sending the whole batch back to back does not work, as
+ * even a short read at low speed keeps the SWIM line busy for longer than
+ * the next command takes to arrive, and writes such as the flash keys
+ * cannot simply be replayed once found to have been issued too early.
+ */
+
+#include "stlink-batch.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+
+
+typedef struct STLinkBatchOp {
+    uint8_t cdb[16];
+    uint8_t cdb_length;
+    bool read;
+    uint8_t *data;      // write data phase (owned) or read destination
+    uint16_t length;
+    uint16_t swim_len;
+    uint8_t busy[4];    // reply to the trailing STLINK_SWIM_GET_BUSY
+    int status;
+} STLinkBatchOp;
+
+struct STLinkBatch {
+    stlink *stl;
+    STLinkBatchOp *ops;
+    int count;
+    int capacity;
+    int failed_op;
+};
+
+stlink_batch *stlink_batch_new(stlink *stl)
+{
+    stlink_batch *batch = calloc(1, sizeof(stlink_batch));
+    if (batch == NULL)
+        return NULL;
+    batch->stl = stl;
+    batch->failed_op = -1;
+    return batch;
+}
+
+void stlink_batch_clear(stlink_batch *batch)
+{
+    for (int i = 0; i < batch->count; i++) {
+        if (!batch->ops[i].read)
+            free(batch->ops[i].data);
+    }
+    batch->count = 0;
+    batch->failed_op = -1;
+}
+
+void stlink_batch_free(stlink_batch *batch)
+{
+    if (batch == NULL)
+        return;
+
+    stlink_batch_clear(batch);
+    free(batch->ops);
+    free(batch);
+}
+
+int stlink_batch_count(stlink_batch *batch)
+{
+    return batch->count;
+}
+
+int stlink_batch_failed_op(stlink_batch *batch)
+{
+    return batch->failed_op;
+}
+
+static STLinkBatchOp *batch_add(stlink_batch *batch)
+{
+    if (batch->count == batch->capacity) {
+        int capacity = (batch->capacity > 0) ? batch->capacity * 2 : 32;
+        STLinkBatchOp *ops = realloc(batch->ops, capacity * sizeof(STLinkBatchOp));
+        if (ops == NULL)
+            return NULL;
+        batch->ops = ops;
+        batch->capacity = capacity;
+    }
+    STLinkBatchOp *op = &batch->ops[batch->count++];
+    memset(op, 0, sizeof(STLinkBatchOp));
+    return op;
+}
+
+int stlink_batch_swim_do(stlink_batch *batch, uint8_t cmd)
+{
+    STLinkBatchOp *op = batch_add(batch);
+    if (op == NULL)
+        return -1;
+    op->cdb_length = stlink_swim_cdb(op->cdb, cmd);
+    return 0;
+}
+
+int stlink_batch_swim_do_03(stlink_batch *batch, uint8_t x)
+{
+    STLinkBatchOp *op = batch_add(batch);
+    if (op == NULL)
+        return -1;
+    stlink_swim_cdb(op->cdb, STLINK_SWIM_DO_03);
+    op->cdb[2] = x;
+    op->cdb_length = 3;
+    return 0;
+}
+
+int stlink_batch_swim_write(stlink_batch *batch, uint32_t addr, uint16_t len, const uint8_t *buffer)
+{
+    STLinkBatchOp *op = batch_add(batch);
+    if (op == NULL)
+        return -1;
+    op->cdb_length = stlink_swim_write_cdb(op->cdb, addr, len, buffer);
+    op->swim_len = len;
+    stlink_target_written(batch->stl, addr, len, buffer);
+    if (len > 8) {
+        op->length = len - 8;
+        op->data = malloc(op->length);
+        if (op->data == NULL) {
+            batch->count--;
+            return -1;
+        }
+        memcpy(op->data, buffer + 8, op->length);
+    }
+    return 0;
+}
+
+int stlink_batch_swim_write_byte(stlink_batch *batch, uint32_t addr, uint8_t value)
+{
+    return stlink_batch_swim_write(batch, addr, 1, &value);
+}
+
+// buffer is filled in by stlink_batch_submit().
+int stlink_batch_swim_read(stlink_batch *batch, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    STLinkBatchOp *op = batch_add(batch);
+    if (op == NULL)
+        return -1;
+    op->cdb_length = stlink_swim_begin_read_cdb(op->cdb, addr, len);
+    op->read = true;
+    op->data = buffer;
+    op->length = len;
+    op->swim_len = len;
+    return 0;
+}
+
+static void batch_op_done(stlink *stl, int status, void *opaque)
+{
+    STLinkBatchOp *op = opaque;
+    if (status != 0)
+        op->status = -1;
+}
+
+// Stops at the first command not submitted, marking the operation failed.
+static int batch_submit_op(stlink *stl, STLinkBatchOp *op)
+{
+    uint8_t cdb[2];
+    int ret;
+
+    op->status = 0;
+    memset(op->busy, 0xff, sizeof(op->busy));
+    if (op->read) {
+        ret = stlink_submit_command(stl, op->cdb, op->cdb_length, NULL, 0, true,
+                                    batch_op_done, op);
+    } else {
+        ret = stlink_submit_command(stl, op->cdb, op->cdb_length, op->data, op->length, false,
+                                    batch_op_done, op);
+    }
+    if (ret == 0) {
+        stlink_swim_cdb(cdb, STLINK_SWIM_GET_BUSY);
+        ret = stlink_submit_command(stl, cdb, sizeof(cdb), op->busy, sizeof(op->busy), true,
+                                    batch_op_done, op);
+    }
+    if (ret == 0 && op->read) {
+        stlink_swim_cdb(cdb, STLINK_SWIM_READ);
+        ret = stlink_submit_command(stl, cdb, sizeof(cdb), op->data, op->length, true,
+                                    batch_op_done, op);
+    }
+    if (ret != 0)
+        op->status = -1;
+    return ret;
+}
+
+// 0 when done, 1 while still in progress, -1 on error
+static int batch_op_state(STLinkBatchOp *op)
+{
+    if (op->status != 0)
+        return -1;
+    switch (op->busy[0]) {
+    case STLINK_SWIM_OK:
+        return 0;
+    case STLINK_SWIM_BUSY:
+        return 1;
+    default:
+        STLINK_ERR(SWIM, "%s: SWIM status 0x%02" PRIX8, __func__, op->busy[0]);
+        return -1;
+    }
+}
+
+int stlink_batch_submit(stlink_batch *batch)
+{
+    stlink *stl = batch->stl;
+
+    STLINK_DBG(SWIM, "submitting %d SWIM operations...", batch->count);
+    batch->failed_op = -1;
+    for (int i = 0; i < batch->count; i++) {
+        STLinkBatchOp *op = &batch->ops[i];
+        int submitted = batch_submit_op(stl, op);
+        stlink_wait_commands(stl, 0);
+        int state = (submitted == 0) ? batch_op_state(op) : -1;
+        bool stale = op->read && state == 1;
+        if (state == 1) {
+            stl->swim_op = op->cdb[1];
+            stl->swim_len = op->swim_len;
+            state = stlink_swim_wait(stl);
+        }
+        if (state == 0 && stale)
+            state = stlink_swim_read(stl, op->length, op->data);
+        if (state != 0) {
+            STLINK_ERR(SWIM, "%s: operation %d failed", __func__, i);
+            batch->failed_op = i;
+            return -1;
+        }
+    }
+    return 0;
+}
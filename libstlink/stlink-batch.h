@@ -0,0 +1,28 @@
+#ifndef STLINK_BATCH_H
+#define STLINK_BATCH_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+typedef struct STLinkBatch stlink_batch;
+
+stlink_batch *stlink_batch_new(stlink *stl);
+void stlink_batch_free(stlink_batch *batch);
+void stlink_batch_clear(stlink_batch *batch);
+int stlink_batch_count(stlink_batch *batch);
+int stlink_batch_failed_op(stlink_batch *batch);
+
+int stlink_batch_swim_do(stlink_batch *batch, uint8_t cmd);
+int stlink_batch_swim_do_03(stlink_batch *batch, uint8_t x);
+int stlink_batch_swim_write(stlink_batch *batch, uint32_t addr, uint16_t len, const uint8_t *buffer);
+int stlink_batch_swim_write_byte(stlink_batch *batch, uint32_t addr, uint8_t value);
+int stlink_batch_swim_read(stlink_batch *batch, uint32_t addr, uint16_t len, uint8_t *buffer);
+
+int stlink_batch_submit(stlink_batch *batch);
+
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Transfer buffers
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Buffers handed to the transport come from the backend where it can
+ * provide memory the host controller can access directly, and are kept
+ * in per-device pools instead of being allocated per command.
+ */
+
+#include "stlink-buffer.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bswap.h"
+#include "stlink.h"
+#include "stlink-internal.h"
+
+
+typedef struct STLinkPoolBuffer {
+    struct STLinkPoolBuffer *next;
+} STLinkPoolBuffer;
+
+uint8_t *stlink_mem_alloc(stlink *stl, size_t length)
+{
+    if (stl->dev_mem)
+        return stl->ops->mem_alloc(stl, length);
+    return malloc(length);
+}
+
+void stlink_mem_free(stlink *stl, uint8_t *buffer, size_t length)
+{
+    if (buffer == NULL)
+        return;
+    if (stl->dev_mem)
+        stl->ops->mem_free(stl, buffer, length);
+    else
+        free(buffer);
+}
+
+/*
+ * To be called once the transport is up.  Whether the backend provides
+ * memory is decided here, by the first buffer, for all that follow.
+ */
+int stlink_init_buffers(stlink *stl)
+{
+    stl->dev_mem = (stl->ops->mem_alloc != NULL && stl->ops->mem_free != NULL);
+    stl->xfer = stlink_mem_alloc(stl, STLINK_XFER_SIZE);
+    if (stl->xfer == NULL && stl->dev_mem) {
+        STLINK_DBG(TRANSPORT, "%s: no %s memory, using malloc()", __func__, stl->ops->name);
+        stl->dev_mem = false;
+        stl->xfer = stlink_mem_alloc(stl, STLINK_XFER_SIZE);
+    }
+    stl->csw = (USBCommandStatusWrapper *)stlink_mem_alloc(stl, sizeof(USBCommandStatusWrapper));
+    if (stl->xfer == NULL || stl->csw == NULL) {
+        stlink_free_buffers(stl);
+        return -1;
+    }
+    memset(stl->xfer, 0, sizeof(USBCommandBlockWrapper));
+    stlink_cbw(stl)->dCBWSignature = cpu_to_le32(USB_CBW_SIGNATURE);
+    return 0;
+}
+
+void stlink_free_buffers(stlink *stl)
+{
+    if (stl->buffers_out > 0)
+        STLINK_WARN(TRANSPORT, "%s: %d buffers still in use", __func__, stl->buffers_out);
+    while (stl->buffer_pool != NULL) {
+        STLinkPoolBuffer *buf = stl->buffer_pool;
+        stl->buffer_pool = buf->next;
+        stlink_mem_free(stl, (uint8_t *)buf, STLINK_BUFFER_SIZE);
+    }
+    stlink_async_free_all(stl);
+    stlink_mem_free(stl, (uint8_t *)stl->csw, sizeof(USBCommandStatusWrapper));
+    stlink_mem_free(stl, stl->xfer, STLINK_XFER_SIZE);
+    stl->csw = NULL;
+    stl->xfer = NULL;
+}
+
+/*
+ * Returns a buffer of up to STLINK_BUFFER_SIZE bytes suitable for data
+ * phases.  It must be released before the device is closed.
+ */
+uint8_t *stlink_buffer_alloc(stlink *stl, size_t length)
+{
+    if (length > STLINK_BUFFER_SIZE)
+        return NULL;
+    uint8_t *buf = stl->buffer_pool;
+    if (buf != NULL)
+        stl->buffer_pool = ((STLinkPoolBuffer *)buf)->next;
+    else
+        buf = stlink_mem_alloc(stl, STLINK_BUFFER_SIZE);
+    if (buf != NULL)
+        stl->buffers_out++;
+    return buf;
+}
+
+void stlink_buffer_free(stlink *stl, uint8_t *buffer)
+{
+    if (buffer == NULL)
+        return;
+    STLinkPoolBuffer *buf = (STLinkPoolBuffer *)buffer;
+    buf->next = stl->buffer_pool;
+    stl->buffer_pool = buf;
+    stl->buffers_out--;
+}
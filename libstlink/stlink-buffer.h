@@ -0,0 +1,17 @@
+#ifndef STLINK_BUFFER_H
+#define STLINK_BUFFER_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+#define STLINK_BUFFER_SIZE 0x1800 // largest SWIM transfer
+
+uint8_t *stlink_buffer_alloc(stlink *stl, size_t length);
+void stlink_buffer_free(stlink *stl, uint8_t *buffer);
+
+
+#endif
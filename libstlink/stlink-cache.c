@@ -0,0 +1,463 @@
+/*
+ * Persistent target memory cache
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Data EEPROM and flash contents last seen on a target are kept in a file
+ * per probe serial and target unique ID, mapped into memory, with a valid
+ * flag and a CRC-32 per block.  Reads of valid blocks are served from the
+ * cache, everything else is read from the target and filled in.  Nothing
+ * tells us when the target was changed behind our back, so a cache should
+ * be spot-checked against the target with stlink_cache_validate() before
+ * it is attached.  The file spans the part's data EEPROM through the end
+ * of its flash; parts without a unique ID are not cached at all, as the
+ * next board on the probe could not be told from the last one.
+ */
+
+#include "stlink-cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+
+
+#define CACHE_MAGIC     "STLC"
+#define CACHE_VERSION   2
+
+// Followed by a CRC-32 and a valid flag per block, then the data
+typedef struct CacheFile {
+    char magic[4];
+    uint32_t version;
+    uint32_t base;
+    uint32_t size;
+    uint32_t block_size;
+    uint32_t next_sample; // rotates spot checks across runs
+    char serial[STLINK_SERIAL_MAX];
+    uint8_t uid[STLINK_CACHE_UID_SIZE];
+} CacheFile;
+
+struct STLinkCache {
+    int fd;
+    CacheFile *file;
+    size_t file_size;
+    const stlink_device *dev;
+    uint32_t base;
+    uint32_t size;
+    uint32_t blocks;
+    uint32_t *crc;
+    uint8_t *valid;
+    uint8_t *data;
+};
+
+// Side effects of reading other regions rule out caching them.
+static bool cache_covers(stlink_cache *cache, uint32_t addr, uint32_t len)
+{
+    const stlink_device *dev = cache->dev;
+    uint32_t last = addr + len - 1;
+    return (stlink_device_in_eeprom(dev, addr) && stlink_device_in_eeprom(dev, last)) ||
+           (stlink_device_in_flash(dev, addr) && stlink_device_in_flash(dev, last));
+}
+
+static uint32_t cache_block(stlink_cache *cache, uint32_t addr)
+{
+    return (addr - cache->base) / STLINK_CACHE_BLOCK_SIZE;
+}
+
+static uint32_t cache_block_addr(stlink_cache *cache, uint32_t block)
+{
+    return cache->base + block * STLINK_CACHE_BLOCK_SIZE;
+}
+
+static bool cache_block_ok(stlink_cache *cache, uint32_t block)
+{
+    if (!cache->valid[block])
+        return false;
+    const uint8_t *data = &cache->data[block * STLINK_CACHE_BLOCK_SIZE];
+    return stlink_crc32(0, data, STLINK_CACHE_BLOCK_SIZE) == cache->crc[block];
+}
+
+// Data EEPROM, which is below flash on all parts, through the end of flash
+static void cache_layout(stlink_cache *cache, const stlink_device *dev)
+{
+    uint32_t end = dev->flash_start + dev->flash_size;
+    cache->dev = dev;
+    cache->base = dev->eeprom_start - dev->eeprom_start % STLINK_CACHE_BLOCK_SIZE;
+    cache->blocks = (end - cache->base + STLINK_CACHE_BLOCK_SIZE - 1) / STLINK_CACHE_BLOCK_SIZE;
+    cache->size = cache->blocks * STLINK_CACHE_BLOCK_SIZE;
+    cache->file_size = sizeof(CacheFile) + cache->blocks * (sizeof(uint32_t) + 1) + cache->size;
+}
+
+static int cache_mkdirs(char *path)
+{
+    for (char *p = path + 1; ; p++) {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0';
+        int ret = mkdir(path, 0755);
+        *p = c;
+        if (ret != 0 && errno != EEXIST)
+            return -1;
+        if (c == '\0')
+            return 0;
+    }
+}
+
+static char *cache_join(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char *path = malloc(len);
+    if (path != NULL)
+        snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static char *cache_default_dir(void)
+{
+    const char *env = getenv("STLINK_CACHE_DIR");
+    if (env != NULL && env[0] != '\0')
+        return strdup(env);
+    env = getenv("XDG_CACHE_HOME");
+    if (env != NULL && env[0] != '\0')
+        return cache_join(env, "stlink");
+    env = getenv("HOME");
+    if (env == NULL || env[0] == '\0')
+        return NULL;
+    return cache_join(env, ".cache/stlink");
+}
+
+static char *cache_path(const char *dir, const char *serial, const uint8_t *uid)
+{
+    char name[STLINK_SERIAL_MAX + 2 * STLINK_CACHE_UID_SIZE + 16];
+    int n = 0;
+    for (const char *s = serial; *s != '\0' && n < STLINK_SERIAL_MAX; s++) {
+        bool safe = (*s >= '0' && *s <= '9') || (*s >= 'A' && *s <= 'Z') ||
+                    (*s >= 'a' && *s <= 'z');
+        name[n++] = safe ? *s : '_';
+    }
+    if (n == 0)
+        n = sprintf(name, "unknown");
+    name[n++] = '-';
+    for (int i = 0; i < STLINK_CACHE_UID_SIZE; i++) {
+        n += sprintf(name + n, "%02" PRIx8, uid[i]);
+    }
+    sprintf(name + n, ".cache");
+    return cache_join(dir, name);
+}
+
+static void cache_reset(stlink_cache *cache, const char *serial, const uint8_t *uid)
+{
+    CacheFile *file = cache->file;
+    memset(file, 0, cache->file_size);
+    memcpy(file->magic, CACHE_MAGIC, sizeof(file->magic));
+    file->version = CACHE_VERSION;
+    file->base = cache->base;
+    file->size = cache->size;
+    file->block_size = STLINK_CACHE_BLOCK_SIZE;
+    snprintf(file->serial, sizeof(file->serial), "%s", serial);
+    memcpy(file->uid, uid, STLINK_CACHE_UID_SIZE);
+}
+
+static bool cache_matches(stlink_cache *cache, const char *serial, const uint8_t *uid)
+{
+    CacheFile *file = cache->file;
+    return memcmp(file->magic, CACHE_MAGIC, sizeof(file->magic)) == 0 &&
+           file->version == CACHE_VERSION &&
+           file->base == cache->base &&
+           file->size == cache->size &&
+           file->block_size == STLINK_CACHE_BLOCK_SIZE &&
+           strncmp(file->serial, serial, sizeof(file->serial)) == 0 &&
+           memcmp(file->uid, uid, STLINK_CACHE_UID_SIZE) == 0;
+}
+
+stlink_cache *stlink_cache_open(const char *dir, const char *serial, const uint8_t *uid,
+                                const stlink_device *dev)
+{
+    stlink_cache *cache = malloc(sizeof(stlink_cache));
+    if (cache == NULL)
+        return NULL;
+    cache_layout(cache, dev);
+
+    char *cache_dir = (dir != NULL) ? strdup(dir) : cache_default_dir();
+    if (cache_dir == NULL) {
+        free(cache);
+        return NULL;
+    }
+    if (cache_mkdirs(cache_dir) != 0) {
+        STLINK_WARN(DEVICE, "%s: cannot create %s: %s", __func__, cache_dir, strerror(errno));
+        free(cache_dir);
+        free(cache);
+        return NULL;
+    }
+    char *path = cache_path(cache_dir, serial, uid);
+    free(cache_dir);
+    if (path == NULL) {
+        free(cache);
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        STLINK_WARN(DEVICE, "%s: cannot open %s: %s", __func__, path, strerror(errno));
+        free(path);
+        free(cache);
+        return NULL;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        STLINK_WARN(DEVICE, "%s: %s is in use", __func__, path);
+        close(fd);
+        free(path);
+        free(cache);
+        return NULL;
+    }
+    struct stat st;
+    bool fresh = fstat(fd, &st) != 0 || st.st_size != (off_t)cache->file_size;
+    if (fresh && (ftruncate(fd, 0) != 0 || ftruncate(fd, cache->file_size) != 0)) {
+        STLINK_WARN(DEVICE, "%s: cannot size %s", __func__, path);
+        close(fd);
+        free(path);
+        free(cache);
+        return NULL;
+    }
+    CacheFile *file = mmap(NULL, cache->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED) {
+        STLINK_WARN(DEVICE, "%s: cannot map %s", __func__, path);
+        close(fd);
+        free(path);
+        free(cache);
+        return NULL;
+    }
+    cache->fd = fd;
+    cache->file = file;
+    cache->crc = (uint32_t *)(file + 1);
+    cache->valid = (uint8_t *)(cache->crc + cache->blocks);
+    cache->data = cache->valid + cache->blocks;
+    if (fresh || !cache_matches(cache, serial, uid))
+        cache_reset(cache, serial, uid);
+    STLINK_DBG(DEVICE, "using cache %s", path);
+    free(path);
+    return cache;
+}
+
+// Requires SWIM access to the target, i.e. after the prologue.
+stlink_cache *stlink_cache_open_target(stlink *stl, const char *dir)
+{
+    const stlink_device *dev = stlink_get_device(stl);
+    if (dev->uid_size == 0 || dev->uid_size > STLINK_CACHE_UID_SIZE) {
+        STLINK_INFO(DEVICE, "%s has no unique ID, not caching", dev->name);
+        return NULL;
+    }
+    uint8_t uid[STLINK_CACHE_UID_SIZE] = { 0 };
+    if (stlink_swim_read_wait(stl, dev->uid_addr, dev->uid_size, uid) != 0)
+        return NULL;
+    return stlink_cache_open(dir, stlink_get_serial(stl), uid, dev);
+}
+
+void stlink_cache_close(stlink_cache *cache)
+{
+    if (cache == NULL)
+        return;
+    munmap(cache->file, cache->file_size);
+    close(cache->fd);
+    free(cache);
+}
+
+// Returns the cached bytes if all of them are known, NULL otherwise.
+const uint8_t *stlink_cache_lookup(stlink_cache *cache, uint32_t addr, uint32_t len)
+{
+    if (len == 0 || !cache_covers(cache, addr, len))
+        return NULL;
+    for (uint32_t block = cache_block(cache, addr); block <= cache_block(cache, addr + len - 1);
+         block++) {
+        if (!cache_block_ok(cache, block))
+            return NULL;
+    }
+    return &cache->data[addr - cache->base];
+}
+
+// Blocks only partly covered by data are updated only if already valid.
+void stlink_cache_update(stlink_cache *cache, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    if (len == 0 || !cache_covers(cache, addr, len))
+        return;
+    uint32_t end = addr + len;
+    for (uint32_t block = cache_block(cache, addr); block <= cache_block(cache, end - 1);
+         block++) {
+        uint32_t block_addr = cache_block_addr(cache, block);
+        uint32_t lo = (addr > block_addr) ? addr : block_addr;
+        uint32_t hi = (end < block_addr + STLINK_CACHE_BLOCK_SIZE) ?
+                      end : block_addr + STLINK_CACHE_BLOCK_SIZE;
+        bool whole = lo == block_addr && hi == block_addr + STLINK_CACHE_BLOCK_SIZE;
+        if (!whole && !cache_block_ok(cache, block)) {
+            cache->valid[block] = 0;
+            continue;
+        }
+        uint8_t *cached = &cache->data[block * STLINK_CACHE_BLOCK_SIZE];
+        memcpy(cached + (lo - block_addr), data + (lo - addr), hi - lo);
+        cache->crc[block] = stlink_crc32(0, cached, STLINK_CACHE_BLOCK_SIZE);
+        cache->valid[block] = 1;
+    }
+}
+
+void stlink_cache_invalidate(stlink_cache *cache, uint32_t addr, uint32_t len)
+{
+    uint32_t end = addr + len;
+    if (addr < cache->base)
+        addr = cache->base;
+    if (end > cache->base + cache->size)
+        end = cache->base + cache->size;
+    if (addr >= end)
+        return;
+    for (uint32_t block = cache_block(cache, addr); block <= cache_block(cache, end - 1);
+         block++) {
+        cache->valid[block] = 0;
+    }
+}
+
+void stlink_cache_invalidate_all(stlink_cache *cache)
+{
+    memset(cache->valid, 0, cache->blocks);
+}
+
+/*
+ * Compares up to samples valid blocks against the target, a different
+ * selection each time.  Returns 0 if they all match, 1 if the cache was
+ * stale and has been dropped, and -1 on errors.
+ */
+int stlink_cache_validate(stlink *stl, stlink_cache *cache, int samples)
+{
+    CacheFile *file = cache->file;
+    uint32_t *valid = malloc(cache->blocks * sizeof(uint32_t));
+    if (valid == NULL)
+        return -1;
+    uint32_t count = 0;
+    for (uint32_t block = 0; block < cache->blocks; block++) {
+        if (cache_block_ok(cache, block))
+            valid[count++] = block;
+        else
+            cache->valid[block] = 0;
+    }
+    if (count == 0 || samples <= 0) {
+        free(valid);
+        return 0;
+    }
+    if ((uint32_t)samples > count)
+        samples = count;
+
+    uint32_t stride = count / samples;
+    uint32_t first = file->next_sample++ % stride;
+    uint8_t buf[STLINK_CACHE_BLOCK_SIZE];
+    int ret = 0;
+    for (int i = 0; i < samples && ret == 0; i++) {
+        uint32_t block = valid[first + i * stride];
+        uint32_t addr = cache_block_addr(cache, block);
+        if (stlink_swim_read_wait(stl, addr, sizeof(buf), buf) != 0) {
+            ret = -1;
+        } else if (stlink_crc32(0, buf, sizeof(buf)) != cache->crc[block]) {
+            STLINK_INFO(DEVICE, "cached block at 0x%06" PRIx32 " is stale, dropping cache", addr);
+            stlink_cache_invalidate_all(cache);
+            ret = 1;
+        }
+    }
+    free(valid);
+    if (ret != 0)
+        return ret;
+    STLINK_DBG(DEVICE, "%d of %" PRIu32 " cached blocks confirmed", samples, count);
+    return 0;
+}
+
+void stlink_set_cache(stlink *stl, stlink_cache *cache)
+{
+    stl->cache = cache;
+}
+
+void stlink_cache_written(stlink *stl, uint32_t addr, uint32_t len)
+{
+    if (stl->cache != NULL)
+        stlink_cache_invalidate(stl->cache, addr, len);
+}
+
+typedef struct CacheFill {
+    stlink_cache *cache;
+    uint32_t start;
+    uint32_t end;
+    stlink_sink_fn sink;
+    void *opaque;
+} CacheFill;
+
+static int cache_fill_sink(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len)
+{
+    CacheFill *fill = opaque;
+    stlink_cache_update(fill->cache, addr, data, len);
+    uint32_t lo = (addr > fill->start) ? addr : fill->start;
+    uint32_t hi = (addr + len < fill->end) ? addr + len : fill->end;
+    if (lo >= hi)
+        return 0;
+    return fill->sink(fill->opaque, lo, data + (lo - addr), hi - lo);
+}
+
+/*
+ * Like stlink_swim_read_range(), but serves runs of valid blocks from the
+ * cache and reads the others in whole blocks, filling them in.
+ */
+int stlink_cache_read(stlink *stl, uint32_t addr, uint32_t len,
+                      stlink_sink_fn sink, void *opaque)
+{
+    stlink_cache *cache = stl->cache;
+    if (cache == NULL || len == 0 || !cache_covers(cache, addr, len))
+        return stlink_swim_read_range(stl, addr, len, sink, opaque);
+
+    uint32_t end = addr + len;
+    uint32_t block = cache_block(cache, addr);
+    uint32_t last = cache_block(cache, end - 1);
+    uint32_t hits = 0;
+    while (block <= last) {
+        bool ok = cache_block_ok(cache, block);
+        uint32_t run = block + 1;
+        while (run <= last && cache_block_ok(cache, run) == ok)
+            run++;
+        uint32_t run_addr = cache_block_addr(cache, block);
+        uint32_t run_end = cache_block_addr(cache, run);
+        uint32_t lo = (addr > run_addr) ? addr : run_addr;
+        uint32_t hi = (end < run_end) ? end : run_end;
+
+        if (ok) {
+            hits += run - block;
+            while (lo < hi) {
+                uint16_t n = (hi - lo > STLINK_BUFFER_SIZE) ? STLINK_BUFFER_SIZE : hi - lo;
+                if (sink(opaque, lo, &cache->data[lo - cache->base], n) != 0)
+                    return -1;
+                lo += n;
+            }
+        } else {
+            CacheFill fill = {
+                .cache = cache,
+                .start = lo,
+                .end = hi,
+                .sink = sink,
+                .opaque = opaque,
+            };
+            if (stlink_swim_read_range(stl, run_addr, run_end - run_addr,
+                                       cache_fill_sink, &fill) != 0)
+                return -1;
+        }
+        block = run;
+    }
+    STLINK_DBG(DEVICE, "%" PRIu32 " of %" PRIu32 " blocks from cache", hits,
+               last + 1 - cache_block(cache, addr));
+    return 0;
+}
@@ -0,0 +1,42 @@
+#ifndef STLINK_CACHE_H
+#define STLINK_CACHE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+#include "stlink-device.h"
+#include "stlink-read.h"
+
+
+#define STLINK_CACHE_BLOCK_SIZE 128
+#define STLINK_CACHE_UID_SIZE   12
+
+typedef struct STLinkCache stlink_cache;
+
+/*
+ * Last known data EEPROM and flash contents of a dev, in a file mapped
+ * from dir, or from $STLINK_CACHE_DIR, $XDG_CACHE_HOME/stlink or
+ * ~/.cache/stlink if NULL.  A cache file is locked by the process holding
+ * it open.
+ */
+stlink_cache *stlink_cache_open(const char *dir, const char *serial, const uint8_t *uid,
+                                const stlink_device *dev);
+// NULL as well for parts without a unique ID
+stlink_cache *stlink_cache_open_target(stlink *stl, const char *dir);
+void stlink_cache_close(stlink_cache *cache);
+
+const uint8_t *stlink_cache_lookup(stlink_cache *cache, uint32_t addr, uint32_t len);
+void stlink_cache_update(stlink_cache *cache, uint32_t addr, const uint8_t *data, uint32_t len);
+void stlink_cache_invalidate(stlink_cache *cache, uint32_t addr, uint32_t len);
+void stlink_cache_invalidate_all(stlink_cache *cache);
+int stlink_cache_validate(stlink *stl, stlink_cache *cache, int samples);
+
+// Reads go through the cache attached to stl, writes invalidate it.
+void stlink_set_cache(stlink *stl, stlink_cache *cache);
+int stlink_cache_read(stlink *stl, uint32_t addr, uint32_t len,
+                      stlink_sink_fn sink, void *opaque);
+
+
+#endif
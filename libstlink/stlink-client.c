@@ -0,0 +1,180 @@
+/*
+ * stlinkd client
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Forwards jobs to a running stlinkd, which keeps its probes in SWIM mode
+ * with the target attached, so that a job costs a socket round trip plus
+ * the actual transfers instead of a full USB and SWIM bring-up.
+ */
+
+#include "stlink-client.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "stlink-internal.h"
+
+
+struct STLinkClient {
+    int fd;
+};
+
+stlink_client *stlink_client_connect(const char *path)
+{
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (path != NULL) {
+        if (strlen(path) >= sizeof(sun.sun_path))
+            return NULL;
+        strcpy(sun.sun_path, path);
+    } else if (stlink_daemon_socket_path(sun.sun_path, sizeof(sun.sun_path)) != 0) {
+        return NULL;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return NULL;
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        STLINK_ERR(DEVICE, "%s: %s: %s", __func__, sun.sun_path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    stlink_client *client = malloc(sizeof(stlink_client));
+    if (client == NULL) {
+        close(fd);
+        return NULL;
+    }
+    client->fd = fd;
+
+    stlink_daemon_hello hello;
+    if (stlink_client_hello(client, &hello) != 0 || hello.version != STLINK_DAEMON_VERSION) {
+        STLINK_ERR(DEVICE, "%s: daemon speaks an unknown protocol", __func__);
+        stlink_client_close(client);
+        return NULL;
+    }
+    return client;
+}
+
+void stlink_client_close(stlink_client *client)
+{
+    if (client == NULL)
+        return;
+    close(client->fd);
+    free(client);
+}
+
+// One round trip; a successful reply must carry exactly reply_len bytes.
+static int client_call(stlink_client *client, const stlink_daemon_request *req,
+                       const void *payload, uint32_t payload_len,
+                       void *reply_data, uint32_t reply_len)
+{
+    stlink_daemon_reply reply;
+    if (stlink_daemon_send(client->fd, req, sizeof(*req)) != 0 ||
+        (payload_len > 0 && stlink_daemon_send(client->fd, payload, payload_len) != 0) ||
+        stlink_daemon_recv(client->fd, &reply, sizeof(reply)) != 0) {
+        STLINK_ERR(DEVICE, "%s: lost connection to daemon", __func__);
+        return -1;
+    }
+    if (reply.status == 0 && reply.len == reply_len)
+        return (reply_len > 0) ? stlink_daemon_recv(client->fd, reply_data, reply_len) : 0;
+
+    // skip whatever came along to stay in sync
+    uint8_t discard[256];
+    while (reply.len > 0) {
+        uint32_t n = (reply.len > sizeof(discard)) ? sizeof(discard) : reply.len;
+        if (stlink_daemon_recv(client->fd, discard, n) != 0)
+            break;
+        reply.len -= n;
+    }
+    if (reply.status == 0)
+        STLINK_ERR(DEVICE, "%s: unexpected reply to command %02x", __func__, req->cmd);
+    return -1;
+}
+
+int stlink_client_hello(stlink_client *client, stlink_daemon_hello *hello)
+{
+    stlink_daemon_request req = { .cmd = STLINK_DAEMON_HELLO };
+    return client_call(client, &req, NULL, 0, hello, sizeof(*hello));
+}
+
+int stlink_client_probe(stlink_client *client, int probe, stlink_daemon_probe *info)
+{
+    stlink_daemon_request req = { .cmd = STLINK_DAEMON_PROBE, .probe = probe };
+    return client_call(client, &req, NULL, 0, info, sizeof(*info));
+}
+
+// Index of the probe with the given serial, or of the first one if empty.
+int stlink_client_find_probe(stlink_client *client, const char *serial)
+{
+    stlink_daemon_hello hello;
+    if (stlink_client_hello(client, &hello) != 0)
+        return -1;
+    for (uint32_t i = 0; i < hello.probes; i++) {
+        stlink_daemon_probe info;
+        if (stlink_client_probe(client, i, &info) != 0)
+            return -1;
+        if (serial == NULL || serial[0] == '\0' ||
+            strncmp(info.serial, serial, sizeof(info.serial)) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int stlink_client_read(stlink_client *client, int probe, uint32_t addr, uint32_t len,
+                       uint8_t *buffer)
+{
+    if (len > STLINK_DAEMON_MAX_PAYLOAD)
+        return -1;
+    stlink_daemon_request req = {
+        .cmd = STLINK_DAEMON_READ,
+        .probe = probe,
+        .addr = addr,
+        .len = len,
+    };
+    return client_call(client, &req, NULL, 0, buffer, len);
+}
+
+int stlink_client_write(stlink_client *client, int probe, uint32_t addr, uint32_t len,
+                        const uint8_t *buffer)
+{
+    if (len > STLINK_DAEMON_MAX_PAYLOAD)
+        return -1;
+    stlink_daemon_request req = {
+        .cmd = STLINK_DAEMON_WRITE,
+        .probe = probe,
+        .addr = addr,
+        .len = len,
+    };
+    return client_call(client, &req, buffer, len, NULL, 0);
+}
+
+int stlink_client_flash(stlink_client *client, int probe, uint32_t addr, uint32_t len,
+                        const uint8_t *image, uint8_t flags, stlink_daemon_flash *result)
+{
+    if (len > STLINK_DAEMON_MAX_PAYLOAD)
+        return -1;
+    stlink_daemon_request req = {
+        .cmd = STLINK_DAEMON_FLASH,
+        .probe = probe,
+        .flags = flags,
+        .addr = addr,
+        .len = len,
+    };
+    return client_call(client, &req, image, len, result, sizeof(*result));
+}
+
+int stlink_client_reconnect(stlink_client *client, int probe)
+{
+    stlink_daemon_request req = { .cmd = STLINK_DAEMON_RECONNECT, .probe = probe };
+    return client_call(client, &req, NULL, 0, NULL, 0);
+}
@@ -0,0 +1,29 @@
+#ifndef STLINK_CLIENT_H
+#define STLINK_CLIENT_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stlink-daemon.h"
+
+
+typedef struct STLinkClient stlink_client;
+
+// path may be NULL for stlink_daemon_socket_path().
+stlink_client *stlink_client_connect(const char *path);
+void stlink_client_close(stlink_client *client);
+
+int stlink_client_hello(stlink_client *client, stlink_daemon_hello *hello);
+int stlink_client_probe(stlink_client *client, int probe, stlink_daemon_probe *info);
+int stlink_client_find_probe(stlink_client *client, const char *serial);
+int stlink_client_read(stlink_client *client, int probe, uint32_t addr, uint32_t len,
+                       uint8_t *buffer);
+int stlink_client_write(stlink_client *client, int probe, uint32_t addr, uint32_t len,
+                        const uint8_t *buffer);
+int stlink_client_flash(stlink_client *client, int probe, uint32_t addr, uint32_t len,
+                        const uint8_t *image, uint8_t flags, stlink_daemon_flash *result);
+int stlink_client_reconnect(stlink_client *client, int probe);
+
+
+#endif
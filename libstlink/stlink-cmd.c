@@ -17,59 +17,91 @@
 
 #include "bswap.h"
 #include "stlink.h"
+#include "stlink-internal.h"
 
 
 static inline void dump_cdb(uint8_t *cdb, uint8_t len)
 {
-    printf("%s: CDB:", __func__);
-    for (int i = 0; i < len; i++) {
-        printf(" %02" PRIX8, cdb[i]);
-    }
-    printf("\n");
+    STLINK_LOG_HEX(STLINK_LOG_DEBUG, STLINK_LOG_CDB, "CDB", cdb, len);
+}
+
+static inline void swim_track(stlink *stl, uint8_t cmd, uint16_t len)
+{
+    stl->swim_op = cmd;
+    stl->swim_len = len;
+}
+
+uint8_t stlink_swim_cdb(uint8_t *cdb, uint8_t cmd)
+{
+    memset(cdb, 0, 2);
+    cdb[0] = STLINK_SWIM_COMMAND;
+    cdb[1] = cmd;
+    return 2;
+}
+
+uint8_t stlink_swim_write_cdb(uint8_t *cdb, uint32_t addr, uint16_t len, const uint8_t *buffer)
+{
+    memset(cdb, 0, 16);
+    cdb[0] = STLINK_SWIM_COMMAND;
+    cdb[1] = STLINK_SWIM_DO_0A;
+    *(uint16_t *)&cdb[2] = cpu_to_be16(len);
+    *(uint32_t *)&cdb[4] = cpu_to_be32(addr);
+    memcpy(&cdb[8], buffer, (len > 8) ? 8 : len);
+    return 16;
+}
+
+uint8_t stlink_swim_begin_read_cdb(uint8_t *cdb, uint32_t addr, uint16_t len)
+{
+    memset(cdb, 0, 8);
+    cdb[0] = STLINK_SWIM_COMMAND;
+    cdb[1] = STLINK_SWIM_BEGIN_READ;
+    *(uint16_t *)&cdb[2] = cpu_to_be16(len);
+    *(uint32_t *)&cdb[4] = cpu_to_be32(addr);
+    return 8;
 }
 
 void stlink_get_version(stlink *stl)
 {
-    printf("getting version...\n");
+    STLINK_INFO(DEVICE, "getting version...");
     uint8_t cdb[6]; // sic!
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_GET_VERSION;
     unsigned char buf[6];
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), buf, sizeof(buf), true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(DEVICE, "%s: command failed: %d", __func__, ret);
         return;
     }
-    printf("version: %02X %02X %02X %02X %02X %02X\n", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
+    STLINK_INFO(DEVICE, "version: %02X %02X %02X %02X %02X %02X", buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]);
     uint16_t vid = le16_to_cpu(*(uint16_t *)&buf[2]);
     uint16_t pid = le16_to_cpu(*(uint16_t *)&buf[4]);
-    printf("vid = 0x%04X, pid = 0x%04X\n", vid, pid);
+    STLINK_INFO(DEVICE, "vid = 0x%04X, pid = 0x%04X", vid, pid);
     uint8_t stlink_v = buf[0] >> 4;
     uint8_t jtag_v = ((buf[0] & 0xf) << 2) | (buf[1] >> 6);
     uint8_t swim_v = buf[1] & 0x3f;
-    printf("stlink_v = %" PRIu8 ", jtag_v = %" PRIu8 ", swim_v = %" PRIu8 "\n",
+    STLINK_INFO(DEVICE, "stlink_v = %" PRIu8 ", jtag_v = %" PRIu8 ", swim_v = %" PRIu8,
            stlink_v, jtag_v, swim_v);
 }
 
 int stlink_get_current_mode(stlink *stl)
 {
-    printf("getting current mode...\n");
+    STLINK_INFO(DEVICE, "getting current mode...");
     uint8_t cdb[10];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_GET_CURRENT_MODE;
     unsigned char buf[2];
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), buf, sizeof(buf), true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(DEVICE, "%s: command failed: %d", __func__, ret);
         return -1;
     }
-    printf("current mode: %02X %02X\n", buf[0], buf[1]);
+    STLINK_INFO(DEVICE, "current mode: %02X %02X", buf[0], buf[1]);
     return buf[0];
 }
 
 void stlink_exit_dfu_mode(stlink *stl)
 {
-    printf("exiting DFU mode...\n");
+    STLINK_INFO(DEVICE, "exiting DFU mode...");
     uint8_t cdb[10];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_DFU_COMMAND;
@@ -77,15 +109,15 @@ void stlink_exit_dfu_mode(stlink *stl)
     unsigned char buf[2];
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), buf, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(DEVICE, "%s: command failed: %d", __func__, ret);
         return;
     }
-    printf("exited DFU mode\n");
+    STLINK_INFO(DEVICE, "exited DFU mode");
 }
 
 void stlink_enter_swd_mode(stlink *stl)
 {
-    printf("entering SWD mode...\n");
+    STLINK_INFO(DEVICE, "entering SWD mode...");
     uint8_t cdb[10];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_DEBUG_COMMAND;
@@ -93,46 +125,46 @@ void stlink_enter_swd_mode(stlink *stl)
     cdb[2] = STLINK_DEBUG_ENTER_SWD;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(DEVICE, "%s: command failed: %d", __func__, ret);
         return;
     }
-    printf("entered SWD mode\n");
+    STLINK_INFO(DEVICE, "entered SWD mode");
 }
 
 void stlink_swim_enter(stlink *stl)
 {
-    printf("entering SWIM mode...\n");
+    STLINK_INFO(DEVICE, "entering SWIM mode...");
     uint8_t cdb[2];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_ENTER;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(DEVICE, "%s: command failed: %d", __func__, ret);
         return;
     }
-    printf("entered SWIM mode\n");
+    STLINK_INFO(DEVICE, "entered SWIM mode");
 }
 
 int stlink_swim_exit(stlink *stl)
 {
-    printf("exiting SWIM mode...\n");
+    STLINK_INFO(DEVICE, "exiting SWIM mode...");
     uint8_t cdb[2];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_EXIT;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(DEVICE, "%s: command failed: %d", __func__, ret);
         return -1;
     }
-    printf("exited SWIM mode\n");
+    STLINK_INFO(DEVICE, "exited SWIM mode");
     return 0;
 }
 
 int stlink_swim_get_size(stlink *stl, uint16_t *size)
 {
-    printf("reading size...\n");
+    STLINK_DBG(SWIM, "reading size...");
     uint8_t cdb[2];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
@@ -140,16 +172,27 @@ int stlink_swim_get_size(stlink *stl, uint16_t *size)
     uint16_t buf;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), (unsigned char *)&buf, sizeof(buf), true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     *size = le16_to_cpu(buf);
+    stl->swim_size = *size;
+    return 0;
+}
+
+int stlink_swim_chunk_size(stlink *stl, uint16_t *size)
+{
+    if (stl->swim_size == 0 && stlink_swim_get_size(stl, size) != 0)
+        return -1;
+    *size = (stl->swim_size < STLINK_BUFFER_SIZE) ? stl->swim_size : STLINK_BUFFER_SIZE;
+    // whole flash blocks, so that chunks line up with programming
+    *size = stlink_device_chunk_size(stlink_get_device(stl), *size);
     return 0;
 }
 
 int stlink_swim_get_02(stlink *stl, uint8_t x)
 {
-    printf("reading 0x02...\n");
+    STLINK_DBG(SWIM, "reading 0x02...");
     uint8_t cdb[3];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
@@ -158,20 +201,17 @@ int stlink_swim_get_02(stlink *stl, uint8_t x)
     uint8_t buf[8];
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), buf, sizeof(buf), true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
-    printf("%s:", __func__);
-    for (int i = 0; i < sizeof(buf); i++) {
-        printf(" %02" PRIX8, buf[i]);
-    }
-    printf("\n");
+    STLINK_LOG_HEX(STLINK_LOG_DEBUG, STLINK_LOG_SWIM, __func__, buf, sizeof(buf));
     return 0;
 }
 
 int stlink_swim_do_03(stlink *stl, uint8_t x)
 {
-    printf("doing 0x03...\n");
+    STLINK_DBG(SWIM, "doing 0x03...");
+    swim_track(stl, STLINK_SWIM_DO_03, 0);
     uint8_t cdb[3];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
@@ -179,7 +219,7 @@ int stlink_swim_do_03(stlink *stl, uint8_t x)
     cdb[2] = x;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -187,14 +227,15 @@ int stlink_swim_do_03(stlink *stl, uint8_t x)
 
 int stlink_swim_do_04(stlink *stl)
 {
-    printf("doing 0x04...\n");
+    STLINK_DBG(SWIM, "doing 0x04...");
+    swim_track(stl, STLINK_SWIM_DO_04, 0);
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_DO_04;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -202,14 +243,15 @@ int stlink_swim_do_04(stlink *stl)
 
 int stlink_swim_do_05(stlink *stl)
 {
-    printf("doing 0x05...\n");
+    STLINK_DBG(SWIM, "doing 0x05...");
+    swim_track(stl, STLINK_SWIM_DO_05, 0);
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_DO_05;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -217,14 +259,15 @@ int stlink_swim_do_05(stlink *stl)
 
 int stlink_swim_do_06(stlink *stl)
 {
-    printf("doing 0x06...\n");
+    STLINK_DBG(SWIM, "doing 0x06...");
+    swim_track(stl, STLINK_SWIM_DO_06, 0);
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_DO_06;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -232,14 +275,15 @@ int stlink_swim_do_06(stlink *stl)
 
 int stlink_swim_do_07(stlink *stl)
 {
-    printf("doing 0x07...\n");
+    STLINK_DBG(SWIM, "doing 0x07...");
+    swim_track(stl, STLINK_SWIM_DO_07, 0);
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_DO_07;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -247,14 +291,15 @@ int stlink_swim_do_07(stlink *stl)
 
 int stlink_swim_do_08(stlink *stl)
 {
-    printf("doing 0x08...\n");
+    STLINK_DBG(SWIM, "doing 0x08...");
+    swim_track(stl, STLINK_SWIM_DO_08, 0);
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_DO_08;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -262,7 +307,7 @@ int stlink_swim_do_08(stlink *stl)
 
 int stlink_swim_get_busy(stlink *stl, uint32_t *status)
 {
-    printf("reading 0x09...\n");
+    STLINK_DBG(SWIM, "reading 0x09...");
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
@@ -270,35 +315,67 @@ int stlink_swim_get_busy(stlink *stl, uint32_t *status)
     uint8_t buf[4];
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), buf, sizeof(buf), true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
 #if 0
-    printf("%s:", __func__);
-    for (int i = 0; i < sizeof(buf); i++) {
-        printf(" %02" PRIX8, buf[i]);
-    }
-    printf("\n");
+    STLINK_LOG_HEX(STLINK_LOG_DEBUG, STLINK_LOG_SWIM, __func__, buf, sizeof(buf));
 #endif
     uint32_t count = (buf[3] << 16) | (buf[2] << 8) | buf[1];
-    printf("%s: busy = 0x%02" PRIX8 ", count = 0x%06" PRIx32 "\n", __func__, buf[0], count);
+    STLINK_DBG(SWIM, "%s: busy = 0x%02" PRIX8 ", count = 0x%06" PRIx32, __func__, buf[0], count);
     *status = le32_to_cpu(*(uint32_t *)buf);
     return 0;
 }
 
 int stlink_swim_write(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
 {
-    printf("writing at 0x%06" PRIx32 " (0x%" PRIx16 ")...\n", addr, len);
+    STLINK_DBG(SWIM, "writing at 0x%06" PRIx32 " (0x%" PRIx16 ")...", addr, len);
+    swim_track(stl, STLINK_SWIM_DO_0A, len);
+    stlink_target_written(stl, addr, len, buffer);
     uint8_t cdb[16];
-    memset(cdb, 0, sizeof(cdb));
+    stlink_swim_write_cdb(cdb, addr, len, buffer);
+    int ret = stlink_send_command(stl, cdb, sizeof(cdb), buffer + 8, (len > 8) ? (len - 8) : 0, false);
+    if (ret != 0) {
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Returns where to put the data of the next SWIM write, for sending it with
+ * stlink_swim_write_commit() without any copying.  The buffer is only valid
+ * until the next command is sent.
+ */
+uint8_t *stlink_swim_write_buffer(stlink *stl, uint16_t len)
+{
+    if (len > STLINK_BUFFER_SIZE)
+        return NULL;
+    if (stl->async_pending > 0)
+        stlink_wait_commands(stl, 0);
+    // the data starts in the CDB, which stlink_fill_cbw() must then clear
+    stlink_cbw(stl)->bCBWCBLength = sizeof(stlink_cbw(stl)->CBWCB);
+    return stl->xfer + STLINK_XFER_PAYLOAD;
+}
+
+int stlink_swim_write_commit(stlink *stl, uint32_t addr, uint16_t len)
+{
+    STLINK_DBG(SWIM, "writing at 0x%06" PRIx32 " (0x%" PRIx16 ")...", addr, len);
+    swim_track(stl, STLINK_SWIM_DO_0A, len);
+    stlink_target_written(stl, addr, len, stl->xfer + STLINK_XFER_PAYLOAD);
+    USBCommandBlockWrapper *cbw = stlink_cbw(stl);
+    uint8_t *cdb = cbw->CBWCB;
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_DO_0A;
     *(uint16_t *)&cdb[2] = cpu_to_be16(len);
     *(uint32_t *)&cdb[4] = cpu_to_be32(addr);
-    memcpy(&cdb[8], buffer, (len > 8) ? 8 : len);
-    int ret = stlink_send_command(stl, cdb, sizeof(cdb), buffer + 8, (len > 8) ? (len - 8) : 0, false);
+    if (len < 8)
+        memset(&cdb[8 + len], 0, 8 - len);
+    stlink_fill_cbw(stl, cbw, cdb, 16, 0, LIBUSB_ENDPOINT_IN, (len > 8) ? (len - 8) : 0);
+    int ret = stlink_send_cbw(stl, stl->xfer + sizeof(USBCommandBlockWrapper),
+                              (len > 8) ? (len - 8) : 0, false);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -306,16 +383,13 @@ int stlink_swim_write(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
 
 int stlink_swim_begin_read(stlink *stl, uint32_t addr, uint16_t len)
 {
-    printf("initiating read at 0x%06" PRIx32 " (0x%" PRIx16 ")...\n", addr, len);
+    STLINK_DBG(SWIM, "initiating read at 0x%06" PRIx32 " (0x%" PRIx16 ")...", addr, len);
+    swim_track(stl, STLINK_SWIM_BEGIN_READ, len);
     uint8_t cdb[8]; // 10
-    memset(cdb, 0, sizeof(cdb));
-    cdb[0] = STLINK_SWIM_COMMAND;
-    cdb[1] = STLINK_SWIM_BEGIN_READ;
-    *(uint16_t *)&cdb[2] = cpu_to_be16(len);
-    *(uint32_t *)&cdb[4] = cpu_to_be32(addr);
+    stlink_swim_begin_read_cdb(cdb, addr, len);
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), NULL, 0, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -323,14 +397,14 @@ int stlink_swim_begin_read(stlink *stl, uint32_t addr, uint16_t len)
 
 int stlink_swim_read(stlink *stl, uint16_t length, uint8_t *buffer)
 {
-    printf("reading 0x%" PRIx16 " bytes...\n", length);
+    STLINK_DBG(SWIM, "reading 0x%" PRIx16 " bytes...", length);
     uint8_t cdb[2]; // 10
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = STLINK_SWIM_COMMAND;
     cdb[1] = STLINK_SWIM_READ;
     int ret = stlink_send_command(stl, cdb, sizeof(cdb), buffer, length, true);
     if (ret != 0) {
-        fprintf(stderr, "%s: command failed: %d\n", __func__, ret);
+        STLINK_ERR(SWIM, "%s: command failed: %d", __func__, ret);
         return -1;
     }
     return 0;
@@ -0,0 +1,67 @@
+/*
+ * stlinkd socket helpers
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Shared by the daemon and its clients.
+ */
+
+#include "stlink-daemon.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+
+int stlink_daemon_socket_path(char *path, size_t size)
+{
+    const char *env = getenv("STLINKD_SOCKET");
+    int len;
+    if (env != NULL && env[0] != '\0') {
+        len = snprintf(path, size, "%s", env);
+    } else if ((env = getenv("XDG_RUNTIME_DIR")) != NULL && env[0] != '\0') {
+        len = snprintf(path, size, "%s/stlinkd.sock", env);
+    } else {
+        len = snprintf(path, size, "/tmp/stlinkd-%u.sock", (unsigned int)getuid());
+    }
+    return (len > 0 && len < size) ? 0 : -1;
+}
+
+int stlink_daemon_send(int fd, const void *buffer, size_t len)
+{
+    const uint8_t *p = buffer;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int stlink_daemon_recv(int fd, void *buffer, size_t len)
+{
+    uint8_t *p = buffer;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#ifndef STLINK_DAEMON_H
+#define STLINK_DAEMON_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+/*
+ * Protocol spoken by stlinkd over its Unix-domain socket.  Every request
+ * is answered with one reply header and its payload; multi-byte fields are
+ * in host byte order, as both ends live on the same machine.
+ */
+#define STLINK_DAEMON_VERSION       2
+#define STLINK_DAEMON_MAX_PAYLOAD   (64 * 1024)
+#define STLINK_DAEMON_PART_MAX      16
+
+enum STLinkDaemonCommand {
+    STLINK_DAEMON_HELLO     = 0x01, // -> stlink_daemon_hello
+    STLINK_DAEMON_PROBE     = 0x02, // -> stlink_daemon_probe
+    STLINK_DAEMON_READ      = 0x10, // len bytes at addr -> data
+    STLINK_DAEMON_WRITE     = 0x11, // data -> addr, no flash programming
+    STLINK_DAEMON_FLASH     = 0x12, // data -> flash or EEPROM at addr -> stlink_daemon_flash
+    STLINK_DAEMON_RECONNECT = 0x20, // leave and re-enter debug mode
+};
+
+enum {
+    STLINK_DAEMON_VERIFY_ON_TARGET = 1 << 0,
+};
+
+typedef struct STLinkDaemonRequest {
+    uint8_t cmd;
+    uint8_t probe;          // index, see STLINK_DAEMON_HELLO
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t addr;
+    uint32_t len;           // payload following, or bytes wanted for READ
+} stlink_daemon_request;
+
+typedef struct STLinkDaemonReply {
+    int32_t status;         // 0 or -1
+    uint32_t len;           // payload following
+} stlink_daemon_reply;
+
+typedef struct STLinkDaemonHello {
+    uint32_t version;
+    uint32_t probes;
+} stlink_daemon_hello;
+
+typedef struct STLinkDaemonProbe {
+    char serial[STLINK_SERIAL_MAX];
+    char part[STLINK_DAEMON_PART_MAX]; // of the target, empty unless connected
+    uint8_t connected;      // target in debug mode
+    uint8_t reserved[2];
+    uint32_t jobs;
+    uint32_t failures;
+} stlink_daemon_probe;
+
+typedef struct STLinkDaemonFlash {
+    uint32_t blocks_total;
+    uint32_t blocks_skipped;
+    uint32_t blocks_programmed;
+    uint32_t bytes_programmed;
+    uint64_t elapsed_us;
+    uint32_t crc;
+    uint8_t verified;
+    uint8_t on_target;
+    uint8_t reserved[2];
+} stlink_daemon_flash;
+
+/*
+ * $STLINKD_SOCKET, else stlinkd.sock in $XDG_RUNTIME_DIR, else
+ * /tmp/stlinkd-<uid>.sock.
+ */
+int stlink_daemon_socket_path(char *path, size_t size);
+
+// Transfer exactly len bytes, retrying after signals.
+int stlink_daemon_send(int fd, const void *buffer, size_t len);
+int stlink_daemon_recv(int fd, void *buffer, size_t len);
+
+
+#endif
@@ -0,0 +1,121 @@
+/*
+ * STM8 core debugging over SWIM
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * The debug module (UM0470) stalls the core through DM_CSR2, single-steps
+ * it with DM_CSR1.STE and stops it on instruction fetch from the BK1/BK2
+ * comparators.  While stalled, the CPU registers are mirrored at 0x7f00;
+ * they are contiguous, so all of them move in a single SWIM transfer.
+ */
+
+#include "stlink-debug.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-batch.h"
+#include "stlink-poll.h"
+#include "stm8.h"
+
+
+#define DEBUG_REGS_SIZE (STM8_REG_CC - STM8_REG_A + 1)
+#define DEBUG_NO_BREAKPOINT 0xffffff
+
+// index into the register block
+#define R(reg) ((reg) - STM8_REG_A)
+
+int stlink_debug_halt(stlink *stl)
+{
+    uint8_t csr2 = STM8_DM_CSR2_STALL;
+    return stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2);
+}
+
+/*
+ * Clears the stop flags, then flushes the prefetched instructions and runs.
+ * Releasing the stall is left out of the batch, which may be retried.
+ */
+int stlink_debug_resume(stlink *stl, bool step)
+{
+    stlink_batch *batch = stlink_batch_new(stl);
+    if (batch == NULL)
+        return -1;
+    stlink_batch_swim_write_byte(batch, STM8_DM_CSR1, step ? STM8_DM_CSR1_STE : 0);
+    stlink_batch_swim_write_byte(batch, STM8_DM_CSR2, STM8_DM_CSR2_STALL | STM8_DM_CSR2_FLUSH);
+    int ret = stlink_batch_submit(batch);
+    stlink_batch_free(batch);
+    if (ret != 0)
+        return -1;
+    uint8_t csr2 = STM8_DM_CSR2_FLUSH;
+    return stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2);
+}
+
+int stlink_debug_get_state(stlink *stl, enum STLinkCoreState *state)
+{
+    uint8_t csr[2]; // DM_CSR1, DM_CSR2
+    if (stlink_swim_read_wait(stl, STM8_DM_CSR1, sizeof(csr), csr) != 0)
+        return -1;
+    if (!(csr[1] & STM8_DM_CSR2_STALL))
+        *state = STLINK_CORE_RUNNING;
+    else if (csr[0] & (STM8_DM_CSR1_BK1F | STM8_DM_CSR1_BK2F))
+        *state = STLINK_CORE_BREAKPOINT;
+    else if (csr[0] & STM8_DM_CSR1_STF)
+        *state = STLINK_CORE_STEPPED;
+    else
+        *state = STLINK_CORE_HALTED;
+    return 0;
+}
+
+int stlink_debug_read_regs(stlink *stl, stlink_stm8_regs *regs)
+{
+    uint8_t buf[DEBUG_REGS_SIZE];
+    if (stlink_swim_read_wait(stl, STM8_REG_A, sizeof(buf), buf) != 0)
+        return -1;
+    regs->a = buf[R(STM8_REG_A)];
+    regs->pc = buf[R(STM8_REG_PCE)] << 16 | buf[R(STM8_REG_PCH)] << 8 | buf[R(STM8_REG_PCL)];
+    regs->x = buf[R(STM8_REG_XH)] << 8 | buf[R(STM8_REG_XL)];
+    regs->y = buf[R(STM8_REG_YH)] << 8 | buf[R(STM8_REG_YL)];
+    regs->sp = buf[R(STM8_REG_SPH)] << 8 | buf[R(STM8_REG_SPL)];
+    regs->cc = buf[R(STM8_REG_CC)];
+    return 0;
+}
+
+int stlink_debug_write_regs(stlink *stl, const stlink_stm8_regs *regs)
+{
+    uint8_t buf[DEBUG_REGS_SIZE];
+    buf[R(STM8_REG_A)] = regs->a;
+    buf[R(STM8_REG_PCE)] = regs->pc >> 16;
+    buf[R(STM8_REG_PCH)] = regs->pc >> 8;
+    buf[R(STM8_REG_PCL)] = regs->pc;
+    buf[R(STM8_REG_XH)] = regs->x >> 8;
+    buf[R(STM8_REG_XL)] = regs->x;
+    buf[R(STM8_REG_YH)] = regs->y >> 8;
+    buf[R(STM8_REG_YL)] = regs->y;
+    buf[R(STM8_REG_SPH)] = regs->sp >> 8;
+    buf[R(STM8_REG_SPL)] = regs->sp;
+    buf[R(STM8_REG_CC)] = regs->cc;
+    return stlink_swim_write_wait(stl, STM8_REG_A, sizeof(buf), buf);
+}
+
+// Breaks on instruction fetch from up to two addresses; count 0 clears both.
+int stlink_debug_set_breakpoints(stlink *stl, const uint32_t *addrs, int count)
+{
+    if (count < 0 || count > STLINK_DEBUG_BREAKPOINTS)
+        return -1;
+    uint8_t buf[7]; // BK1E..BK2L, DM_CR1
+    for (int i = 0; i < STLINK_DEBUG_BREAKPOINTS; i++) {
+        uint32_t addr = (i < count) ? addrs[i] : DEBUG_NO_BREAKPOINT;
+        buf[3 * i] = addr >> 16;
+        buf[3 * i + 1] = addr >> 8;
+        buf[3 * i + 2] = addr;
+    }
+    buf[6] = (count > 0) ? STM8_DM_CR1_BC_FETCH : 0;
+    return stlink_swim_write_wait(stl, STM8_DM_BRK1E, sizeof(buf), buf);
+}
@@ -0,0 +1,37 @@
+#ifndef STLINK_DEBUG_H
+#define STLINK_DEBUG_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+#define STLINK_DEBUG_BREAKPOINTS 2 // hardware comparators BK1 and BK2
+
+typedef struct STLinkSTM8Registers {
+    uint32_t pc;                // 24 bits
+    uint8_t a;
+    uint16_t x;
+    uint16_t y;
+    uint16_t sp;
+    uint8_t cc;
+} stlink_stm8_regs;
+
+enum STLinkCoreState {
+    STLINK_CORE_RUNNING,
+    STLINK_CORE_HALTED,         // stalled from the host
+    STLINK_CORE_STEPPED,
+    STLINK_CORE_BREAKPOINT,
+};
+
+// All of these require the SWIM prologue to have been run.
+int stlink_debug_halt(stlink *stl);
+int stlink_debug_resume(stlink *stl, bool step);
+int stlink_debug_get_state(stlink *stl, enum STLinkCoreState *state);
+int stlink_debug_read_regs(stlink *stl, stlink_stm8_regs *regs);
+int stlink_debug_write_regs(stlink *stl, const stlink_stm8_regs *regs);
+int stlink_debug_set_breakpoints(stlink *stl, const uint32_t *addrs, int count);
+
+
+#endif
@@ -0,0 +1,218 @@
+/*
+ * STM8 device database
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Memory maps, flash block sizes, option byte layouts and flash controller
+ * registers of the supported parts, after their datasheets.  Parts are
+ * listed per density, the package being left open.
+ *
+ * STM8 parts carry no part number readable over SWIM, so detection goes by
+ * what can be told apart: the flash controller sits at 0x505A with FLASH_NCR2
+ * holding the complement of FLASH_CR2 on STM8S and STM8AF, at 0x5050 without
+ * NCR2 on STM8L; the RAM size is found by writing to the last byte of each
+ * candidate size and reading it back.  Densities sharing the RAM size, such
+ * as the STM8S105x4 and x6, cannot be told apart: they share a die, and
+ * the lower density is the same chip tested for less flash.  Of the parts
+ * matching both, the one with the most flash and then data EEPROM is
+ * taken, so that the memory map never comes out smaller than the chip;
+ * setting the part restricts it.
+ */
+
+#include "stlink-device.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+
+
+static const stlink_flash_registers stm8s_flash = {
+    .cr2    = 0x00505b,
+    .ncr2   = 0x00505c,
+    .iapsr  = 0x00505f,
+    .pukr   = 0x005062,
+    .dukr   = 0x005064,
+};
+
+static const stlink_flash_registers stm8l_flash = {
+    .cr2    = 0x005051,
+    .iapsr  = 0x005054,
+    .pukr   = 0x005052,
+    .dukr   = 0x005053,
+};
+
+#define KIB 1024
+
+static const stlink_device devices[] = {
+    { "STM8S105x6", STLINK_FAMILY_STM8S, 2 * KIB, 0x4000, 1 * KIB, 0x4800, 15, 0x487e, true,
+      0x8000, 32 * KIB, 128, 6000, 0, 0, &stm8s_flash },
+    { "STM8S105x4", STLINK_FAMILY_STM8S, 2 * KIB, 0x4000, 1 * KIB, 0x4800, 15, 0x487e, true,
+      0x8000, 16 * KIB, 128, 6000, 0, 0, &stm8s_flash },
+    { "STM8S103x3", STLINK_FAMILY_STM8S, 1 * KIB, 0x4000, 640, 0x4800, 11, 0, true,
+      0x8000, 8 * KIB, 64, 6000, 0x4865, 12, &stm8s_flash },
+    { "STM8S003x3", STLINK_FAMILY_STM8S, 1 * KIB, 0x4000, 128, 0x4800, 11, 0, true,
+      0x8000, 8 * KIB, 64, 6000, 0, 0, &stm8s_flash },
+    { "STM8S207xB", STLINK_FAMILY_STM8S, 6 * KIB, 0x4000, 2 * KIB, 0x4800, 15, 0x487e, true,
+      0x8000, 128 * KIB, 128, 6000, 0, 0, &stm8s_flash },
+    { "STM8S208xB", STLINK_FAMILY_STM8S, 6 * KIB, 0x4000, 2 * KIB, 0x4800, 15, 0x487e, true,
+      0x8000, 128 * KIB, 128, 6000, 0, 0, &stm8s_flash },
+    { "STM8S207x8", STLINK_FAMILY_STM8S, 6 * KIB, 0x4000, 1536, 0x4800, 15, 0x487e, true,
+      0x8000, 64 * KIB, 128, 6000, 0, 0, &stm8s_flash },
+    { "STM8AF6266", STLINK_FAMILY_STM8AF, 2 * KIB, 0x4000, 1 * KIB, 0x4800, 15, 0x487e, true,
+      0x8000, 32 * KIB, 128, 6000, 0x48cd, 12, &stm8s_flash },
+    { "STM8AF5288", STLINK_FAMILY_STM8AF, 6 * KIB, 0x4000, 2 * KIB, 0x4800, 15, 0x487e, true,
+      0x8000, 64 * KIB, 128, 6000, 0x48cd, 12, &stm8s_flash },
+    { "STM8L152x6", STLINK_FAMILY_STM8L, 2 * KIB, 0x1000, 1 * KIB, 0x4800, 13, 0, false,
+      0x8000, 32 * KIB, 128, 6000, 0x4926, 12, &stm8l_flash },
+    { "STM8L151x6", STLINK_FAMILY_STM8L, 2 * KIB, 0x1000, 1 * KIB, 0x4800, 13, 0, false,
+      0x8000, 32 * KIB, 128, 6000, 0x4926, 12, &stm8l_flash },
+    { "STM8L152x8", STLINK_FAMILY_STM8L, 4 * KIB, 0x1000, 2 * KIB, 0x4800, 13, 0, false,
+      0x8000, 64 * KIB, 128, 6000, 0x4926, 12, &stm8l_flash },
+    { "STM8L051x3", STLINK_FAMILY_STM8L, 1 * KIB, 0x1000, 256, 0x4800, 13, 0, false,
+      0x8000, 8 * KIB, 64, 6000, 0x4925, 12, &stm8l_flash },
+};
+
+#define DEVICE_COUNT (int)(sizeof(devices) / sizeof(devices[0]))
+#define DEVICE_DEFAULT (&devices[0])
+
+static const char *const family_names[] = {
+    [STLINK_FAMILY_STM8S]  = "STM8S",
+    [STLINK_FAMILY_STM8AF] = "STM8AF",
+    [STLINK_FAMILY_STM8L]  = "STM8L",
+};
+
+const char *stlink_family_name(enum STLinkFamily family)
+{
+    return (family <= STLINK_FAMILY_STM8L) ? family_names[family] : "unknown";
+}
+
+int stlink_device_count(void)
+{
+    return DEVICE_COUNT;
+}
+
+const stlink_device *stlink_device_get(int index)
+{
+    return (index >= 0 && index < DEVICE_COUNT) ? &devices[index] : NULL;
+}
+
+// Case-insensitive, with x in the pattern matching any character.
+static bool device_match(const char *pattern, const char *name)
+{
+    for (; *pattern != '\0'; pattern++, name++) {
+        if (*name == '\0')
+            return false;
+        if (*pattern != 'x' && toupper((unsigned char)*pattern) != toupper((unsigned char)*name))
+            return false;
+    }
+    return *name == '\0';
+}
+
+const stlink_device *stlink_device_find(const char *name)
+{
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        if (device_match(devices[i].name, name))
+            return &devices[i];
+    }
+    return NULL;
+}
+
+const stlink_device *stlink_get_device(stlink *stl)
+{
+    return (stl->device != NULL) ? stl->device : DEVICE_DEFAULT;
+}
+
+void stlink_set_device(stlink *stl, const stlink_device *device)
+{
+    stl->device = device;
+}
+
+uint32_t stlink_device_chunk_size(const stlink_device *device, uint16_t swim_size)
+{
+    if (swim_size < device->block_size)
+        return swim_size;
+    return swim_size - swim_size % device->block_size;
+}
+
+bool stlink_device_in_flash(const stlink_device *device, uint32_t addr)
+{
+    return addr >= device->flash_start && addr < device->flash_start + device->flash_size;
+}
+
+bool stlink_device_in_eeprom(const stlink_device *device, uint32_t addr)
+{
+    return addr >= device->eeprom_start && addr < device->eeprom_start + device->eeprom_size;
+}
+
+// Whether addr holds what is written to it; its contents are restored.
+static int device_probe_ram(stlink *stl, uint32_t addr, bool *present)
+{
+    static const uint8_t patterns[] = { 0x5a, 0xa5 };
+    uint8_t saved;
+    if (stlink_swim_read_once(stl, addr, 1, &saved) != 0)
+        return -1;
+    *present = true;
+    for (int i = 0; i < (int)sizeof(patterns) && *present; i++) {
+        uint8_t val = patterns[i];
+        if (stlink_swim_write(stl, addr, 1, &val) != 0 || stlink_swim_wait(stl) != 0 ||
+            stlink_swim_read_once(stl, addr, 1, &val) != 0)
+            return -1;
+        *present = (val == patterns[i]);
+    }
+    if (stlink_swim_write(stl, addr, 1, &saved) != 0 || stlink_swim_wait(stl) != 0)
+        return -1;
+    return 0;
+}
+
+const stlink_device *stlink_device_detect(stlink *stl)
+{
+    uint8_t cr2[2];
+    if (stlink_swim_read_wait(stl, stm8s_flash.cr2, sizeof(cr2), cr2) != 0)
+        return NULL;
+    bool stm8l = (uint8_t)~cr2[0] != cr2[1];
+
+    // in table order; sizes no larger than one found present need no probe
+    uint32_t ram_size = 0;
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        const stlink_device *dev = &devices[i];
+        if ((dev->family == STLINK_FAMILY_STM8L) != stm8l || dev->ram_size <= ram_size)
+            continue;
+        bool present;
+        if (device_probe_ram(stl, dev->ram_size - 1, &present) != 0)
+            return NULL;
+        if (present)
+            ram_size = dev->ram_size;
+    }
+    if (ram_size == 0) {
+        STLINK_ERR(DEVICE, "%s: no %s part with that RAM", __func__,
+                   stm8l ? "STM8L" : "STM8S/STM8AF");
+        return NULL;
+    }
+
+    const stlink_device *found = NULL;
+    int matches = 0;
+    for (int i = 0; i < DEVICE_COUNT; i++) {
+        const stlink_device *dev = &devices[i];
+        if ((dev->family == STLINK_FAMILY_STM8L) != stm8l || dev->ram_size != ram_size)
+            continue;
+        matches++;
+        if (found == NULL || dev->flash_size > found->flash_size ||
+            (dev->flash_size == found->flash_size && dev->eeprom_size > found->eeprom_size))
+            found = dev;
+    }
+    STLINK_INFO(DEVICE, "%s flash controller, %" PRIu32 " bytes of RAM: %s",
+                stm8l ? "STM8L" : "STM8S/STM8AF", ram_size, found->name);
+    if (matches > 1)
+        STLINK_INFO(DEVICE, "%d parts match, assuming the most flash; set the part for less",
+                    matches);
+    return found;
+}
@@ -0,0 +1,64 @@
+#ifndef STLINK_DEVICE_H
+#define STLINK_DEVICE_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+enum STLinkFamily {
+    STLINK_FAMILY_STM8S,
+    STLINK_FAMILY_STM8AF,
+    STLINK_FAMILY_STM8L,
+};
+
+// Flash controller registers, 0 if absent
+typedef struct STLinkFlashRegisters {
+    uint32_t cr2;
+    uint32_t ncr2;  // complement of CR2, STM8S and STM8AF only
+    uint32_t iapsr;
+    uint32_t pukr;
+    uint32_t dukr;
+} stlink_flash_registers;
+
+typedef struct STLinkDevice {
+    const char *name;   // x standing for any package
+    enum STLinkFamily family;
+    uint32_t ram_size;  // from 0x0000
+    uint32_t eeprom_start;
+    uint32_t eeprom_size;
+    uint32_t option_start;
+    uint32_t option_size;   // bytes in use from option_start
+    uint32_t optbl;         // bootloader option byte outside that range, 0 if none
+    bool option_complement; // options followed by their complements
+    uint32_t flash_start;
+    uint32_t flash_size;
+    uint32_t block_size;
+    uint32_t prog_time_us;  // standard block programming, incl. erase
+    uint32_t uid_addr;      // unique ID, 0 if the part has none
+    uint32_t uid_size;
+    const stlink_flash_registers *flash;
+} stlink_device;
+
+int stlink_device_count(void);
+const stlink_device *stlink_device_get(int index);
+const stlink_device *stlink_device_find(const char *name);
+const char *stlink_family_name(enum STLinkFamily family);
+
+/*
+ * Reads target registers and probes RAM with the core stalled.  Of the
+ * parts that cannot be told apart, returns the one with the most flash.
+ */
+const stlink_device *stlink_device_detect(stlink *stl);
+// The part in use, an STM8S105x6 unless set otherwise.
+const stlink_device *stlink_get_device(stlink *stl);
+void stlink_set_device(stlink *stl, const stlink_device *device);
+// Largest multiple of the flash block size the probe can move at once.
+uint32_t stlink_device_chunk_size(const stlink_device *device, uint16_t swim_size);
+bool stlink_device_in_flash(const stlink_device *device, uint32_t addr);
+bool stlink_device_in_eeprom(const stlink_device *device, uint32_t addr);
+
+
+#endif
@@ -0,0 +1,923 @@
+/*
+ * Software-emulated ST-Link
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Speaks the USB mass storage bulk-only protocol on the transport level,
+ * so that both the synchronous and the pipelined command paths can be
+ * exercised without hardware.  Every transfer takes latency_us plus its
+ * packets at usb_bytes_per_second to complete; transfers submitted
+ * asynchronously overlap in latency but not on the wire, as on the bus.
+ *
+ * Behind it sits an STM8S105, or the part given in the configuration, with
+ * its memory map: RAM, data EEPROM, option bytes, boot ROM, flash and the
+ * SWIM and debug module registers.  The boot ROM and unique ID are where
+ * the STM8S105 has them.
+ * SWIM memory accesses are rejected with STLINK_SWIM_NO_PROLOGUE until the
+ * entry sequence has been sent, and report busy for as long as their frames
+ * would take on the line, at the speed selected in SWIM_CSR.  High speed
+ * can be made to corrupt every n-th byte read, as a poor cable would.
+ * Boards can be swapped: while none is attached, the entry sequence goes
+ * unanswered, so that memory accesses are rejected the same way.
+ *
+ * The STM8 flash controller is modelled closely enough for programming:
+ * unlock keys, byte, word and block (FLASH_CR2/NCR2) programming, option
+ * bytes, and EOP only being set once the programming time has elapsed.
+ *
+ * The core only executes one-byte no-ops: releasing the stall in DM_CSR2
+ * either steps PC by one (DM_CSR1.STE) or runs to the nearest BK1/BK2
+ * breakpoint ahead of PC, and keeps running if there is none.  The one
+ * exception is the flash loader, recognised by its version behind the
+ * entry point: its slots are then programmed natively, taking the block
+ * programming time each, one after the other.
+ */
+
+#include "stlink-emu.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "bswap.h"
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-loader.h"
+#include "stlink-transport.h"
+#include "stm8.h"
+
+
+#define EMU_ENDPOINT_IN     0x81
+#define EMU_ENDPOINT_OUT    0x02
+
+#define EMU_MEMORY_SIZE     0x28000 // up to the end of 128 KiB of flash
+#define EMU_SWIM_SIZE       0x1800
+
+// full speed: at most 19 bulk packets of 64 bytes per 1 ms frame
+#define EMU_PACKET_SIZE             64
+#define EMU_USB_BYTES_PER_SECOND    (19 * EMU_PACKET_SIZE * 1000)
+#define EMU_SWIM_BITRATE            800000
+// A SWIM byte frame carries 8 data bits plus header, parity and ack.
+#define EMU_SWIM_BITS_PER_BYTE      12
+// ROTF/WOTF header: command, byte count and 24-bit address
+#define EMU_SWIM_HEADER_BYTES       5
+
+// option bytes up to the bootloader option
+#define EMU_OPTION_AREA_SIZE    128
+// the largest flash block of the parts
+#define EMU_FLASH_BLOCK_MAX     128
+
+#define EMU_FLASH_BLOCK_MODES   (STM8_FLASH_CR2_PRG | STM8_FLASH_CR2_FPRG | \
+                                 STM8_FLASH_CR2_ERASE | STM8_FLASH_CR2_WPRG)
+
+#define REQUEST_SENSE 0x03
+#define REQUEST_SENSE_LENGTH 18
+
+// Data waiting to be picked up by an IN transfer
+typedef struct EmuResponse {
+    struct EmuResponse *next;
+    int length;
+    uint8_t data[];
+} EmuResponse;
+
+typedef struct EmuTransfer {
+    struct EmuTransfer *next;
+    struct libusb_transfer *transfer;
+    uint64_t due;
+    bool cancelled;
+} EmuTransfer;
+
+typedef struct STLinkEmu {
+    stlink_emu_config config;
+    unsigned int transfers;
+    unsigned int faults;
+    uint64_t last_due;
+    EmuTransfer *queue_head;
+    EmuTransfer *queue_tail;
+
+    USBCommandBlockWrapper cbw;
+    int data_out_length; // CBW waiting for its data phase
+    EmuResponse *in_head;
+    EmuResponse *in_tail;
+
+    uint8_t mode;
+    bool swim_active;       // entry sequence sent since STLINK_SWIM_ENTER
+    uint8_t swim_status;    // of the last SWIM operation
+    uint64_t swim_due;      // when the last SWIM operation is done
+    uint32_t read_addr;
+    uint16_t read_length;
+    unsigned int hs_bytes; // read at high speed, for hs_error_every
+    const stlink_device *dev;
+    uint8_t memory[EMU_MEMORY_SIZE];
+
+    // flash controller
+    uint8_t iapsr;
+    int pukr_keys; // correct keys seen so far
+    int dukr_keys;
+    bool programming;
+    uint64_t eop_due;
+    uint8_t block_mode; // FLASH_CR2 bits latched by the first block byte
+    uint32_t block_addr;
+    int block_count;
+    uint8_t block[EMU_FLASH_BLOCK_MAX];
+
+    // flash loader, while the core runs it
+    bool loader;
+    uint64_t loader_due[STLINK_LOADER_SLOTS];
+    uint64_t loader_busy; // until the last queued block is programmed
+
+    uint64_t released; // when the epilogue let the board run, 0 while in use
+} STLinkEmu;
+
+static unsigned int emu_instances;
+
+static bool emu_in_range(uint32_t addr, uint32_t start, uint32_t size)
+{
+    return addr >= start && addr < start + size;
+}
+
+static void emu_sleep_until(uint64_t deadline)
+{
+    uint64_t now = stlink_time_us();
+    if (deadline <= now)
+        return;
+    stlink_sleep_us(deadline - now);
+}
+
+// Time a transfer occupies the bus, in whole bulk packets.
+static uint64_t emu_wire_time(STLinkEmu *emu, int length)
+{
+    if (emu->config.usb_bytes_per_second == 0)
+        return 0;
+    int packets = (length + EMU_PACKET_SIZE - 1) / EMU_PACKET_SIZE;
+    if (packets == 0)
+        packets = 1;
+    return (uint64_t)packets * EMU_PACKET_SIZE * 1000000 / emu->config.usb_bytes_per_second;
+}
+
+static void emu_respond(STLinkEmu *emu, const uint8_t *data, int length)
+{
+    EmuResponse *resp = malloc(sizeof(EmuResponse) + length);
+    if (resp == NULL)
+        return;
+    resp->next = NULL;
+    resp->length = length;
+    memcpy(resp->data, data, length);
+    if (emu->in_tail != NULL)
+        emu->in_tail->next = resp;
+    else
+        emu->in_head = resp;
+    emu->in_tail = resp;
+}
+
+static bool emu_loader_state(STLinkEmu *emu, uint32_t addr)
+{
+    return emu->loader && emu_in_range(addr, STLINK_LOADER_STATE, STLINK_LOADER_SLOTS);
+}
+
+static uint8_t emu_read_byte(STLinkEmu *emu, uint32_t addr)
+{
+    if (emu_loader_state(emu, addr)) {
+        int slot = addr - STLINK_LOADER_STATE;
+        if (emu->memory[addr] == STLINK_LOADER_FULL &&
+            stlink_time_us() >= emu->loader_due[slot])
+            emu->memory[addr] = STLINK_LOADER_EMPTY;
+    }
+    if (addr == emu->dev->flash->iapsr) {
+        if (emu->programming && stlink_time_us() >= emu->eop_due) {
+            emu->programming = false;
+            emu->iapsr |= STM8_FLASH_IAPSR_EOP;
+        }
+        uint8_t val = emu->iapsr;
+        emu->iapsr &= ~(STM8_FLASH_IAPSR_EOP | STM8_FLASH_IAPSR_WR_PG_DIS);
+        return val;
+    }
+    return (addr < EMU_MEMORY_SIZE) ? emu->memory[addr] : 0x00;
+}
+
+static void emu_read_memory(STLinkEmu *emu, uint32_t addr, uint8_t *buf, int len)
+{
+    for (int i = 0; i < len; i++) {
+        buf[i] = emu_read_byte(emu, addr + i);
+    }
+}
+
+static int emu_unlock_key(int keys, uint8_t val, uint8_t key1, uint8_t key2)
+{
+    if (keys == 0 && val == key1)
+        return 1;
+    if (keys == 1 && val == key2)
+        return 2;
+    return 0;
+}
+
+static void emu_flash_program(STLinkEmu *emu, unsigned int time_us)
+{
+    emu->programming = true;
+    emu->eop_due = stlink_time_us() + time_us;
+}
+
+// FLASH_CR2 only takes effect together with its complement in FLASH_NCR2, if any.
+static uint8_t emu_flash_cr2(STLinkEmu *emu)
+{
+    const stlink_flash_registers *flash = emu->dev->flash;
+    uint8_t cr2 = emu->memory[flash->cr2];
+    if (flash->ncr2 != 0 && (uint8_t)~cr2 != emu->memory[flash->ncr2])
+        return 0;
+    return cr2;
+}
+
+static void emu_flash_set_cr2(STLinkEmu *emu, uint8_t cr2)
+{
+    const stlink_flash_registers *flash = emu->dev->flash;
+    emu->memory[flash->cr2] = cr2;
+    if (flash->ncr2 != 0)
+        emu->memory[flash->ncr2] = ~cr2;
+}
+
+// Returns the block programming mode selected by FLASH_CR2/NCR2, if any.
+static uint8_t emu_flash_block_mode(STLinkEmu *emu)
+{
+    return emu_flash_cr2(emu) & EMU_FLASH_BLOCK_MODES;
+}
+
+static void emu_flash_block_write(STLinkEmu *emu, uint32_t addr, uint8_t val)
+{
+    if (emu->block_count == 0)
+        emu->block_mode = emu_flash_block_mode(emu);
+    // word programming takes a word, the other modes a block
+    const uint32_t block_size = (emu->block_mode & STM8_FLASH_CR2_WPRG) ?
+                                STM8_FLASH_WORD_SIZE : emu->dev->block_size;
+    if (emu->block_count == 0) {
+        emu->block_addr = addr - addr % block_size;
+        memcpy(emu->block, &emu->memory[emu->block_addr], block_size);
+    }
+    if (addr < emu->block_addr || addr >= emu->block_addr + block_size) {
+        // the block address is fixed by the first byte written
+        emu->iapsr |= STM8_FLASH_IAPSR_WR_PG_DIS;
+        return;
+    }
+    emu->block[addr - emu->block_addr] = val;
+    if (++emu->block_count < block_size)
+        return;
+
+    if (emu->block_mode & STM8_FLASH_CR2_ERASE)
+        memset(emu->block, 0x00, block_size);
+    memcpy(&emu->memory[emu->block_addr], emu->block, block_size);
+    emu->block_count = 0;
+    emu_flash_set_cr2(emu, 0x00);
+    // fast programming skips the erase phase
+    emu_flash_program(emu, (emu->block_mode & STM8_FLASH_CR2_FPRG) ?
+                           emu->dev->prog_time_us / 2 : emu->dev->prog_time_us);
+}
+
+static uint32_t emu_get24(STLinkEmu *emu, uint32_t addr)
+{
+    return emu->memory[addr] << 16 | emu->memory[addr + 1] << 8 | emu->memory[addr + 2];
+}
+
+static bool emu_loader_entry(STLinkEmu *emu, uint32_t pc)
+{
+    static const uint8_t id[] = { 'S', 'L', 'D', STLINK_LOADER_VERSION };
+    return pc == STLINK_LOADER_STUB &&
+           memcmp(&emu->memory[STLINK_LOADER_ID], id, sizeof(id)) == 0;
+}
+
+static void emu_core_run(STLinkEmu *emu)
+{
+    uint8_t *m = emu->memory;
+    uint32_t pc = emu_get24(emu, STM8_REG_PCE);
+    if (!(m[STM8_DM_CSR1] & STM8_DM_CSR1_STE) && emu_loader_entry(emu, pc)) {
+        emu->loader = true;
+        emu->loader_busy = stlink_time_us();
+        return;
+    }
+    if (m[STM8_DM_CSR1] & STM8_DM_CSR1_STE) {
+        pc = (pc + 1) & 0xffffff;
+        m[STM8_DM_CSR1] |= STM8_DM_CSR1_STF;
+    } else {
+        if ((m[STM8_DM_CR1] & STM8_DM_CR1_BC_MASK) != STM8_DM_CR1_BC_FETCH)
+            return;
+        uint32_t bk1 = emu_get24(emu, STM8_DM_BRK1E);
+        uint32_t bk2 = emu_get24(emu, STM8_DM_BRK2E);
+        uint32_t d1 = (bk1 - pc) & 0xffffff;
+        uint32_t d2 = (bk2 - pc) & 0xffffff;
+        if (bk1 == 0xffffff && bk2 == 0xffffff)
+            return;
+        if (bk2 == 0xffffff || (bk1 != 0xffffff && d1 <= d2)) {
+            pc = bk1;
+            m[STM8_DM_CSR1] |= STM8_DM_CSR1_BK1F;
+        } else {
+            pc = bk2;
+            m[STM8_DM_CSR1] |= STM8_DM_CSR1_BK2F;
+        }
+    }
+    m[STM8_REG_PCE] = pc >> 16;
+    m[STM8_REG_PCH] = pc >> 8;
+    m[STM8_REG_PCL] = pc;
+    m[STM8_DM_CSR2] |= STM8_DM_CSR2_STALL;
+}
+
+static void emu_write_byte(STLinkEmu *emu, uint32_t addr, uint8_t val);
+
+// What the loader does with a slot handed to it.
+static void emu_loader_program(STLinkEmu *emu, int slot)
+{
+    uint32_t base = STLINK_LOADER_SLOT + slot * STLINK_LOADER_SLOT_SIZE;
+    uint32_t addr = emu->memory[base] << 8 | emu->memory[base + 1];
+    emu_flash_set_cr2(emu, STM8_FLASH_CR2_PRG);
+    for (uint32_t i = 0; i < emu->dev->block_size; i++) {
+        emu_write_byte(emu, addr + i, emu->memory[base + 2 + i]);
+    }
+    if (emu->iapsr & STM8_FLASH_IAPSR_WR_PG_DIS) {
+        emu->iapsr &= ~(STM8_FLASH_IAPSR_EOP | STM8_FLASH_IAPSR_WR_PG_DIS);
+        emu->block_count = 0;
+        emu->memory[STLINK_LOADER_STATE + slot] = STLINK_LOADER_FAILED;
+        return;
+    }
+    uint64_t now = stlink_time_us();
+    if (emu->loader_busy < now)
+        emu->loader_busy = now;
+    emu->loader_busy += emu->dev->prog_time_us;
+    emu->loader_due[slot] = emu->loader_busy;
+}
+
+static void emu_write_byte(STLinkEmu *emu, uint32_t addr, uint8_t val)
+{
+    const stlink_device *dev = emu->dev;
+    const stlink_flash_registers *flash = dev->flash;
+    // nothing between RAM and data EEPROM
+    if (emu_in_range(addr, STM8S105_BOOT_ROM_START, STM8S105_BOOT_ROM_SIZE) ||
+        emu_in_range(addr, dev->uid_addr, dev->uid_size) ||
+        emu_in_range(addr, dev->ram_size, dev->eeprom_start - dev->ram_size))
+        return;
+    if (emu_in_range(addr, dev->option_start, EMU_OPTION_AREA_SIZE)) {
+        // option bytes sit behind the data EEPROM lock plus FLASH_CR2.OPT
+        if (!(emu->iapsr & STM8_FLASH_IAPSR_DUL) ||
+            !(emu_flash_cr2(emu) & STM8_FLASH_CR2_OPT)) {
+            emu->iapsr |= STM8_FLASH_IAPSR_WR_PG_DIS;
+            return;
+        }
+        emu->memory[addr] = val;
+        emu_flash_program(emu, dev->prog_time_us);
+        return;
+    }
+
+    uint8_t lock = 0;
+    if (stlink_device_in_flash(dev, addr))
+        lock = STM8_FLASH_IAPSR_PUL;
+    else if (stlink_device_in_eeprom(dev, addr))
+        lock = STM8_FLASH_IAPSR_DUL;
+
+    if (lock != 0) {
+        if (!(emu->iapsr & lock)) {
+            emu->iapsr |= STM8_FLASH_IAPSR_WR_PG_DIS;
+            return;
+        }
+        if (emu->block_count > 0 || emu_flash_block_mode(emu) != 0) {
+            emu_flash_block_write(emu, addr, val);
+            return;
+        }
+        emu->memory[addr] = val;
+        emu_flash_program(emu, dev->prog_time_us);
+        return;
+    }
+
+    // the flash controller moves with the family
+    if (addr == flash->pukr) {
+        emu->pukr_keys = emu_unlock_key(emu->pukr_keys, val,
+                                        STM8_FLASH_PUKR_KEY1, STM8_FLASH_PUKR_KEY2);
+        if (emu->pukr_keys == 2)
+            emu->iapsr |= STM8_FLASH_IAPSR_PUL;
+        return;
+    }
+    if (addr == flash->dukr) {
+        emu->dukr_keys = emu_unlock_key(emu->dukr_keys, val,
+                                        STM8_FLASH_DUKR_KEY1, STM8_FLASH_DUKR_KEY2);
+        if (emu->dukr_keys == 2)
+            emu->iapsr |= STM8_FLASH_IAPSR_DUL;
+        return;
+    }
+    if (addr == flash->iapsr) {
+        // PUL and DUL can only be cleared
+        emu->iapsr &= val | ~(STM8_FLASH_IAPSR_PUL | STM8_FLASH_IAPSR_DUL);
+        if (!(emu->iapsr & STM8_FLASH_IAPSR_PUL))
+            emu->pukr_keys = 0;
+        if (!(emu->iapsr & STM8_FLASH_IAPSR_DUL))
+            emu->dukr_keys = 0;
+        return;
+    }
+
+    switch (addr) {
+    case STM8_SWIM_CSR:
+        emu->memory[addr] = val;
+        // only the epilogue sets HSIT; the operator takes the board to be done
+        if ((val & STM8_SWIM_CSR_HSIT) && emu->config.swap_board_us != 0 && emu->released == 0)
+            emu->released = stlink_time_us();
+        break;
+    case STM8_DM_CSR2: {
+        bool stalled = emu->memory[addr] & STM8_DM_CSR2_STALL;
+        emu->memory[addr] = val & ~STM8_DM_CSR2_FLUSH;
+        if (stalled && !(val & STM8_DM_CSR2_STALL))
+            emu_core_run(emu);
+        else if (val & STM8_DM_CSR2_STALL)
+            emu->loader = false;
+        break;
+    }
+    default:
+        if (addr < EMU_MEMORY_SIZE)
+            emu->memory[addr] = val;
+        if (emu_loader_state(emu, addr) && val == STLINK_LOADER_FULL)
+            emu_loader_program(emu, addr - STLINK_LOADER_STATE);
+        break;
+    }
+}
+
+static void emu_write_memory(STLinkEmu *emu, uint32_t addr, const uint8_t *buf, int len)
+{
+    for (int i = 0; i < len; i++) {
+        emu_write_byte(emu, addr + i, buf[i]);
+    }
+}
+
+// Keeps STLINK_SWIM_GET_BUSY busy for as long as bytes take on the line.
+static void emu_swim_start(STLinkEmu *emu, uint32_t bytes)
+{
+    emu->swim_status = STLINK_SWIM_OK;
+    emu->swim_due = 0;
+    if (emu->config.swim_bitrate == 0)
+        return;
+    uint64_t bits = (uint64_t)bytes * EMU_SWIM_BITS_PER_BYTE;
+    // low speed, 22 instead of 10 HSI cycles per bit, until SWIM_CSR.HS is set
+    if (!(emu->memory[STM8_SWIM_CSR] & STM8_SWIM_CSR_HS))
+        bits = bits * 22 / 10;
+    emu->swim_due = stlink_time_us() + bits * 1000000 / emu->config.swim_bitrate;
+}
+
+// Flips a bit in every hs_error_every-th byte read at high speed.
+static void emu_swim_noise(STLinkEmu *emu, uint8_t *buf, int len)
+{
+    if (emu->config.hs_error_every == 0 || !(emu->memory[STM8_SWIM_CSR] & STM8_SWIM_CSR_HS))
+        return;
+    for (int i = 0; i < len; i++) {
+        if (++emu->hs_bytes % emu->config.hs_error_every == 0)
+            buf[i] ^= 0x01;
+    }
+}
+
+// Memory accesses need the SWIM entry sequence first.
+static bool emu_swim_ready(STLinkEmu *emu)
+{
+    if (emu->swim_active)
+        return true;
+    emu->swim_status = STLINK_SWIM_NO_PROLOGUE;
+    return false;
+}
+
+static void emu_plug_board(STLinkEmu *emu, unsigned int instance);
+
+// Swaps the board as the operator would; false while none is attached.
+static bool emu_board_present(STLinkEmu *emu)
+{
+    if (emu->released == 0)
+        return true;
+    uint64_t now = stlink_time_us();
+    if (now < emu->released + emu->config.swap_board_us)
+        return true;
+    if (now < emu->released + 2 * (uint64_t)emu->config.swap_board_us) {
+        emu->swim_active = false;
+        return false;
+    }
+    emu_plug_board(emu, __sync_fetch_and_add(&emu_instances, 1));
+    return true;
+}
+
+// Returns the number of bytes to send back, or -1 to fail the command.
+static int emu_swim_command(STLinkEmu *emu, uint8_t *cdb,
+                            uint8_t *out, int out_length, uint8_t *in)
+{
+    uint16_t len = be16_to_cpu(*(uint16_t *)&cdb[2]);
+    uint32_t addr = be32_to_cpu(*(uint32_t *)&cdb[4]);
+    bool present = emu_board_present(emu);
+
+    switch (cdb[1]) {
+    case STLINK_SWIM_ENTER:
+        emu->mode = STLINK_DEV_SWIM_MODE;
+        emu->swim_active = false;
+        emu->swim_status = STLINK_SWIM_OK;
+        return 0;
+    case STLINK_SWIM_EXIT:
+        emu->mode = STLINK_DEV_MASS_MODE;
+        emu->swim_active = false;
+        return 0;
+    case STLINK_SWIM_GET_02:
+        memset(in, 0, 8);
+        return 8;
+    case STLINK_SWIM_DO_07:
+        // entry sequence
+        emu->swim_active = present;
+        emu_swim_start(emu, 1);
+        return 0;
+    case STLINK_SWIM_DO_03:
+    case STLINK_SWIM_DO_04:
+    case STLINK_SWIM_DO_05:
+    case STLINK_SWIM_DO_06:
+    case STLINK_SWIM_DO_08:
+        emu_swim_start(emu, 1);
+        return 0;
+    case STLINK_SWIM_GET_BUSY:
+        memset(in, 0, 4);
+        in[0] = emu->swim_status;
+        if (in[0] == STLINK_SWIM_OK && stlink_time_us() < emu->swim_due)
+            in[0] = STLINK_SWIM_BUSY;
+        return 4;
+    case STLINK_SWIM_DO_0A:
+        if (!emu_swim_ready(emu))
+            return 0;
+        emu_swim_start(emu, EMU_SWIM_HEADER_BYTES + len);
+        emu_write_memory(emu, addr, &cdb[8], (len > 8) ? 8 : len);
+        if (len > 8)
+            emu_write_memory(emu, addr + 8, out, (out_length < len - 8) ? out_length : len - 8);
+        return 0;
+    case STLINK_SWIM_BEGIN_READ:
+        if (len > EMU_SWIM_SIZE)
+            return -1;
+        if (!emu_swim_ready(emu))
+            return 0;
+        emu_swim_start(emu, EMU_SWIM_HEADER_BYTES + len);
+        emu->read_addr = addr;
+        emu->read_length = len;
+        return 0;
+    case STLINK_SWIM_READ:
+        emu_read_memory(emu, emu->read_addr, in, emu->read_length);
+        emu_swim_noise(emu, in, emu->read_length);
+        return emu->read_length;
+    case STLINK_SWIM_GET_SIZE:
+        *(uint16_t *)in = cpu_to_le16(EMU_SWIM_SIZE);
+        return 2;
+    default:
+        return -1;
+    }
+}
+
+static void emu_execute(STLinkEmu *emu, uint8_t *out, int out_length)
+{
+    uint8_t *cdb = emu->cbw.CBWCB;
+    uint32_t expected = le32_to_cpu(emu->cbw.dCBWDataTransferLength);
+    uint8_t in[EMU_SWIM_SIZE];
+    int in_length;
+
+    switch (cdb[0]) {
+    case STLINK_GET_VERSION:
+        // V1J11S3
+        in[0] = (1 << 4) | (11 >> 2);
+        in[1] = ((11 & 0x3) << 6) | 3;
+        *(uint16_t *)&in[2] = cpu_to_le16(USB_VID_ST);
+        *(uint16_t *)&in[4] = cpu_to_le16(USB_PID_STLINK);
+        in_length = 6;
+        break;
+    case STLINK_GET_CURRENT_MODE:
+        in[0] = emu->mode;
+        in[1] = 0;
+        in_length = 2;
+        break;
+    case STLINK_DFU_COMMAND:
+        if (cdb[1] == STLINK_DFU_EXIT)
+            emu->mode = STLINK_DEV_MASS_MODE;
+        in_length = 0;
+        break;
+    case STLINK_DEBUG_COMMAND:
+        if (cdb[1] == STLINK_DEBUG_ENTER)
+            emu->mode = STLINK_DEV_DEBUG_MODE;
+        else if (cdb[1] == STLINK_DEBUG_EXIT)
+            emu->mode = STLINK_DEV_MASS_MODE;
+        in_length = 0;
+        break;
+    case STLINK_SWIM_COMMAND:
+        in_length = emu_swim_command(emu, cdb, out, out_length, in);
+        break;
+    case REQUEST_SENSE:
+        memset(in, 0, REQUEST_SENSE_LENGTH);
+        in[0] = 0x70;
+        in_length = REQUEST_SENSE_LENGTH;
+        break;
+    default:
+        in_length = -1;
+        break;
+    }
+
+    uint8_t status = USB_CSW_STATUS_COMMAND_PASSED;
+    if (in_length < 0) {
+        status = USB_CSW_STATUS_COMMAND_FAILED;
+        in_length = 0;
+    }
+    if (in_length > expected)
+        in_length = expected;
+    if (in_length > 0 && out_length == 0)
+        emu_respond(emu, in, in_length);
+
+    USBCommandStatusWrapper csw;
+    csw.dCSWSignature = cpu_to_le32(USB_CSW_SIGNATURE);
+    csw.dCSWTag = emu->cbw.dCBWTag;
+    csw.dCSWDataResidue = cpu_to_le32(expected - ((out_length > 0) ? out_length : in_length));
+    csw.bCSWStatus = status;
+    emu_respond(emu, (uint8_t *)&csw, sizeof(csw));
+}
+
+// The CBW flags are not reliable (see stlink_send_command), so go by opcode.
+static int emu_data_out_length(USBCommandBlockWrapper *cbw)
+{
+    if (cbw->CBWCB[0] == STLINK_SWIM_COMMAND && cbw->CBWCB[1] == STLINK_SWIM_DO_0A)
+        return le32_to_cpu(cbw->dCBWDataTransferLength);
+    return 0;
+}
+
+static int emu_out(STLinkEmu *emu, uint8_t *data, int length, int *transferred)
+{
+    *transferred = 0;
+    if (emu->data_out_length > 0) {
+        if (length != emu->data_out_length)
+            return LIBUSB_ERROR_PIPE;
+        emu->data_out_length = 0;
+        emu_execute(emu, data, length);
+        *transferred = length;
+        return LIBUSB_SUCCESS;
+    }
+    if (length != sizeof(USBCommandBlockWrapper))
+        return LIBUSB_ERROR_PIPE;
+    memcpy(&emu->cbw, data, length);
+    if (le32_to_cpu(emu->cbw.dCBWSignature) != USB_CBW_SIGNATURE)
+        return LIBUSB_ERROR_PIPE;
+    *transferred = length;
+    emu->data_out_length = emu_data_out_length(&emu->cbw);
+    if (emu->data_out_length == 0)
+        emu_execute(emu, NULL, 0);
+    return LIBUSB_SUCCESS;
+}
+
+static int emu_in(STLinkEmu *emu, uint8_t *data, int length, int *transferred)
+{
+    *transferred = 0;
+    EmuResponse *resp = emu->in_head;
+    if (resp == NULL)
+        return LIBUSB_ERROR_TIMEOUT;
+    emu->in_head = resp->next;
+    if (emu->in_head == NULL)
+        emu->in_tail = NULL;
+    int ret = LIBUSB_SUCCESS;
+    int n = resp->length;
+    if (n > length) {
+        n = length;
+        ret = LIBUSB_ERROR_OVERFLOW;
+    }
+    memcpy(data, resp->data, n);
+    *transferred = n;
+    free(resp);
+    return ret;
+}
+
+static int emu_transfer(STLinkEmu *emu, uint8_t endpoint, uint8_t *data, int length,
+                        int *transferred)
+{
+    if (endpoint & LIBUSB_ENDPOINT_IN)
+        return emu_in(emu, data, length, transferred);
+    return emu_out(emu, data, length, transferred);
+}
+
+static void emu_drop_responses(STLinkEmu *emu)
+{
+    while (emu->in_head != NULL) {
+        EmuResponse *resp = emu->in_head;
+        emu->in_head = resp->next;
+        free(resp);
+    }
+    emu->in_tail = NULL;
+}
+
+// Picks the next configured fault, in turn; 0 for none this time.
+static unsigned int emu_next_fault(STLinkEmu *emu)
+{
+    if (emu->config.fault_every == 0 || emu->config.fault_mask == 0 ||
+        ++emu->transfers % emu->config.fault_every != 0)
+        return 0;
+    for (;;) {
+        unsigned int fault = 1 << (emu->faults++ % 3);
+        if (emu->config.fault_mask & fault)
+            return fault;
+    }
+}
+
+static int emu_bulk_transfer(stlink *stl, uint8_t endpoint, uint8_t *data, int length,
+                             int *transferred, unsigned int timeout)
+{
+    STLinkEmu *emu = stlink_get_transport_opaque(stl);
+    emu_sleep_until(stlink_time_us() + emu->config.latency_us + emu_wire_time(emu, length));
+    switch (emu_next_fault(emu)) {
+    case STLINK_EMU_FAULT_STALL:
+        *transferred = 0;
+        return LIBUSB_ERROR_PIPE;
+    case STLINK_EMU_FAULT_TIMEOUT:
+        // whatever was on its way is gone
+        *transferred = 0;
+        if (endpoint & LIBUSB_ENDPOINT_IN)
+            emu_drop_responses(emu);
+        return LIBUSB_ERROR_TIMEOUT;
+    case STLINK_EMU_FAULT_SWIM:
+        emu->swim_active = false;
+        break;
+    }
+    return emu_transfer(emu, endpoint, data, length, transferred);
+}
+
+static int emu_clear_halt(stlink *stl, uint8_t endpoint)
+{
+    return LIBUSB_SUCCESS;
+}
+
+static int emu_reset_interface(stlink *stl)
+{
+    STLinkEmu *emu = stlink_get_transport_opaque(stl);
+    emu->data_out_length = 0;
+    emu_drop_responses(emu);
+    return LIBUSB_SUCCESS;
+}
+
+static int emu_submit_transfer(stlink *stl, struct libusb_transfer *transfer)
+{
+    STLinkEmu *emu = stlink_get_transport_opaque(stl);
+    EmuTransfer *et = malloc(sizeof(EmuTransfer));
+    if (et == NULL)
+        return LIBUSB_ERROR_NO_MEM;
+    et->next = NULL;
+    et->transfer = transfer;
+    et->cancelled = false;
+    // queued transfers follow each other on the bus
+    uint64_t wire_us = emu_wire_time(emu, transfer->length);
+    et->due = stlink_time_us() + emu->config.latency_us + wire_us;
+    if (et->due < emu->last_due + wire_us)
+        et->due = emu->last_due + wire_us;
+    emu->last_due = et->due;
+    if (emu->queue_tail != NULL)
+        emu->queue_tail->next = et;
+    else
+        emu->queue_head = et;
+    emu->queue_tail = et;
+    return LIBUSB_SUCCESS;
+}
+
+static int emu_cancel_transfer(stlink *stl, struct libusb_transfer *transfer)
+{
+    STLinkEmu *emu = stlink_get_transport_opaque(stl);
+    for (EmuTransfer *et = emu->queue_head; et != NULL; et = et->next) {
+        if (et->transfer == transfer) {
+            et->cancelled = true;
+            return LIBUSB_SUCCESS;
+        }
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static enum libusb_transfer_status emu_transfer_status(int ret)
+{
+    switch (ret) {
+    case LIBUSB_SUCCESS:
+        return LIBUSB_TRANSFER_COMPLETED;
+    case LIBUSB_ERROR_PIPE:
+        return LIBUSB_TRANSFER_STALL;
+    case LIBUSB_ERROR_TIMEOUT:
+        return LIBUSB_TRANSFER_TIMED_OUT;
+    case LIBUSB_ERROR_OVERFLOW:
+        return LIBUSB_TRANSFER_OVERFLOW;
+    default:
+        return LIBUSB_TRANSFER_ERROR;
+    }
+}
+
+static int emu_handle_events(stlink *stl, struct timeval *tv)
+{
+    STLinkEmu *emu = stlink_get_transport_opaque(stl);
+    EmuTransfer *et = emu->queue_head;
+    if (et == NULL)
+        return LIBUSB_SUCCESS;
+    uint64_t limit = stlink_time_us() + tv->tv_sec * 1000000 + tv->tv_usec;
+    if (!et->cancelled)
+        emu_sleep_until((et->due < limit) ? et->due : limit);
+
+    uint64_t now = stlink_time_us();
+    while ((et = emu->queue_head) != NULL && (et->cancelled || et->due <= now)) {
+        emu->queue_head = et->next;
+        if (emu->queue_head == NULL)
+            emu->queue_tail = NULL;
+
+        struct libusb_transfer *transfer = et->transfer;
+        if (et->cancelled) {
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+        } else {
+            int ret = emu_transfer(emu, transfer->endpoint, transfer->buffer,
+                                   transfer->length, &transfer->actual_length);
+            transfer->status = emu_transfer_status(ret);
+        }
+        free(et);
+        transfer->callback(transfer);
+    }
+    return LIBUSB_SUCCESS;
+}
+
+static void emu_close(stlink *stl)
+{
+    STLinkEmu *emu = stlink_get_transport_opaque(stl);
+    while (emu->queue_head != NULL) {
+        EmuTransfer *et = emu->queue_head;
+        emu->queue_head = et->next;
+        free(et);
+    }
+    emu_drop_responses(emu);
+    free(emu);
+}
+
+static const STLinkTransportOps emu_transport_ops = {
+    .name               = "emulator",
+    .bulk_transfer      = emu_bulk_transfer,
+    .clear_halt         = emu_clear_halt,
+    .submit_transfer    = emu_submit_transfer,
+    .cancel_transfer    = emu_cancel_transfer,
+    .handle_events      = emu_handle_events,
+    .close              = emu_close,
+    .reset              = emu_reset_interface,
+};
+
+void stlink_emu_get_default_config(stlink_emu_config *config)
+{
+    config->latency_us = 1000;
+    config->usb_bytes_per_second = EMU_USB_BYTES_PER_SECOND;
+    config->swim_bitrate = EMU_SWIM_BITRATE;
+    config->fault_every = 0;
+    config->fault_mask = 0;
+    config->hs_error_every = 0;
+    config->device = NULL;
+    config->swap_board_us = 0;
+}
+
+// Erased flash and EEPROM read as 0x00, option bytes hold factory defaults.
+static void emu_plug_board(STLinkEmu *emu, unsigned int instance)
+{
+    const stlink_device *dev = emu->dev;
+    memset(emu->memory, 0, sizeof(emu->memory));
+    emu->swim_active = false;
+    emu->iapsr = 0;
+    emu->pukr_keys = 0;
+    emu->dukr_keys = 0;
+    emu->programming = false;
+    emu->block_count = 0;
+    emu->loader = false;
+    emu->loader_busy = 0;
+    memset(emu->loader_due, 0, sizeof(emu->loader_due));
+    emu->released = 0;
+    if (dev->uid_size > 0)
+        snprintf((char *)&emu->memory[dev->uid_addr], dev->uid_size, "EMU%08X", instance);
+    if (dev->option_complement) {
+        // OPT0 (ROP) has none
+        for (uint32_t off = 2; off < dev->option_size; off += 2) {
+            emu->memory[dev->option_start + off] = 0xff;
+        }
+        if (dev->optbl != 0)
+            emu->memory[dev->optbl + 1] = 0xff;
+    }
+    emu_flash_set_cr2(emu, 0x00);
+    emu->memory[STM8_DM_CSR2] = STM8_DM_CSR2_STALL;
+    emu->memory[STM8_REG_PCH] = dev->flash_start >> 8;
+}
+
+stlink *stlink_emu_open_config(const stlink_emu_config *config)
+{
+    STLinkEmu *emu = calloc(1, sizeof(STLinkEmu));
+    if (emu == NULL)
+        return NULL;
+    unsigned int instance = __sync_fetch_and_add(&emu_instances, 1);
+    emu->config = *config;
+    emu->dev = (config->device != NULL) ? config->device : stlink_device_find("STM8S105x6");
+    emu->mode = STLINK_DEV_DFU_MODE;
+    emu_plug_board(emu, instance);
+
+    stlink *stl = stlink_open_transport(&emu_transport_ops, emu,
+                                        EMU_ENDPOINT_IN, EMU_ENDPOINT_OUT);
+    if (stl == NULL) {
+        free(emu);
+        return NULL;
+    }
+    // like the target's unique ID, distinct per instance
+    snprintf(stl->serial, sizeof(stl->serial), "EMU%08X", instance);
+    return stl;
+}
+
+stlink *stlink_emu_open(unsigned int latency_us)
+{
+    stlink_emu_config config;
+    stlink_emu_get_default_config(&config);
+    config.latency_us = latency_us;
+    return stlink_emu_open_config(&config);
+}
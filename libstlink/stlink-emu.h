@@ -0,0 +1,36 @@
+#ifndef STLINK_EMU_H
+#define STLINK_EMU_H
+
+
+#include "stlink-libusb.h"
+#include "stlink-device.h"
+
+
+enum STLinkEmuFault {
+    STLINK_EMU_FAULT_STALL      = 1 << 0, // endpoint stalls, transfer not taken
+    STLINK_EMU_FAULT_TIMEOUT    = 1 << 1, // transfer lost
+    STLINK_EMU_FAULT_SWIM       = 1 << 2, // target drops out of SWIM
+};
+
+typedef struct STLinkEmuConfig {
+    unsigned int latency_us;            // per USB transfer
+    unsigned int usb_bytes_per_second;  // bulk throughput, 0 for unlimited
+    unsigned int swim_bitrate;          // SWIM high speed bit/s, 0 for instant
+    unsigned int fault_every;           // synchronous transfers, 0 for never
+    unsigned int fault_mask;            // STLINK_EMU_FAULT_*, taken in turn
+    unsigned int hs_error_every;        // bytes read at SWIM high speed, 0 for never
+    const stlink_device *device;        // part behind it, NULL for an STM8S105x6
+    unsigned int swap_board_us;         // see below, 0 for one board staying put
+} stlink_emu_config;
+
+/*
+ * With swap_board_us, an operator pulls each board that long after the
+ * epilogue let it run, and plugs in a fresh one, erased and with the next
+ * unique ID, as long after that.
+ */
+void stlink_emu_get_default_config(stlink_emu_config *config);
+stlink *stlink_emu_open(unsigned int latency_us);
+stlink *stlink_emu_open_config(const stlink_emu_config *config);
+
+
+#endif
@@ -0,0 +1,299 @@
+/*
+ * STM8 flash and data EEPROM programming over SWIM
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Programming is done per flash block of the part set with
+ * stlink_set_device(): the target range is read back in one streamed pass,
+ * or taken from the cache attached with stlink_set_cache(), and only blocks
+ * whose contents differ from the image are unlocked, programmed and
+ * verified.  Blocks are written in block
+ * programming mode (FLASH_CR2/NCR2 PRG), i.e. with a single SWIM write and
+ * a single wait for EOP each; partially covered blocks are completed from
+ * the read-back contents.
+ *
+ * With STLINK_FLASH_LOADER the changed blocks are handed to a loader in
+ * target RAM instead and verified in one streamed pass at the end; should
+ * the loader fail, the remaining blocks are programmed over SWIM.
+ */
+
+#include "stlink-flash.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-loader.h"
+#include "stlink-poll.h"
+#include "stlink-read.h"
+#include "stm8.h"
+
+
+int stlink_flash_unlock(stlink *stl, uint32_t addr)
+{
+    const stlink_device *dev = stlink_get_device(stl);
+    uint8_t keys[2];
+    uint32_t reg;
+    uint8_t mask;
+    if (stlink_device_in_eeprom(dev, addr)) {
+        reg = dev->flash->dukr;
+        keys[0] = STM8_FLASH_DUKR_KEY1;
+        keys[1] = STM8_FLASH_DUKR_KEY2;
+        mask = STM8_FLASH_IAPSR_DUL;
+    } else {
+        reg = dev->flash->pukr;
+        keys[0] = STM8_FLASH_PUKR_KEY1;
+        keys[1] = STM8_FLASH_PUKR_KEY2;
+        mask = STM8_FLASH_IAPSR_PUL;
+    }
+    if (stlink_swim_write_wait(stl, reg, 1, &keys[0]) != 0 ||
+        stlink_swim_write_wait(stl, reg, 1, &keys[1]) != 0)
+        return -1;
+    uint8_t iapsr;
+    if (stlink_swim_read_wait(stl, dev->flash->iapsr, 1, &iapsr) != 0)
+        return -1;
+    if (!(iapsr & mask)) {
+        STLINK_ERR(FLASH, "%s: unlocking failed, IAPSR = 0x%02" PRIX8, __func__, iapsr);
+        return -1;
+    }
+    stl->flash_unlocked |= mask;
+    return 0;
+}
+
+int stlink_flash_lock(stlink *stl)
+{
+    uint8_t iapsr = 0x00;
+    stl->flash_unlocked = 0;
+    return stlink_swim_write_wait(stl, stlink_get_device(stl)->flash->iapsr, 1, &iapsr);
+}
+
+static int flash_poll_eop(stlink *stl, void *opaque)
+{
+    uint8_t iapsr;
+    if (stlink_swim_read_wait(stl, stlink_get_device(stl)->flash->iapsr, 1, &iapsr) != 0)
+        return -1;
+    if (iapsr & STM8_FLASH_IAPSR_WR_PG_DIS) {
+        STLINK_ERR(FLASH, "flash_wait_eop: write to protected page");
+        return -1;
+    }
+    return (iapsr & STM8_FLASH_IAPSR_EOP) ? 0 : 1;
+}
+
+static int flash_wait_eop(stlink *stl)
+{
+    int ret = stlink_poll_until(stl, flash_poll_eop, NULL, stlink_get_device(stl)->prog_time_us,
+                                &stl->eop_stats);
+    if (ret == 1)
+        STLINK_ERR(FLASH, "%s: timed out", __func__);
+    return (ret == 0) ? 0 : -1;
+}
+
+/*
+ * Programs a byte, an aligned word or a whole block, in the mode matching
+ * len, into unlocked memory.
+ */
+int stlink_flash_program(stlink *stl, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    const stlink_device *dev = stlink_get_device(stl);
+    uint8_t mode;
+    if (len == dev->block_size && addr % len == 0) {
+        mode = STM8_FLASH_CR2_PRG;
+    } else if (len == STM8_FLASH_WORD_SIZE && addr % len == 0) {
+        mode = STM8_FLASH_CR2_WPRG;
+    } else if (len == 1) {
+        mode = 0;
+    } else {
+        STLINK_ERR(FLASH, "%s: cannot program %" PRIu32 " bytes at 0x%06" PRIx32,
+                   __func__, len, addr);
+        return -1;
+    }
+    // FLASH_NCR2, where present, follows FLASH_CR2 and must hold the complement.
+    uint8_t cr2[2] = { mode, (uint8_t)~mode };
+    if (mode != 0 &&
+        stlink_swim_write_wait(stl, dev->flash->cr2, (dev->flash->ncr2 != 0) ? 2 : 1, cr2) != 0)
+        return -1;
+    if (stlink_swim_write_wait(stl, addr, len, (uint8_t *)data) != 0)
+        return -1;
+    return flash_wait_eop(stl);
+}
+
+/*
+ * Unlocks the memory at addr unless already unlocked, then programs it.
+ * Should the target drop out of SWIM meanwhile, the prologue bringing it
+ * back relocks the memory, so both steps are redone, if enabled with
+ * stlink_recovery_set_reenter().
+ */
+int stlink_flash_unlock_program(stlink *stl, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    uint8_t mask = stlink_device_in_eeprom(stlink_get_device(stl), addr) ?
+                   STM8_FLASH_IAPSR_DUL : STM8_FLASH_IAPSR_PUL;
+    int ret;
+    stl->sequence++;
+    for (int attempt = 0; ; attempt++) {
+        ret = 0;
+        if (!(stl->flash_unlocked & mask))
+            ret = stlink_flash_unlock(stl, addr);
+        if (ret == 0)
+            ret = stlink_flash_program(stl, addr, data, len);
+        if (ret == 0 || attempt > 0 || stlink_recover_sequence(stl) != 0)
+            break;
+        STLINK_INFO(FLASH, "unlocking and programming 0x%06" PRIx32 " again...", addr);
+    }
+    stl->sequence--;
+    return ret;
+}
+
+void stlink_flash_set_mode(stlink *stl, enum STLinkFlashMode mode)
+{
+    stl->flash_mode = mode;
+}
+
+// Programs the blocks where wanted differs from current through the loader.
+static int flash_write_loader(stlink *stl, uint32_t first, uint32_t size,
+                              const uint8_t *wanted, uint8_t *current,
+                              stlink_flash_stats *stats)
+{
+    const uint32_t block_size = stlink_get_device(stl)->block_size;
+    if (first + size > 0x10000) {
+        STLINK_WARN(FLASH, "%s: range not reachable by the loader", __func__);
+        return -1;
+    }
+    stlink_loader *ld = stlink_loader_start(stl);
+    if (ld == NULL)
+        return -1;
+    int ret = 0;
+    for (uint32_t off = 0; off < size && ret == 0; off += block_size) {
+        if (memcmp(wanted + off, current + off, block_size) == 0)
+            continue;
+        STLINK_INFO(FLASH, "queueing block at 0x%06" PRIx32 "...", first + off);
+        ret = stlink_loader_program(ld, first + off, wanted + off);
+    }
+    if (stlink_loader_finish(ld) != 0 || ret != 0)
+        return -1;
+
+    // current still holds the old contents, to tell the programmed blocks
+    uint8_t *readback = malloc(size);
+    if (readback == NULL)
+        return -1;
+    stlink_memory_sink sink = {
+        .buffer = readback,
+        .base = first,
+        .size = size,
+    };
+    ret = stlink_swim_read_range(stl, first, size, stlink_sink_memory, &sink);
+    for (uint32_t off = 0; off < size && ret == 0; off += block_size) {
+        if (memcmp(readback + off, wanted + off, block_size) != 0) {
+            STLINK_ERR(FLASH, "%s: verify failed at 0x%06" PRIx32, __func__, first + off);
+            ret = -1;
+        }
+    }
+    for (uint32_t off = 0; off < size && ret == 0; off += block_size) {
+        stats->blocks_total++;
+        if (memcmp(current + off, readback + off, block_size) == 0) {
+            stats->blocks_skipped++;
+            continue;
+        }
+        stats->blocks_programmed++;
+        stats->bytes_programmed += block_size;
+    }
+    // the range was invalidated before starting the loader
+    if (ret == 0 && stl->cache != NULL)
+        stlink_cache_update(stl->cache, first, readback, size);
+    memcpy(current, readback, size);
+    free(readback);
+    return ret;
+}
+
+int stlink_flash_write_delta(stlink *stl, uint32_t addr, const uint8_t *image, uint32_t len,
+                             stlink_flash_stats *stats)
+{
+    memset(stats, 0, sizeof(stlink_flash_stats));
+    uint64_t start = stlink_time_us();
+
+    const uint32_t block_size = stlink_get_device(stl)->block_size;
+    uint32_t first = addr - addr % block_size;
+    uint32_t size = ((addr + len + block_size - 1) / block_size) * block_size - first;
+    uint8_t *current = malloc(size);
+    uint8_t *wanted = malloc(size);
+    if (current == NULL || wanted == NULL) {
+        free(current);
+        free(wanted);
+        return -1;
+    }
+    stlink_memory_sink sink = {
+        .buffer = current,
+        .base = first,
+        .size = size,
+    };
+    if (stlink_cache_read(stl, first, size, stlink_sink_memory, &sink) != 0) {
+        free(current);
+        free(wanted);
+        return -1;
+    }
+    memcpy(wanted, current, size);
+    memcpy(wanted + (addr - first), image, len);
+
+    int ret = 0;
+    bool loaded = false;
+    uint64_t program_start = stlink_time_us();
+    if (stl->flash_mode == STLINK_FLASH_LOADER && memcmp(wanted, current, size) != 0) {
+        ret = stlink_flash_unlock(stl, addr);
+        // the stub programs behind the cache's back, and may stop anywhere
+        if (stl->cache != NULL)
+            stlink_cache_invalidate(stl->cache, first, size);
+        // the loader cannot be restarted midway, only replaced by SWIM programming
+        stl->sequence++;
+        if (ret == 0 && flash_write_loader(stl, first, size, wanted, current, stats) == 0)
+            loaded = true;
+        stl->sequence--;
+        if (ret == 0 && !loaded) {
+            STLINK_INFO(FLASH, "falling back to SWIM programming...");
+            memset(stats, 0, sizeof(stlink_flash_stats));
+            ret = stlink_swim_read_range(stl, first, size, stlink_sink_memory, &sink);
+            if (ret == 0 && stl->cache != NULL)
+                stlink_cache_update(stl->cache, first, current, size);
+        }
+    }
+    for (uint32_t off = 0; off < size && !loaded && ret == 0; off += block_size) {
+        uint32_t block_addr = first + off;
+        stats->blocks_total++;
+        if (memcmp(wanted + off, current + off, block_size) == 0) {
+            stats->blocks_skipped++;
+            continue;
+        }
+
+        STLINK_INFO(FLASH, "programming block at 0x%06" PRIx32 "...", block_addr);
+        ret = stlink_flash_unlock_program(stl, block_addr, wanted + off, block_size);
+        if (ret != 0)
+            break;
+        ret = stlink_swim_read_wait(stl, block_addr, block_size, current + off);
+        if (ret != 0)
+            break;
+        if (memcmp(wanted + off, current + off, block_size) != 0) {
+            STLINK_ERR(FLASH, "%s: verify failed at 0x%06" PRIx32, __func__, block_addr);
+            ret = -1;
+            break;
+        }
+        if (stl->cache != NULL)
+            stlink_cache_update(stl->cache, block_addr, current + off, block_size);
+        stats->blocks_programmed++;
+        stats->bytes_programmed += block_size;
+    }
+    if (stl->flash_unlocked != 0 && stlink_flash_lock(stl) != 0)
+        ret = -1;
+
+    free(current);
+    free(wanted);
+    uint64_t now = stlink_time_us();
+    stats->elapsed_us = now - start;
+    stats->program_us = now - program_start;
+    if (stats->program_us > 0)
+        stats->bytes_per_second = (uint64_t)stats->bytes_programmed * 1000000 / stats->program_us;
+    return ret;
+}
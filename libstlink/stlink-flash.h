@@ -0,0 +1,35 @@
+#ifndef STLINK_FLASH_H
+#define STLINK_FLASH_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+enum STLinkFlashMode {
+    STLINK_FLASH_SWIM,      // block by block over SWIM
+    STLINK_FLASH_LOADER,    // through a loader in target RAM, see stlink-loader.h
+};
+
+typedef struct STLinkFlashStats {
+    uint32_t blocks_total;
+    uint32_t blocks_skipped;
+    uint32_t blocks_programmed;
+    uint32_t bytes_programmed;
+    uint64_t elapsed_us;
+    uint64_t program_us;        // programming and verification only
+    uint32_t bytes_per_second;  // programming throughput
+} stlink_flash_stats;
+
+int stlink_flash_unlock(stlink *stl, uint32_t addr);
+int stlink_flash_lock(stlink *stl);
+int stlink_flash_program(stlink *stl, uint32_t addr, const uint8_t *data, uint32_t len);
+int stlink_flash_unlock_program(stlink *stl, uint32_t addr, const uint8_t *data, uint32_t len);
+
+void stlink_flash_set_mode(stlink *stl, enum STLinkFlashMode mode);
+int stlink_flash_write_delta(stlink *stl, uint32_t addr, const uint8_t *image, uint32_t len,
+                             stlink_flash_stats *stats);
+
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * Gang programming
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Runs the same job on several probes at once, one worker thread per probe.
+ * Probes share nothing but the job's opaque data, so each one must have been
+ * opened with its own libusb context.  The status of every probe can be
+ * queried while the jobs are running.
+ */
+
+#include "stlink-gang.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+
+
+typedef struct STLinkGangProbe {
+    stlink_gang *gang;
+    stlink *stl;
+    pthread_t thread;
+    bool started;
+    stlink_gang_status status;
+    uint64_t start_us;
+} STLinkGangProbe;
+
+struct STLinkGang {
+    STLinkGangProbe *probes;
+    int count;
+    int capacity;
+
+    pthread_mutex_t lock; // protects the probes' status
+    stlink_gang_fn fn;
+    void *opaque;
+};
+
+stlink_gang *stlink_gang_new(void)
+{
+    stlink_gang *gang = calloc(1, sizeof(stlink_gang));
+    if (gang == NULL)
+        return NULL;
+    pthread_mutex_init(&gang->lock, NULL);
+    return gang;
+}
+
+// Waits for running jobs; the probes themselves are left open.
+void stlink_gang_free(stlink_gang *gang)
+{
+    if (gang == NULL)
+        return;
+
+    stlink_gang_wait(gang);
+    pthread_mutex_destroy(&gang->lock);
+    free(gang->probes);
+    free(gang);
+}
+
+int stlink_gang_add(stlink_gang *gang, stlink *stl)
+{
+    if (gang->count == gang->capacity) {
+        int capacity = (gang->capacity > 0) ? gang->capacity * 2 : 16;
+        STLinkGangProbe *probes = realloc(gang->probes, capacity * sizeof(STLinkGangProbe));
+        if (probes == NULL)
+            return -1;
+        gang->probes = probes;
+        gang->capacity = capacity;
+    }
+    STLinkGangProbe *probe = &gang->probes[gang->count];
+    memset(probe, 0, sizeof(STLinkGangProbe));
+    probe->gang = gang;
+    probe->stl = stl;
+    probe->status.state = STLINK_GANG_IDLE;
+    return gang->count++;
+}
+
+int stlink_gang_count(stlink_gang *gang)
+{
+    return gang->count;
+}
+
+stlink *stlink_gang_get_probe(stlink_gang *gang, int index)
+{
+    if (index < 0 || index >= gang->count)
+        return NULL;
+    return gang->probes[index].stl;
+}
+
+static void *gang_worker(void *arg)
+{
+    STLinkGangProbe *probe = arg;
+    stlink_gang *gang = probe->gang;
+
+    int ret = gang->fn(probe->stl, gang->opaque);
+
+    pthread_mutex_lock(&gang->lock);
+    probe->status.result = ret;
+    probe->status.state = (ret == 0) ? STLINK_GANG_DONE : STLINK_GANG_FAILED;
+    probe->status.elapsed_us = stlink_time_us() - probe->start_us;
+    pthread_mutex_unlock(&gang->lock);
+    return NULL;
+}
+
+/*
+ * Starts fn on every probe.  The probes must not be used otherwise until
+ * stlink_gang_wait() returns.
+ */
+int stlink_gang_start(stlink_gang *gang, stlink_gang_fn fn, void *opaque)
+{
+    gang->fn = fn;
+    gang->opaque = opaque;
+    int ret = 0;
+    for (int i = 0; i < gang->count; i++) {
+        STLinkGangProbe *probe = &gang->probes[i];
+        if (probe->started)
+            continue;
+        pthread_mutex_lock(&gang->lock);
+        probe->status.state = STLINK_GANG_RUNNING;
+        probe->status.result = 0;
+        probe->status.elapsed_us = 0;
+        probe->start_us = stlink_time_us();
+        pthread_mutex_unlock(&gang->lock);
+
+        int err = pthread_create(&probe->thread, NULL, gang_worker, probe);
+        if (err != 0) {
+            STLINK_ERR(DEVICE, "%s: starting worker %d failed: %s", __func__, i, strerror(err));
+            pthread_mutex_lock(&gang->lock);
+            probe->status.state = STLINK_GANG_FAILED;
+            probe->status.result = -1;
+            pthread_mutex_unlock(&gang->lock);
+            ret = -1;
+            continue;
+        }
+        probe->started = true;
+    }
+    return ret;
+}
+
+// Returns the number of probes whose job failed.
+int stlink_gang_wait(stlink_gang *gang)
+{
+    int failed = 0;
+    for (int i = 0; i < gang->count; i++) {
+        STLinkGangProbe *probe = &gang->probes[i];
+        if (probe->started) {
+            pthread_join(probe->thread, NULL);
+            probe->started = false;
+        }
+        if (probe->status.state == STLINK_GANG_FAILED)
+            failed++;
+    }
+    return failed;
+}
+
+void stlink_gang_get_status(stlink_gang *gang, int index, stlink_gang_status *status)
+{
+    STLinkGangProbe *probe = &gang->probes[index];
+    pthread_mutex_lock(&gang->lock);
+    *status = probe->status;
+    if (status->state == STLINK_GANG_RUNNING)
+        status->elapsed_us = stlink_time_us() - probe->start_us;
+    pthread_mutex_unlock(&gang->lock);
+}
+
+void stlink_gang_dump_status(stlink_gang *gang, FILE *f)
+{
+    static const char *const states[] = {
+        [STLINK_GANG_IDLE]      = "idle",
+        [STLINK_GANG_RUNNING]   = "running",
+        [STLINK_GANG_DONE]      = "done",
+        [STLINK_GANG_FAILED]    = "FAILED",
+    };
+    for (int i = 0; i < gang->count; i++) {
+        stlink_gang_status status;
+        stlink_gang_get_status(gang, i, &status);
+        const char *serial = stlink_get_serial(gang->probes[i].stl);
+        fprintf(f, "probe %2d %-24s %-8s %6" PRIu64 " ms\n", i,
+                (serial[0] != '\0') ? serial : "-", states[status.state],
+                status.elapsed_us / 1000);
+    }
+}
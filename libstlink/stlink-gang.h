@@ -0,0 +1,41 @@
+#ifndef STLINK_GANG_H
+#define STLINK_GANG_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stlink-libusb.h"
+
+
+enum STLinkGangState {
+    STLINK_GANG_IDLE,
+    STLINK_GANG_RUNNING,
+    STLINK_GANG_DONE,
+    STLINK_GANG_FAILED,
+};
+
+typedef struct STLinkGangStatus {
+    enum STLinkGangState state;
+    int result;             // return value of the job
+    uint64_t elapsed_us;    // so far, while running
+} stlink_gang_status;
+
+typedef int (*stlink_gang_fn)(stlink *stl, void *opaque);
+
+typedef struct STLinkGang stlink_gang;
+
+stlink_gang *stlink_gang_new(void);
+void stlink_gang_free(stlink_gang *gang);
+int stlink_gang_add(stlink_gang *gang, stlink *stl);
+int stlink_gang_count(stlink_gang *gang);
+stlink *stlink_gang_get_probe(stlink_gang *gang, int index);
+
+int stlink_gang_start(stlink_gang *gang, stlink_gang_fn fn, void *opaque);
+int stlink_gang_wait(stlink_gang *gang);
+
+void stlink_gang_get_status(stlink_gang *gang, int index, stlink_gang_status *status);
+void stlink_gang_dump_status(stlink_gang *gang, FILE *f);
+
+
+#endif
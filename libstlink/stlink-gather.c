@@ -0,0 +1,116 @@
+/*
+ * Scatter-gather SWIM reads
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Each SWIM read is a BEGIN_READ, busy polling and a READ, so reading a
+ * dozen scattered bytes one by one costs a dozen round trips where one
+ * would do.  Requests are sorted by address and merged into spans as long
+ * as the span fits the probe's buffer and the gap to the next request is
+ * small; each span is then read once and copied out to its requests.
+ * Gaps are never bridged in the peripheral and CPU register areas, where
+ * reading a register may have side effects.
+ */
+
+#include "stlink-gather.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+#include "stm8.h"
+
+
+static bool overlaps(uint32_t start, uint32_t end, uint32_t region, uint32_t size)
+{
+    return start < region + size && end > region;
+}
+
+// Whether the gap [start, end) must not be read.
+static bool gather_volatile(uint32_t start, uint32_t end)
+{
+    return overlaps(start, end, STM8S105_IO_START, STM8S105_IO_SIZE) ||
+           overlaps(start, end, STM8S105_CPU_START, STM8S105_CPU_SIZE);
+}
+
+static int gather_compare(const void *a, const void *b)
+{
+    const stlink_read_request *ra = *(const stlink_read_request * const *)a;
+    const stlink_read_request *rb = *(const stlink_read_request * const *)b;
+    if (ra->addr != rb->addr)
+        return (ra->addr < rb->addr) ? -1 : 1;
+    return (int)ra->len - (int)rb->len;
+}
+
+int stlink_swim_read_gather(stlink *stl, const stlink_read_request *reqs, int count,
+                            uint16_t max_gap, int *reads)
+{
+    if (reads != NULL)
+        *reads = 0;
+    if (count <= 0)
+        return 0;
+    uint16_t size;
+    if (stlink_swim_chunk_size(stl, &size) != 0 || size == 0)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        if (reqs[i].len > size) {
+            STLINK_ERR(SWIM, "%s: request at 0x%06" PRIx32 " exceeds 0x%" PRIx16 " bytes",
+                       __func__, reqs[i].addr, size);
+            return -1;
+        }
+    }
+
+    const stlink_read_request **sorted = malloc(count * sizeof(*sorted));
+    uint8_t *buf = stlink_buffer_alloc(stl, size);
+    if (sorted == NULL || buf == NULL) {
+        free(sorted);
+        stlink_buffer_free(stl, buf);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        sorted[i] = &reqs[i];
+    }
+    qsort(sorted, count, sizeof(*sorted), gather_compare);
+
+    int ret = 0;
+    int spans = 0;
+    for (int first = 0; first < count && ret == 0; ) {
+        uint32_t start = sorted[first]->addr;
+        uint32_t end = start + sorted[first]->len;
+        int last = first + 1;
+        while (last < count) {
+            const stlink_read_request *req = sorted[last];
+            uint32_t req_end = req->addr + req->len;
+            if (req->addr > end &&
+                (req->addr - end > max_gap || gather_volatile(end, req->addr)))
+                break;
+            if (req_end > end && req_end - start > size)
+                break;
+            if (req_end > end)
+                end = req_end;
+            last++;
+        }
+
+        ret = stlink_swim_read_wait(stl, start, end - start, buf);
+        spans++;
+        for (int i = first; i < last && ret == 0; i++) {
+            memcpy(sorted[i]->buffer, buf + (sorted[i]->addr - start), sorted[i]->len);
+        }
+        first = last;
+    }
+    STLINK_DBG(SWIM, "%s: %d requests in %d reads", __func__, count, spans);
+
+    stlink_buffer_free(stl, buf);
+    free(sorted);
+    if (reads != NULL)
+        *reads = spans;
+    return ret;
+}
@@ -0,0 +1,28 @@
+#ifndef STLINK_GATHER_H
+#define STLINK_GATHER_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+// Gaps up to this size are read along rather than starting a new read.
+#define STLINK_GATHER_DEFAULT_GAP 16
+
+typedef struct STLinkReadRequest {
+    uint32_t addr;
+    uint16_t len;
+    uint8_t *buffer;            // receives len bytes
+} stlink_read_request;
+
+/*
+ * Reads all requests, in any order and possibly overlapping, with as few
+ * SWIM reads as the probe's buffer allows.  The number of reads issued is
+ * stored in *reads unless it is NULL.
+ */
+int stlink_swim_read_gather(stlink *stl, const stlink_read_request *reqs, int count,
+                            uint16_t max_gap, int *reads);
+
+
+#endif
@@ -0,0 +1,198 @@
+/*
+ * ST-Link hot-plug tracking
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * libusb must not be called back into from a hotplug callback, so the
+ * callback only notes that something changed.  stlink_hotplug_poll() then
+ * compares the device list against the table of known probes, holding a
+ * reference on each so that a device pointer identifies one attachment.
+ * Without hotplug support in libusb, the list is compared on every poll.
+ */
+
+#include "stlink-hotplug.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+
+
+typedef struct HotplugProbe {
+    libusb_device *dev;
+    bool seen;
+} HotplugProbe;
+
+struct STLinkHotplug {
+    libusb_context *usb_context;
+    stlink_hotplug_fn fn;
+    void *opaque;
+    bool has_hotplug;
+    libusb_hotplug_callback_handle handle;
+    bool changed;
+
+    // parallel arrays, so that the probe infos can be handed out as is
+    HotplugProbe *probes;
+    stlink_probe_info *infos;
+    int count;
+    int capacity;
+};
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
+                                        libusb_hotplug_event event, void *user_data)
+{
+    stlink_hotplug *hp = user_data;
+    hp->changed = true;
+    return 0;
+}
+
+stlink_hotplug *stlink_hotplug_new(libusb_context *usb_context,
+                                   stlink_hotplug_fn fn, void *opaque)
+{
+    stlink_hotplug *hp = calloc(1, sizeof(stlink_hotplug));
+    if (hp == NULL)
+        return NULL;
+    hp->usb_context = usb_context;
+    hp->fn = fn;
+    hp->opaque = opaque;
+    hp->changed = true;
+    if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        int ret = libusb_hotplug_register_callback(usb_context,
+                LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                LIBUSB_HOTPLUG_NO_FLAGS, USB_VID_ST, USB_PID_STLINK,
+                LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, hp, &hp->handle);
+        hp->has_hotplug = (ret == LIBUSB_SUCCESS);
+    }
+    if (!hp->has_hotplug)
+        STLINK_INFO(TRANSPORT, "no hotplug support, polling the device list");
+    return hp;
+}
+
+void stlink_hotplug_free(stlink_hotplug *hp)
+{
+    if (hp == NULL)
+        return;
+    if (hp->has_hotplug)
+        libusb_hotplug_deregister_callback(hp->usb_context, hp->handle);
+    for (int i = 0; i < hp->count; i++) {
+        libusb_unref_device(hp->probes[i].dev);
+    }
+    free(hp->probes);
+    free(hp->infos);
+    free(hp);
+}
+
+static int hotplug_find(stlink_hotplug *hp, libusb_device *dev)
+{
+    for (int i = 0; i < hp->count; i++) {
+        if (hp->probes[i].dev == dev)
+            return i;
+    }
+    return -1;
+}
+
+static int hotplug_add(stlink_hotplug *hp, libusb_device *dev)
+{
+    if (hp->count == hp->capacity) {
+        int capacity = (hp->capacity > 0) ? 2 * hp->capacity : 8;
+        HotplugProbe *probes = realloc(hp->probes, capacity * sizeof(HotplugProbe));
+        if (probes == NULL)
+            return -1;
+        hp->probes = probes;
+        stlink_probe_info *infos = realloc(hp->infos, capacity * sizeof(stlink_probe_info));
+        if (infos == NULL)
+            return -1;
+        hp->infos = infos;
+        hp->capacity = capacity;
+    }
+    int i = hp->count++;
+    hp->probes[i].dev = libusb_ref_device(dev);
+    hp->probes[i].seen = true;
+    stlink_usb_get_info(dev, &hp->infos[i]);
+    STLINK_INFO(TRANSPORT, "probe arrived: bus %03" PRIu8 " port %03" PRIu8 ", serial %s",
+                hp->infos[i].bus, hp->infos[i].port,
+                (hp->infos[i].serial[0] != '\0') ? hp->infos[i].serial : "(none)");
+    return i;
+}
+
+static void hotplug_remove(stlink_hotplug *hp, int i)
+{
+    stlink_probe_info info = hp->infos[i];
+    STLINK_INFO(TRANSPORT, "probe left: bus %03" PRIu8 " port %03" PRIu8,
+                info.bus, info.port);
+    libusb_unref_device(hp->probes[i].dev);
+    hp->count--;
+    hp->probes[i] = hp->probes[hp->count];
+    hp->infos[i] = hp->infos[hp->count];
+    if (hp->fn != NULL)
+        hp->fn(&info, false, hp->opaque);
+}
+
+static int hotplug_rescan(stlink_hotplug *hp)
+{
+    libusb_device **devs;
+    ssize_t count = libusb_get_device_list(hp->usb_context, &devs);
+    if (count < 0) {
+        STLINK_ERR(TRANSPORT, "%s: listing devices failed: %zd", __func__, count);
+        return -1;
+    }
+    for (int i = 0; i < hp->count; i++) {
+        hp->probes[i].seen = false;
+    }
+    for (ssize_t i = 0; i < count; i++) {
+        int n = hotplug_find(hp, devs[i]);
+        if (n >= 0)
+            hp->probes[n].seen = true;
+    }
+    for (int i = hp->count - 1; i >= 0; i--) {
+        if (!hp->probes[i].seen)
+            hotplug_remove(hp, i);
+    }
+    int first_new = hp->count;
+    for (ssize_t i = 0; i < count; i++) {
+        if (stlink_usb_is_stlink(devs[i]) && hotplug_find(hp, devs[i]) < 0)
+            hotplug_add(hp, devs[i]);
+    }
+    libusb_free_device_list(devs, 1);
+
+    for (int i = first_new; i < hp->count && hp->fn != NULL; i++) {
+        hp->fn(&hp->infos[i], true, hp->opaque);
+    }
+    return 0;
+}
+
+// Waits up to timeout_ms for probes to come or go, then reports them.
+int stlink_hotplug_poll(stlink_hotplug *hp, int timeout_ms)
+{
+    if (hp->has_hotplug) {
+        if (!hp->changed) {
+            struct timeval tv = {
+                .tv_sec = timeout_ms / 1000,
+                .tv_usec = (timeout_ms % 1000) * 1000,
+            };
+            int ret = libusb_handle_events_timeout_completed(hp->usb_context, &tv, NULL);
+            if (ret != LIBUSB_SUCCESS && ret != LIBUSB_ERROR_INTERRUPTED)
+                return -1;
+        }
+    } else if (!hp->changed) {
+        usleep(timeout_ms * 1000);
+        hp->changed = true;
+    }
+    if (!hp->changed)
+        return 0;
+    hp->changed = false;
+    return hotplug_rescan(hp);
+}
+
+int stlink_hotplug_get_probes(stlink_hotplug *hp, const stlink_probe_info **probes)
+{
+    *probes = hp->infos;
+    return hp->count;
+}
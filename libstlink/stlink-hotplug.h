@@ -0,0 +1,26 @@
+#ifndef STLINK_HOTPLUG_H
+#define STLINK_HOTPLUG_H
+
+
+#include <stdbool.h>
+
+#include "stlink-libusb.h"
+
+
+typedef struct STLinkHotplug stlink_hotplug;
+
+// Reports a probe that was plugged in, or pulled, since the last call.
+typedef void (*stlink_hotplug_fn)(const stlink_probe_info *info, bool arrived, void *opaque);
+
+/*
+ * Keeps track of the ST-Links on the bus.  Probes already present are
+ * reported as arrived on the first stlink_hotplug_poll().
+ */
+stlink_hotplug *stlink_hotplug_new(libusb_context *usb_context,
+                                   stlink_hotplug_fn fn, void *opaque);
+void stlink_hotplug_free(stlink_hotplug *hp);
+int stlink_hotplug_poll(stlink_hotplug *hp, int timeout_ms);
+int stlink_hotplug_get_probes(stlink_hotplug *hp, const stlink_probe_info **probes);
+
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ * Firmware image files
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Images are mapped rather than read.  Raw binaries and ELF PT_LOAD
+ * segments are used in place, so opening even a large ELF file only costs
+ * a walk over its program headers.  Intel HEX and S-record files must be
+ * decoded, which happens in a single pass into one buffer sized from the
+ * file, with consecutive records coalesced into one segment.
+ *
+ * Dumps go the other way: the output file is sized up front and mapped, so
+ * that a read can stream into it through stlink_sink_memory().
+ */
+
+#include "stlink-image.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stlink-internal.h"
+
+
+struct STLinkImage {
+    enum STLinkImageFormat format;
+    uint8_t *map;
+    size_t map_size;
+    uint8_t *decoded;               // HEX and S-record data
+    stlink_image_segment *segments;
+    int count;
+    int capacity;
+};
+
+static int image_add_segment(stlink_image *image, uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    if (len == 0)
+        return 0;
+    if ((uint64_t)addr + len > (uint64_t)UINT32_MAX + 1) {
+        STLINK_ERR(FLASH, "%s: segment at 0x%08" PRIx32 " exceeds the address space",
+                   __func__, addr);
+        return -1;
+    }
+    if (image->count > 0) {
+        stlink_image_segment *last = &image->segments[image->count - 1];
+        if (last->addr + last->len == addr && last->data + last->len == data) {
+            last->len += len;
+            return 0;
+        }
+    }
+    if (image->count == image->capacity) {
+        int capacity = (image->capacity > 0) ? image->capacity * 2 : 16;
+        stlink_image_segment *segments = realloc(image->segments,
+                                                 capacity * sizeof(stlink_image_segment));
+        if (segments == NULL)
+            return -1;
+        image->segments = segments;
+        image->capacity = capacity;
+    }
+    image->segments[image->count++] = (stlink_image_segment) {
+        .addr = addr,
+        .len = len,
+        .data = data,
+    };
+    return 0;
+}
+
+static int image_compare_segments(const void *a, const void *b)
+{
+    const stlink_image_segment *sa = a;
+    const stlink_image_segment *sb = b;
+    return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+// Sorts the segments, rejects overlaps and joins what is contiguous.
+static int image_finish_segments(stlink_image *image)
+{
+    if (image->count == 0) {
+        STLINK_ERR(FLASH, "%s: image has no data", __func__);
+        return -1;
+    }
+    qsort(image->segments, image->count, sizeof(stlink_image_segment), image_compare_segments);
+    int count = 1;
+    for (int i = 1; i < image->count; i++) {
+        stlink_image_segment *last = &image->segments[count - 1];
+        stlink_image_segment *seg = &image->segments[i];
+        if ((uint64_t)last->addr + last->len > seg->addr) {
+            STLINK_ERR(FLASH, "%s: segments overlap at 0x%08" PRIx32, __func__, seg->addr);
+            return -1;
+        }
+        if (last->addr + last->len == seg->addr && last->data + last->len == seg->data) {
+            last->len += seg->len;
+            continue;
+        }
+        image->segments[count++] = *seg;
+    }
+    image->count = count;
+    return 0;
+}
+
+static int hex_nibble(uint8_t c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes len bytes from 2 * len hex digits.
+static int hex_decode(const uint8_t *text, uint8_t *out, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_nibble(text[2 * i]);
+        int lo = hex_nibble(text[2 * i + 1]);
+        if (hi < 0 || lo < 0)
+            return -1;
+        out[i] = hi << 4 | lo;
+    }
+    return 0;
+}
+
+static bool is_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Yields the next non-blank line of a text image, without surrounding blanks.
+static bool image_next_line(const uint8_t **pos, const uint8_t *end,
+                            const uint8_t **line, size_t *len)
+{
+    while (*pos < end) {
+        const uint8_t *start = *pos;
+        const uint8_t *eol = memchr(start, '\n', end - start);
+        if (eol == NULL)
+            eol = end;
+        *pos = (eol < end) ? eol + 1 : end;
+        while (start < eol && is_space(*start))
+            start++;
+        while (eol > start && is_space(eol[-1]))
+            eol--;
+        if (start < eol) {
+            *line = start;
+            *len = eol - start;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Intel HEX: ":" count(1) offset(2) type(1) data(count) checksum(1), with
+ * extended segment (02) and linear (04) address records.
+ */
+static int image_parse_ihex(stlink_image *image)
+{
+    const uint8_t *pos = image->map;
+    const uint8_t *end = image->map + image->map_size;
+    uint8_t *out = image->decoded;
+    uint32_t upper = 0;
+    int lineno = 0;
+    const uint8_t *line;
+    size_t len;
+    while (image_next_line(&pos, end, &line, &len)) {
+        uint8_t rec[5 + 255];
+        lineno++;
+        size_t n = (len - 1) / 2;
+        if (line[0] != ':' || len % 2 != 1 || n < 5 || n > sizeof(rec) ||
+            hex_decode(line + 1, rec, n) != 0 || rec[0] + 5 != n) {
+            STLINK_ERR(FLASH, "%s: malformed record in line %d", __func__, lineno);
+            return -1;
+        }
+        uint8_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += rec[i];
+        if (sum != 0) {
+            STLINK_ERR(FLASH, "%s: checksum error in line %d", __func__, lineno);
+            return -1;
+        }
+        uint8_t count = rec[0];
+        uint16_t offset = rec[1] << 8 | rec[2];
+        const uint8_t *data = &rec[4];
+        switch (rec[3]) {
+        case 0x00:
+            memcpy(out, data, count);
+            if (image_add_segment(image, upper + offset, out, count) != 0)
+                return -1;
+            out += count;
+            break;
+        case 0x01:
+            return 0;
+        case 0x02:
+        case 0x04:
+            if (count != 2) {
+                STLINK_ERR(FLASH, "%s: malformed address in line %d", __func__, lineno);
+                return -1;
+            }
+            upper = (uint32_t)(data[0] << 8 | data[1]) << (rec[3] == 0x02 ? 4 : 16);
+            break;
+        case 0x03:
+        case 0x05:
+            break;
+        default:
+            STLINK_ERR(FLASH, "%s: unknown record type %02x in line %d", __func__,
+                       rec[3], lineno);
+            return -1;
+        }
+    }
+    STLINK_WARN(FLASH, "%s: no end-of-file record", __func__);
+    return 0;
+}
+
+/*
+ * Motorola S-record: "S" type count(1) address(2-4) data checksum(1), where
+ * count covers address, data and checksum.
+ */
+static int image_parse_srec(stlink_image *image)
+{
+    static const uint8_t addr_bytes[10] = { 2, 2, 3, 4, 0, 2, 3, 4, 3, 2 };
+    const uint8_t *pos = image->map;
+    const uint8_t *end = image->map + image->map_size;
+    uint8_t *out = image->decoded;
+    int lineno = 0;
+    const uint8_t *line;
+    size_t len;
+    while (image_next_line(&pos, end, &line, &len)) {
+        uint8_t rec[1 + 255];
+        lineno++;
+        int type = (len >= 2) ? hex_nibble(line[1]) : -1;
+        size_t n = (len - 2) / 2;
+        if (line[0] != 'S' || type < 0 || type > 9 || type == 4 || len % 2 != 0 ||
+            n < 2 || n > sizeof(rec) || hex_decode(line + 2, rec, n) != 0 ||
+            rec[0] + 1 != n || rec[0] < addr_bytes[type] + 1) {
+            STLINK_ERR(FLASH, "%s: malformed record in line %d", __func__, lineno);
+            return -1;
+        }
+        uint8_t sum = 0;
+        for (size_t i = 0; i < n; i++)
+            sum += rec[i];
+        if (sum != 0xff) {
+            STLINK_ERR(FLASH, "%s: checksum error in line %d", __func__, lineno);
+            return -1;
+        }
+        uint32_t addr = 0;
+        for (int i = 0; i < addr_bytes[type]; i++)
+            addr = addr << 8 | rec[1 + i];
+        const uint8_t *data = &rec[1 + addr_bytes[type]];
+        uint32_t count = rec[0] - addr_bytes[type] - 1;
+        if (type >= 7)
+            return 0;
+        if (type >= 1 && type <= 3) {
+            memcpy(out, data, count);
+            if (image_add_segment(image, addr, out, count) != 0)
+                return -1;
+            out += count;
+        }
+    }
+    STLINK_WARN(FLASH, "%s: no termination record", __func__);
+    return 0;
+}
+
+static uint32_t elf_u16(const uint8_t *p, bool be)
+{
+    return be ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+}
+
+static uint32_t elf_u32(const uint8_t *p, bool be)
+{
+    return be ? elf_u16(p, be) << 16 | elf_u16(p + 2, be)
+              : elf_u16(p + 2, be) << 16 | elf_u16(p, be);
+}
+
+static uint64_t elf_u64(const uint8_t *p, bool be)
+{
+    return be ? (uint64_t)elf_u32(p, be) << 32 | elf_u32(p + 4, be)
+              : (uint64_t)elf_u32(p + 4, be) << 32 | elf_u32(p, be);
+}
+
+enum {
+    ELF_CLASS_32    = 1,
+    ELF_CLASS_64    = 2,
+    ELF_DATA_LSB    = 1,
+    ELF_DATA_MSB    = 2,
+    ELF_PT_LOAD     = 1,
+};
+
+// Loadable file contents of ELF32 or ELF64 files, at their physical address.
+static int image_parse_elf(stlink_image *image)
+{
+    const uint8_t *m = image->map;
+    size_t size = image->map_size;
+    if (size < 52 || (m[4] != ELF_CLASS_32 && m[4] != ELF_CLASS_64) ||
+        (m[5] != ELF_DATA_LSB && m[5] != ELF_DATA_MSB) ||
+        (m[4] == ELF_CLASS_64 && size < 64)) {
+        STLINK_ERR(FLASH, "%s: unsupported ELF header", __func__);
+        return -1;
+    }
+    bool is64 = m[4] == ELF_CLASS_64;
+    bool be = m[5] == ELF_DATA_MSB;
+    uint64_t phoff = is64 ? elf_u64(m + 32, be) : elf_u32(m + 28, be);
+    uint32_t phentsize = elf_u16(m + (is64 ? 54 : 42), be);
+    uint32_t phnum = elf_u16(m + (is64 ? 56 : 44), be);
+    if (phentsize < (is64 ? 56 : 32) || phoff > size ||
+        (uint64_t)phnum * phentsize > size - phoff) {
+        STLINK_ERR(FLASH, "%s: program headers out of bounds", __func__);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < phnum; i++) {
+        const uint8_t *ph = m + phoff + (uint64_t)i * phentsize;
+        if (elf_u32(ph, be) != ELF_PT_LOAD)
+            continue;
+        uint64_t offset = is64 ? elf_u64(ph + 8, be) : elf_u32(ph + 4, be);
+        uint64_t paddr = is64 ? elf_u64(ph + 24, be) : elf_u32(ph + 12, be);
+        uint64_t filesz = is64 ? elf_u64(ph + 32, be) : elf_u32(ph + 16, be);
+        if (filesz == 0)
+            continue;
+        if (offset > size || filesz > size - offset ||
+            paddr + filesz > (uint64_t)UINT32_MAX + 1) {
+            STLINK_ERR(FLASH, "%s: segment %" PRIu32 " out of bounds", __func__, i);
+            return -1;
+        }
+        if (image_add_segment(image, paddr, m + offset, filesz) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static enum STLinkImageFormat image_detect(const uint8_t *m, size_t size)
+{
+    if (size >= 4 && memcmp(m, "\177ELF", 4) == 0)
+        return STLINK_IMAGE_ELF;
+    size_t i = 0;
+    while (i < size && is_space(m[i]))
+        i++;
+    if (i < size && m[i] == ':')
+        return STLINK_IMAGE_IHEX;
+    if (i + 1 < size && m[i] == 'S' && m[i + 1] >= '0' && m[i + 1] <= '9')
+        return STLINK_IMAGE_SREC;
+    return STLINK_IMAGE_RAW;
+}
+
+stlink_image *stlink_image_open(const char *path, enum STLinkImageFormat format, uint32_t base)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        STLINK_ERR(FLASH, "%s: cannot open %s: %s", __func__, path, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        STLINK_ERR(FLASH, "%s: %s is empty", __func__, path);
+        close(fd);
+        return NULL;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        STLINK_ERR(FLASH, "%s: cannot map %s: %s", __func__, path, strerror(errno));
+        return NULL;
+    }
+
+    stlink_image *image = calloc(1, sizeof(stlink_image));
+    if (image == NULL) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    image->map = map;
+    image->map_size = st.st_size;
+    image->format = (format == STLINK_IMAGE_AUTO) ? image_detect(map, st.st_size) : format;
+
+    int ret;
+    switch (image->format) {
+    case STLINK_IMAGE_IHEX:
+    case STLINK_IMAGE_SREC:
+        // each data byte takes at least two characters
+        image->decoded = malloc(image->map_size / 2);
+        if (image->decoded == NULL) {
+            ret = -1;
+            break;
+        }
+        ret = (image->format == STLINK_IMAGE_IHEX) ? image_parse_ihex(image)
+                                                   : image_parse_srec(image);
+        break;
+    case STLINK_IMAGE_ELF:
+        ret = image_parse_elf(image);
+        break;
+    default:
+        ret = image_add_segment(image, base, map, image->map_size);
+        break;
+    }
+    if (ret == 0)
+        ret = image_finish_segments(image);
+    if (ret != 0) {
+        STLINK_ERR(FLASH, "%s: cannot load %s", __func__, path);
+        stlink_image_close(image);
+        return NULL;
+    }
+
+    STLINK_DBG(FLASH, "%s: %s image, %d segments", path,
+               stlink_image_get_format_name(image->format), image->count);
+    return image;
+}
+
+void stlink_image_close(stlink_image *image)
+{
+    if (image == NULL)
+        return;
+    munmap(image->map, image->map_size);
+    free(image->decoded);
+    free(image->segments);
+    free(image);
+}
+
+enum STLinkImageFormat stlink_image_get_format(stlink_image *image)
+{
+    return image->format;
+}
+
+const char *stlink_image_get_format_name(enum STLinkImageFormat format)
+{
+    switch (format) {
+    case STLINK_IMAGE_RAW:
+        return "raw";
+    case STLINK_IMAGE_IHEX:
+        return "Intel HEX";
+    case STLINK_IMAGE_SREC:
+        return "S-record";
+    case STLINK_IMAGE_ELF:
+        return "ELF";
+    default:
+        return "auto";
+    }
+}
+
+int stlink_image_get_segment_count(stlink_image *image)
+{
+    return image->count;
+}
+
+const stlink_image_segment *stlink_image_get_segment(stlink_image *image, int index)
+{
+    if (index < 0 || index >= image->count)
+        return NULL;
+    return &image->segments[index];
+}
+
+int stlink_image_create_dump(const char *path, uint32_t base, uint32_t size,
+                             stlink_memory_sink *sink)
+{
+    if (size == 0)
+        return -1;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        STLINK_ERR(FLASH, "%s: cannot create %s: %s", __func__, path, strerror(errno));
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0) {
+        STLINK_ERR(FLASH, "%s: cannot size %s: %s", __func__, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+#ifdef __linux__
+    // allocate now rather than on the first write to each page; best effort
+    posix_fallocate(fd, 0, size);
+#endif
+    uint8_t *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        STLINK_ERR(FLASH, "%s: cannot map %s: %s", __func__, path, strerror(errno));
+        return -1;
+    }
+    sink->buffer = map;
+    sink->base = base;
+    sink->size = size;
+    return 0;
+}
+
+int stlink_image_close_dump(stlink_memory_sink *sink)
+{
+    int ret = munmap(sink->buffer, sink->size);
+    sink->buffer = NULL;
+    return (ret == 0) ? 0 : -1;
+}
@@ -0,0 +1,45 @@
+#ifndef STLINK_IMAGE_H
+#define STLINK_IMAGE_H
+
+
+#include <stdint.h>
+
+#include "stlink-read.h"
+
+
+enum STLinkImageFormat {
+    STLINK_IMAGE_AUTO,
+    STLINK_IMAGE_RAW,
+    STLINK_IMAGE_IHEX,
+    STLINK_IMAGE_SREC,
+    STLINK_IMAGE_ELF,
+};
+
+typedef struct STLinkImageSegment {
+    uint32_t addr;
+    uint32_t len;
+    const uint8_t *data;
+} stlink_image_segment;
+
+typedef struct STLinkImage stlink_image;
+
+/*
+ * Maps a firmware image read-only.  Segments are sorted by address and do
+ * not overlap; raw and ELF segment data points into the mapping itself.
+ * base is the load address of a raw image.
+ */
+stlink_image *stlink_image_open(const char *path, enum STLinkImageFormat format, uint32_t base);
+void stlink_image_close(stlink_image *image);
+
+enum STLinkImageFormat stlink_image_get_format(stlink_image *image);
+const char *stlink_image_get_format_name(enum STLinkImageFormat format);
+int stlink_image_get_segment_count(stlink_image *image);
+const stlink_image_segment *stlink_image_get_segment(stlink_image *image, int index);
+
+// Output file of size bytes, mapped into sink for use with stlink_sink_memory().
+int stlink_image_create_dump(const char *path, uint32_t base, uint32_t size,
+                             stlink_memory_sink *sink);
+int stlink_image_close_dump(stlink_memory_sink *sink);
+
+
+#endif
@@ -0,0 +1,157 @@
+/*
+ * libstlink internals shared between transport backends
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ */
+#ifndef STLINK_INTERNAL_H
+#define STLINK_INTERNAL_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "stlink-libusb.h"
+#include "stlink-buffer.h"
+#include "stlink-cache.h"
+#include "stlink-device.h"
+#include "stlink-flash.h"
+#include "stlink-log.h"
+#include "stlink-memcache.h"
+#include "stlink-poll.h"
+#include "stlink-recover.h"
+#include "stlink-speed.h"
+#include "stlink-transport.h"
+
+
+#define STLINK_TIMEOUT_MS 1000 // 1 s
+#define STLINK_ASYNC_DEPTH 8    // commands in flight
+#define STLINK_SWIM_COMMANDS 16
+#define STLINK_SWIM_SPEED_ERRORS 3 // prologue recoveries before slowing down
+
+#define STLINK_ERR(category, ...) \
+    STLINK_LOG(STLINK_LOG_ERROR, STLINK_LOG_##category, __VA_ARGS__)
+#define STLINK_WARN(category, ...) \
+    STLINK_LOG(STLINK_LOG_WARNING, STLINK_LOG_##category, __VA_ARGS__)
+#define STLINK_INFO(category, ...) \
+    STLINK_LOG(STLINK_LOG_INFO, STLINK_LOG_##category, __VA_ARGS__)
+#define STLINK_DBG(category, ...) \
+    STLINK_LOG(STLINK_LOG_DEBUG, STLINK_LOG_##category, __VA_ARGS__)
+
+/*
+ * The first 8 bytes of SWIM write data go into the CDB, the rest into the
+ * data phase.  With the data phase placed right behind the CBW, the payload
+ * is contiguous from here on and can be filled in place.
+ */
+#define STLINK_XFER_PAYLOAD (sizeof(USBCommandBlockWrapper) - 8)
+#define STLINK_XFER_SIZE    (STLINK_XFER_PAYLOAD + STLINK_BUFFER_SIZE)
+
+typedef struct STLinkAsyncCommand STLinkAsyncCommand;
+
+// ST-Link device
+struct STLink {
+    const STLinkTransportOps *ops;
+    void *opaque;
+
+    libusb_context *usb_context;
+    libusb_device_handle *handle;
+    bool dev_mem; // transfer buffers come from libusb_dev_mem_alloc()
+    uint8_t endpoint_in;
+    uint8_t endpoint_out;
+    char serial[STLINK_SERIAL_MAX];
+
+    uint32_t tag; // last CBW tag sent
+
+    // preallocated transfer buffers, see stlink-buffer.c
+    uint8_t *xfer;                  // CBW followed by SWIM write payload
+    USBCommandStatusWrapper *csw;
+    void *buffer_pool;              // free list of STLINK_BUFFER_SIZE buffers
+    int buffers_out;
+    STLinkAsyncCommand *async_free; // recycled asynchronous commands
+
+    // in-flight asynchronous commands, oldest first
+    STLinkAsyncCommand *async_head;
+    STLinkAsyncCommand *async_tail;
+    int async_pending;
+    int async_depth;
+
+    uint16_t swim_size; // cached STLINK_SWIM_GET_SIZE
+
+    // last SWIM operation, for busy polling
+    uint8_t swim_op;
+    uint16_t swim_len;
+    uint8_t swim_error; // SWIM status it failed with, if any
+    enum STLinkSWIMSpeed swim_speed; // selected by the prologue
+    int swim_speed_errors;
+    stlink_poll_config poll;
+    stlink_poll_histogram poll_stats[STLINK_SWIM_COMMANDS];
+    stlink_poll_histogram eop_stats;
+
+    stlink_cache *cache; // optional, see stlink_set_cache()
+    stlink_memcache *memcache; // optional, see stlink_memcache_enable()
+    enum STLinkFlashMode flash_mode;
+    uint8_t flash_unlocked; // FLASH_IAPSR PUL and DUL, as set by stlink_flash_unlock()
+    const stlink_device *device; // see stlink_set_device()
+
+    stlink_recovery_stats recovery;
+    bool recovering;
+    bool swim_reenter;  // see stlink_recovery_set_reenter()
+    int sequence;       // nesting of sequences that recover as a whole
+};
+
+stlink *stlink_alloc(const STLinkTransportOps *ops, void *opaque);
+void stlink_poll_init(stlink *stl);
+typedef int (*stlink_poll_fn)(stlink *stl, void *opaque);
+int stlink_poll_until(stlink *stl, stlink_poll_fn poll, void *opaque, uint64_t predict_us,
+                      stlink_poll_histogram *hist);
+
+int stlink_init_buffers(stlink *stl);
+void stlink_free_buffers(stlink *stl);
+uint8_t *stlink_mem_alloc(stlink *stl, size_t length);
+void stlink_mem_free(stlink *stl, uint8_t *buffer, size_t length);
+void stlink_async_free_all(stlink *stl);
+void stlink_cache_written(stlink *stl, uint32_t addr, uint32_t len);
+bool stlink_usb_is_stlink(libusb_device *dev);
+void stlink_usb_get_info(libusb_device *dev, stlink_probe_info *info);
+void stlink_target_written(stlink *stl, uint32_t addr, uint32_t len, const uint8_t *data);
+void stlink_recovery_failed(stlink *stl, enum STLinkFailure failure);
+void stlink_recovery_succeeded(stlink *stl, enum STLinkRecovery recovery);
+void stlink_recovery_gave_up(stlink *stl);
+int stlink_recover_transport(stlink *stl);
+int stlink_recover_swim(stlink *stl);
+int stlink_recover_sequence(stlink *stl);
+int stlink_swim_wait_status(stlink *stl, uint8_t *status);
+int stlink_swim_read_once(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer);
+uint32_t stlink_swim_speed_bitrate(enum STLinkSWIMSpeed speed, uint8_t swimccr);
+int stlink_memcache_read(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer);
+
+static inline USBCommandBlockWrapper *stlink_cbw(stlink *stl)
+{
+    return (USBCommandBlockWrapper *)stl->xfer;
+}
+
+uint32_t stlink_fill_cbw(stlink *stl, USBCommandBlockWrapper *cbw,
+                         const uint8_t *cdb, uint8_t cdb_length,
+                         uint8_t lun, uint8_t flags, uint32_t data_transfer_length);
+int stlink_send_cbw(stlink *stl, uint8_t *buffer, int transfer_length, bool inbound);
+
+uint8_t stlink_swim_cdb(uint8_t *cdb, uint8_t cmd);
+uint8_t stlink_swim_write_cdb(uint8_t *cdb, uint32_t addr, uint16_t len, const uint8_t *buffer);
+uint8_t stlink_swim_begin_read_cdb(uint8_t *cdb, uint32_t addr, uint16_t len);
+int stlink_swim_chunk_size(stlink *stl, uint16_t *size);
+
+static inline void stlink_sleep_us(uint64_t us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+    nanosleep(&ts, NULL);
+}
+
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Programming job queue
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * A job file lists what a production line programs: per variant the image,
+ * the part, how many boards and what serial numbers they get.  Each image
+ * file is opened once however many jobs name it, and since images are
+ * read-only once opened, the probe workers of a gang share them without
+ * locking.  Workers take boards from the queue one at a time, the first
+ * job in file order that their probe and part qualify for; serial numbers
+ * are handed out with the board, so no two boards get the same one, even
+ * if one of them fails.  The serial number is patched in after the image,
+ * see stlink-patch.h, and always read back.
+ */
+
+#include "stlink-job.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-flash.h"
+#include "stlink-patch.h"
+#include "stlink-verify.h"
+#include "stm8.h"
+
+
+typedef struct JobImage {
+    char *path;
+    stlink_image *image;
+} JobImage;
+
+struct STLinkJobQueue {
+    stlink_job *jobs;
+    stlink_job_stats *stats;
+    int count;
+    int capacity;
+
+    JobImage *images;
+    int image_count;
+
+    pthread_mutex_t lock; // protects the stats
+};
+
+static int jobqueue_grow(stlink_jobqueue *queue)
+{
+    if (queue->count < queue->capacity)
+        return 0;
+    int capacity = (queue->capacity > 0) ? queue->capacity * 2 : 16;
+    stlink_job *jobs = realloc(queue->jobs, capacity * sizeof(stlink_job));
+    if (jobs == NULL)
+        return -1;
+    queue->jobs = jobs;
+    stlink_job_stats *stats = realloc(queue->stats, capacity * sizeof(stlink_job_stats));
+    if (stats == NULL)
+        return -1;
+    queue->stats = stats;
+    queue->capacity = capacity;
+    return 0;
+}
+
+// Opens path unless an earlier job did; images are freed with the queue.
+static JobImage *jobqueue_open_image(stlink_jobqueue *queue, const char *path)
+{
+    for (int i = 0; i < queue->image_count; i++) {
+        if (strcmp(queue->images[i].path, path) == 0)
+            return &queue->images[i];
+    }
+    JobImage *images = realloc(queue->images, (queue->image_count + 1) * sizeof(JobImage));
+    if (images == NULL)
+        return NULL;
+    queue->images = images;
+
+    // raw images go to the start of flash, the same on all parts
+    stlink_image *image = stlink_image_open(path, STLINK_IMAGE_AUTO, STM8S105_FLASH_START);
+    char *copy = strdup(path);
+    if (image == NULL || copy == NULL) {
+        stlink_image_close(image);
+        free(copy);
+        return NULL;
+    }
+    JobImage *ji = &queue->images[queue->image_count++];
+    ji->path = copy;
+    ji->image = image;
+    return ji;
+}
+
+static bool parse_u32(const char *s, uint32_t *val)
+{
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(s, &end, 0);
+    if (errno != 0 || end == s || *end != '\0' || v > UINT32_MAX)
+        return false;
+    *val = v;
+    return true;
+}
+
+// ADDR,SIZE,FIRST
+static bool parse_serial(char *s, stlink_job *job)
+{
+    char *size = strchr(s, ',');
+    char *first = (size != NULL) ? strchr(size + 1, ',') : NULL;
+    if (first == NULL)
+        return false;
+    *size++ = '\0';
+    *first++ = '\0';
+    char *end;
+    errno = 0;
+    job->serial_first = strtoull(first, &end, 0);
+    if (errno != 0 || end == first || *end != '\0')
+        return false;
+    if (!parse_u32(s, &job->serial_addr) || !parse_u32(size, &job->serial_size) ||
+        job->serial_size == 0 || job->serial_size > STLINK_JOB_SERIAL_MAX)
+        return false;
+    // the first serial number must fit, later ones are checked as handed out
+    return job->serial_size == STLINK_JOB_SERIAL_MAX ||
+           job->serial_first < (uint64_t)1 << (8 * job->serial_size);
+}
+
+static int parse_option(stlink_job *job, char *opt)
+{
+    char *val = strchr(opt, '=');
+    if (val == NULL)
+        return -1;
+    *val++ = '\0';
+    if (strcmp(opt, "part") == 0) {
+        job->device = stlink_device_find(val);
+        return (job->device != NULL) ? 0 : -1;
+    }
+    if (strcmp(opt, "probe") == 0) {
+        if (strlen(val) >= sizeof(job->probe))
+            return -1;
+        strcpy(job->probe, val);
+        return 0;
+    }
+    if (strcmp(opt, "serial") == 0)
+        return parse_serial(val, job) ? 0 : -1;
+    if (strcmp(opt, "verify") == 0) {
+        if (strcmp(val, "none") == 0)
+            job->verify = STLINK_JOB_VERIFY_NONE;
+        else if (strcmp(val, "readback") == 0)
+            job->verify = STLINK_JOB_VERIFY_READBACK;
+        else if (strcmp(val, "target") == 0)
+            job->verify = STLINK_JOB_VERIFY_ON_TARGET;
+        else
+            return -1;
+        return 0;
+    }
+    if (strcmp(opt, "boards") == 0) {
+        uint32_t boards;
+        if (!parse_u32(val, &boards) || boards == 0 || boards > INT32_MAX)
+            return -1;
+        job->boards = boards;
+        return 0;
+    }
+    return -1;
+}
+
+// Image and options of one line, the image path being relative to that of the job file.
+static int parse_line(stlink_jobqueue *queue, char *line, const char *path, int dir_len,
+                      int lineno)
+{
+    char *hash = strchr(line, '#');
+    if (hash != NULL)
+        *hash = '\0';
+    char *save;
+    char *image = strtok_r(line, " \t\r\n", &save);
+    if (image == NULL)
+        return 0;
+
+    if (jobqueue_grow(queue) != 0)
+        return -1;
+    stlink_job *job = &queue->jobs[queue->count];
+    memset(job, 0, sizeof(stlink_job));
+    job->verify = STLINK_JOB_VERIFY_READBACK;
+    job->boards = 1;
+    job->line = lineno;
+    for (char *opt = strtok_r(NULL, " \t\r\n", &save); opt != NULL;
+         opt = strtok_r(NULL, " \t\r\n", &save)) {
+        if (parse_option(job, opt) != 0) {
+            STLINK_ERR(FLASH, "%s:%d: bad option %s", path, lineno, opt);
+            return -1;
+        }
+    }
+
+    char *full = malloc(dir_len + strlen(image) + 1);
+    if (full == NULL)
+        return -1;
+    if (image[0] == '/')
+        dir_len = 0;
+    memcpy(full, path, dir_len);
+    strcpy(full + dir_len, image);
+    JobImage *ji = jobqueue_open_image(queue, full);
+    free(full);
+    if (ji == NULL) {
+        STLINK_ERR(FLASH, "%s:%d: cannot open image %s", path, lineno, image);
+        return -1;
+    }
+    job->image_path = ji->path;
+    job->image = ji->image;
+    memset(&queue->stats[queue->count], 0, sizeof(stlink_job_stats));
+    queue->count++;
+    return 0;
+}
+
+stlink_jobqueue *stlink_jobqueue_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        STLINK_ERR(FLASH, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+    stlink_jobqueue *queue = calloc(1, sizeof(stlink_jobqueue));
+    if (queue == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+
+    const char *slash = strrchr(path, '/');
+    int dir_len = (slash != NULL) ? slash - path + 1 : 0;
+    char *line = NULL;
+    size_t line_size = 0;
+    int ret = 0;
+    for (int lineno = 1; ret == 0 && getline(&line, &line_size, f) >= 0; lineno++) {
+        ret = parse_line(queue, line, path, dir_len, lineno);
+    }
+    free(line);
+    fclose(f);
+    if (ret == 0 && queue->count == 0) {
+        STLINK_ERR(FLASH, "%s: no jobs", path);
+        ret = -1;
+    }
+    if (ret != 0) {
+        stlink_jobqueue_free(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void stlink_jobqueue_free(stlink_jobqueue *queue)
+{
+    if (queue == NULL)
+        return;
+
+    for (int i = 0; i < queue->image_count; i++) {
+        stlink_image_close(queue->images[i].image);
+        free(queue->images[i].path);
+    }
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->images);
+    free(queue->jobs);
+    free(queue->stats);
+    free(queue);
+}
+
+int stlink_jobqueue_get_count(stlink_jobqueue *queue)
+{
+    return queue->count;
+}
+
+const stlink_job *stlink_jobqueue_get_job(stlink_jobqueue *queue, int index)
+{
+    return (index >= 0 && index < queue->count) ? &queue->jobs[index] : NULL;
+}
+
+void stlink_jobqueue_get_stats(stlink_jobqueue *queue, int index, stlink_job_stats *stats)
+{
+    pthread_mutex_lock(&queue->lock);
+    *stats = queue->stats[index];
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int stlink_jobqueue_get_failed(stlink_jobqueue *queue)
+{
+    int failed = 0;
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < queue->count; i++) {
+        const stlink_job_stats *stats = &queue->stats[i];
+        failed += stats->boards_failed + queue->jobs[i].boards - stats->boards_started;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return failed;
+}
+
+void stlink_jobqueue_dump_stats(stlink_jobqueue *queue, FILE *f)
+{
+    for (int i = 0; i < queue->count; i++) {
+        const stlink_job *job = &queue->jobs[i];
+        stlink_job_stats stats;
+        stlink_jobqueue_get_stats(queue, i, &stats);
+        int finished = stats.boards_done + stats.boards_failed;
+        int missed = job->boards - stats.boards_started;
+        const char *image = strrchr(job->image_path, '/');
+        fprintf(f, "job %2d %-20s %-10s %4d of %4d done, %4d FAILED (%4d not started),"
+                " %6" PRIu32 " bytes, %6" PRIu64 " ms avg, %6" PRIu64 " min, %6" PRIu64 " max\n",
+                i, (image != NULL) ? image + 1 : job->image_path,
+                (job->device != NULL) ? job->device->name : "-",
+                stats.boards_done, job->boards, stats.boards_failed + missed, missed,
+                stats.bytes_programmed,
+                (finished > 0) ? stats.total_us / finished / 1000 : 0,
+                stats.min_us / 1000, stats.max_us / 1000);
+    }
+}
+
+// Parts sharing RAM size and flash controller cannot be told apart.
+static bool job_accepts(const stlink_job *job, const char *probe, const stlink_device *dev)
+{
+    if (job->probe[0] != '\0' && strcmp(job->probe, probe) != 0)
+        return false;
+    return job->device == NULL || (dev->family == job->device->family &&
+                                   dev->ram_size == job->device->ram_size);
+}
+
+int stlink_jobqueue_take(stlink_jobqueue *queue, stlink *stl, const stlink_device *dev,
+                         stlink_job_unit *unit)
+{
+    const char *probe = stlink_get_serial(stl);
+    int ret = -1;
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < queue->count && ret != 0; i++) {
+        const stlink_job *job = &queue->jobs[i];
+        stlink_job_stats *stats = &queue->stats[i];
+        if (stats->boards_started == job->boards || !job_accepts(job, probe, dev))
+            continue;
+        unit->job = i;
+        unit->board = stats->boards_started++;
+        unit->serial = job->serial_first + unit->board;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+int stlink_jobqueue_get_left(stlink_jobqueue *queue, stlink *stl, const stlink_device *dev)
+{
+    const char *probe = stlink_get_serial(stl);
+    int left = 0;
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < queue->count; i++) {
+        const stlink_job *job = &queue->jobs[i];
+        if (job_accepts(job, probe, dev))
+            left += job->boards - queue->stats[i].boards_started;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return left;
+}
+
+static bool job_in_memory(const stlink_device *dev, uint32_t addr, uint32_t len)
+{
+    return (stlink_device_in_flash(dev, addr) && stlink_device_in_flash(dev, addr + len - 1)) ||
+           (stlink_device_in_eeprom(dev, addr) && stlink_device_in_eeprom(dev, addr + len - 1));
+}
+
+static int job_check(const stlink_job *job, const stlink_job_unit *unit,
+                     const stlink_device *dev)
+{
+    for (int i = 0; i < stlink_image_get_segment_count(job->image); i++) {
+        const stlink_image_segment *seg = stlink_image_get_segment(job->image, i);
+        if (!job_in_memory(dev, seg->addr, seg->len)) {
+            STLINK_ERR(FLASH, "%s: 0x%" PRIx32 "+0x%" PRIx32 " is outside %s flash and EEPROM",
+                       job->image_path, seg->addr, seg->len, dev->name);
+            return -1;
+        }
+    }
+    if (job->serial_size == 0)
+        return 0;
+    if (!job_in_memory(dev, job->serial_addr, job->serial_size)) {
+        STLINK_ERR(FLASH, "job %d: serial number outside %s flash and EEPROM",
+                   unit->job, dev->name);
+        return -1;
+    }
+    if (job->serial_size < STLINK_JOB_SERIAL_MAX &&
+        unit->serial >= (uint64_t)1 << (8 * job->serial_size)) {
+        STLINK_ERR(FLASH, "job %d: serial number %" PRIu64 " does not fit %" PRIu32 " bytes",
+                   unit->job, unit->serial, job->serial_size);
+        return -1;
+    }
+    return 0;
+}
+
+static int job_verify(stlink *stl, const stlink_job *job, uint32_t addr,
+                      const uint8_t *data, uint32_t len)
+{
+    if (job->verify == STLINK_JOB_VERIFY_NONE)
+        return 0;
+    enum STLinkVerifyMode mode = (job->verify == STLINK_JOB_VERIFY_ON_TARGET) ?
+                                 STLINK_VERIFY_ON_TARGET : STLINK_VERIFY_READBACK;
+    return stlink_verify(stl, addr, data, len, mode, NULL);
+}
+
+int stlink_jobqueue_run(stlink_jobqueue *queue, stlink *stl, const stlink_job_unit *unit)
+{
+    const stlink_job *job = &queue->jobs[unit->job];
+    uint64_t start = stlink_time_us();
+    uint32_t bytes = 0;
+
+    if (job->device != NULL)
+        stlink_set_device(stl, job->device);
+    int ret = job_check(job, unit, stlink_get_device(stl));
+    for (int i = 0; i < stlink_image_get_segment_count(job->image) && ret == 0; i++) {
+        const stlink_image_segment *seg = stlink_image_get_segment(job->image, i);
+        stlink_flash_stats stats;
+        ret = stlink_flash_write_delta(stl, seg->addr, seg->data, seg->len, &stats);
+        bytes += stats.bytes_programmed;
+        if (ret == 0)
+            ret = job_verify(stl, job, seg->addr, seg->data, seg->len);
+    }
+    // after the image, which may hold a placeholder there
+    if (ret == 0 && job->serial_size > 0) {
+        uint8_t serial[STLINK_JOB_SERIAL_MAX];
+        for (uint32_t i = 0; i < job->serial_size; i++) {
+            serial[i] = unit->serial >> (8 * (job->serial_size - 1 - i));
+        }
+        stlink_patch patch = { job->serial_addr, job->serial_size, serial };
+        stlink_patch_stats stats;
+        ret = stlink_patch_apply(stl, &patch, 1, &stats);
+        bytes += stats.bytes_programmed;
+    }
+    uint64_t elapsed = stlink_time_us() - start;
+
+    pthread_mutex_lock(&queue->lock);
+    stlink_job_stats *stats = &queue->stats[unit->job];
+    if (ret == 0)
+        stats->boards_done++;
+    else
+        stats->boards_failed++;
+    stats->bytes_programmed += bytes;
+    stats->total_us += elapsed;
+    if (stats->boards_done + stats->boards_failed == 1 || elapsed < stats->min_us)
+        stats->min_us = elapsed;
+    if (elapsed > stats->max_us)
+        stats->max_us = elapsed;
+    pthread_mutex_unlock(&queue->lock);
+
+    if (job->serial_size > 0)
+        STLINK_INFO(FLASH, "job %d board %d, serial %" PRIu64 ": %s, %" PRIu64 " ms", unit->job,
+                    unit->board, unit->serial, (ret == 0) ? "done" : "FAILED", elapsed / 1000);
+    else
+        STLINK_INFO(FLASH, "job %d board %d: %s, %" PRIu64 " ms", unit->job, unit->board,
+                    (ret == 0) ? "done" : "FAILED", elapsed / 1000);
+    return ret;
+}
@@ -0,0 +1,89 @@
+#ifndef STLINK_JOB_H
+#define STLINK_JOB_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stlink-libusb.h"
+#include "stlink-device.h"
+#include "stlink-image.h"
+
+
+#define STLINK_JOB_SERIAL_MAX 8
+
+enum STLinkJobVerify {
+    STLINK_JOB_VERIFY_NONE,         // only what programming reads back
+    STLINK_JOB_VERIFY_READBACK,
+    STLINK_JOB_VERIFY_ON_TARGET,
+};
+
+// One line of a job file
+typedef struct STLinkJob {
+    const char *image_path;
+    stlink_image *image;            // shared with the jobs naming the same file
+    const stlink_device *device;    // NULL for whatever part is found
+    char probe[STLINK_SERIAL_MAX];  // ST-Link serial number, empty for any
+    enum STLinkJobVerify verify;
+    uint32_t serial_addr;
+    uint32_t serial_size;           // bytes, big-endian; 0 for no serial number
+    uint64_t serial_first;
+    int boards;
+    int line;
+} stlink_job;
+
+typedef struct STLinkJobStats {
+    int boards_started;
+    int boards_done;
+    int boards_failed;
+    uint32_t bytes_programmed;
+    uint64_t total_us;              // of the finished boards
+    uint64_t min_us;
+    uint64_t max_us;
+} stlink_job_stats;
+
+// A board handed to a probe
+typedef struct STLinkJobUnit {
+    int job;
+    int board;                      // counting from 0 within the job
+    uint64_t serial;
+} stlink_job_unit;
+
+typedef struct STLinkJobQueue stlink_jobqueue;
+
+/*
+ * Reads a job file, opening every image it names once.  Each line holds an
+ * image path, relative to the job file, and options:
+ *
+ *   part=STM8S105x6        program only targets matching this part
+ *   probe=SERIAL           program only through this ST-Link
+ *   serial=ADDR,SIZE,FIRST write a serial number counting up from FIRST
+ *   verify=none|readback|target
+ *   boards=N               number of boards, 1 by default
+ *
+ * Empty lines and anything after a # are ignored.
+ */
+stlink_jobqueue *stlink_jobqueue_load(const char *path);
+void stlink_jobqueue_free(stlink_jobqueue *queue);
+
+int stlink_jobqueue_get_count(stlink_jobqueue *queue);
+const stlink_job *stlink_jobqueue_get_job(stlink_jobqueue *queue, int index);
+void stlink_jobqueue_get_stats(stlink_jobqueue *queue, int index, stlink_job_stats *stats);
+// Boards failed or never started, say for lack of a probe or part taking them
+int stlink_jobqueue_get_failed(stlink_jobqueue *queue);
+void stlink_jobqueue_dump_stats(stlink_jobqueue *queue, FILE *f);
+
+/*
+ * Takes the next board for the target attached to stl, found to be dev.
+ * Returns -1 once no board is left that this probe and part may take.
+ * Safe to call from several probe workers at once.
+ */
+int stlink_jobqueue_take(stlink_jobqueue *queue, stlink *stl, const stlink_device *dev,
+                         stlink_job_unit *unit);
+// Boards that stlink_jobqueue_take() would still hand this probe for dev
+int stlink_jobqueue_get_left(stlink_jobqueue *queue, stlink *stl, const stlink_device *dev);
+// Programs the board with the target stalled, and accounts for the result.
+int stlink_jobqueue_run(stlink_jobqueue *queue, stlink *stl, const stlink_job_unit *unit);
+
+
+#endif
@@ -22,54 +22,207 @@
 
 #include "bswap.h"
 #include "stlink.h"
+#include "stlink-internal.h"
 
 
-#define STLINK_TIMEOUT_MS 1000 // 1 s
+static int usb_bulk_transfer(stlink *stl, uint8_t endpoint, uint8_t *data, int length,
+                             int *transferred, unsigned int timeout)
+{
+    return libusb_bulk_transfer(stl->handle, endpoint, data, length, transferred, timeout);
+}
 
-// Command Block Wrapper (CBW)
-typedef struct CommandBlockWrapper {
-    uint32_t    dCBWSignature;
-    uint32_t    dCBWTag;
-    uint32_t    dCBWDataTransferLength;
-    uint8_t     bmCBWFlags;
-    uint8_t     bCBWLUN;
-    uint8_t     bCBWCBLength;
-    uint8_t     CBWCB[16];
-} __attribute__((packed)) USBCommandBlockWrapper;
+static int usb_clear_halt(stlink *stl, uint8_t endpoint)
+{
+    return libusb_clear_halt(stl->handle, endpoint);
+}
 
-#define USB_CBW_SIGNATURE 0x43425355
+static int usb_submit_transfer(stlink *stl, struct libusb_transfer *transfer)
+{
+    return libusb_submit_transfer(transfer);
+}
 
-// Command Status Wrapper (CSW)
-typedef struct CommandStatusWrapper {
-    uint32_t    dCSWSignature;
-    uint32_t    dCSWTag;
-    uint32_t    dCSWDataResidue;
-    uint8_t     bCSWStatus;
-} __attribute__((packed)) USBCommandStatusWrapper;
+static int usb_cancel_transfer(stlink *stl, struct libusb_transfer *transfer)
+{
+    return libusb_cancel_transfer(transfer);
+}
 
-#define USB_CSW_SIGNATURE 0x53425355
+static int usb_handle_events(stlink *stl, struct timeval *tv)
+{
+    return libusb_handle_events_timeout_completed(stl->usb_context, tv, NULL);
+}
 
-enum {
-    USB_CSW_STATUS_COMMAND_PASSED   = 0x00,
-    USB_CSW_STATUS_COMMAND_FAILED   = 0x01,
-    USB_CSW_STATUS_PHASE_ERROR      = 0x02,
-};
+/*
+ * Kernel-provided buffers spare the kernel a copy per transfer.  Without
+ * them stlink_init_buffers() falls back to malloc() for all buffers.
+ */
+static uint8_t *usb_mem_alloc(stlink *stl, size_t length)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    return libusb_dev_mem_alloc(stl->handle, length);
+#else
+    return NULL;
+#endif
+}
 
-// ST-Link device
-struct STLink {
-    libusb_device_handle *handle;
-    uint8_t endpoint_in;
-    uint8_t endpoint_out;
+static void usb_mem_free(stlink *stl, uint8_t *buffer, size_t length)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+    libusb_dev_mem_free(stl->handle, buffer, length);
+#endif
+}
+
+// Bulk-Only Mass Storage Reset (BOT 3.1), a class request to interface 0
+#define USB_BOT_RESET 0xff
+
+static int usb_reset(stlink *stl)
+{
+    return libusb_control_transfer(stl->handle,
+                                   LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                   USB_BOT_RESET, 0, 0, NULL, 0, STLINK_TIMEOUT_MS);
+}
+
+static void usb_close(stlink *stl)
+{
+    libusb_release_interface(stl->handle, 0);
+    libusb_close(stl->handle);
+}
+
+static const STLinkTransportOps usb_transport_ops = {
+    .name               = "libusb",
+    .bulk_transfer      = usb_bulk_transfer,
+    .clear_halt         = usb_clear_halt,
+    .submit_transfer    = usb_submit_transfer,
+    .cancel_transfer    = usb_cancel_transfer,
+    .handle_events      = usb_handle_events,
+    .close              = usb_close,
+    .mem_alloc          = usb_mem_alloc,
+    .mem_free           = usb_mem_free,
+    .reset              = usb_reset,
 };
 
+static void usb_get_info(libusb_device *dev, libusb_device_handle *handle,
+                         stlink_probe_info *info)
+{
+    memset(info, 0, sizeof(stlink_probe_info));
+    info->bus = libusb_get_bus_number(dev);
+    info->port = libusb_get_port_number(dev);
+
+    struct libusb_device_descriptor desc;
+    if (handle == NULL ||
+        libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS ||
+        desc.iSerialNumber == 0)
+        return;
+    int ret = libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                                 (unsigned char *)info->serial,
+                                                 sizeof(info->serial) - 1);
+    if (ret < 0)
+        info->serial[0] = '\0';
+}
+
+bool stlink_usb_is_stlink(libusb_device *dev)
+{
+    struct libusb_device_descriptor desc;
+    if (libusb_get_device_descriptor(dev, &desc) != LIBUSB_SUCCESS)
+        return false;
+    return desc.idVendor == USB_VID_ST && desc.idProduct == USB_PID_STLINK;
+}
+
+static bool usb_probe_matches(const stlink_probe_info *info, const stlink_probe_info *match)
+{
+    if (match == NULL)
+        return true;
+    if (match->bus != 0 && match->bus != info->bus)
+        return false;
+    if (match->port != 0 && match->port != info->port)
+        return false;
+    if (match->serial[0] != '\0' && strcmp(match->serial, info->serial) != 0)
+        return false;
+    return true;
+}
+
+// Looks up bus, port and, if the probe can be opened, its serial number.
+void stlink_usb_get_info(libusb_device *dev, stlink_probe_info *info)
+{
+    libusb_device_handle *handle = NULL;
+    if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)
+        handle = NULL;
+    usb_get_info(dev, handle, info);
+    if (handle != NULL)
+        libusb_close(handle);
+}
+
+/*
+ * Lists all ST-Links.  Returns the number of probes found, or -1; the list
+ * is to be released with free().  Probes that cannot be opened, e.g.
+ * because they are in use, are listed without serial number.
+ */
+int stlink_enumerate(libusb_context *usb_context, stlink_probe_info **probes)
+{
+    libusb_device **devs;
+    ssize_t count = libusb_get_device_list(usb_context, &devs);
+    if (count < 0) {
+        STLINK_ERR(TRANSPORT, "%s: listing devices failed: %zd", __func__, count);
+        return -1;
+    }
+    *probes = calloc((count > 0) ? count : 1, sizeof(stlink_probe_info));
+    if (*probes == NULL) {
+        libusb_free_device_list(devs, 1);
+        return -1;
+    }
+    int n = 0;
+    for (ssize_t i = 0; i < count; i++) {
+        if (stlink_usb_is_stlink(devs[i]))
+            stlink_usb_get_info(devs[i], &(*probes)[n++]);
+    }
+    libusb_free_device_list(devs, 1);
+    return n;
+}
+
+static libusb_device_handle *usb_open_matching(libusb_context *usb_context,
+                                               const stlink_probe_info *match,
+                                               stlink_probe_info *info)
+{
+    libusb_device **devs;
+    ssize_t count = libusb_get_device_list(usb_context, &devs);
+    if (count < 0)
+        return NULL;
+    libusb_device_handle *found = NULL;
+    for (ssize_t i = 0; i < count && found == NULL; i++) {
+        if (!stlink_usb_is_stlink(devs[i]))
+            continue;
+        libusb_device_handle *handle;
+        if (libusb_open(devs[i], &handle) != LIBUSB_SUCCESS)
+            continue;
+        usb_get_info(devs[i], handle, info);
+        if (usb_probe_matches(info, match))
+            found = handle;
+        else
+            libusb_close(handle);
+    }
+    libusb_free_device_list(devs, 1);
+    return found;
+}
+
 stlink *stlink_open(libusb_context *usb_context)
 {
-    stlink *stl = malloc(sizeof(stlink));
-    stl->handle = libusb_open_device_with_vid_pid(usb_context, USB_VID_ST, USB_PID_STLINK);
+    return stlink_open_probe(usb_context, NULL);
+}
+
+stlink *stlink_open_probe(libusb_context *usb_context, const stlink_probe_info *match)
+{
+    stlink *stl = stlink_alloc(&usb_transport_ops, NULL);
+    if (stl == NULL)
+        return NULL;
+    stl->usb_context = usb_context;
+    stlink_probe_info info;
+    stl->handle = usb_open_matching(usb_context, match, &info);
     if (stl->handle == NULL) {
         free(stl);
         return NULL;
     }
+    strcpy(stl->serial, info.serial);
+    STLINK_INFO(TRANSPORT, "bus %03" PRIu8 " port %03" PRIu8 ", serial %s",
+           info.bus, info.port, (info.serial[0] != '\0') ? info.serial : "(none)");
 
     libusb_device *dev = libusb_get_device(stl->handle);
     struct libusb_config_descriptor *conf_desc;
@@ -80,17 +233,17 @@ stlink *stlink_open(libusb_context *usb_context)
         return NULL;
     }
     for (int i = 0; i < conf_desc->bNumInterfaces; i++) {
-        printf("interface %d\n", i);
+        STLINK_DBG(TRANSPORT, "interface %d", i);
         for (int j = 0; j < conf_desc->interface[i].num_altsetting; j++) {
             for (int k = 0; k < conf_desc->interface[i].altsetting[j].bNumEndpoints; k++) {
                 const struct libusb_endpoint_descriptor *endpoint;
                 endpoint = &conf_desc->interface[i].altsetting[j].endpoint[k];
                 if (endpoint->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
                     stl->endpoint_in = endpoint->bEndpointAddress;
-                    printf("Found IN endpoint\n");
+                    STLINK_DBG(TRANSPORT, "Found IN endpoint");
                 } else {
                     stl->endpoint_out = endpoint->bEndpointAddress;
-                    printf("Found OUT endpoint\n");
+                    STLINK_DBG(TRANSPORT, "Found OUT endpoint");
                 }
             }
         }
@@ -99,17 +252,23 @@ stlink *stlink_open(libusb_context *usb_context)
 
     ret = libusb_kernel_driver_active(stl->handle, 0);
     if (ret == 1) {
-        printf("kernel driver active\n");
+        STLINK_WARN(TRANSPORT, "kernel driver active");
         ret = libusb_detach_kernel_driver(stl->handle, 0);
-        fprintf(stderr, "detaching kernel driver failed: %d\n", ret);
+        STLINK_ERR(TRANSPORT, "detaching kernel driver failed: %d", ret);
     } else if (ret == 0) {
-        //printf("kernel driver not active\n");
+        //STLINK_DBG(TRANSPORT, "kernel driver not active");
     } else {
-        fprintf(stderr, "libusb_kernel_driver_active = %d\n", ret);
+        STLINK_ERR(TRANSPORT, "libusb_kernel_driver_active = %d", ret);
     }
     ret = libusb_claim_interface(stl->handle, 0);
     if (ret != LIBUSB_SUCCESS) {
-        fprintf(stderr, "claiming interface failed: %d\n", ret);
+        STLINK_ERR(TRANSPORT, "claiming interface failed: %d", ret);
+        libusb_close(stl->handle);
+        free(stl);
+        return NULL;
+    }
+    if (stlink_init_buffers(stl) != 0) {
+        libusb_release_interface(stl->handle, 0);
         libusb_close(stl->handle);
         free(stl);
         return NULL;
@@ -118,197 +277,281 @@ stlink *stlink_open(libusb_context *usb_context)
     return stl;
 }
 
-void stlink_close(stlink *stl)
+const char *stlink_get_serial(stlink *stl)
 {
-    if (stl == NULL)
-        return;
-
-    libusb_release_interface(stl->handle, 0);
-    libusb_close(stl->handle);
-    free(stl);
+    return stl->serial;
 }
 
 #define RETRY_MAX 5
 
-static uint32_t
-send_usb_mass_storage_command(libusb_device_handle *handle, uint8_t endpoint,
-                              uint8_t *cdb, uint8_t cdb_length,
-                              uint8_t lun, uint8_t flags, uint32_t data_transfer_length)
+/*
+ * CBWs are reused.  Bytes past bCBWCBLength are kept zero, so only what a
+ * longer CDB before left behind needs clearing.
+ */
+uint32_t stlink_fill_cbw(stlink *stl, USBCommandBlockWrapper *cbw,
+                         const uint8_t *cdb, uint8_t cdb_length,
+                         uint8_t lun, uint8_t flags, uint32_t data_transfer_length)
+{
+    uint8_t last_length = cbw->bCBWCBLength;
+    if (last_length > sizeof(cbw->CBWCB))
+        last_length = sizeof(cbw->CBWCB);
+    cbw->dCBWSignature = cpu_to_le32(USB_CBW_SIGNATURE);
+    if (++stl->tag == 0)
+        stl->tag = 1;
+    cbw->dCBWTag = cpu_to_le32(stl->tag);
+    cbw->dCBWDataTransferLength = cpu_to_le32(data_transfer_length);
+    cbw->bmCBWFlags = flags;
+    cbw->bCBWLUN = lun;
+    cbw->bCBWCBLength = cdb_length;
+    // CDBs may have been built in place.
+    if (cdb != cbw->CBWCB)
+        memcpy(cbw->CBWCB, cdb, cdb_length);
+    if (last_length > cdb_length)
+        memset(cbw->CBWCB + cdb_length, 0, last_length - cdb_length);
+    return stl->tag;
+}
+
+#define RECOVER_MAX 2
+
+static enum STLinkFailure usb_failure(int ret)
+{
+    switch (ret) {
+    case LIBUSB_ERROR_TIMEOUT:
+        return STLINK_FAILURE_TIMEOUT;
+    case LIBUSB_ERROR_PIPE:
+        return STLINK_FAILURE_STALL;
+    case LIBUSB_ERROR_OVERFLOW:
+        return STLINK_FAILURE_PHASE;
+    default:
+        return STLINK_FAILURE_IO;
+    }
+}
+
+// A bulk transfer, repeated after clearing the halt if the endpoint stalls.
+static int usb_bulk(stlink *stl, uint8_t endpoint, uint8_t *data, int length, int *transferred)
 {
-    static uint32_t tag;
-
-    USBCommandBlockWrapper cbw;
-    memset(&cbw, 0, sizeof(USBCommandBlockWrapper));
-    cbw.dCBWSignature = cpu_to_le32(USB_CBW_SIGNATURE);
-    if (tag == 0)
-        tag = 1;
-    cbw.dCBWTag = cpu_to_le32(tag);
-    int curTag = tag++;
-    cbw.dCBWDataTransferLength = cpu_to_le32(data_transfer_length);
-    cbw.bmCBWFlags = flags;
-    cbw.bCBWLUN = lun;
-    cbw.bCBWCBLength = cdb_length;
-    memcpy(cbw.CBWCB, cdb, cdb_length);
-    int transferred;
     int ret;
     int try = 0;
     do {
-        ret = libusb_bulk_transfer(handle, endpoint, (unsigned char *)&cbw, sizeof(cbw),
-                                   &transferred, STLINK_TIMEOUT_MS);
+        ret = stl->ops->bulk_transfer(stl, endpoint, data, length, transferred,
+                                      STLINK_TIMEOUT_MS);
         if (ret == LIBUSB_ERROR_PIPE) {
-            libusb_clear_halt(handle, endpoint);
+            stlink_recovery_failed(stl, STLINK_FAILURE_STALL);
+            stl->ops->clear_halt(stl, endpoint);
         }
         try++;
     } while ((ret == LIBUSB_ERROR_PIPE) && (try < RETRY_MAX));
+    if (ret == LIBUSB_SUCCESS && try > 1)
+        stlink_recovery_succeeded(stl, STLINK_RECOVERY_CLEAR_HALT);
+    return ret;
+}
+
+static uint32_t
+send_usb_mass_storage_command(stlink *stl, uint8_t endpoint, USBCommandBlockWrapper *cbw,
+                              enum STLinkFailure *failure)
+{
+    int transferred;
+    int ret = usb_bulk(stl, endpoint, (uint8_t *)cbw, sizeof(USBCommandBlockWrapper),
+                       &transferred);
     if (ret != LIBUSB_SUCCESS) {
-        fprintf(stderr, "%s: sending failed: %d\n", __func__, ret);
+        STLINK_ERR(TRANSPORT, "%s: sending failed: %d", __func__, ret);
+        *failure = usb_failure(ret);
         return 0;
     }
-    return curTag;
+    return le32_to_cpu(cbw->dCBWTag);
 }
 
 static int
-get_usb_mass_storage_status(libusb_device_handle *handle, uint8_t endpoint, uint32_t *tag)
+get_usb_mass_storage_status(stlink *stl, uint8_t endpoint, uint32_t *tag,
+                            enum STLinkFailure *failure)
 {
-    USBCommandStatusWrapper csw;
+    USBCommandStatusWrapper *csw = stl->csw;
     int transferred;
-    int ret;
-    int try = 0;
-    do {
-        ret = libusb_bulk_transfer(handle, endpoint, (unsigned char *)&csw, sizeof(csw),
-                                   &transferred, STLINK_TIMEOUT_MS);
-        if (ret == LIBUSB_ERROR_PIPE) {
-            libusb_clear_halt(handle, endpoint);
-        }
-        try++;
-    } while ((ret == LIBUSB_ERROR_PIPE) && (try < RETRY_MAX));
+    int ret = usb_bulk(stl, endpoint, (uint8_t *)csw, sizeof(*csw), &transferred);
     if (ret != LIBUSB_SUCCESS) {
-        fprintf(stderr, "%s: receiving failed: %d\n", __func__, ret);
+        STLINK_ERR(TRANSPORT, "%s: receiving failed: %d", __func__, ret);
+        *failure = usb_failure(ret);
         return -1;
     }
-    if (transferred != sizeof(csw)) {
-        fprintf(stderr, "%s: received unexpected amount: %d\n", __func__, transferred);
+    if (transferred != sizeof(*csw)) {
+        STLINK_ERR(TRANSPORT, "%s: received unexpected amount: %d", __func__, transferred);
+        *failure = STLINK_FAILURE_PHASE;
         return -1;
     }
-    csw.dCSWSignature = le32_to_cpu(csw.dCSWSignature);
-    csw.dCSWTag = le32_to_cpu(csw.dCSWTag);
-    csw.dCSWDataResidue = le32_to_cpu(csw.dCSWDataResidue);
-    if (csw.dCSWSignature != USB_CSW_SIGNATURE) {
-        fprintf(stderr, "%s: received wrong signature: %04" PRIX32 "\n",
-                __func__, csw.dCSWSignature);
+    uint32_t signature = le32_to_cpu(csw->dCSWSignature);
+    if (signature != USB_CSW_SIGNATURE) {
+        STLINK_ERR(TRANSPORT, "%s: received wrong signature: %04" PRIX32,
+                __func__, signature);
+        *failure = STLINK_FAILURE_PHASE;
         return -1;
     }
-    //printf("%s: residue = 0x%" PRIx32 "\n", __func__);
-    *tag = csw.dCSWTag;
-    return csw.bCSWStatus;
+    //STLINK_DBG(TRANSPORT, "%s: residue = 0x%" PRIx32, __func__, le32_to_cpu(csw->dCSWDataResidue));
+    *tag = le32_to_cpu(csw->dCSWTag);
+    return csw->bCSWStatus;
 }
 
 #define REQUEST_SENSE 0x03
 #define REQUEST_SENSE_LENGTH 18
 
 static void
-get_sense(libusb_device_handle *handle, uint8_t endpoint_in, uint8_t endpoint_out)
+get_sense(stlink *stl, uint8_t endpoint_in, uint8_t endpoint_out)
 {
     uint8_t cdb[16];
     memset(cdb, 0, sizeof(cdb));
     cdb[0] = REQUEST_SENSE;
     cdb[4] = REQUEST_SENSE_LENGTH;
-    uint32_t tag = send_usb_mass_storage_command(handle, endpoint_out, cdb, sizeof(cdb), 0,
-                                                 LIBUSB_ENDPOINT_IN, REQUEST_SENSE_LENGTH);
+    stlink_fill_cbw(stl, stlink_cbw(stl), cdb, sizeof(cdb), 0,
+                    LIBUSB_ENDPOINT_IN, REQUEST_SENSE_LENGTH);
+    enum STLinkFailure failure;
+    uint32_t tag = send_usb_mass_storage_command(stl, endpoint_out, stlink_cbw(stl), &failure);
     if (tag == 0) {
-        fprintf(stderr, "%s: sending REQUEST SENSE failed\n", __func__);
+        STLINK_ERR(TRANSPORT, "%s: sending REQUEST SENSE failed", __func__);
         return;
     }
     unsigned char sense[REQUEST_SENSE_LENGTH];
     int transferred;
-    int ret;
-    int try = 0;
-    do {
-        ret = libusb_bulk_transfer(handle, endpoint_in, sense, sizeof(sense),
-                                   &transferred, STLINK_TIMEOUT_MS);
-        if (ret == LIBUSB_ERROR_PIPE) {
-            libusb_clear_halt(handle, endpoint_in);
-        }
-        try++;
-    } while ((ret == LIBUSB_ERROR_PIPE) && (try < RETRY_MAX));
+    int ret = usb_bulk(stl, endpoint_in, sense, sizeof(sense), &transferred);
     if (ret != LIBUSB_SUCCESS) {
-        fprintf(stderr, "%s: receiving failed: %d\n", __func__, ret);
+        STLINK_ERR(TRANSPORT, "%s: receiving failed: %d", __func__, ret);
         return;
     }
     if (transferred != sizeof(sense)) {
-        fprintf(stderr, "%s: received unexpected amount: %d\n", __func__, transferred);
+        STLINK_ERR(TRANSPORT, "%s: received unexpected amount: %d", __func__, transferred);
     }
     uint32_t received_tag;
-    int status = get_usb_mass_storage_status(handle, endpoint_in, &received_tag);
+    int status = get_usb_mass_storage_status(stl, endpoint_in, &received_tag, &failure);
     if (status != USB_CSW_STATUS_COMMAND_PASSED) {
-        fprintf(stderr, "%s: receiving failed with status: %02x\n", __func__, status);
+        STLINK_ERR(TRANSPORT, "%s: receiving failed with status: %02x", __func__, status);
         return;
     }
     if (sense[0] != 0x70 && sense[0] != 0x71) {
-        fprintf(stderr, "No sense data\n");
+        STLINK_WARN(TRANSPORT, "No sense data");
     } else {
-        fprintf(stderr, "Sense KCQ: %02X %02X %02X\n", sense[2] & 0x0f, sense[12], sense[13]);
+        STLINK_WARN(TRANSPORT, "Sense KCQ: %02X %02X %02X", sense[2] & 0x0f, sense[12], sense[13]);
     }
 }
 
 int stlink_send_command(stlink *stl, uint8_t *cdb, uint8_t cdb_length,
                         uint8_t *buffer, int transfer_length, bool inbound)
 {
-    printf("%s: CDB:", __func__);
-    for (int i = 0; i < cdb_length; i++) {
-        printf(" %02" PRIX8, cdb[i]);
-    }
-    printf("\n");
+    if (stl->async_pending > 0)
+        stlink_wait_commands(stl, 0);
     uint8_t lun = 0;
-    uint32_t tag = send_usb_mass_storage_command(stl->handle, stl->endpoint_out,
-                                                 cdb, cdb_length, lun,
-                                                 LIBUSB_ENDPOINT_IN, transfer_length);
+    stlink_fill_cbw(stl, stlink_cbw(stl), cdb, cdb_length, lun,
+                    LIBUSB_ENDPOINT_IN, transfer_length);
+    return stlink_send_cbw(stl, buffer, transfer_length, inbound);
+}
+
+// Runs the CBW in stl->xfer, its data phase and CSW once.
+static bool usb_exchange(stlink *stl, uint8_t *buffer, int transfer_length, bool inbound,
+                         enum STLinkFailure *failure)
+{
+    USBCommandBlockWrapper *cbw = stlink_cbw(stl);
+    uint32_t tag = send_usb_mass_storage_command(stl, stl->endpoint_out, cbw, failure);
     if (tag == 0) {
-        fprintf(stderr, "%s: sending failed\n", __func__);
-        return -1;
+        STLINK_ERR(TRANSPORT, "%s: sending failed", __func__);
+        return false;
     }
     int transferred;
     if (transfer_length > 0) {
-        int ret;
-        int try = 0;
-        do {
-            ret = libusb_bulk_transfer(stl->handle,
-                                       (!inbound) ? stl->endpoint_out : stl->endpoint_in,
-                                       buffer, transfer_length,
-                                       &transferred, STLINK_TIMEOUT_MS);
-            if (ret == LIBUSB_ERROR_PIPE) {
-                libusb_clear_halt(stl->handle, stl->endpoint_in);
-            }
-            try++;
-        } while ((ret == LIBUSB_ERROR_PIPE) && (try < RETRY_MAX));
+        int ret = usb_bulk(stl, (!inbound) ? stl->endpoint_out : stl->endpoint_in,
+                           buffer, transfer_length, &transferred);
         if (ret != LIBUSB_SUCCESS) {
-            fprintf(stderr, "%s: transferring failed: %d\n", __func__, ret);
-            return -1;
+            STLINK_ERR(TRANSPORT, "%s: transferring failed: %d", __func__, ret);
+            *failure = usb_failure(ret);
+            return false;
         }
         if (transferred != transfer_length) {
-            fprintf(stderr, "%s: transferred unexpected amount: %d\n", __func__, transferred);
+            STLINK_WARN(TRANSPORT, "%s: transferred unexpected amount: %d", __func__, transferred);
         }
     }
     uint32_t received_tag;
-    int status = get_usb_mass_storage_status(stl->handle, stl->endpoint_in, &received_tag);
+    int status = get_usb_mass_storage_status(stl, stl->endpoint_in, &received_tag, failure);
     if (status < 0) {
-        fprintf(stderr, "%s: receiving status failed: %d\n", __func__, status);
-        return -1;
+        STLINK_ERR(TRANSPORT, "%s: receiving status failed: %d", __func__, status);
+        return false;
+    }
+    if (received_tag != tag) {
+        // left over from an earlier command, ours should be next
+        STLINK_WARN(TRANSPORT, "%s: received tag %08" PRIx32 " but expected %08" PRIx32,
+                __func__, received_tag, tag);
+        stlink_recovery_failed(stl, STLINK_FAILURE_TAG);
+        status = get_usb_mass_storage_status(stl, stl->endpoint_in, &received_tag, failure);
+        if (status < 0 || received_tag != tag) {
+            *failure = STLINK_FAILURE_TAG;
+            return false;
+        }
+        stlink_recovery_succeeded(stl, STLINK_RECOVERY_RESYNC);
     }
     if (status != USB_CSW_STATUS_COMMAND_PASSED) {
-        fprintf(stderr, "%s: receiving status: %02x\n", __func__, status);
+        STLINK_WARN(TRANSPORT, "%s: receiving status: %02x", __func__, status);
     }
     if (status == USB_CSW_STATUS_COMMAND_FAILED) {
-        get_sense(stl->handle, stl->endpoint_in, stl->endpoint_out);
-        return -1;
+        get_sense(stl, stl->endpoint_in, stl->endpoint_out);
+        *failure = STLINK_FAILURE_COMMAND;
+        return false;
     }
-    if (received_tag != tag) {
-        fprintf(stderr, "%s: received tag %08" PRIx32 " but expected %08" PRIx32 "\n",
-                __func__, received_tag, tag);
-        //return -1;
+    if (status == USB_CSW_STATUS_PHASE_ERROR ||
+        (transfer_length > 0 && transferred != transfer_length)) {
+        *failure = STLINK_FAILURE_PHASE;
+        return false;
     }
-    if (transfer_length > 0 && transferred != transfer_length) {
-        return -1;
+    return true;
+}
+
+// Commands that may reach the probe twice without changing anything
+static bool cdb_idempotent(const uint8_t *cdb)
+{
+    switch (cdb[0]) {
+    case STLINK_GET_VERSION:
+    case STLINK_GET_CURRENT_MODE:
+        return true;
+    case STLINK_SWIM_COMMAND:
+        switch (cdb[1]) {
+        case STLINK_SWIM_GET_02:
+        case STLINK_SWIM_GET_BUSY:
+        case STLINK_SWIM_BEGIN_READ:
+        case STLINK_SWIM_READ:
+        case STLINK_SWIM_GET_SIZE:
+            return true;
+        }
+        return false;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Runs the command whose CBW has been filled in stl->xfer.  Also used for
+ * SWIM writes that were prepared in place.  After a command got lost on
+ * the way, the mass storage interface is reset; only idempotent commands
+ * are then repeated, see stlink-recover.c.
+ */
+int stlink_send_cbw(stlink *stl, uint8_t *buffer, int transfer_length, bool inbound)
+{
+    USBCommandBlockWrapper *cbw = stlink_cbw(stl);
+    STLINK_LOG_HEX(STLINK_LOG_DEBUG, STLINK_LOG_CDB, "CDB", cbw->CBWCB, cbw->bCBWCBLength);
+    for (int attempt = 0; ; attempt++) {
+        enum STLinkFailure failure;
+        if (usb_exchange(stl, buffer, transfer_length, inbound, &failure)) {
+            if (attempt > 0)
+                stlink_recovery_succeeded(stl, STLINK_RECOVERY_RESET);
+            return 0;
+        }
+        // stalls and tag mismatches were counted as they happened
+        if (failure != STLINK_FAILURE_STALL && failure != STLINK_FAILURE_TAG)
+            stlink_recovery_failed(stl, failure);
+        if (failure == STLINK_FAILURE_COMMAND || failure == STLINK_FAILURE_IO ||
+            attempt == RECOVER_MAX || stlink_recover_transport(stl) != 0) {
+            stlink_recovery_gave_up(stl);
+            return -1;
+        }
+        // it may have taken effect, e.g. an unlock key, before the CSW got lost
+        if (!cdb_idempotent(cbw->CBWCB)) {
+            STLINK_ERR(TRANSPORT, "%s: command %02" PRIX8 " %02" PRIX8 " may have run,"
+                       " not repeating", __func__, cbw->CBWCB[0], cbw->CBWCB[1]);
+            stlink_recovery_gave_up(stl);
+            return -1;
+        }
     }
-    return 0;
 }
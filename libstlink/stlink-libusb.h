@@ -3,16 +3,46 @@
 
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 
 
 typedef struct STLink stlink;
 
+#define STLINK_SERIAL_MAX 33
+
+/*
+ * Identifies a probe on the bus.  When matching, zero bus/port numbers and
+ * an empty serial act as wildcards.
+ */
+typedef struct STLinkProbeInfo {
+    uint8_t bus;
+    uint8_t port;
+    char serial[STLINK_SERIAL_MAX];
+} stlink_probe_info;
+
+/*
+ * An stlink must only be used by one thread at a time.  To drive several
+ * probes concurrently, open each one with its own libusb context.
+ */
 stlink *stlink_open(libusb_context *usb_context);
+stlink *stlink_open_probe(libusb_context *usb_context, const stlink_probe_info *match);
+int stlink_enumerate(libusb_context *usb_context, stlink_probe_info **probes);
+const char *stlink_get_serial(stlink *stl);
 void stlink_close(stlink *stl);
 int stlink_send_command(stlink *stl, uint8_t *cdb, uint8_t cdb_length,
                         uint8_t *buffer, int transfer_length, bool inbound);
 
+typedef void (*stlink_command_cb)(stlink *stl, int status, void *opaque);
+
+int stlink_submit_command(stlink *stl, uint8_t *cdb, uint8_t cdb_length,
+                          uint8_t *buffer, int transfer_length, bool inbound,
+                          stlink_command_cb cb, void *opaque);
+int stlink_wait_commands(stlink *stl, int max_pending);
+int stlink_pending_commands(stlink *stl);
+void stlink_set_async_depth(stlink *stl, int depth);
+
 void stlink_get_version(stlink *stl);
 int stlink_get_current_mode(stlink *stl);
 void stlink_exit_dfu_mode(stlink *stl);
@@ -29,8 +59,18 @@ int stlink_swim_do_07(stlink *stl);
 int stlink_swim_do_08(stlink *stl);
 int stlink_swim_get_busy(stlink *stl, uint32_t *status);
 int stlink_swim_write(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer);
+uint8_t *stlink_swim_write_buffer(stlink *stl, uint16_t len);
+int stlink_swim_write_commit(stlink *stl, uint32_t addr, uint16_t len);
 int stlink_swim_begin_read(stlink *stl, uint32_t addr, uint16_t len);
 int stlink_swim_read(stlink *stl, uint16_t length, uint8_t *buffer);
 
+// Monotonic clock all of the library's timings are taken with
+static inline uint64_t stlink_time_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 
 #endif
@@ -0,0 +1,269 @@
+/*
+ * Target-resident flash loader
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Programming a block over SWIM leaves the probe idle for the whole
+ * programming time.  Instead a small routine in target RAM programs the
+ * blocks, taking them from two slots in turn: while it programs one, the
+ * host fills the other, so that transfer and programming overlap.  Each
+ * slot holds the block address and data and has a state byte serving as
+ * mailbox, set by the host once the slot is filled and cleared by the stub
+ * once the block is programmed.
+ *
+ * The stub is written for the STM8S and STM8AF flash controller and 128
+ * byte blocks.  It carries its version behind the entry point.  The whole
+ * stub is read back before each run and only uploaded if any byte differs,
+ * since firmware running in between may have overwritten RAM; otherwise it
+ * stays resident across programming runs.
+ */
+
+#include "stlink-loader.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+#include "stm8.h"
+
+
+/*
+ * Loops over both slots, programming full ones in block mode.  Runs with
+ * interrupts off, using the two bytes below the top of RAM for calls and
+ * $f2 as byte counter.
+ *
+ *  0300  20 04        jra   $0306
+ *  0302  53 4C 44 01  "SLD", version 1
+ *  0306  B6 F0        ld    a, $f0          ; slot 0
+ *  0308  A1 01        cp    a, #1
+ *  030A  26 0B        jrne  $0317
+ *  030C  CE 01 00     ldw   x, $0100
+ *  030F  90 AE 01 02  ldw   y, #$0102
+ *  0313  AD 15        callr $032A
+ *  0315  B7 F0        ld    $f0, a
+ *  0317  B6 F1        ld    a, $f1          ; slot 1
+ *  0319  A1 01        cp    a, #1
+ *  031B  26 0B        jrne  $0328
+ *  031D  CE 02 00     ldw   x, $0200
+ *  0320  90 AE 02 02  ldw   y, #$0202
+ *  0324  AD 04        callr $032A
+ *  0326  B7 F1        ld    $f1, a
+ *  0328  20 DC        jra   $0306
+ *  032A  35 01 50 5B  mov   $505b, #$01     ; FLASH_CR2 = PRG
+ *  032E  35 FE 50 5C  mov   $505c, #$fe     ; FLASH_NCR2
+ *  0332  A6 80        ld    a, #128
+ *  0334  B7 F2        ld    $f2, a
+ *  0336  90 F6        ld    a, (y)          ; copy loop
+ *  0338  F7           ld    (x), a
+ *  0339  5C           incw  x
+ *  033A  90 5C        incw  y
+ *  033C  3A F2        dec   $f2
+ *  033E  26 F6        jrne  $0336
+ *  0340  C6 50 5F     ld    a, $505f        ; IAPSR
+ *  0343  A5 01        bcp   a, #$01         ; WR_PG_DIS
+ *  0345  26 06        jrne  $034D
+ *  0347  A5 04        bcp   a, #$04         ; EOP
+ *  0349  27 F5        jreq  $0340
+ *  034B  4F           clr   a
+ *  034C  81           ret
+ *  034D  A6 02        ld    a, #2
+ *  034F  81           ret
+ */
+static const uint8_t loader_stub[] = {
+    0x20, 0x04,
+    'S', 'L', 'D', STLINK_LOADER_VERSION,
+    0xb6, 0xf0,
+    0xa1, 0x01,
+    0x26, 0x0b,
+    0xce, 0x01, 0x00,
+    0x90, 0xae, 0x01, 0x02,
+    0xad, 0x15,
+    0xb7, 0xf0,
+    0xb6, 0xf1,
+    0xa1, 0x01,
+    0x26, 0x0b,
+    0xce, 0x02, 0x00,
+    0x90, 0xae, 0x02, 0x02,
+    0xad, 0x04,
+    0xb7, 0xf1,
+    0x20, 0xdc,
+    0x35, 0x01, 0x50, 0x5b,
+    0x35, 0xfe, 0x50, 0x5c,
+    0xa6, 0x80,
+    0xb7, 0xf2,
+    0x90, 0xf6,
+    0xf7,
+    0x5c,
+    0x90, 0x5c,
+    0x3a, 0xf2,
+    0x26, 0xf6,
+    0xc6, 0x50, 0x5f,
+    0xa5, 0x01,
+    0x26, 0x06,
+    0xa5, 0x04,
+    0x27, 0xf5,
+    0x4f,
+    0x81,
+    0xa6, 0x02,
+    0x81,
+};
+
+// A slot is programmed after the other one at the latest
+#define LOADER_SLOT_TIMEOUT_US(dev) (2 * (dev)->prog_time_us + 100 * 1000)
+
+struct STLinkLoader {
+    stlink *stl;
+    int next;                           // slot to fill next
+    bool queued[STLINK_LOADER_SLOTS];   // handed to the stub, not yet seen done
+    uint8_t *buf;                       // block address and data
+    bool failed;
+};
+
+static int loader_install(stlink *stl)
+{
+    uint8_t resident[sizeof(loader_stub)];
+    if (stlink_swim_read_wait(stl, STLINK_LOADER_STUB, sizeof(resident), resident) != 0)
+        return -1;
+    if (memcmp(resident, loader_stub, sizeof(resident)) == 0) {
+        STLINK_DBG(FLASH, "%s: loader version %d already resident", __func__,
+                   STLINK_LOADER_VERSION);
+        return 0;
+    }
+    STLINK_INFO(FLASH, "uploading flash loader version %d...", STLINK_LOADER_VERSION);
+    return stlink_swim_write_wait(stl, STLINK_LOADER_STUB, sizeof(loader_stub),
+                                  (uint8_t *)loader_stub);
+}
+
+static int loader_run(stlink *stl)
+{
+    uint8_t states[STLINK_LOADER_SLOTS] = { STLINK_LOADER_EMPTY, STLINK_LOADER_EMPTY };
+    uint8_t pc[3] = { 0x00, STLINK_LOADER_STUB >> 8, STLINK_LOADER_STUB & 0xff };
+    uint16_t sp = stlink_get_device(stl)->ram_size - 1;
+    uint8_t sp_cc[3] = { sp >> 8, sp & 0xff, 0x28 }; // CC: I1 | I0, interrupts off
+    uint8_t csr2;
+    if (stlink_swim_write_wait(stl, STLINK_LOADER_STATE, sizeof(states), states) != 0 ||
+        stlink_swim_write_wait(stl, STM8_REG_PCE, sizeof(pc), pc) != 0 ||
+        stlink_swim_write_wait(stl, STM8_REG_SPH, sizeof(sp_cc), sp_cc) != 0)
+        return -1;
+
+    // flush the prefetched instructions, then let the core run
+    csr2 = STM8_DM_CSR2_STALL | STM8_DM_CSR2_FLUSH;
+    if (stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2) != 0)
+        return -1;
+    csr2 = STM8_DM_CSR2_FLUSH;
+    return stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2);
+}
+
+stlink_loader *stlink_loader_start(stlink *stl)
+{
+    const stlink_device *dev = stlink_get_device(stl);
+    if (dev->flash->cr2 != STM8S105_FLASH_CR2 || dev->block_size != STM8S105_FLASH_BLOCK_SIZE) {
+        STLINK_INFO(FLASH, "no flash loader for the %s", dev->name);
+        return NULL;
+    }
+    stlink_loader *ld = calloc(1, sizeof(stlink_loader));
+    if (ld == NULL)
+        return NULL;
+    ld->stl = stl;
+    ld->buf = stlink_buffer_alloc(stl, 2 + STM8S105_FLASH_BLOCK_SIZE);
+    if (ld->buf == NULL) {
+        free(ld);
+        return NULL;
+    }
+    if (loader_install(stl) != 0 || loader_run(stl) != 0) {
+        stlink_buffer_free(stl, ld->buf);
+        free(ld);
+        return NULL;
+    }
+    return ld;
+}
+
+// Waits for the stub to be done with a slot.
+static int loader_wait_slot(stlink_loader *ld, int slot)
+{
+    stlink *stl = ld->stl;
+    const stlink_poll_config *config = &stl->poll;
+    uint64_t start = stlink_time_us();
+    uint64_t deadline = start + LOADER_SLOT_TIMEOUT_US(stlink_get_device(stl));
+    uint64_t delay = config->initial_delay_us;
+
+    while (ld->queued[slot]) {
+        uint8_t state;
+        if (stlink_swim_read_wait(stl, STLINK_LOADER_STATE + slot, 1, &state) != 0)
+            return -1;
+        if (state == STLINK_LOADER_EMPTY) {
+            ld->queued[slot] = false;
+            break;
+        }
+        if (state == STLINK_LOADER_FAILED) {
+            STLINK_ERR(FLASH, "%s: write to protected page", __func__);
+            return -1;
+        }
+        if (stlink_time_us() >= deadline) {
+            STLINK_WARN(FLASH, "%s: loader silent after %" PRIu64 " ms", __func__,
+                        (stlink_time_us() - start) / 1000);
+            return -1;
+        }
+        if (config->strategy != STLINK_POLL_IMMEDIATE) {
+            stlink_sleep_us(delay);
+            delay *= 2;
+            if (delay > config->max_delay_us)
+                delay = config->max_delay_us;
+        }
+    }
+    return 0;
+}
+
+int stlink_loader_program(stlink_loader *ld, uint32_t addr, const uint8_t *block)
+{
+    stlink *stl = ld->stl;
+    int slot = ld->next;
+    if (addr > 0xffff || addr % STM8S105_FLASH_BLOCK_SIZE != 0) {
+        STLINK_ERR(FLASH, "%s: block at 0x%06" PRIx32 " not reachable by the loader",
+                   __func__, addr);
+        return -1;
+    }
+    if (ld->failed || loader_wait_slot(ld, slot) != 0) {
+        ld->failed = true;
+        return -1;
+    }
+
+    // the block first, then the state byte handing it over
+    ld->buf[0] = addr >> 8;
+    ld->buf[1] = addr & 0xff;
+    memcpy(ld->buf + 2, block, STM8S105_FLASH_BLOCK_SIZE);
+    uint8_t state = STLINK_LOADER_FULL;
+    if (stlink_swim_write_wait(stl, STLINK_LOADER_SLOT + slot * STLINK_LOADER_SLOT_SIZE,
+                               2 + STM8S105_FLASH_BLOCK_SIZE, ld->buf) != 0 ||
+        stlink_swim_write_wait(stl, STLINK_LOADER_STATE + slot, 1, &state) != 0) {
+        ld->failed = true;
+        return -1;
+    }
+    ld->queued[slot] = true;
+    ld->next = (slot + 1) % STLINK_LOADER_SLOTS;
+    return 0;
+}
+
+int stlink_loader_finish(stlink_loader *ld)
+{
+    stlink *stl = ld->stl;
+    int ret = ld->failed ? -1 : 0;
+    for (int i = 0; i < STLINK_LOADER_SLOTS && ret == 0; i++) {
+        // oldest first
+        ret = loader_wait_slot(ld, (ld->next + i) % STLINK_LOADER_SLOTS);
+    }
+    uint8_t csr2 = STM8_DM_CSR2_STALL;
+    if (stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2) != 0)
+        ret = -1;
+    stlink_buffer_free(stl, ld->buf);
+    free(ld);
+    return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef STLINK_LOADER_H
+#define STLINK_LOADER_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+// Layout of the flash loader in target RAM, see stlink-loader.c
+enum {
+    STLINK_LOADER_STATE     = 0x00f0, // one state byte per slot
+    STLINK_LOADER_SLOT      = 0x0100, // per slot: 16-bit block address, block data
+    STLINK_LOADER_SLOT_SIZE = 0x0100,
+    STLINK_LOADER_SLOTS     = 2,
+    STLINK_LOADER_STUB      = 0x0300, // entry point
+    STLINK_LOADER_ID        = 0x0302, // "SLD" and the version
+    STLINK_LOADER_VERSION   = 1,
+};
+
+// Slot states
+enum {
+    STLINK_LOADER_EMPTY     = 0x00,
+    STLINK_LOADER_FULL      = 0x01, // set by the host, cleared by the stub
+    STLINK_LOADER_FAILED    = 0x02, // write to a protected page
+};
+
+typedef struct STLinkLoader stlink_loader;
+
+/*
+ * Uploads the loader unless it is already resident and lets the core run
+ * it.  The flash or data EEPROM must have been unlocked.
+ */
+stlink_loader *stlink_loader_start(stlink *stl);
+// Queues one block for programming, waiting for a free slot if need be.
+int stlink_loader_program(stlink_loader *ld, uint32_t addr, const uint8_t *block);
+// Waits for the queued blocks, stalls the core and frees the loader.
+int stlink_loader_finish(stlink_loader *ld);
+
+
+#endif
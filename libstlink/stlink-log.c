@@ -0,0 +1,74 @@
+/*
+ * Logging
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Filtering happens inline in the callers, so that disabled messages cost
+ * a comparison, or nothing when compiled out.  Messages are formatted in
+ * one piece before being handed to the sink, which keeps lines intact when
+ * several probes log concurrently.
+ */
+
+#include "stlink-log.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+
+#define LOG_MESSAGE_MAX 256
+
+enum STLinkLogLevel stlink_log_level = STLINK_LOG_INFO;
+unsigned int stlink_log_categories = STLINK_LOG_ALL;
+
+// Errors and warnings go to stderr, everything else to stdout.
+static void log_sink_stdio(void *opaque, enum STLinkLogLevel level,
+                           enum STLinkLogCategory category, const char *message)
+{
+    fprintf((level <= STLINK_LOG_WARNING) ? stderr : stdout, "%s\n", message);
+}
+
+static stlink_log_sink log_sink = log_sink_stdio;
+static void *log_opaque;
+
+void stlink_log(enum STLinkLogLevel level, enum STLinkLogCategory category,
+                const char *format, ...)
+{
+    char message[LOG_MESSAGE_MAX];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    log_sink(log_opaque, level, category, message);
+}
+
+void stlink_log_hex(enum STLinkLogLevel level, enum STLinkLogCategory category,
+                    const char *prefix, const uint8_t *data, int length)
+{
+    char message[LOG_MESSAGE_MAX];
+    int pos = snprintf(message, sizeof(message), "%s:", prefix);
+    for (int i = 0; i < length && pos < sizeof(message) - 4; i++) {
+        pos += snprintf(message + pos, sizeof(message) - pos, " %02X", data[i]);
+    }
+    log_sink(log_opaque, level, category, message);
+}
+
+void stlink_log_set_level(enum STLinkLogLevel level)
+{
+    stlink_log_level = level;
+}
+
+void stlink_log_set_categories(unsigned int categories)
+{
+    stlink_log_categories = categories;
+}
+
+// NULL restores the default sink.
+void stlink_log_set_sink(stlink_log_sink sink, void *opaque)
+{
+    log_sink = (sink != NULL) ? sink : log_sink_stdio;
+    log_opaque = opaque;
+}
@@ -0,0 +1,69 @@
+#ifndef STLINK_LOG_H
+#define STLINK_LOG_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+enum STLinkLogLevel {
+    STLINK_LOG_NONE,
+    STLINK_LOG_ERROR,
+    STLINK_LOG_WARNING,
+    STLINK_LOG_INFO,
+    STLINK_LOG_DEBUG,
+};
+
+enum STLinkLogCategory {
+    STLINK_LOG_DEVICE       = 1 << 0,   // probe modes and identification
+    STLINK_LOG_TRANSPORT    = 1 << 1,   // USB and bulk-only transport
+    STLINK_LOG_CDB          = 1 << 2,   // dumps of every command block
+    STLINK_LOG_SWIM         = 1 << 3,
+    STLINK_LOG_FLASH        = 1 << 4,
+    STLINK_LOG_ALL          = 0xff,
+};
+
+/*
+ * Messages above this level are compiled out, e.g. with
+ * -DSTLINK_LOG_MAX_LEVEL=STLINK_LOG_ERROR.
+ */
+#ifndef STLINK_LOG_MAX_LEVEL
+#define STLINK_LOG_MAX_LEVEL STLINK_LOG_DEBUG
+#endif
+
+// message comes without trailing newline
+typedef void (*stlink_log_sink)(void *opaque, enum STLinkLogLevel level,
+                                enum STLinkLogCategory category, const char *message);
+
+extern enum STLinkLogLevel stlink_log_level;
+extern unsigned int stlink_log_categories;
+
+static inline bool stlink_log_enabled(enum STLinkLogLevel level, enum STLinkLogCategory category)
+{
+    return level <= STLINK_LOG_MAX_LEVEL && level <= stlink_log_level &&
+           (stlink_log_categories & category) != 0;
+}
+
+#define STLINK_LOG(level, category, ...) \
+    do { \
+        if (stlink_log_enabled(level, category)) \
+            stlink_log(level, category, __VA_ARGS__); \
+    } while (0)
+
+#define STLINK_LOG_HEX(level, category, prefix, data, length) \
+    do { \
+        if (stlink_log_enabled(level, category)) \
+            stlink_log_hex(level, category, prefix, data, length); \
+    } while (0)
+
+void stlink_log(enum STLinkLogLevel level, enum STLinkLogCategory category,
+                const char *format, ...) __attribute__((format(printf, 3, 4)));
+void stlink_log_hex(enum STLinkLogLevel level, enum STLinkLogCategory category,
+                    const char *prefix, const uint8_t *data, int length);
+
+void stlink_log_set_level(enum STLinkLogLevel level);
+void stlink_log_set_categories(unsigned int categories);
+void stlink_log_set_sink(stlink_log_sink sink, void *opaque);
+
+
+#endif
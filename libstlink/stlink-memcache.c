@@ -0,0 +1,267 @@
+/*
+ * Target memory read cache
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Every SWIM read costs a begin_read, at least one busy poll and a read,
+ * so small reads of nearby addresses are served from 64-byte lines, and
+ * adjacent missing lines are filled by a single read of up to the SWIM
+ * buffer size.  What may be cached depends on the region:
+ *
+ *  - peripheral, CPU, SWIM and debug module registers never are, since
+ *    they change under us or on being read;
+ *  - RAM only while the core is known to be stalled;
+ *  - flash, data EEPROM, option bytes and boot ROM unless the core is
+ *    known to be running, as it may program them itself.
+ *
+ * Writes invalidate the lines they touch.  The core state is tracked from
+ * writes and reads of DM_CSR2; releasing the stall or writing SWIM_CSR,
+ * which may reset the target, drops everything.
+ */
+
+#include "stlink-memcache.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+#include "stm8.h"
+
+
+// option bytes and the unique ID share this area
+#define MEMCACHE_OPTION_AREA_SIZE 256
+
+enum MemcacheRegion {
+    REGION_VOLATILE,
+    REGION_RAM,
+    REGION_NONVOLATILE,
+};
+
+enum MemcacheCore {
+    CORE_UNKNOWN,
+    CORE_STALLED,
+    CORE_RUNNING,
+};
+
+typedef struct MemcacheLine {
+    bool valid;
+    uint32_t addr;
+    uint8_t data[STLINK_MEMCACHE_LINE_SIZE];
+} MemcacheLine;
+
+struct STLinkMemcache {
+    enum MemcacheCore core;
+    stlink_memcache_stats stats;
+    MemcacheLine lines[STLINK_MEMCACHE_LINES];
+};
+
+static bool in_region(uint32_t addr, uint32_t start, uint32_t size)
+{
+    return addr >= start && addr < start + size;
+}
+
+/*
+ * Region boundaries are line aligned, so the first byte decides.  The boot
+ * ROM sits at the same place on all parts.
+ */
+static enum MemcacheRegion memcache_region(const stlink_device *dev, uint32_t line_addr)
+{
+    if (in_region(line_addr, 0, dev->ram_size))
+        return REGION_RAM;
+    if (in_region(line_addr, dev->eeprom_start, dev->eeprom_size) ||
+        in_region(line_addr, dev->option_start, MEMCACHE_OPTION_AREA_SIZE) ||
+        in_region(line_addr, STM8S105_BOOT_ROM_START, STM8S105_BOOT_ROM_SIZE) ||
+        in_region(line_addr, dev->flash_start, dev->flash_size))
+        return REGION_NONVOLATILE;
+    return REGION_VOLATILE;
+}
+
+static bool memcache_cacheable(stlink *stl, uint32_t line_addr)
+{
+    stlink_memcache *mc = stl->memcache;
+    switch (memcache_region(stlink_get_device(stl), line_addr)) {
+    case REGION_RAM:
+        return mc->core == CORE_STALLED;
+    case REGION_NONVOLATILE:
+        return mc->core != CORE_RUNNING;
+    default:
+        return false;
+    }
+}
+
+static MemcacheLine *memcache_line(stlink_memcache *mc, uint32_t line_addr)
+{
+    return &mc->lines[(line_addr / STLINK_MEMCACHE_LINE_SIZE) % STLINK_MEMCACHE_LINES];
+}
+
+static bool memcache_hit(stlink_memcache *mc, uint32_t line_addr)
+{
+    MemcacheLine *line = memcache_line(mc, line_addr);
+    return line->valid && line->addr == line_addr;
+}
+
+static void memcache_drop(stlink_memcache *mc)
+{
+    for (int i = 0; i < STLINK_MEMCACHE_LINES; i++) {
+        mc->lines[i].valid = false;
+    }
+    mc->stats.flushes++;
+}
+
+static void memcache_set_core(stlink_memcache *mc, uint8_t dm_csr2)
+{
+    enum MemcacheCore core = (dm_csr2 & STM8_DM_CSR2_STALL) ? CORE_STALLED : CORE_RUNNING;
+    if (core == CORE_RUNNING && mc->core != CORE_RUNNING)
+        memcache_drop(mc);
+    mc->core = core;
+}
+
+static int memcache_read_target(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    stl->memcache->stats.reads++;
+    int ret = stlink_swim_read_once(stl, addr, len, buffer);
+    if (ret != 0 && stlink_recover_swim(stl) == 0)
+        ret = stlink_swim_read_once(stl, addr, len, buffer);
+    if (ret != 0)
+        return -1;
+    if (in_region(STM8_DM_CSR2, addr, len))
+        memcache_set_core(stl->memcache, buffer[STM8_DM_CSR2 - addr]);
+    return 0;
+}
+
+/*
+ * Fills the missing lines from line_addr on, up to end, with one read.
+ * *filled receives the end of the lines filled.
+ */
+static int memcache_fill(stlink *stl, uint32_t line_addr, uint32_t end, uint32_t *filled)
+{
+    stlink_memcache *mc = stl->memcache;
+    uint8_t buf[STLINK_MEMCACHE_LINES * STLINK_MEMCACHE_LINE_SIZE];
+    uint16_t chunk;
+    if (stlink_swim_chunk_size(stl, &chunk) != 0)
+        return -1;
+    if (chunk > sizeof(buf))
+        chunk = sizeof(buf);
+    chunk -= chunk % STLINK_MEMCACHE_LINE_SIZE;
+    if (chunk == 0)
+        return -1;
+
+    uint32_t run = STLINK_MEMCACHE_LINE_SIZE;
+    while (line_addr + run < end && run < chunk &&
+           memcache_cacheable(stl, line_addr + run) && !memcache_hit(mc, line_addr + run))
+        run += STLINK_MEMCACHE_LINE_SIZE;
+    if (memcache_read_target(stl, line_addr, run, buf) != 0)
+        return -1;
+    mc->stats.misses += run / STLINK_MEMCACHE_LINE_SIZE;
+    for (uint32_t off = 0; off < run; off += STLINK_MEMCACHE_LINE_SIZE) {
+        MemcacheLine *line = memcache_line(mc, line_addr + off);
+        line->valid = true;
+        line->addr = line_addr + off;
+        memcpy(line->data, buf + off, STLINK_MEMCACHE_LINE_SIZE);
+    }
+    *filled = line_addr + run;
+    return 0;
+}
+
+// Backs stlink_swim_read_wait() while the cache is enabled.
+int stlink_memcache_read(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    stlink_memcache *mc = stl->memcache;
+    uint32_t end = addr + len;
+    uint32_t filled = 0;
+    while (addr < end) {
+        uint32_t line_addr = addr - addr % STLINK_MEMCACHE_LINE_SIZE;
+        if (!memcache_cacheable(stl, line_addr)) {
+            // everything up to the next cacheable line in one go
+            uint32_t next = line_addr + STLINK_MEMCACHE_LINE_SIZE;
+            while (next < end && !memcache_cacheable(stl, next))
+                next += STLINK_MEMCACHE_LINE_SIZE;
+            uint32_t n = ((next < end) ? next : end) - addr;
+            if (memcache_read_target(stl, addr, n, buffer) != 0)
+                return -1;
+            addr += n;
+            buffer += n;
+            continue;
+        }
+        // lines filled by this call were counted as misses already
+        if (line_addr >= filled) {
+            if (memcache_hit(mc, line_addr))
+                mc->stats.hits++;
+            else if (memcache_fill(stl, line_addr, end, &filled) != 0)
+                return -1;
+        }
+        uint32_t n = line_addr + STLINK_MEMCACHE_LINE_SIZE - addr;
+        if (n > end - addr)
+            n = end - addr;
+        memcpy(buffer, memcache_line(mc, line_addr)->data + (addr - line_addr), n);
+        addr += n;
+        buffer += n;
+    }
+    return 0;
+}
+
+int stlink_memcache_enable(stlink *stl, bool enable)
+{
+    if (!enable) {
+        free(stl->memcache);
+        stl->memcache = NULL;
+        return 0;
+    }
+    if (stl->memcache == NULL)
+        stl->memcache = calloc(1, sizeof(stlink_memcache));
+    return (stl->memcache != NULL) ? 0 : -1;
+}
+
+void stlink_memcache_flush(stlink *stl)
+{
+    if (stl->memcache != NULL)
+        memcache_drop(stl->memcache);
+}
+
+void stlink_memcache_invalidate(stlink *stl, uint32_t addr, uint32_t len)
+{
+    stlink_memcache *mc = stl->memcache;
+    if (mc == NULL || len == 0)
+        return;
+    for (uint32_t line_addr = addr - addr % STLINK_MEMCACHE_LINE_SIZE; line_addr < addr + len;
+         line_addr += STLINK_MEMCACHE_LINE_SIZE) {
+        if (memcache_hit(mc, line_addr))
+            memcache_line(mc, line_addr)->valid = false;
+    }
+}
+
+void stlink_memcache_get_stats(stlink *stl, stlink_memcache_stats *stats)
+{
+    if (stl->memcache != NULL)
+        *stats = stl->memcache->stats;
+    else
+        memset(stats, 0, sizeof(stlink_memcache_stats));
+}
+
+// Called for every SWIM write; data may be NULL if not at hand.
+void stlink_target_written(stlink *stl, uint32_t addr, uint32_t len, const uint8_t *data)
+{
+    stlink_cache_written(stl, addr, len);
+    stlink_memcache *mc = stl->memcache;
+    if (mc == NULL)
+        return;
+    if (in_region(STM8_SWIM_CSR, addr, len)) {
+        memcache_drop(mc);
+        mc->core = CORE_UNKNOWN;
+    } else if (in_region(STM8_DM_CSR2, addr, len)) {
+        if (data != NULL) {
+            memcache_set_core(mc, data[STM8_DM_CSR2 - addr]);
+        } else {
+            memcache_drop(mc);
+            mc->core = CORE_UNKNOWN;
+        }
+    }
+    stlink_memcache_invalidate(stl, addr, len);
+}
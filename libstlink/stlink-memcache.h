@@ -0,0 +1,33 @@
+#ifndef STLINK_MEMCACHE_H
+#define STLINK_MEMCACHE_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+#define STLINK_MEMCACHE_LINE_SIZE   64
+#define STLINK_MEMCACHE_LINES       64
+
+typedef struct STLinkMemcache stlink_memcache;
+
+typedef struct STLinkMemcacheStats {
+    uint32_t hits;              // lines served from the cache
+    uint32_t misses;            // lines read from the target
+    uint32_t reads;             // SWIM reads issued
+    uint32_t flushes;
+} stlink_memcache_stats;
+
+/*
+ * Caches what stlink_swim_read_wait() returns, as long as it cannot have
+ * changed: see stlink-memcache.c for the rules.  Off by default.
+ */
+int stlink_memcache_enable(stlink *stl, bool enable);
+void stlink_memcache_flush(stlink *stl);
+void stlink_memcache_invalidate(stlink *stl, uint32_t addr, uint32_t len);
+void stlink_memcache_get_stats(stlink *stl, stlink_memcache_stats *stats);
+
+
+#endif
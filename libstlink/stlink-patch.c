@@ -0,0 +1,286 @@
+/*
+ * Small flash and data EEPROM patches
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Serial numbers and calibration constants change per board while the
+ * firmware around them does not, so rewriting them should cost no more
+ * than the bytes themselves.  The patched bytes are read first, in one
+ * gathered pass; each block they touch then takes at most one programming
+ * operation, the smallest that covers what actually changes: a byte, an
+ * aligned word (FLASH_CR2.WPRG) or the whole block.  Only for word and
+ * block programming is the rest of the word or block read to fill it up.
+ * Verification reads back just the patched bytes, again gathered.
+ */
+
+#include "stlink-patch.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-cache.h"
+#include "stlink-device.h"
+#include "stlink-flash.h"
+#include "stlink-gather.h"
+#include "stm8.h"
+
+
+typedef struct PatchPlan {
+    uint32_t block_size;
+    uint32_t *blocks;   // addresses of the blocks touched, sorted
+    int count;
+    uint8_t *current;   // per block, as far as read
+    uint8_t *wanted;
+    uint8_t *readback;
+    bool *patched;
+} PatchPlan;
+
+static int patch_compare_blocks(const void *a, const void *b)
+{
+    uint32_t ba = *(const uint32_t *)a;
+    uint32_t bb = *(const uint32_t *)b;
+    return (ba < bb) ? -1 : (ba > bb);
+}
+
+// Offset of addr into the plan's per-block buffers
+static uint32_t patch_offset(const PatchPlan *plan, uint32_t addr)
+{
+    uint32_t block = addr - addr % plan->block_size;
+    const uint32_t *found = bsearch(&block, plan->blocks, plan->count, sizeof(uint32_t),
+                                    patch_compare_blocks);
+    return (found - plan->blocks) * plan->block_size + addr % plan->block_size;
+}
+
+static bool patch_in_memory(const stlink_device *dev, const stlink_patch *patch)
+{
+    uint32_t last = patch->addr + patch->len - 1;
+    return (stlink_device_in_flash(dev, patch->addr) && stlink_device_in_flash(dev, last)) ||
+           (stlink_device_in_eeprom(dev, patch->addr) && stlink_device_in_eeprom(dev, last));
+}
+
+static int patch_plan(PatchPlan *plan, const stlink_device *dev,
+                      const stlink_patch *patches, int count)
+{
+    int capacity = 0;
+    for (int i = 0; i < count; i++) {
+        const stlink_patch *patch = &patches[i];
+        if (patch->len == 0 || !patch_in_memory(dev, patch)) {
+            STLINK_ERR(FLASH, "%s: 0x%" PRIx32 "+0x%" PRIx32 " is outside %s flash and EEPROM",
+                       __func__, patch->addr, patch->len, dev->name);
+            return -1;
+        }
+        uint32_t first = patch->addr - patch->addr % plan->block_size;
+        for (uint32_t block = first; block < patch->addr + patch->len; block += plan->block_size) {
+            bool known = false;
+            for (int j = 0; j < plan->count && !known; j++) {
+                known = (plan->blocks[j] == block);
+            }
+            if (known)
+                continue;
+            if (plan->count == capacity) {
+                capacity = (capacity > 0) ? capacity * 2 : 16;
+                uint32_t *blocks = realloc(plan->blocks, capacity * sizeof(uint32_t));
+                if (blocks == NULL)
+                    return -1;
+                plan->blocks = blocks;
+            }
+            plan->blocks[plan->count++] = block;
+        }
+    }
+    qsort(plan->blocks, plan->count, sizeof(uint32_t), patch_compare_blocks);
+
+    size_t size = (size_t)plan->count * plan->block_size;
+    plan->current = calloc(size, 1);
+    plan->wanted = calloc(size, 1);
+    plan->readback = calloc(size, 1);
+    plan->patched = calloc(size, sizeof(bool));
+    if (plan->current == NULL || plan->wanted == NULL || plan->readback == NULL ||
+        plan->patched == NULL)
+        return -1;
+    return 0;
+}
+
+static void patch_free_plan(PatchPlan *plan)
+{
+    free(plan->blocks);
+    free(plan->current);
+    free(plan->wanted);
+    free(plan->readback);
+    free(plan->patched);
+}
+
+// Reads the patched bytes into buf, split at block boundaries.
+static int patch_read(stlink *stl, const PatchPlan *plan, const stlink_patch *patches,
+                      int count, uint8_t *buf, int *reads)
+{
+    int nreqs = 0;
+    for (int i = 0; i < count; i++) {
+        const stlink_patch *patch = &patches[i];
+        nreqs += (patch->addr % plan->block_size + patch->len + plan->block_size - 1) /
+                 plan->block_size;
+    }
+    stlink_read_request *reqs = calloc(nreqs, sizeof(stlink_read_request));
+    if (reqs == NULL)
+        return -1;
+    nreqs = 0;
+    for (int i = 0; i < count; i++) {
+        const stlink_patch *patch = &patches[i];
+        for (uint32_t off = 0; off < patch->len; ) {
+            uint32_t addr = patch->addr + off;
+            uint32_t len = plan->block_size - addr % plan->block_size;
+            if (len > patch->len - off)
+                len = patch->len - off;
+            reqs[nreqs++] = (stlink_read_request){ addr, len, buf + patch_offset(plan, addr) };
+            off += len;
+        }
+    }
+    int n;
+    int ret = stlink_swim_read_gather(stl, reqs, nreqs, STLINK_GATHER_DEFAULT_GAP, &n);
+    *reads += n;
+    free(reqs);
+    return ret;
+}
+
+/*
+ * Finds the bytes of block b that change and the smallest programming unit
+ * covering them: 0 if none do, else 1, a word or the block size.  *start
+ * receives the offset of the unit into the block.
+ */
+static uint32_t patch_unit(const PatchPlan *plan, int b, uint32_t *start)
+{
+    const uint32_t base = b * plan->block_size;
+    int first = -1;
+    int last = -1;
+    for (uint32_t i = 0; i < plan->block_size; i++) {
+        if (plan->patched[base + i] && plan->wanted[base + i] != plan->current[base + i]) {
+            if (first < 0)
+                first = i;
+            last = i;
+        }
+    }
+    if (first < 0)
+        return 0;
+    if (first == last) {
+        *start = first;
+        return 1;
+    }
+    if (first / STM8_FLASH_WORD_SIZE == last / STM8_FLASH_WORD_SIZE) {
+        *start = first - first % STM8_FLASH_WORD_SIZE;
+        return STM8_FLASH_WORD_SIZE;
+    }
+    *start = 0;
+    return plan->block_size;
+}
+
+int stlink_patch_apply(stlink *stl, const stlink_patch *patches, int count,
+                       stlink_patch_stats *stats)
+{
+    stlink_patch_stats dummy;
+    if (stats == NULL)
+        stats = &dummy;
+    memset(stats, 0, sizeof(stlink_patch_stats));
+    uint64_t start = stlink_time_us();
+
+    const stlink_device *dev = stlink_get_device(stl);
+    PatchPlan plan = {
+        .block_size = dev->block_size,
+    };
+    int ret = patch_plan(&plan, dev, patches, count);
+    if (ret == 0)
+        ret = patch_read(stl, &plan, patches, count, plan.current, &stats->reads);
+    if (ret != 0) {
+        patch_free_plan(&plan);
+        return -1;
+    }
+    memcpy(plan.wanted, plan.current, (size_t)plan.count * plan.block_size);
+    for (int i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < patches[i].len; j++) {
+            uint32_t off = patch_offset(&plan, patches[i].addr + j);
+            plan.wanted[off] = patches[i].data[j];
+            plan.patched[off] = true;
+        }
+    }
+    stats->blocks_total = plan.count;
+
+    // fill up the words and blocks to be programmed in one more pass
+    uint32_t *unit_start = calloc(plan.count, sizeof(uint32_t));
+    uint32_t *unit_len = calloc(plan.count, sizeof(uint32_t));
+    stlink_read_request *fill = calloc(plan.count, sizeof(stlink_read_request));
+    if (unit_start == NULL || unit_len == NULL || fill == NULL)
+        ret = -1;
+    int nfill = 0;
+    for (int b = 0; b < plan.count && ret == 0; b++) {
+        unit_len[b] = patch_unit(&plan, b, &unit_start[b]);
+        if (unit_len[b] > 1) {
+            uint32_t off = b * plan.block_size + unit_start[b];
+            fill[nfill++] = (stlink_read_request){ plan.blocks[b] + unit_start[b], unit_len[b],
+                                                   plan.current + off };
+        }
+    }
+    if (ret == 0 && nfill > 0) {
+        int n;
+        ret = stlink_swim_read_gather(stl, fill, nfill, STLINK_GATHER_DEFAULT_GAP, &n);
+        stats->reads += n;
+    }
+    for (int b = 0; b < plan.count && ret == 0; b++) {
+        for (uint32_t i = 0; i < unit_len[b]; i++) {
+            uint32_t off = b * plan.block_size + unit_start[b] + i;
+            if (!plan.patched[off])
+                plan.wanted[off] = plan.current[off];
+        }
+    }
+
+    for (int b = 0; b < plan.count && ret == 0; b++) {
+        if (unit_len[b] == 0) {
+            stats->blocks_skipped++;
+            continue;
+        }
+        uint32_t addr = plan.blocks[b] + unit_start[b];
+        STLINK_INFO(FLASH, "programming %" PRIu32 " bytes at 0x%06" PRIx32 "...",
+                    unit_len[b], addr);
+        ret = stlink_flash_unlock_program(stl, addr,
+                                          plan.wanted + b * plan.block_size + unit_start[b],
+                                          unit_len[b]);
+        if (ret != 0)
+            break;
+        if (unit_len[b] == 1)
+            stats->byte_writes++;
+        else if (unit_len[b] == STM8_FLASH_WORD_SIZE)
+            stats->word_writes++;
+        else
+            stats->block_writes++;
+        stats->bytes_programmed += unit_len[b];
+    }
+    if (stl->flash_unlocked != 0 && stlink_flash_lock(stl) != 0)
+        ret = -1;
+
+    if (ret == 0)
+        ret = patch_read(stl, &plan, patches, count, plan.readback, &stats->reads);
+    for (size_t off = 0; off < (size_t)plan.count * plan.block_size && ret == 0; off++) {
+        if (plan.patched[off] && plan.readback[off] != plan.wanted[off]) {
+            STLINK_ERR(FLASH, "%s: verify failed at 0x%06" PRIx32, __func__,
+                       plan.blocks[off / plan.block_size] + (uint32_t)(off % plan.block_size));
+            ret = -1;
+        }
+    }
+    for (int b = 0; b < plan.count && ret == 0 && stl->cache != NULL; b++) {
+        if (unit_len[b] > 0)
+            stlink_cache_update(stl->cache, plan.blocks[b] + unit_start[b],
+                                plan.wanted + b * plan.block_size + unit_start[b], unit_len[b]);
+    }
+
+    free(unit_start);
+    free(unit_len);
+    free(fill);
+    patch_free_plan(&plan);
+    stats->elapsed_us = stlink_time_us() - start;
+    return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef STLINK_PATCH_H
+#define STLINK_PATCH_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+typedef struct STLinkPatch {
+    uint32_t addr;
+    uint32_t len;
+    const uint8_t *data;
+} stlink_patch;
+
+typedef struct STLinkPatchStats {
+    uint32_t blocks_total;      // touched by the patches
+    uint32_t blocks_skipped;    // already holding the patched bytes
+    uint32_t byte_writes;
+    uint32_t word_writes;
+    uint32_t block_writes;
+    uint32_t bytes_programmed;
+    int reads;                  // SWIM reads, including verification
+    uint64_t elapsed_us;
+} stlink_patch_stats;
+
+/*
+ * Writes small patches, e.g. a serial number or calibration constants,
+ * into flash or data EEPROM with the target stalled.  Later patches win
+ * where they overlap.  Only the patched bytes are read back for
+ * verification.  stats may be NULL.
+ */
+int stlink_patch_apply(stlink *stl, const stlink_patch *patches, int count,
+                       stlink_patch_stats *stats);
+
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * SWIM busy polling
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Every poll is a full CBW/CSW exchange, so spinning on it both burns CPU
+ * and saturates the bus.  Waits are bounded by a hard deadline and their
+ * duration is recorded per SWIM command, and for the end of flash
+ * programming, which is polled the same way through FLASH_IAPSR.
+ */
+
+#include "stlink-poll.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+
+
+// A SWIM byte frame carries 8 data bits plus header, parity and ack.
+#define SWIM_BITS_PER_BYTE  12
+// ROTF/WOTF header: command, byte count and 24-bit address
+#define SWIM_HEADER_BYTES   5
+
+void stlink_poll_init(stlink *stl)
+{
+    stl->poll.strategy = STLINK_POLL_BACKOFF;
+    stl->poll.initial_delay_us = 50;
+    stl->poll.max_delay_us = 10 * 1000;
+    stl->poll.deadline_ms = 2000;
+    stl->poll.swim_bitrate = 800000; // high speed
+    stlink_poll_reset_stats(stl);
+}
+
+void stlink_poll_get_config(stlink *stl, stlink_poll_config *config)
+{
+    *config = stl->poll;
+}
+
+void stlink_poll_set_config(stlink *stl, const stlink_poll_config *config)
+{
+    stl->poll = *config;
+    if (stl->poll.swim_bitrate == 0)
+        stl->poll.swim_bitrate = 800000;
+    if (stl->poll.max_delay_us < stl->poll.initial_delay_us)
+        stl->poll.max_delay_us = stl->poll.initial_delay_us;
+}
+
+static uint64_t poll_predict_us(stlink *stl)
+{
+    uint32_t bytes = 1;
+    if (stl->swim_op == STLINK_SWIM_DO_0A || stl->swim_op == STLINK_SWIM_BEGIN_READ)
+        bytes = SWIM_HEADER_BYTES + stl->swim_len;
+    return (uint64_t)bytes * SWIM_BITS_PER_BYTE * 1000000 / stl->poll.swim_bitrate;
+}
+
+static int poll_status(stlink *stl, uint8_t *status)
+{
+    uint8_t cdb[2];
+    uint8_t buf[4];
+    stlink_swim_cdb(cdb, STLINK_SWIM_GET_BUSY);
+    int ret = stlink_send_command(stl, cdb, sizeof(cdb), buf, sizeof(buf), true);
+    if (ret != 0)
+        return -1;
+    *status = buf[0];
+    return 0;
+}
+
+static void poll_record(stlink_poll_histogram *hist, uint64_t us, int polls)
+{
+    int bucket = 0;
+    while ((us >> bucket) > 0 && bucket < STLINK_POLL_BUCKETS - 1)
+        bucket++;
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->polls += polls;
+    hist->total_us += us;
+    if (us > hist->max_us)
+        hist->max_us = us;
+}
+
+/*
+ * Calls poll until it reports done, sleeping in between as the strategy
+ * has it and, with STLINK_POLL_PREDICT, for predict_us first.  poll
+ * returns 0 when done, 1 while still in progress and -1 on error.
+ * Returns the same, 1 meaning that the deadline passed; the wait is
+ * recorded in hist.
+ */
+int stlink_poll_until(stlink *stl, stlink_poll_fn poll, void *opaque, uint64_t predict_us,
+                      stlink_poll_histogram *hist)
+{
+    const stlink_poll_config *config = &stl->poll;
+    uint64_t start = stlink_time_us();
+    uint64_t deadline = start + (uint64_t)config->deadline_ms * 1000;
+    uint64_t delay = config->initial_delay_us;
+    int polls = 0;
+
+    if (config->strategy == STLINK_POLL_PREDICT)
+        stlink_sleep_us(predict_us);
+    for (;;) {
+        int ret = poll(stl, opaque);
+        polls++;
+        if (ret < 0)
+            return -1;
+        if (ret == 0)
+            break;
+        uint64_t now = stlink_time_us();
+        if (now >= deadline) {
+            hist->timeouts++;
+            return 1;
+        }
+        if (config->strategy != STLINK_POLL_IMMEDIATE) {
+            stlink_sleep_us((delay < deadline - now) ? delay : deadline - now);
+            delay *= 2;
+            if (delay > config->max_delay_us)
+                delay = config->max_delay_us;
+        }
+    }
+    poll_record(hist, stlink_time_us() - start, polls);
+    return 0;
+}
+
+static int poll_swim_busy(stlink *stl, void *opaque)
+{
+    uint8_t status;
+    if (poll_status(stl, &status) != 0)
+        return -1;
+    if (status == STLINK_SWIM_OK)
+        return 0;
+    if (status == STLINK_SWIM_BUSY)
+        return 1;
+    stl->swim_error = status;
+    STLINK_ERR(SWIM, "stlink_swim_wait: SWIM status 0x%02" PRIX8 "%s", status,
+            (status == STLINK_SWIM_NO_PROLOGUE) ? " (missing prologue)" : "");
+    return -1;
+}
+
+/*
+ * Waits for the last SWIM operation issued through stlink-cmd.c to finish.
+ * Returns -1 on transport errors, SWIM error codes and when the deadline
+ * passes.
+ */
+int stlink_swim_wait(stlink *stl)
+{
+    stl->swim_error = STLINK_SWIM_OK;
+    int ret = stlink_poll_until(stl, poll_swim_busy, NULL, poll_predict_us(stl),
+                                &stl->poll_stats[stl->swim_op % STLINK_SWIM_COMMANDS]);
+    if (ret == 1)
+        STLINK_ERR(SWIM, "%s: SWIM command 0x%02" PRIX8 " still busy after %u ms",
+                __func__, stl->swim_op, stl->poll.deadline_ms);
+    return (ret == 0) ? 0 : -1;
+}
+
+static int poll_swim_status(stlink *stl, void *opaque)
+{
+    uint8_t *status = opaque;
+    if (poll_status(stl, status) != 0)
+        return -1;
+    return (*status == STLINK_SWIM_BUSY) ? 1 : 0;
+}
+
+/*
+ * Like stlink_swim_wait(), but hands back the SWIM status the operation
+ * ended with instead of failing on it, for callers to whom it is an answer.
+ */
+int stlink_swim_wait_status(stlink *stl, uint8_t *status)
+{
+    int ret = stlink_poll_until(stl, poll_swim_status, status, poll_predict_us(stl),
+                                &stl->poll_stats[stl->swim_op % STLINK_SWIM_COMMANDS]);
+    return (ret == 0) ? 0 : -1;
+}
+
+static int swim_write_once(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    if (stlink_swim_write(stl, addr, len, buffer) != 0)
+        return -1;
+    return stlink_swim_wait(stl);
+}
+
+/*
+ * Not repeated should the target drop out of SWIM: the prologue bringing
+ * it back resets it, undoing whatever the write depended on.
+ */
+int stlink_swim_write_wait(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    return swim_write_once(stl, addr, len, buffer);
+}
+
+int stlink_swim_read_once(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    if (stlink_swim_begin_read(stl, addr, len) != 0)
+        return -1;
+    if (stlink_swim_wait(stl) != 0)
+        return -1;
+    return stlink_swim_read(stl, len, buffer);
+}
+
+int stlink_swim_read_wait(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer)
+{
+    if (stl->memcache != NULL)
+        return stlink_memcache_read(stl, addr, len, buffer);
+    int ret = stlink_swim_read_once(stl, addr, len, buffer);
+    if (ret != 0 && stlink_recover_swim(stl) == 0)
+        ret = stlink_swim_read_once(stl, addr, len, buffer);
+    return ret;
+}
+
+const stlink_poll_histogram *stlink_poll_get_histogram(stlink *stl, uint8_t swim_cmd)
+{
+    if (swim_cmd >= STLINK_SWIM_COMMANDS)
+        return NULL;
+    return &stl->poll_stats[swim_cmd];
+}
+
+const stlink_poll_histogram *stlink_poll_get_eop_histogram(stlink *stl)
+{
+    return &stl->eop_stats;
+}
+
+void stlink_poll_reset_stats(stlink *stl)
+{
+    memset(stl->poll_stats, 0, sizeof(stl->poll_stats));
+    memset(&stl->eop_stats, 0, sizeof(stl->eop_stats));
+}
+
+static void poll_dump_histogram(FILE *f, const char *name, const stlink_poll_histogram *hist)
+{
+    if (hist->count == 0 && hist->timeouts == 0)
+        return;
+    fprintf(f, "%s: %" PRIu32 " waits, %" PRIu32 " polls, %" PRIu32 " timeouts,"
+               " avg %" PRIu64 " us, max %" PRIu64 " us\n",
+            name, hist->count, hist->polls, hist->timeouts,
+            (hist->count > 0) ? hist->total_us / hist->count : 0, hist->max_us);
+    for (int j = 0; j < STLINK_POLL_BUCKETS; j++) {
+        if (hist->buckets[j] == 0)
+            continue;
+        fprintf(f, "  < %8" PRIu64 " us: %" PRIu32 "\n", (uint64_t)1 << j, hist->buckets[j]);
+    }
+}
+
+void stlink_poll_dump_stats(stlink *stl, FILE *f)
+{
+    for (int i = 0; i < STLINK_SWIM_COMMANDS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "SWIM 0x%02X", i);
+        poll_dump_histogram(f, name, &stl->poll_stats[i]);
+    }
+    poll_dump_histogram(f, "flash EOP", &stl->eop_stats);
+}
@@ -0,0 +1,50 @@
+#ifndef STLINK_POLL_H
+#define STLINK_POLL_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stlink-libusb.h"
+
+
+enum STLinkPollStrategy {
+    STLINK_POLL_IMMEDIATE,  // poll back to back
+    STLINK_POLL_BACKOFF,    // sleep exponentially longer between polls
+    STLINK_POLL_PREDICT,    // sleep for the expected SWIM time, then back off
+};
+
+typedef struct STLinkPollConfig {
+    enum STLinkPollStrategy strategy;
+    unsigned int initial_delay_us;
+    unsigned int max_delay_us;
+    unsigned int deadline_ms;
+    unsigned int swim_bitrate; // bit/s
+} stlink_poll_config;
+
+#define STLINK_POLL_BUCKETS 24 // powers of two, in us
+
+typedef struct STLinkPollHistogram {
+    uint32_t count;
+    uint32_t polls;
+    uint32_t timeouts;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint32_t buckets[STLINK_POLL_BUCKETS];
+} stlink_poll_histogram;
+
+void stlink_poll_get_config(stlink *stl, stlink_poll_config *config);
+void stlink_poll_set_config(stlink *stl, const stlink_poll_config *config);
+
+int stlink_swim_wait(stlink *stl);
+int stlink_swim_write_wait(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer);
+int stlink_swim_read_wait(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buffer);
+
+const stlink_poll_histogram *stlink_poll_get_histogram(stlink *stl, uint8_t swim_cmd);
+// Waits for the end of flash programming
+const stlink_poll_histogram *stlink_poll_get_eop_histogram(stlink *stl);
+void stlink_poll_reset_stats(stlink *stl);
+void stlink_poll_dump_stats(stlink *stl, FILE *f);
+
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * Streaming SWIM reads
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * The ST-Link has a single read buffer, so the READ of chunk N has to
+ * precede the BEGIN_READ of chunk N+1.  Both go out in the same exchange
+ * though, together with the first busy poll for chunk N+1, and chunk N is
+ * handed to the sink while that exchange is in flight.
+ */
+
+#include "stlink-read.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+
+
+int stlink_sink_file(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len)
+{
+    FILE *file = opaque;
+    return (fwrite(data, 1, len, file) < len) ? -1 : 0;
+}
+
+int stlink_sink_memory(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len)
+{
+    stlink_memory_sink *mem = opaque;
+    if (addr < mem->base || addr + len > mem->base + mem->size)
+        return -1;
+    memcpy(mem->buffer + (addr - mem->base), data, len);
+    return 0;
+}
+
+/*
+ * Slicing-by-8: eight tables let the loop fold in eight bytes per step with
+ * independent lookups instead of one dependent lookup per byte.
+ */
+static uint32_t crc32_table[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        }
+        crc32_table[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = crc32_table[k - 1][i];
+            crc32_table[k][i] = crc32_table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+}
+
+uint32_t stlink_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    pthread_once(&crc32_once, crc32_init);
+    crc = ~crc;
+    while (len >= 8) {
+        uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | (uint32_t)data[3] << 24);
+        uint32_t hi = data[4] | data[5] << 8 | data[6] << 16 | (uint32_t)data[7] << 24;
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+              crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+              crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+        data += 8;
+        len -= 8;
+    }
+    for (size_t i = 0; i < len; i++) {
+        crc = crc32_table[0][(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// opaque points to the running CRC, initially 0.
+int stlink_sink_crc32(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len)
+{
+    uint32_t *crc = opaque;
+    *crc = stlink_crc32(*crc, data, len);
+    return 0;
+}
+
+typedef struct ReadAhead {
+    int status;
+    uint8_t busy[4];
+} ReadAhead;
+
+static void read_ahead_done(stlink *stl, int status, void *opaque)
+{
+    ReadAhead *ra = opaque;
+    if (status != 0)
+        ra->status = -1;
+}
+
+static void read_ahead_begin(stlink *stl, ReadAhead *ra, uint32_t addr, uint16_t len)
+{
+    uint8_t cdb[8];
+    stlink_swim_begin_read_cdb(cdb, addr, len);
+    stlink_submit_command(stl, cdb, sizeof(cdb), NULL, 0, true, read_ahead_done, ra);
+    stlink_swim_cdb(cdb, STLINK_SWIM_GET_BUSY);
+    stlink_submit_command(stl, cdb, 2, ra->busy, sizeof(ra->busy), true, read_ahead_done, ra);
+}
+
+// Waits for the exchange and, if the first poll came too early, for SWIM.
+static int read_ahead_finish(stlink *stl, ReadAhead *ra, bool begun, uint16_t len)
+{
+    stlink_wait_commands(stl, 0);
+    if (ra->status != 0)
+        return -1;
+    if (!begun || ra->busy[0] == STLINK_SWIM_OK)
+        return 0;
+    if (ra->busy[0] != STLINK_SWIM_BUSY) {
+        STLINK_ERR(SWIM, "%s: SWIM status 0x%02" PRIX8, __func__, ra->busy[0]);
+        return -1;
+    }
+    stl->swim_op = STLINK_SWIM_BEGIN_READ;
+    stl->swim_len = len;
+    return stlink_swim_wait(stl);
+}
+
+int stlink_swim_read_range(stlink *stl, uint32_t addr, uint32_t len,
+                           stlink_sink_fn sink, void *opaque)
+{
+    STLINK_INFO(SWIM, "reading 0x%" PRIx32 " bytes at 0x%06" PRIx32 "...", len, addr);
+    uint16_t size;
+    if (stlink_swim_chunk_size(stl, &size) != 0 || size == 0)
+        return -1;
+    if (len == 0)
+        return 0;
+
+    uint8_t *bufs[2];
+    bufs[0] = stlink_buffer_alloc(stl, size);
+    bufs[1] = stlink_buffer_alloc(stl, size);
+    if (bufs[0] == NULL || bufs[1] == NULL) {
+        stlink_buffer_free(stl, bufs[0]);
+        stlink_buffer_free(stl, bufs[1]);
+        return -1;
+    }
+
+    uint32_t end = addr + len;
+    uint32_t cur = addr;
+    uint16_t cur_len = (end - cur > size) ? size : end - cur;
+    ReadAhead ra = { .status = 0 };
+    read_ahead_begin(stl, &ra, cur, cur_len);
+    int ret = read_ahead_finish(stl, &ra, true, cur_len);
+
+    uint8_t *prev = NULL;
+    uint32_t prev_addr = 0;
+    uint16_t prev_len = 0;
+    for (int n = 0; ret == 0 && cur < end; n++) {
+        uint8_t *buf = bufs[n & 1];
+        uint32_t next = cur + cur_len;
+        uint16_t next_len = (end - next > size) ? size : end - next;
+
+        uint8_t cdb[2];
+        ra.status = 0;
+        stlink_swim_cdb(cdb, STLINK_SWIM_READ);
+        stlink_submit_command(stl, cdb, sizeof(cdb), buf, cur_len, true, read_ahead_done, &ra);
+        if (next < end)
+            read_ahead_begin(stl, &ra, next, next_len);
+
+        if (prev != NULL && sink(opaque, prev_addr, prev, prev_len) != 0) {
+            STLINK_ERR(SWIM, "%s: sink failed at 0x%06" PRIx32, __func__, prev_addr);
+            stlink_wait_commands(stl, 0);
+            ret = -1;
+            break;
+        }
+
+        ret = read_ahead_finish(stl, &ra, next < end, next_len);
+        prev = buf;
+        prev_addr = cur;
+        prev_len = cur_len;
+        cur = next;
+        cur_len = next_len;
+    }
+    if (ret == 0 && prev != NULL && sink(opaque, prev_addr, prev, prev_len) != 0) {
+        STLINK_ERR(SWIM, "%s: sink failed at 0x%06" PRIx32, __func__, prev_addr);
+        ret = -1;
+    }
+
+    stlink_buffer_free(stl, bufs[0]);
+    stlink_buffer_free(stl, bufs[1]);
+    return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef STLINK_READ_H
+#define STLINK_READ_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stlink-libusb.h"
+
+
+// Receives consecutive chunks in address order; non-zero aborts the read.
+typedef int (*stlink_sink_fn)(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len);
+
+typedef struct STLinkMemorySink {
+    uint8_t *buffer;
+    uint32_t base;
+    uint32_t size;
+} stlink_memory_sink;
+
+int stlink_sink_file(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len);
+int stlink_sink_memory(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len);
+int stlink_sink_crc32(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len);
+
+uint32_t stlink_crc32(uint32_t crc, const uint8_t *data, size_t len);
+
+int stlink_swim_read_range(stlink *stl, uint32_t addr, uint32_t len,
+                           stlink_sink_fn sink, void *opaque);
+
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Error recovery
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Failures are classified where they are seen and recovered from at the
+ * lowest level that can, rather than by reconnecting:
+ *
+ *  - a stalled endpoint is cleared and the transfer repeated;
+ *  - a CSW with the tag of an earlier command is skipped once;
+ *  - timeouts, phase errors and anything else that leaves the bulk-only
+ *    protocol out of step get a mass storage reset (BOT 5.3.4), after
+ *    which the whole command is repeated if it is idempotent, i.e. a
+ *    status query or read; a write may already have reached the target,
+ *    where repeating e.g. an unlock key would lock the memory, so its
+ *    failure is left to the caller;
+ *  - SWIM status 0x04, the target having dropped out of SWIM, gets the
+ *    prologue re-run if enabled with stlink_recovery_set_reenter(); every
+ *    third time, at the next slower SWIM speed.  The prologue resets the
+ *    target and relocks flash and EEPROM, so only a single read is simply
+ *    repeated.  Sequences that depend on earlier steps, such as unlocking
+ *    and programming a flash block, are marked as such and start over as a
+ *    whole, see stlink_flash_unlock_program(); single writes are not
+ *    repeated.
+ *
+ * Failed commands are not repeated, as the ST-Link rejected them.
+ */
+
+#include "stlink-recover.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-session.h"
+
+
+static const char *const failure_names[STLINK_FAILURES] = {
+    [STLINK_FAILURE_TIMEOUT]     = "timeout",
+    [STLINK_FAILURE_STALL]       = "stall",
+    [STLINK_FAILURE_PHASE]       = "phase error",
+    [STLINK_FAILURE_TAG]         = "tag mismatch",
+    [STLINK_FAILURE_COMMAND]     = "command failed",
+    [STLINK_FAILURE_NO_PROLOGUE] = "missing prologue",
+    [STLINK_FAILURE_IO]          = "I/O error",
+};
+
+static const char *const recovery_names[STLINK_RECOVERIES] = {
+    [STLINK_RECOVERY_CLEAR_HALT] = "clear halt",
+    [STLINK_RECOVERY_RESYNC]     = "resync",
+    [STLINK_RECOVERY_RESET]      = "mass storage reset",
+    [STLINK_RECOVERY_PROLOGUE]   = "SWIM prologue",
+};
+
+const char *stlink_failure_name(enum STLinkFailure failure)
+{
+    return (failure < STLINK_FAILURES) ? failure_names[failure] : "unknown";
+}
+
+const char *stlink_recovery_name(enum STLinkRecovery recovery)
+{
+    return (recovery < STLINK_RECOVERIES) ? recovery_names[recovery] : "unknown";
+}
+
+void stlink_recovery_failed(stlink *stl, enum STLinkFailure failure)
+{
+    stl->recovery.failures[failure]++;
+}
+
+void stlink_recovery_succeeded(stlink *stl, enum STLinkRecovery recovery)
+{
+    STLINK_INFO(TRANSPORT, "recovered by %s", recovery_names[recovery]);
+    stl->recovery.recoveries[recovery]++;
+}
+
+void stlink_recovery_gave_up(stlink *stl)
+{
+    stl->recovery.unrecovered++;
+}
+
+// Bulk-Only Mass Storage Reset, then both endpoints are cleared.
+int stlink_recover_transport(stlink *stl)
+{
+    STLINK_WARN(TRANSPORT, "resetting the mass storage interface...");
+    if (stl->ops->reset != NULL && stl->ops->reset(stl) != LIBUSB_SUCCESS) {
+        STLINK_ERR(TRANSPORT, "%s: reset failed", __func__);
+        return -1;
+    }
+    if (stl->ops->clear_halt(stl, stl->endpoint_in) != LIBUSB_SUCCESS ||
+        stl->ops->clear_halt(stl, stl->endpoint_out) != LIBUSB_SUCCESS) {
+        STLINK_ERR(TRANSPORT, "%s: clearing halts failed", __func__);
+        return -1;
+    }
+    return 0;
+}
+
+void stlink_recovery_set_reenter(stlink *stl, bool enable)
+{
+    stl->swim_reenter = enable;
+}
+
+static int recover_prologue(stlink *stl)
+{
+    if (stl->swim_error != STLINK_SWIM_NO_PROLOGUE || stl->recovering || !stl->swim_reenter)
+        return -1;
+    stl->swim_error = STLINK_SWIM_OK;
+    stlink_recovery_failed(stl, STLINK_FAILURE_NO_PROLOGUE);
+    if (++stl->swim_speed_errors >= STLINK_SWIM_SPEED_ERRORS &&
+        stl->swim_speed + 1 < STLINK_SWIM_SPEEDS) {
+        stl->swim_speed++;
+        stl->swim_speed_errors = 0;
+        stl->poll.swim_bitrate = stlink_swim_speed_bitrate(stl->swim_speed, 0x00);
+        STLINK_WARN(SWIM, "falling back to %s speed", stlink_swim_speed_name(stl->swim_speed));
+    }
+    STLINK_WARN(SWIM, "target left SWIM, re-running the prologue...");
+    stl->recovering = true;
+    int ret = stlink_swim_prologue(stl, NULL);
+    stl->recovering = false;
+    if (ret != 0) {
+        stlink_recovery_gave_up(stl);
+        return -1;
+    }
+    stlink_recovery_succeeded(stl, STLINK_RECOVERY_PROLOGUE);
+    return 0;
+}
+
+/*
+ * Re-runs the prologue if the last SWIM read failed for the lack of one.
+ * Returns 0 if the read is worth repeating, never within a sequence.
+ */
+int stlink_recover_swim(stlink *stl)
+{
+    if (stl->sequence > 0)
+        return -1;
+    return recover_prologue(stl);
+}
+
+// The same for the sequence being run, which must then start over.
+int stlink_recover_sequence(stlink *stl)
+{
+    return recover_prologue(stl);
+}
+
+const stlink_recovery_stats *stlink_recovery_get_stats(stlink *stl)
+{
+    return &stl->recovery;
+}
+
+void stlink_recovery_reset_stats(stlink *stl)
+{
+    memset(&stl->recovery, 0, sizeof(stl->recovery));
+}
+
+void stlink_recovery_dump_stats(stlink *stl, FILE *f)
+{
+    const stlink_recovery_stats *stats = &stl->recovery;
+    for (int i = 0; i < STLINK_FAILURES; i++) {
+        if (stats->failures[i] > 0)
+            fprintf(f, "%s: %" PRIu32 "\n", failure_names[i], stats->failures[i]);
+    }
+    for (int i = 0; i < STLINK_RECOVERIES; i++) {
+        if (stats->recoveries[i] > 0)
+            fprintf(f, "recovered by %s: %" PRIu32 "\n", recovery_names[i], stats->recoveries[i]);
+    }
+    if (stats->unrecovered > 0)
+        fprintf(f, "unrecovered: %" PRIu32 "\n", stats->unrecovered);
+}
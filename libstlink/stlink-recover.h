@@ -0,0 +1,52 @@
+#ifndef STLINK_RECOVER_H
+#define STLINK_RECOVER_H
+
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "stlink-libusb.h"
+
+
+enum STLinkFailure {
+    STLINK_FAILURE_TIMEOUT,     // USB transfer timed out
+    STLINK_FAILURE_STALL,       // endpoint halted
+    STLINK_FAILURE_PHASE,       // phase error, malformed CSW or short transfer
+    STLINK_FAILURE_TAG,         // CSW of another command
+    STLINK_FAILURE_COMMAND,     // command failed, sense data logged
+    STLINK_FAILURE_NO_PROLOGUE, // SWIM status 0x04
+    STLINK_FAILURE_IO,          // anything else, e.g. the probe is gone
+    STLINK_FAILURES,
+};
+
+// From the lowest level up
+enum STLinkRecovery {
+    STLINK_RECOVERY_CLEAR_HALT, // endpoint halt cleared, transfer repeated
+    STLINK_RECOVERY_RESYNC,     // stale CSW skipped
+    STLINK_RECOVERY_RESET,      // mass storage reset, command repeated
+    STLINK_RECOVERY_PROLOGUE,   // SWIM prologue re-run, operation repeated
+    STLINK_RECOVERIES,
+};
+
+typedef struct STLinkRecoveryStats {
+    uint32_t failures[STLINK_FAILURES];
+    uint32_t recoveries[STLINK_RECOVERIES]; // successful ones only
+    uint32_t unrecovered;
+} stlink_recovery_stats;
+
+/*
+ * Lets reads, and sequences such as flash programming, re-run the prologue
+ * should the target drop out of SWIM.  Off by default, since the prologue
+ * resets the target, which must not happen behind a debugger's back.
+ */
+void stlink_recovery_set_reenter(stlink *stl, bool enable);
+
+const stlink_recovery_stats *stlink_recovery_get_stats(stlink *stl);
+void stlink_recovery_reset_stats(stlink *stl);
+void stlink_recovery_dump_stats(stlink *stl, FILE *f);
+const char *stlink_failure_name(enum STLinkFailure failure);
+const char *stlink_recovery_name(enum STLinkRecovery recovery);
+
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * SWIM debug session setup and teardown
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * The prologue puts the target into SWIM debug mode with the core reset
+ * and stalled, the epilogue lets it run again.  Both are sent as batches,
+ * each operation together with its first busy poll.
+ * Command 0x03 selects the ST-Link's SWIM speed, 0x01 being high speed.
+ * Between sessions, sending just the entry sequence tells whether a target
+ * is attached at all, so that boards can be swapped on a probe.
+ */
+
+#include "stlink-session.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-batch.h"
+#include "stlink-memcache.h"
+#include "stm8.h"
+
+
+static uint8_t session_csr_hs(stlink *stl)
+{
+    return (stl->swim_speed == STLINK_SWIM_SPEED_HIGH) ? STM8_SWIM_CSR_HS : 0;
+}
+
+// info may be NULL.  Enters SWIM at the speed set with stlink_swim_set_speed().
+int stlink_swim_prologue(stlink *stl, stlink_swim_target_info *info)
+{
+    stlink_swim_target_info dummy;
+    if (info == NULL)
+        info = &dummy;
+
+    stlink_batch *batch = stlink_batch_new(stl);
+    if (batch == NULL)
+        return -1;
+
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_07);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_08);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_07);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_04); // causes demo to stop blinking
+    stlink_batch_swim_do_03(batch, 0x00);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_05);
+
+    // 0xa0
+    stlink_batch_swim_write_byte(batch, STM8_SWIM_CSR,
+                                 STM8_SWIM_CSR_SAFE_MASK |
+                                 STM8_SWIM_CSR_SWIM_DM);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_08);
+
+    stlink_batch_swim_read(batch, STM8_DM_CSR2, 1, &info->dm_csr2);
+
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_06);
+    if (stl->swim_speed == STLINK_SWIM_SPEED_HIGH) {
+        // 0xb0, then the ST-Link follows
+        stlink_batch_swim_write_byte(batch, STM8_SWIM_CSR,
+                                     STM8_SWIM_CSR_SAFE_MASK |
+                                     STM8_SWIM_CSR_SWIM_DM |
+                                     STM8_SWIM_CSR_HS);
+        stlink_batch_swim_do_03(batch, 0x01);
+    }
+    // 0xb4, or 0xa4 at low speed
+    stlink_batch_swim_write_byte(batch, STM8_SWIM_CSR,
+                                 STM8_SWIM_CSR_SAFE_MASK |
+                                 STM8_SWIM_CSR_SWIM_DM |
+                                 session_csr_hs(stl) |
+                                 STM8_SWIM_CSR_RST);
+
+    stlink_batch_swim_write_byte(batch, STM8S105_CLK_CKDIVR, 0x00);
+
+    // ??? boot ROM
+    stlink_batch_swim_read(batch, 0x67f0, 6, info->rom);
+    // ??? reserved (between GPIO and periph. reg. and boot ROM)
+    stlink_batch_swim_read(batch, 0x5808, 1, &info->reserved);
+    // ??? option bytes
+    stlink_batch_swim_read(batch, 0x488e, 2, info->opt);
+    // Read-out protection (ROP)
+    stlink_batch_swim_read(batch, STM8S105_OPT0, 1, &info->rop);
+    // User boot code (UBC)
+    stlink_batch_swim_read(batch, STM8S105_OPT1, 1, &info->ubc[0]);
+    stlink_batch_swim_read(batch, STM8S105_NOPT1, 1, &info->ubc[1]);
+
+    // the core reset relocks flash and EEPROM
+    stl->flash_unlocked = 0;
+    int ret = stlink_batch_submit(batch);
+    stlink_batch_free(batch);
+    return ret;
+}
+
+// swim_csr may be NULL.
+int stlink_swim_epilogue(stlink *stl, uint8_t *swim_csr)
+{
+    uint8_t dummy;
+    if (swim_csr == NULL)
+        swim_csr = &dummy;
+
+    stlink_batch *batch = stlink_batch_new(stl);
+    if (batch == NULL)
+        return -1;
+
+    stlink_batch_swim_read(batch, STM8_SWIM_CSR, 1, swim_csr);
+
+    // 0xb6, or 0xa6 at low speed
+    stlink_batch_swim_write_byte(batch, STM8_SWIM_CSR,
+                                 STM8_SWIM_CSR_SAFE_MASK |
+                                 STM8_SWIM_CSR_SWIM_DM |
+                                 session_csr_hs(stl) |
+                                 STM8_SWIM_CSR_RST |
+                                 STM8_SWIM_CSR_HSIT);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_05);
+    // demo resumes blinking
+    stlink_batch_swim_do_03(batch, 0x00);
+    stlink_batch_swim_do(batch, STLINK_SWIM_DO_07);
+    // demo stops blinking
+
+    int ret = stlink_batch_submit(batch);
+    stlink_batch_free(batch);
+    return ret;
+}
+
+/*
+ * Sends the entry sequence and reads SWIM_CSR back.  Returns 1 if a target
+ * answers, 0 if none does and -1 on transport errors.  A target found is
+ * left as the epilogue leaves it; the prologue still has to be run.
+ */
+int stlink_swim_target_present(stlink *stl)
+{
+    // whatever answers may be another board
+    stlink_memcache_flush(stl);
+    uint8_t status;
+    if (stlink_swim_do_07(stl) != 0 || stlink_swim_wait_status(stl, &status) != 0)
+        return -1;
+    if (status != STLINK_SWIM_OK)
+        return 0;
+    if (stlink_swim_begin_read(stl, STM8_SWIM_CSR, 1) != 0 ||
+        stlink_swim_wait_status(stl, &status) != 0)
+        return -1;
+    if (status != STLINK_SWIM_OK)
+        return 0;
+    uint8_t csr;
+    return (stlink_swim_read(stl, 1, &csr) == 0) ? 1 : -1;
+}
@@ -0,0 +1,25 @@
+#ifndef STLINK_SESSION_H
+#define STLINK_SESSION_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+// Target state read while entering debug mode
+typedef struct STLinkSWIMTargetInfo {
+    uint8_t dm_csr2;
+    uint8_t rom[6];         // boot ROM at 0x67f0
+    uint8_t reserved;       // 0x5808
+    uint8_t opt[2];         // 0x488e
+    uint8_t rop;            // read-out protection
+    uint8_t ubc[2];         // user boot code, OPT1 and NOPT1
+} stlink_swim_target_info;
+
+int stlink_swim_prologue(stlink *stl, stlink_swim_target_info *info);
+int stlink_swim_epilogue(stlink *stl, uint8_t *swim_csr);
+int stlink_swim_target_present(stlink *stl);
+
+
+#endif
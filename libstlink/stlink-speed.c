@@ -0,0 +1,145 @@
+/*
+ * SWIM speed negotiation
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * The prologue switches both ends of the SWIM line to the selected speed:
+ * the target with SWIM_CSR.HS, the ST-Link with SWIM command 0x03.  Long
+ * or noisy cables may not carry high speed, which then shows as corrupted
+ * data rather than as failed commands.  stlink_swim_negotiate() therefore
+ * enters SWIM at each speed in turn, fastest first, and keeps the first
+ * one that reads back a test pattern written to RAM intact.  The bit rate
+ * follows from the HSI, the SWIM clock divider in CLK_SWIMCCR and the
+ * clocks per bit of the speed.
+ *
+ * Should the target keep dropping out of SWIM later on, error recovery
+ * drops to the next slower speed, see stlink_recover_swim().
+ */
+
+#include "stlink-speed.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-session.h"
+#include "stm8.h"
+
+
+// Above the flash loader, below the stack of parts with 1 KiB of RAM
+#define SPEED_TEST_ADDR 0x0360
+#define SPEED_TEST_SIZE 128
+
+static const char *const speed_names[STLINK_SWIM_SPEEDS] = {
+    [STLINK_SWIM_SPEED_HIGH] = "high",
+    [STLINK_SWIM_SPEED_LOW]  = "low",
+};
+
+const char *stlink_swim_speed_name(enum STLinkSWIMSpeed speed)
+{
+    return (speed < STLINK_SWIM_SPEEDS) ? speed_names[speed] : "unknown";
+}
+
+enum STLinkSWIMSpeed stlink_swim_get_speed(stlink *stl)
+{
+    return stl->swim_speed;
+}
+
+void stlink_swim_set_speed(stlink *stl, enum STLinkSWIMSpeed speed)
+{
+    stl->swim_speed = speed;
+    stl->swim_speed_errors = 0;
+}
+
+uint32_t stlink_swim_speed_bitrate(enum STLinkSWIMSpeed speed, uint8_t swimccr)
+{
+    uint32_t clock = STM8_HSI_HZ;
+    if (!(swimccr & STM8_CLK_SWIMCCR_SWIMCLK))
+        clock /= 2;
+    return clock / ((speed == STLINK_SWIM_SPEED_HIGH) ? STM8_SWIM_HS_CYCLES : STM8_SWIM_LS_CYCLES);
+}
+
+// Bit patterns most likely to suffer from slow edges
+static void speed_pattern(uint8_t *buf, int len)
+{
+    for (int i = 0; i < len; i++) {
+        uint8_t walk = 1 << ((i / 4) % 8);
+        switch (i % 4) {
+        case 0: buf[i] = 0x55; break;
+        case 1: buf[i] = 0xaa; break;
+        case 2: buf[i] = walk; break;
+        case 3: buf[i] = ~walk; break;
+        }
+    }
+}
+
+// Neither cached nor recovered, so that any error shows.
+static int speed_write(stlink *stl, uint32_t addr, uint16_t len, uint8_t *buf)
+{
+    if (stlink_swim_write(stl, addr, len, buf) != 0)
+        return -1;
+    return stlink_swim_wait(stl);
+}
+
+static int speed_test(stlink *stl, uint32_t *bytes_per_second)
+{
+    uint8_t saved[SPEED_TEST_SIZE];
+    uint8_t pattern[SPEED_TEST_SIZE];
+    uint8_t readback[SPEED_TEST_SIZE];
+    speed_pattern(pattern, sizeof(pattern));
+    if (stlink_swim_read_once(stl, SPEED_TEST_ADDR, sizeof(saved), saved) != 0 ||
+        speed_write(stl, SPEED_TEST_ADDR, sizeof(pattern), pattern) != 0)
+        return -1;
+    uint64_t start = stlink_time_us();
+    int ret = stlink_swim_read_once(stl, SPEED_TEST_ADDR, sizeof(readback), readback);
+    uint64_t elapsed = stlink_time_us() - start;
+    if (ret != 0 || speed_write(stl, SPEED_TEST_ADDR, sizeof(saved), saved) != 0)
+        return -1;
+    for (int i = 0; i < SPEED_TEST_SIZE; i++) {
+        if (readback[i] != pattern[i]) {
+            STLINK_WARN(SWIM, "%s: read 0x%02" PRIX8 " at 0x%06X, expected 0x%02" PRIX8,
+                        __func__, readback[i], SPEED_TEST_ADDR + i, pattern[i]);
+            return -1;
+        }
+    }
+    *bytes_per_second = (elapsed > 0) ? SPEED_TEST_SIZE * 1000000 / elapsed : 0;
+    return 0;
+}
+
+/*
+ * Re-enters SWIM at the fastest speed that passes the test pattern, leaving
+ * the target stalled as after stlink_swim_prologue().  link may be NULL.
+ */
+int stlink_swim_negotiate(stlink *stl, stlink_swim_link *link)
+{
+    stlink_swim_link dummy;
+    if (link == NULL)
+        link = &dummy;
+    memset(link, 0, sizeof(stlink_swim_link));
+
+    for (int speed = 0; speed < STLINK_SWIM_SPEEDS; speed++) {
+        link->attempts++;
+        stlink_swim_set_speed(stl, speed);
+        if (stlink_swim_prologue(stl, NULL) != 0 ||
+            stlink_swim_read_once(stl, STM8S105_CLK_SWIMCCR, 1, &link->swimccr) != 0 ||
+            speed_test(stl, &link->bytes_per_second) != 0) {
+            STLINK_WARN(SWIM, "%s speed failed", speed_names[speed]);
+            continue;
+        }
+        link->speed = speed;
+        link->swim_clock = STM8_HSI_HZ / ((link->swimccr & STM8_CLK_SWIMCCR_SWIMCLK) ? 1 : 2);
+        link->bitrate = stlink_swim_speed_bitrate(speed, link->swimccr);
+        stl->poll.swim_bitrate = link->bitrate;
+        STLINK_INFO(SWIM, "%s speed, %" PRIu32 " bit/s, %" PRIu32 " bytes/s effective",
+                    speed_names[speed], link->bitrate, link->bytes_per_second);
+        return 0;
+    }
+    STLINK_ERR(SWIM, "%s: no working SWIM speed", __func__);
+    return -1;
+}
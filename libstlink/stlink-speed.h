@@ -0,0 +1,33 @@
+#ifndef STLINK_SPEED_H
+#define STLINK_SPEED_H
+
+
+#include <stdint.h>
+
+#include "stlink-libusb.h"
+
+
+// Fastest first
+enum STLinkSWIMSpeed {
+    STLINK_SWIM_SPEED_HIGH, // SWIM_CSR.HS, 10 SWIM clocks per bit
+    STLINK_SWIM_SPEED_LOW,  // 22 SWIM clocks per bit
+    STLINK_SWIM_SPEEDS,
+};
+
+typedef struct STLinkSWIMLink {
+    enum STLinkSWIMSpeed speed;
+    uint8_t swimccr;            // CLK_SWIMCCR as found
+    uint32_t swim_clock;        // Hz
+    uint32_t bitrate;           // nominal bit/s
+    uint32_t bytes_per_second;  // measured on the test pattern readback
+    int attempts;               // speeds tried
+} stlink_swim_link;
+
+const char *stlink_swim_speed_name(enum STLinkSWIMSpeed speed);
+enum STLinkSWIMSpeed stlink_swim_get_speed(stlink *stl);
+// Takes effect with the next prologue.
+void stlink_swim_set_speed(stlink *stl, enum STLinkSWIMSpeed speed);
+int stlink_swim_negotiate(stlink *stl, stlink_swim_link *link);
+
+
+#endif
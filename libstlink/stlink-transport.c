@@ -0,0 +1,72 @@
+/*
+ * Pluggable transport backends
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Everything above the bulk-only transport only talks to the backend
+ * through its STLinkTransportOps, so an stlink can sit on libusb, the
+ * built-in emulator or anything else that moves CBWs, data and CSWs.
+ */
+
+#include "stlink-transport.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stlink-internal.h"
+
+
+stlink *stlink_alloc(const STLinkTransportOps *ops, void *opaque)
+{
+    stlink *stl = malloc(sizeof(stlink));
+    if (stl == NULL)
+        return NULL;
+    memset(stl, 0, sizeof(stlink));
+    stl->ops = ops;
+    stl->opaque = opaque;
+    stl->async_depth = STLINK_ASYNC_DEPTH;
+    stlink_poll_init(stl);
+    return stl;
+}
+
+stlink *stlink_open_transport(const STLinkTransportOps *ops, void *opaque,
+                              uint8_t endpoint_in, uint8_t endpoint_out)
+{
+    stlink *stl = stlink_alloc(ops, opaque);
+    if (stl == NULL)
+        return NULL;
+    stl->endpoint_in = endpoint_in;
+    stl->endpoint_out = endpoint_out;
+    if (stlink_init_buffers(stl) != 0) {
+        free(stl);
+        return NULL;
+    }
+    STLINK_DBG(TRANSPORT, "using %s transport", ops->name);
+    return stl;
+}
+
+void *stlink_get_transport_opaque(stlink *stl)
+{
+    return stl->opaque;
+}
+
+const char *stlink_get_transport_name(stlink *stl)
+{
+    return stl->ops->name;
+}
+
+void stlink_close(stlink *stl)
+{
+    if (stl == NULL)
+        return;
+
+    if (stl->async_pending > 0)
+        stlink_wait_commands(stl, 0);
+    stlink_memcache_enable(stl, false);
+    stlink_free_buffers(stl);
+    stl->ops->close(stl);
+    free(stl);
+}
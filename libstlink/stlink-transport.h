@@ -0,0 +1,74 @@
+#ifndef STLINK_TRANSPORT_H
+#define STLINK_TRANSPORT_H
+
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "stlink-libusb.h"
+
+
+// Command Block Wrapper (CBW)
+typedef struct CommandBlockWrapper {
+    uint32_t    dCBWSignature;
+    uint32_t    dCBWTag;
+    uint32_t    dCBWDataTransferLength;
+    uint8_t     bmCBWFlags;
+    uint8_t     bCBWLUN;
+    uint8_t     bCBWCBLength;
+    uint8_t     CBWCB[16];
+} __attribute__((packed)) USBCommandBlockWrapper;
+
+#define USB_CBW_SIGNATURE 0x43425355
+
+// Command Status Wrapper (CSW)
+typedef struct CommandStatusWrapper {
+    uint32_t    dCSWSignature;
+    uint32_t    dCSWTag;
+    uint32_t    dCSWDataResidue;
+    uint8_t     bCSWStatus;
+} __attribute__((packed)) USBCommandStatusWrapper;
+
+#define USB_CSW_SIGNATURE 0x53425355
+
+enum {
+    USB_CSW_STATUS_COMMAND_PASSED   = 0x00,
+    USB_CSW_STATUS_COMMAND_FAILED   = 0x01,
+    USB_CSW_STATUS_PHASE_ERROR      = 0x02,
+};
+
+/*
+ * Bulk-only transport backend.
+ * Return values follow libusb conventions (LIBUSB_SUCCESS, LIBUSB_ERROR_*);
+ * asynchronous transfers are plain libusb_transfer structs whose callback
+ * is invoked from handle_events().  close() releases the backend's opaque
+ * state and is called from stlink_close().
+ */
+typedef struct STLinkTransportOps {
+    const char *name;
+    int (*bulk_transfer)(stlink *stl, uint8_t endpoint, uint8_t *data, int length,
+                         int *transferred, unsigned int timeout);
+    int (*clear_halt)(stlink *stl, uint8_t endpoint);
+    int (*submit_transfer)(stlink *stl, struct libusb_transfer *transfer);
+    int (*cancel_transfer)(stlink *stl, struct libusb_transfer *transfer);
+    int (*handle_events)(stlink *stl, struct timeval *tv);
+    void (*close)(stlink *stl);
+    // optional, for transfer buffers; malloc() and free() otherwise
+    uint8_t *(*mem_alloc)(stlink *stl, size_t length);
+    void (*mem_free)(stlink *stl, uint8_t *buffer, size_t length);
+    // optional, Bulk-Only Mass Storage Reset of the interface
+    int (*reset)(stlink *stl);
+} STLinkTransportOps;
+
+/*
+ * Opens an stlink on top of a custom backend.  ops must outlive the stlink.
+ * On failure opaque is left to the caller.
+ */
+stlink *stlink_open_transport(const STLinkTransportOps *ops, void *opaque,
+                              uint8_t endpoint_in, uint8_t endpoint_out);
+void *stlink_get_transport_opaque(stlink *stl);
+const char *stlink_get_transport_name(stlink *stl);
+
+
+#endif
@@ -0,0 +1,244 @@
+/*
+ * Flash verification
+ *
+ * Copyright (c) 2011 Andreas Färber <andreas.faerber@web.de>
+ *
+ * Licensed under the GNU Lesser General Public License (LGPL) version 2.1,
+ * or (at your option) any later version.
+ *
+ * Readback verification streams the range through stlink_swim_read_range(),
+ * so each chunk is checksummed and compared while the next one is still on
+ * the wire.  Alternatively a small routine uploaded to target RAM computes
+ * the CRC in place and only its four bytes are read back; if the target
+ * does not report back in time, verification falls back to readback.
+ */
+
+#include "stlink-verify.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "stlink.h"
+#include "stlink-internal.h"
+#include "stlink-poll.h"
+#include "stlink-read.h"
+#include "stm8.h"
+
+
+// Mailbox shared with the stub, big-endian like the STM8 itself
+enum {
+    VERIFY_MAILBOX      = 0x0020,
+    VERIFY_BOX_ADDR     = 0x0020, // 16-bit start address
+    VERIFY_BOX_LEN      = 0x0022, // 16-bit length
+    VERIFY_BOX_CRC      = 0x0024, // running CRC, not yet inverted
+    VERIFY_BOX_BITS     = 0x0028, // bit counter
+    VERIFY_BOX_DONE     = 0x0029, // set to 1 when finished
+    VERIFY_BOX_SIZE     = 10,
+    VERIFY_STUB_ADDR    = 0x0030,
+};
+
+/*
+ * Bitwise CRC-32 (reflected, 0xEDB88320) over [addr, addr + len), as
+ * stlink_crc32() computes it.  Spins once done, until stalled again.
+ *
+ *  0030  BE 20        ldw   x, $20
+ *  0032  90 BE 22     ldw   y, $22
+ *  0035  F6           ld    a, (x)          ; byte loop
+ *  0036  B8 27        xor   a, $27
+ *  0038  B7 27        ld    $27, a
+ *  003A  A6 08        ld    a, #8
+ *  003C  B7 28        ld    $28, a
+ *  003E  34 24        srl   $24             ; bit loop
+ *  0040  36 25        rrc   $25
+ *  0042  36 26        rrc   $26
+ *  0044  36 27        rrc   $27
+ *  0046  24 18        jrnc  $0060
+ *  0048  B6 24 A8 ED B7 24   $24 ^= 0xED
+ *  004E  B6 25 A8 B8 B7 25   $25 ^= 0xB8
+ *  0054  B6 26 A8 83 B7 26   $26 ^= 0x83
+ *  005A  B6 27 A8 20 B7 27   $27 ^= 0x20
+ *  0060  3A 28        dec   $28
+ *  0062  26 DA        jrne  $003E
+ *  0064  5C           incw  x
+ *  0065  90 5A        decw  y
+ *  0067  26 CC        jrne  $0035
+ *  0069  A6 01        ld    a, #1
+ *  006B  B7 29        ld    $29, a
+ *  006D  20 FE        jra   $006D
+ */
+static const uint8_t verify_stub[] = {
+    0xbe, 0x20,
+    0x90, 0xbe, 0x22,
+    0xf6,
+    0xb8, 0x27,
+    0xb7, 0x27,
+    0xa6, 0x08,
+    0xb7, 0x28,
+    0x34, 0x24,
+    0x36, 0x25,
+    0x36, 0x26,
+    0x36, 0x27,
+    0x24, 0x18,
+    0xb6, 0x24, 0xa8, 0xed, 0xb7, 0x24,
+    0xb6, 0x25, 0xa8, 0xb8, 0xb7, 0x25,
+    0xb6, 0x26, 0xa8, 0x83, 0xb7, 0x26,
+    0xb6, 0x27, 0xa8, 0x20, 0xb7, 0x27,
+    0x3a, 0x28,
+    0x26, 0xda,
+    0x5c,
+    0x90, 0x5a,
+    0x26, 0xcc,
+    0xa6, 0x01,
+    0xb7, 0x29,
+    0x20, 0xfe,
+};
+
+// About 110 instructions per byte at 16 MHz, with plenty of headroom
+#define VERIFY_STUB_US_PER_BYTE 20
+#define VERIFY_STUB_SLACK_US    (100 * 1000)
+
+typedef struct VerifySink {
+    const uint8_t *image;
+    uint32_t base;
+    uint32_t crc;
+    uint32_t first_mismatch;
+} VerifySink;
+
+static int verify_sink(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len)
+{
+    VerifySink *vs = opaque;
+    vs->crc = stlink_crc32(vs->crc, data, len);
+    if (vs->first_mismatch != UINT32_MAX)
+        return 0;
+    const uint8_t *expected = vs->image + (addr - vs->base);
+    if (memcmp(data, expected, len) == 0)
+        return 0;
+    for (uint16_t i = 0; i < len; i++) {
+        if (data[i] != expected[i]) {
+            vs->first_mismatch = addr + i;
+            break;
+        }
+    }
+    return 0;
+}
+
+static int verify_readback(stlink *stl, uint32_t addr, uint32_t len,
+                           const uint8_t *image, stlink_verify_result *result)
+{
+    VerifySink vs = {
+        .image = image,
+        .base = addr,
+        .crc = 0,
+        .first_mismatch = UINT32_MAX,
+    };
+    if (stlink_swim_read_range(stl, addr, len, verify_sink, &vs) != 0)
+        return -1;
+    result->crc_actual = vs.crc;
+    result->first_mismatch = vs.first_mismatch;
+    return 0;
+}
+
+static int verify_run_stub(stlink *stl, uint32_t addr, uint32_t len, uint32_t *crc)
+{
+    uint8_t box[VERIFY_BOX_SIZE] = {
+        addr >> 8, addr & 0xff,
+        len >> 8, len & 0xff,
+        0xff, 0xff, 0xff, 0xff,
+        0x00,
+        0x00,
+    };
+    uint8_t pc[3] = { 0x00, VERIFY_STUB_ADDR >> 8, VERIFY_STUB_ADDR & 0xff };
+    uint8_t cc = 0x28; // I1 | I0, interrupts off
+    uint8_t csr2;
+    if (stlink_swim_write_wait(stl, VERIFY_STUB_ADDR, sizeof(verify_stub),
+                               (uint8_t *)verify_stub) != 0 ||
+        stlink_swim_write_wait(stl, VERIFY_MAILBOX, sizeof(box), box) != 0 ||
+        stlink_swim_write_wait(stl, STM8_REG_PCE, sizeof(pc), pc) != 0 ||
+        stlink_swim_write_wait(stl, STM8_REG_CC, 1, &cc) != 0)
+        return -1;
+
+    // flush the prefetched instructions, then let the core run
+    csr2 = STM8_DM_CSR2_STALL | STM8_DM_CSR2_FLUSH;
+    if (stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2) != 0)
+        return -1;
+    csr2 = STM8_DM_CSR2_FLUSH;
+    if (stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2) != 0)
+        return -1;
+
+    uint64_t start = stlink_time_us();
+    uint64_t deadline = start + VERIFY_STUB_SLACK_US + (uint64_t)len * VERIFY_STUB_US_PER_BYTE;
+    uint64_t delay = 1000;
+    int ret = -1;
+    for (;;) {
+        uint8_t done;
+        if (stlink_swim_read_wait(stl, VERIFY_BOX_DONE, 1, &done) != 0)
+            break;
+        if (done == 1) {
+            ret = 0;
+            break;
+        }
+        if (stlink_time_us() >= deadline) {
+            STLINK_WARN(FLASH, "%s: no checksum from target after %" PRIu64 " ms", __func__,
+                        (stlink_time_us() - start) / 1000);
+            break;
+        }
+        stlink_sleep_us(delay);
+        if (delay < 16 * 1000)
+            delay *= 2;
+    }
+
+    csr2 = STM8_DM_CSR2_STALL;
+    if (stlink_swim_write_wait(stl, STM8_DM_CSR2, 1, &csr2) != 0 || ret != 0)
+        return -1;
+
+    uint8_t val[4];
+    if (stlink_swim_read_wait(stl, VERIFY_BOX_CRC, sizeof(val), val) != 0)
+        return -1;
+    *crc = ~((uint32_t)val[0] << 24 | (uint32_t)val[1] << 16 | (uint32_t)val[2] << 8 | val[3]);
+    return 0;
+}
+
+/*
+ * Checks [addr, addr + len) against image.  Returns 0 if they match and -1
+ * on mismatch or error; result may be NULL.
+ */
+int stlink_verify(stlink *stl, uint32_t addr, const uint8_t *image, uint32_t len,
+                  enum STLinkVerifyMode mode, stlink_verify_result *result)
+{
+    stlink_verify_result dummy;
+    if (result == NULL)
+        result = &dummy;
+    memset(result, 0, sizeof(stlink_verify_result));
+    result->first_mismatch = UINT32_MAX;
+
+    uint64_t start = stlink_time_us();
+    result->crc_expected = stlink_crc32(0, image, len);
+
+    int ret = -1;
+    if (mode == STLINK_VERIFY_ON_TARGET) {
+        if (len == 0 || len > 0xffff || addr + len > 0x10000) {
+            STLINK_WARN(FLASH, "%s: range not reachable by the target stub", __func__);
+        } else if (verify_run_stub(stl, addr, len, &result->crc_actual) == 0) {
+            result->on_target = true;
+            ret = 0;
+        }
+        if (ret != 0)
+            STLINK_INFO(FLASH, "falling back to readback...");
+    }
+    if (ret != 0)
+        ret = verify_readback(stl, addr, len, image, result);
+    result->elapsed_us = stlink_time_us() - start;
+    if (ret != 0)
+        return -1;
+
+    result->match = result->crc_actual == result->crc_expected &&
+                    result->first_mismatch == UINT32_MAX;
+    if (!result->match) {
+        STLINK_ERR(FLASH, "%s: CRC 0x%08" PRIx32 " but expected 0x%08" PRIx32, __func__,
+                   result->crc_actual, result->crc_expected);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef STLINK_VERIFY_H
+#define STLINK_VERIFY_H
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stlink-libusb.h"
+
+
+enum STLinkVerifyMode {
+    STLINK_VERIFY_READBACK,     // read back and checksum on the host
+    STLINK_VERIFY_ON_TARGET,    // checksum in target RAM, read back on failure
+};
+
+typedef struct STLinkVerifyResult {
+    bool match;
+    bool on_target;             // checksum was computed by the target
+    uint32_t crc_expected;
+    uint32_t crc_actual;
+    uint32_t first_mismatch;    // address, readback only
+    uint64_t elapsed_us;
+} stlink_verify_result;
+
+int stlink_verify(stlink *stl, uint32_t addr, const uint8_t *image, uint32_t len,
+                  enum STLinkVerifyMode mode, stlink_verify_result *result);
+
+
+#endif
@@ -43,6 +43,13 @@ enum STLinkSWIMCommands {
     STLINK_SWIM_GET_SIZE    = 0x0d,
 };
 
+// first byte of STLINK_SWIM_GET_BUSY
+enum STLinkSWIMStatus {
+    STLINK_SWIM_OK          = 0x00,
+    STLINK_SWIM_BUSY        = 0x01,
+    STLINK_SWIM_NO_PROLOGUE = 0x04,
+};
+
 enum STLinkModes {
     STLINK_DEV_DFU_MODE     = 0x00,
     STLINK_DEV_MASS_MODE    = 0x01,
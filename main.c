@@ -9,9 +9,31 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
 #include "stlink.h"
 #include "stlink-libusb.h"
+#include "stlink-emu.h"
+#include "stlink-poll.h"
+#include "stlink-recover.h"
+#include "stlink-read.h"
+#include "stlink-flash.h"
+#include "stlink-gather.h"
+#include "stlink-gang.h"
+#include "stlink-hotplug.h"
+#include "stlink-image.h"
+#include "stlink-job.h"
+#include "stlink-log.h"
+#include "stlink-memcache.h"
+#include "stlink-patch.h"
+#include "stlink-cache.h"
+#include "stlink-device.h"
+#include "stlink-client.h"
+#include "stlink-session.h"
+#include "stlink-speed.h"
+#include "stlink-verify.h"
 #include "stm8.h"
 
 enum {
@@ -30,296 +52,503 @@ static inline void dump_data(uint8_t *buf, size_t len)
     }
 }
 
-static inline int swim_poll(stlink *stl)
+// Prints each chunk and, given a memory sink, stores it there as well.
+static int dump_sink(void *opaque, uint32_t addr, const uint8_t *data, uint16_t len)
 {
-    int ret;
-    // 01 during read
-    // 04 if missing prologue
-    uint32_t busy;
-    do {
-        ret = stlink_swim_get_busy(stl, &busy);
-    } while ((busy & 0xff) && ret == 0);
-    return ret;
+    dump_data((uint8_t *)data, len);
+    return (opaque != NULL) ? stlink_sink_memory(opaque, addr, data, len) : 0;
 }
 
 #define CHECK_SWIM(x) \
     ret = x; \
     if (ret != 0) \
         return -1; \
-    ret = swim_poll(stl); \
-    if (ret != 0) \
-        return -1
-
-#define SWIM_READ(addr, len, buf) \
-    ret = stlink_swim_begin_read(stl, addr, len); \
-    if (ret != 0) \
-        return -1; \
-    ret = swim_poll(stl); \
-    if (ret != 0) \
-        return -1; \
-    ret = stlink_swim_read(stl, len, buf); \
+    ret = stlink_swim_wait(stl); \
     if (ret != 0) \
         return -1
 
 static int swim_prologue(stlink *stl)
 {
-    int ret;
-    uint8_t buf[2];
+    stlink_swim_target_info info;
+    int ret = stlink_swim_prologue(stl, &info);
+    if (ret != 0)
+        return -1;
 
-    CHECK_SWIM(stlink_swim_do_07(stl));
-    CHECK_SWIM(stlink_swim_do_08(stl));
-    CHECK_SWIM(stlink_swim_do_07(stl));
-    CHECK_SWIM(stlink_swim_do_04(stl)); // causes demo to stop blinking
-    CHECK_SWIM(stlink_swim_do_03(stl, 0x00));
-    CHECK_SWIM(stlink_swim_do_05(stl));
-
-    // 0xa0
-    buf[0] = STM8_SWIM_CSR_SAFE_MASK |
-             STM8_SWIM_CSR_SWIM_DM;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_SWIM_CSR, 1, buf));
-    CHECK_SWIM(stlink_swim_do_08(stl));
-
-    SWIM_READ(STM8_DM_CSR2, 1, buf);
-    dump_data(buf, 1);
-
-    CHECK_SWIM(stlink_swim_do_06(stl));
-    // 0xb0
-    buf[0] = STM8_SWIM_CSR_SAFE_MASK |
-             STM8_SWIM_CSR_SWIM_DM |
-             STM8_SWIM_CSR_HS;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_SWIM_CSR, 1, buf));
-    CHECK_SWIM(stlink_swim_do_03(stl, 0x01));
-    // 0xb4
-    buf[0] = STM8_SWIM_CSR_SAFE_MASK |
-             STM8_SWIM_CSR_SWIM_DM |
-             STM8_SWIM_CSR_HS |
-             STM8_SWIM_CSR_RST;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_SWIM_CSR, 1, buf));
-
-    buf[0] = 0x00;
-    CHECK_SWIM(stlink_swim_write(stl, STM8S105_CLK_CKDIVR, 1, buf));
-
-    // ??? boot ROM
-    SWIM_READ(0x67f0, 6, buf);
-    dump_data(buf, 6);
-
-    // ??? reserved (between GPIO and periph. reg. and boot ROM)
-    SWIM_READ(0x5808, 1, buf);
-    dump_data(buf, 1);
-
-    // ??? option bytes
-    SWIM_READ(0x488e, 2, buf);
-    dump_data(buf, 2);
-
-    // Read-out protection (ROP)
-    SWIM_READ(STM8S105_OPT0, 1, buf);
-    dump_data(buf, 1);
-
-    // User boot code (UBC)
-    SWIM_READ(STM8S105_OPT1, 1, buf);
-    dump_data(buf, 1);
-    SWIM_READ(STM8S105_NOPT1, 1, buf);
-    dump_data(buf, 1);
+    dump_data(&info.dm_csr2, 1);
+    dump_data(info.rom, 6);
+    dump_data(&info.reserved, 1);
+    dump_data(info.opt, 2);
+    dump_data(&info.rop, 1);
+    dump_data(&info.ubc[0], 1);
+    dump_data(&info.ubc[1], 1);
+
+    return 0;
+}
+
+static bool negotiate_speed;
+static const stlink_device *device; // detected if NULL
+static const char *image_path;
+
+static int swim_negotiate(stlink *stl)
+{
+    stlink_swim_link link;
+    if (stlink_swim_negotiate(stl, &link) != 0)
+        return -1;
+    printf("SWIM %s speed after %d attempts: %" PRIu32 " bit/s at %" PRIu32 " Hz SWIM clock,"
+           " %" PRIu32 " bytes/s effective\n", stlink_swim_speed_name(link.speed), link.attempts,
+           link.bitrate, link.swim_clock, link.bytes_per_second);
+    return 0;
+}
 
+// First prologue of a session, settling the SWIM speed and the part.
+static int swim_enter(stlink *stl)
+{
+    int ret = negotiate_speed ? swim_negotiate(stl) : swim_prologue(stl);
+    if (ret != 0)
+        return -1;
+    const stlink_device *dev = device;
+    if (dev == NULL)
+        dev = stlink_device_detect(stl);
+    if (dev == NULL)
+        return -1;
+    stlink_set_device(stl, dev);
+    printf("%s: %" PRIu32 " KiB flash at 0x%06" PRIx32 ", %" PRIu32 " bytes EEPROM at 0x%06" PRIx32
+           ", %" PRIu32 " bytes RAM\n", dev->name, dev->flash_size / 1024, dev->flash_start,
+           dev->eeprom_size, dev->eeprom_start, dev->ram_size);
     return 0;
 }
 
 static int swim_epilogue(stlink *stl)
 {
-    int ret;
-    uint8_t buf[2];
-
-    SWIM_READ(STM8_SWIM_CSR, 1, buf);
-    dump_data(buf, 1);
-
-    // 0xb6
-    buf[0] = STM8_SWIM_CSR_SAFE_MASK |
-             STM8_SWIM_CSR_SWIM_DM |
-             STM8_SWIM_CSR_HS |
-             STM8_SWIM_CSR_RST |
-             STM8_SWIM_CSR_HSIT;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_SWIM_CSR, 1, buf));
-    CHECK_SWIM(stlink_swim_do_05(stl));
-    // demo resumes blinking
-    CHECK_SWIM(stlink_swim_do_03(stl, 0x00));
-    CHECK_SWIM(stlink_swim_do_07(stl));
-    // demo stops blinking
+    uint8_t csr;
+    int ret = stlink_swim_epilogue(stl, &csr);
+    if (ret != 0)
+        return -1;
+
+    dump_data(&csr, 1);
 
     return 0;
 }
 
+static bool use_cache;
+
+// Blocks spot-checked before trusting the cache
+#define CACHE_SAMPLES 4
+
+static stlink_cache *swim_attach_cache(stlink *stl)
+{
+    if (!use_cache)
+        return NULL;
+    stlink_cache *cache = stlink_cache_open_target(stl, NULL);
+    if (cache == NULL)
+        return NULL;
+    if (stlink_cache_validate(stl, cache, CACHE_SAMPLES) < 0) {
+        stlink_cache_close(cache);
+        return NULL;
+    }
+    stlink_set_cache(stl, cache);
+    return cache;
+}
+
+static void swim_detach_cache(stlink *stl, stlink_cache *cache)
+{
+    stlink_set_cache(stl, NULL);
+    stlink_cache_close(cache);
+}
+
 static int swim(stlink *stl)
 {
+    uint8_t *buf = NULL;
+    stlink_cache *cache = NULL;
+    stlink_read_request *opt = NULL;
+
     uint16_t size = 0;
     int ret = stlink_swim_get_size(stl, &size);
     if (ret != 0)
         return -1;
     printf("size = 0x%" PRIx16 "\n", size);
 
-    uint8_t *buf = malloc(size);
+    ret = -1;
+    buf = malloc(size);
+    if (buf == NULL)
+        goto out;
 
-    ret = stlink_swim_get_02(stl, 0x01);
-    if (ret != 0)
-        return -1;
-    CHECK_SWIM(stlink_swim_do_07(stl));
+    if (stlink_swim_get_02(stl, 0x01) != 0)
+        goto out;
+    if (stlink_swim_do_07(stl) != 0 || stlink_swim_wait(stl) != 0)
+        goto out;
 
-    ret = swim_prologue(stl);
-    if (ret != 0)
-        return -1;
+    if (swim_enter(stl) != 0)
+        goto out;
+    cache = swim_attach_cache(stl);
+
+    const stlink_device *dev = stlink_get_device(stl);
 
     // Flash program memory
-    uint32_t flash_start = 0x8000;
-    uint16_t flash_size = 32 * 1024;
-    uint32_t flash_end = flash_start + flash_size;
-    FILE *file = fopen("flash.bin", "w");
-    if (file == NULL)
-        return -1;
-    for (uint32_t addr = flash_start; addr < flash_end; addr += size) {
-        uint16_t len = (addr + size > flash_end) ? (flash_end - addr) : size;
-        ret = stlink_swim_begin_read(stl, addr, len);
-        if (ret != 0) {
-            fclose(file);
-            return -1;
-        }
-        ret = swim_poll(stl);
-        if (ret != 0) {
-            fclose(file);
-            return -1;
-        }
-        ret = stlink_swim_read(stl, len, buf);
-        if (ret != 0) {
-            fclose(file);
-            return -1;
-        }
-        dump_data(buf, len);
-        if (fwrite(buf, 1, len, file) < len) {
-            fclose(file);
+    stlink_memory_sink dump;
+    if (stlink_image_create_dump("flash.bin", dev->flash_start, dev->flash_size, &dump) != 0)
+        goto out;
+    int err = stlink_cache_read(stl, dev->flash_start, dev->flash_size, dump_sink, &dump);
+    stlink_image_close_dump(&dump);
+    if (err != 0)
+        goto out;
+
+    if (swim_epilogue(stl) != 0)
+        goto out;
+
+    // ---
+
+    if (swim_prologue(stl) != 0)
+        goto out;
+
+    if (stlink_cache_read(stl, dev->eeprom_start, dev->eeprom_size, dump_sink, NULL) != 0)
+        goto out;
+
+    if (swim_epilogue(stl) != 0)
+        goto out;
+
+    // ---
+
+    if (swim_prologue(stl) != 0)
+        goto out;
+
+    // Option bytes, skipping the unused part of the option area
+    opt = calloc(dev->option_size + 1, sizeof(stlink_read_request));
+    if (opt == NULL || size < dev->option_size + 1)
+        goto out;
+    int opt_count = 0;
+    for (uint32_t i = 0; i < dev->option_size; i++) {
+        opt[opt_count++] = (stlink_read_request){ dev->option_start + i, 1, buf + i };
+    }
+    if (dev->optbl != 0) {
+        opt[opt_count] = (stlink_read_request){ dev->optbl, 1, buf + opt_count };
+        opt_count++;
+    }
+    int reads;
+    if (stlink_swim_read_gather(stl, opt, opt_count, STLINK_GATHER_DEFAULT_GAP, &reads) != 0)
+        goto out;
+    for (int i = 0; i < opt_count; i++) {
+        dump_data(opt[i].buffer, 1);
+    }
+    printf("%d option bytes in %d reads\n", opt_count, reads);
+
+    if (swim_epilogue(stl) != 0)
+        goto out;
+
+    ret = 0;
+out:
+    if (cache != NULL)
+        swim_detach_cache(stl, cache);
+    free(opt);
+    free(buf);
+    return ret;
+}
+
+static bool in_range(const stlink_image_segment *seg, uint32_t start, uint32_t size)
+{
+    return seg->addr >= start && seg->addr + seg->len <= start + size;
+}
+
+static int check_image(stlink_image *img, const stlink_device *dev, const char *path)
+{
+    for (int i = 0; i < stlink_image_get_segment_count(img); i++) {
+        const stlink_image_segment *seg = stlink_image_get_segment(img, i);
+        if (!in_range(seg, dev->flash_start, dev->flash_size) &&
+            !in_range(seg, dev->eeprom_start, dev->eeprom_size)) {
+            fprintf(stderr, "%s: 0x%" PRIx32 "+0x%" PRIx32 " is outside %s flash and EEPROM\n",
+                    path, seg->addr, seg->len, dev->name);
             return -1;
         }
     }
-    fclose(file);
+    return 0;
+}
 
-    ret = swim_epilogue(stl);
+static enum STLinkVerifyMode verify_mode = STLINK_VERIFY_READBACK;
+static enum STLinkFlashMode flash_mode = STLINK_FLASH_SWIM;
+
+static int swim_program_segment(stlink *stl, const stlink_image_segment *seg)
+{
+    stlink_flash_stats stats;
+    stlink_flash_set_mode(stl, flash_mode);
+    int ret = stlink_flash_write_delta(stl, seg->addr, seg->data, seg->len, &stats);
+    printf("0x%06" PRIx32 ": %" PRIu32 " of %" PRIu32 " blocks programmed (%" PRIu32 " bytes),"
+           " %" PRIu32 " unchanged, %" PRIu64 " ms (%" PRIu32 " bytes/s)\n", seg->addr,
+           stats.blocks_programmed, stats.blocks_total, stats.bytes_programmed,
+           stats.blocks_skipped, stats.elapsed_us / 1000, stats.bytes_per_second);
     if (ret != 0)
         return -1;
 
-    // ---
+    stlink_verify_result result;
+    ret = stlink_verify(stl, seg->addr, seg->data, seg->len, verify_mode, &result);
+    printf("verify %s, CRC 0x%08" PRIx32 " (%s), %" PRIu64 " ms\n",
+           result.match ? "ok" : "FAILED", result.crc_actual,
+           result.on_target ? "on target" : "readback", result.elapsed_us / 1000);
+    return ret;
+}
+
+#define MAX_PATCHES 16
+
+static stlink_patch patches[MAX_PATCHES];
+static int patch_count;
+
+// ADDR=HEXBYTES
+static int parse_patch(const char *arg)
+{
+    char *end;
+    uint32_t addr = strtoul(arg, &end, 0);
+    if (end == arg || *end != '=' || patch_count == MAX_PATCHES)
+        return -1;
+    const char *hex = end + 1;
+    size_t len = strlen(hex) / 2;
+    if (len == 0 || strlen(hex) % 2 != 0)
+        return -1;
+    uint8_t *data = malloc(len);
+    if (data == NULL)
+        return -1;
+    for (size_t i = 0; i < len; i++) {
+        char byte[3] = { hex[2 * i], hex[2 * i + 1], '\0' };
+        data[i] = strtoul(byte, &end, 16);
+        if (*end != '\0') {
+            free(data);
+            return -1;
+        }
+    }
+    patches[patch_count++] = (stlink_patch){ addr, len, data };
+    return 0;
+}
+
+static int swim_apply_patches(stlink *stl)
+{
+    stlink_patch_stats stats;
+    int ret = stlink_patch_apply(stl, patches, patch_count, &stats);
+    printf("%d patches: %" PRIu32 " of %" PRIu32 " blocks unchanged, %" PRIu32 " byte, %" PRIu32
+           " word and %" PRIu32 " block writes (%" PRIu32 " bytes), %d reads, %" PRIu64 " ms\n",
+           patch_count, stats.blocks_skipped, stats.blocks_total, stats.byte_writes,
+           stats.word_writes, stats.block_writes, stats.bytes_programmed, stats.reads,
+           stats.elapsed_us / 1000);
+    return ret;
+}
 
-    ret = swim_prologue(stl);
+// Patches only, in a single session.
+static int swim_patch(stlink *stl)
+{
+    int ret = stlink_swim_get_02(stl, 0x01);
     if (ret != 0)
         return -1;
+    CHECK_SWIM(stlink_swim_do_07(stl));
 
-    uint32_t eeprom_start = 0x4000;
-    uint16_t eeprom_size = 1024;
-    uint32_t eeprom_end = eeprom_start + eeprom_size;
-    for (uint32_t addr = eeprom_start; addr < eeprom_end; addr += size) {
-        uint16_t len = (addr + size > eeprom_end) ? (eeprom_end - addr) : size;
-        SWIM_READ(addr, len, buf);
-        dump_data(buf, len);
-    }
+    ret = swim_enter(stl);
+    if (ret != 0)
+        return -1;
+    stlink_cache *cache = swim_attach_cache(stl);
+    ret = swim_apply_patches(stl);
+    if (cache != NULL)
+        swim_detach_cache(stl, cache);
+    if (ret != 0)
+        return -1;
 
     ret = swim_epilogue(stl);
     if (ret != 0)
         return -1;
 
-    // ---
+    return 0;
+}
+
+static int swim_program(stlink *stl, stlink_image *image)
+{
+    int ret = stlink_swim_get_02(stl, 0x01);
+    if (ret != 0)
+        return -1;
+    CHECK_SWIM(stlink_swim_do_07(stl));
 
-    ret = swim_prologue(stl);
+    ret = swim_enter(stl);
     if (ret != 0)
         return -1;
+    if (check_image(image, stlink_get_device(stl), image_path) != 0)
+        return -1;
+    stlink_cache *cache = swim_attach_cache(stl);
 
-    // Option bytes
-    for (uint32_t addr = 0x4800; addr <= 0x480e; addr++) {
-        SWIM_READ(addr, 1, buf);
-        dump_data(buf, 1);
+    for (int i = 0; i < stlink_image_get_segment_count(image) && ret == 0; i++) {
+        ret = swim_program_segment(stl, stlink_image_get_segment(image, i));
     }
-    SWIM_READ(STM8S105_OPTBL, 1, buf);
-    dump_data(buf, 1);
+    // per-board data on top of the image
+    if (ret == 0 && patch_count > 0)
+        ret = swim_apply_patches(stl);
+    if (cache != NULL)
+        swim_detach_cache(stl, cache);
+    if (ret != 0)
+        return -1;
 
     ret = swim_epilogue(stl);
     if (ret != 0)
         return -1;
 
-    free(buf);
+    return 0;
+}
+
+#define BOARD_UID_MAX   16
+#define BOARD_POLL_US   (100 * 1000)
+#define BOARD_WAIT_S    30 // for the next board to be attached
+
+// The board attached to a probe, as far as it was seen
+typedef struct Board {
+    bool attached;              // at the last look
+    const stlink_device *dev;   // last released, NULL for none yet
+    uint8_t uid[BOARD_UID_MAX];
+    uint32_t uid_size;          // 0 if it has none, or it could not be read
+} Board;
+
+// Notes the board just released by the epilogue, by its unique ID if any.
+static void board_released(stlink *stl, Board *board)
+{
+    board->attached = true;
+    board->dev = stlink_get_device(stl);
+    board->uid_size = 0;
+    if (board->dev != NULL && board->dev->uid_size > 0 &&
+        stlink_swim_read_wait(stl, board->dev->uid_addr, board->dev->uid_size, board->uid) == 0)
+        board->uid_size = board->dev->uid_size;
+}
+
+/*
+ * Checks whether a new target is attached: one answering after none did,
+ * or, on parts with a unique ID, one with another ID than the board last
+ * programmed.  Returns 1 for a new target, 0 if there is none and -1 on
+ * errors.
+ */
+static int board_arrived(stlink *stl, Board *board)
+{
+    int ret = stlink_swim_target_present(stl);
+    if (ret <= 0) {
+        if (ret == 0)
+            board->attached = false;
+        return ret;
+    }
+    if (!board->attached) {
+        board->attached = true;
+        return 1;
+    }
+    if (board->uid_size == 0)
+        return 0;
+    uint8_t uid[BOARD_UID_MAX];
+    // pulled in between, most likely
+    if (stlink_swim_read_wait(stl, board->dev->uid_addr, board->uid_size, uid) != 0)
+        return 0;
+    return memcmp(uid, board->uid, board->uid_size) != 0;
+}
 
+// Returns 1 once a new target is attached, 0 if none was in time, -1 on errors.
+static int board_wait(stlink *stl, Board *board)
+{
+    printf("%s: waiting for the next board...\n", stlink_get_serial(stl));
+    fflush(stdout);
+    uint64_t deadline = stlink_time_us() + BOARD_WAIT_S * 1000000ULL;
+    while (stlink_time_us() < deadline) {
+        int ret = board_arrived(stl, board);
+        if (ret != 0)
+            return ret;
+        usleep(BOARD_POLL_US);
+    }
     return 0;
 }
 
-__attribute__((unused))
-static int swim_flash(stlink *stl)
+// Readies a probe for boards, before the first prologue.
+static int swim_start(stlink *stl)
 {
-    uint16_t size = 0;
-    int ret = stlink_swim_get_size(stl, &size);
+    int ret = stlink_swim_get_02(stl, 0x01);
     if (ret != 0)
         return -1;
-    printf("size = 0x%" PRIx16 "\n", size);
-
-    uint8_t *buf = malloc(size);
+    CHECK_SWIM(stlink_swim_do_07(stl));
+    stlink_flash_set_mode(stl, flash_mode);
+    return 0;
+}
 
-    ret = swim_prologue(stl);
+/*
+ * Programs the attached board with the next unit from the queue.  Returns
+ * 0 once it has been run, counting it in failed if that went wrong, 1 if
+ * there was no unit for it and -1 on errors.
+ */
+static int swim_board(stlink *stl, stlink_jobqueue *queue, Board *board, int *failed)
+{
+    int ret = stlink_swim_prologue(stl, NULL);
     if (ret != 0)
         return -1;
+    const stlink_device *dev = (device != NULL) ? device : stlink_device_detect(stl);
+    if (dev == NULL) {
+        fprintf(stderr, "%s: target part not recognised\n", stlink_get_serial(stl));
+        stlink_swim_epilogue(stl, NULL);
+        return -1;
+    }
+    stlink_set_device(stl, dev);
+    stlink_job_unit unit;
+    bool taken = (stlink_jobqueue_take(queue, stl, dev, &unit) == 0);
+    if (taken && stlink_jobqueue_run(queue, stl, &unit) != 0)
+        (*failed)++;
+    ret = stlink_swim_epilogue(stl, NULL);
+    if (ret != 0)
+        return -1;
+    board_released(stl, board);
+    return taken ? 0 : 1;
+}
 
-    // Unlock program memory
-    buf[0] = 0x56;
-    CHECK_SWIM(stlink_swim_write(stl, STM8S105_FLASH_PUKR, 1, buf));
-    buf[0] = 0xae;
-    CHECK_SWIM(stlink_swim_write(stl, STM8S105_FLASH_PUKR, 1, buf));
-    // Unlock data EEPROM and option bytes
-    buf[0] = 0xae;
-    CHECK_SWIM(stlink_swim_write(stl, STM8S105_FLASH_DUKR, 1, buf));
-    buf[0] = 0x56;
-    CHECK_SWIM(stlink_swim_write(stl, STM8S105_FLASH_DUKR, 1, buf));
-    SWIM_READ(STM8S105_FLASH_IAPSR, 1, buf);
-    dump_data(buf, 1);
-
-    // -> RAM
-    // XXX buf
-    CHECK_SWIM(stlink_swim_write(stl, 0x0030, 0x200, buf));
-    // XXX buf
-    CHECK_SWIM(stlink_swim_write(stl, 0x000f, 20, buf));
-
-    buf[0] = 0x00;
-    CHECK_SWIM(stlink_swim_write(stl, 0x0330, 1, buf));
-    buf[0] = 0x00;
-    CHECK_SWIM(stlink_swim_write(stl, 0x0532, 1, buf));
-    buf[0] = 0x00;
-    CHECK_SWIM(stlink_swim_write(stl, 0x012f, 1, buf));
-    buf[0] = 0x00;
-    CHECK_SWIM(stlink_swim_write(stl, 0x0331, 1, buf));
-    buf[0] = 0x00;
-    CHECK_SWIM(stlink_swim_write(stl, STM8S105_CLK_CKDIVR, 1, buf));
-    buf[0] = 0x00;
-    buf[1] = 0x00;
-    buf[2] = 0x30;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_REG_PCE, 3, buf));
-    buf[0] = 0xe8;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_REG_CC, 1, buf));
-
-    SWIM_READ(STM8_DM_CSR2, 1, buf);
-    dump_data(buf, 1);
-    buf[0] = STM8_DM_CSR2_STALL | STM8_DM_CSR2_FLUSH;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_DM_CSR2, 1, buf));
-    buf[0] = STM8_DM_CSR2_FLUSH;
-    CHECK_SWIM(stlink_swim_write(stl, STM8_DM_CSR2, 1, buf));
-
-    // XXX buf
-    CHECK_SWIM(stlink_swim_write(stl, 0x012f, 0x0202, buf));
-    // XXX buf
-    CHECK_SWIM(stlink_swim_write(stl, 0x0331, 0x0202, buf));
-    SWIM_READ(0x012f, 1, buf);
-    dump_data(buf, 1);
+/*
+ * Programs boards from the queue, one for each target attached in turn,
+ * until none is left for this probe.  Stops with an error rather than
+ * programming the same target twice.
+ */
+static int swim_jobs(stlink *stl, stlink_jobqueue *queue)
+{
+    int ret = swim_start(stl);
+    if (ret != 0)
+        return -1;
 
-    return 0;
+    Board board;
+    memset(&board, 0, sizeof(board));
+    int failed = 0;
+    for (;;) {
+        ret = swim_board(stl, queue, &board, &failed);
+        if (ret < 0)
+            return -1;
+        if (ret == 1 || stlink_jobqueue_get_left(queue, stl, board.dev) == 0)
+            break;
+        ret = board_wait(stl, &board);
+        if (ret < 0)
+            return -1;
+        if (ret == 0) {
+            fprintf(stderr, "%s: no new target within %d s, not programming the same one again\n",
+                    stlink_get_serial(stl), BOARD_WAIT_S);
+            return -1;
+        }
+    }
+    return (failed == 0) ? 0 : -1;
 }
 
-static void connect(libusb_context *usb_context)
+static bool set_poll_strategy;
+static enum STLinkPollStrategy poll_strategy;
+static stlink_image *image;
+static stlink_jobqueue *jobs;
+
+static void dump_memcache_stats(stlink *stl)
 {
-    printf("Opening ST-Link device...\n");
-    stlink *stl = stlink_open(usb_context);
-    if (stl == NULL) {
+    stlink_memcache_stats stats;
+    stlink_memcache_get_stats(stl, &stats);
+    if (stats.reads == 0 && stats.hits == 0)
         return;
+    printf("memcache: %" PRIu32 " hits, %" PRIu32 " misses, %" PRIu32 " reads, %" PRIu32 " flushes\n",
+           stats.hits, stats.misses, stats.reads, stats.flushes);
+}
+
+// Gets the probe into SWIM mode, with the settings given; -1 if it won't go.
+static int probe_setup(stlink *stl)
+{
+    if (set_poll_strategy) {
+        // keep the library's delays, deadline and SWIM bit rate
+        stlink_poll_config config;
+        stlink_poll_get_config(stl, &config);
+        config.strategy = poll_strategy;
+        stlink_poll_set_config(stl, &config);
     }
+    // programming restarts whole flash sequences after resetting the target
+    stlink_recovery_set_reenter(stl, true);
     stlink_get_version(stl);
     int mode = stlink_get_current_mode(stl);
     printf("mode = %02x\n", mode);
@@ -338,18 +567,548 @@ static void connect(libusb_context *usb_context)
         mode = stlink_get_current_mode(stl);
         printf("new mode = %02x\n", mode);
     }
-    if (mode == STLINK_DEV_SWIM_MODE) {
-        swim(stl);
+    if (mode != STLINK_DEV_SWIM_MODE)
+        return -1;
+    stlink_memcache_enable(stl, true);
+    return 0;
+}
+
+static void dump_probe_stats(stlink *stl)
+{
+    stlink_poll_dump_stats(stl, stdout);
+    stlink_recovery_dump_stats(stl, stdout);
+    dump_memcache_stats(stl);
+}
+
+static int connect(stlink *stl, void *opaque)
+{
+    int ret = -1;
+    if (probe_setup(stl) == 0) {
+        if (jobs != NULL)
+            ret = swim_jobs(stl, jobs);
+        else if (image != NULL)
+            ret = swim_program(stl, image);
+        else if (patch_count > 0)
+            ret = swim_patch(stl);
+        else
+            ret = swim(stl);
         stlink_swim_exit(stl);
     }
+    dump_probe_stats(stl);
+    return ret;
+}
+
+// Returns -1 if any board failed or was never started.
+static int dump_job_stats(void)
+{
+    if (jobs == NULL)
+        return 0;
+    stlink_jobqueue_dump_stats(jobs, stdout);
+    return (stlink_jobqueue_get_failed(jobs) == 0) ? 0 : -1;
+}
+
+static int connect_all(stlink **probes, int count)
+{
+    stlink_gang *gang = stlink_gang_new();
+    if (gang == NULL)
+        return -1;
+    for (int i = 0; i < count; i++) {
+        stlink_gang_add(gang, probes[i]);
+    }
+    stlink_gang_start(gang, connect, NULL);
+    int failed = stlink_gang_wait(gang);
+    stlink_gang_dump_status(gang, stdout);
+    printf("%d of %d probes failed\n", failed, count);
+    int ret = dump_job_stats();
+    stlink_gang_free(gang);
+    return (failed == 0) ? ret : -1;
+}
+
+// Raw images are placed at the start of flash, the same on all parts.
+static stlink_image *load_image(const char *path)
+{
+    stlink_image *img = stlink_image_open(path, STLINK_IMAGE_AUTO, STM8S105_FLASH_START);
+    if (img == NULL)
+        return NULL;
+    // otherwise checked once the part is detected
+    if (device != NULL && check_image(img, device, path) != 0) {
+        stlink_image_close(img);
+        return NULL;
+    }
+    return img;
+}
+
+// In pieces of what one request carries.
+static int daemon_flash_segment(stlink_client *client, int probe,
+                                const stlink_image_segment *seg, uint8_t flags)
+{
+    for (uint32_t off = 0; off < seg->len; off += STLINK_DAEMON_MAX_PAYLOAD) {
+        uint32_t len = seg->len - off;
+        if (len > STLINK_DAEMON_MAX_PAYLOAD)
+            len = STLINK_DAEMON_MAX_PAYLOAD;
+        stlink_daemon_flash result;
+        if (stlink_client_flash(client, probe, seg->addr + off, len, seg->data + off,
+                                flags, &result) != 0)
+            return -1;
+        printf("0x%06" PRIx32 ": %" PRIu32 " of %" PRIu32 " blocks programmed (%" PRIu32
+               " bytes), %" PRIu32 " unchanged, %" PRIu64 " ms\n", seg->addr + off,
+               result.blocks_programmed, result.blocks_total, result.bytes_programmed,
+               result.blocks_skipped, result.elapsed_us / 1000);
+        printf("verify %s, CRC 0x%08" PRIx32 " (%s)\n", result.verified ? "ok" : "FAILED",
+               result.crc, result.on_target ? "on target" : "readback");
+    }
+    return 0;
+}
+
+// Same jobs as connect(), run by stlinkd on an already attached target.
+static int daemon_job(const char *serial)
+{
+    stlink_client *client = stlink_client_connect(NULL);
+    if (client == NULL)
+        return -1;
+    int probe = stlink_client_find_probe(client, serial);
+    if (probe < 0) {
+        fprintf(stderr, "No such ST-Link device on the daemon.\n");
+        stlink_client_close(client);
+        return -1;
+    }
+
+    // the daemon detects the part as it brings up the target
+    stlink_daemon_probe info;
+    int ret = stlink_client_probe(client, probe, &info);
+    if (ret == 0 && !info.connected) {
+        ret = stlink_client_reconnect(client, probe);
+        if (ret == 0)
+            ret = stlink_client_probe(client, probe, &info);
+    }
+    const stlink_device *dev = (ret == 0) ? stlink_device_find(info.part) : NULL;
+    if (ret == 0 && dev == NULL) {
+        fprintf(stderr, "The daemon's target is not attached.\n");
+        ret = -1;
+    } else if (dev != NULL && device != NULL && dev != device) {
+        fprintf(stderr, "The daemon's target is a %s, not a %s; see stlinkd -P.\n",
+                dev->name, device->name);
+        ret = -1;
+    }
+    if (ret == 0 && image != NULL)
+        ret = check_image(image, dev, image_path);
+
+    if (ret == 0 && image != NULL) {
+        uint8_t flags = (verify_mode == STLINK_VERIFY_ON_TARGET) ?
+                        STLINK_DAEMON_VERIFY_ON_TARGET : 0;
+        for (int i = 0; i < stlink_image_get_segment_count(image) && ret == 0; i++) {
+            ret = daemon_flash_segment(client, probe, stlink_image_get_segment(image, i), flags);
+        }
+    } else if (ret == 0) {
+        stlink_memory_sink dump;
+        ret = stlink_image_create_dump("flash.bin", dev->flash_start, dev->flash_size, &dump);
+        if (ret == 0) {
+            // more flash than one reply carries on the larger parts
+            for (uint32_t off = 0; off < dev->flash_size && ret == 0;
+                 off += STLINK_DAEMON_MAX_PAYLOAD) {
+                uint32_t n = dev->flash_size - off;
+                if (n > STLINK_DAEMON_MAX_PAYLOAD)
+                    n = STLINK_DAEMON_MAX_PAYLOAD;
+                ret = stlink_client_read(client, probe, dev->flash_start + off, n,
+                                         dump.buffer + off);
+            }
+            if (ret == 0)
+                dump_data(dump.buffer, dump.size);
+            stlink_image_close_dump(&dump);
+        }
+        uint8_t *eeprom = malloc(dev->eeprom_size);
+        if (eeprom == NULL)
+            ret = -1;
+        if (ret == 0)
+            ret = stlink_client_read(client, probe, dev->eeprom_start, dev->eeprom_size, eeprom);
+        if (ret == 0)
+            dump_data(eeprom, dev->eeprom_size);
+        free(eeprom);
+    }
+    if (ret != 0)
+        fprintf(stderr, "Job failed.\n");
+    stlink_client_close(client);
+    return ret;
+}
+
+#define WATCH_PROBES_MAX 16
+
+// A probe kept open while plugged in, for targets to be attached to it
+typedef struct WatchProbe {
+    stlink_probe_info info;
+    stlink *stl;
+    Board board;
+} WatchProbe;
+
+typedef struct WatchState {
+    libusb_context *usb_context;
+    const char *serial;
+    WatchProbe probes[WATCH_PROBES_MAX];
+    int count;
+    int jobs;
+    int failed;
+} WatchState;
+
+static volatile sig_atomic_t quit;
+
+static void handle_signal(int sig)
+{
+    quit = 1;
+}
+
+static const char *watch_serial(const stlink_probe_info *info)
+{
+    return (info->serial[0] != '\0') ? info->serial : "(none)";
+}
+
+static void watch_add(WatchState *w, const stlink_probe_info *info, stlink *stl)
+{
+    if (w->count == WATCH_PROBES_MAX || probe_setup(stl) != 0 || swim_start(stl) != 0) {
+        printf("ST-Link %s: cannot watch it\n", watch_serial(info));
+        stlink_close(stl);
+        w->failed++;
+        return;
+    }
+    WatchProbe *p = &w->probes[w->count++];
+    memset(p, 0, sizeof(*p));
+    p->info = *info;
+    p->stl = stl;
+    printf("ST-Link %s: waiting for targets\n", watch_serial(info));
+}
+
+static void watch_remove(WatchState *w, int i)
+{
+    WatchProbe *p = &w->probes[i];
+    dump_probe_stats(p->stl);
+    stlink_close(p->stl);
+    w->probes[i] = w->probes[--w->count];
+}
+
+static void watch_probe(const stlink_probe_info *info, bool arrived, void *opaque)
+{
+    WatchState *w = opaque;
+    if (!arrived) {
+        printf("ST-Link %s on bus %03" PRIu8 " port %03" PRIu8 " unplugged\n",
+               watch_serial(info), info->bus, info->port);
+        for (int i = 0; i < w->count; i++) {
+            if (w->probes[i].info.bus == info->bus && w->probes[i].info.port == info->port) {
+                watch_remove(w, i);
+                break;
+            }
+        }
+        return;
+    }
+    if (w->serial[0] != '\0' && strcmp(w->serial, info->serial) != 0)
+        return;
+    printf("ST-Link %s on bus %03" PRIu8 " port %03" PRIu8 " plugged in\n",
+           watch_serial(info), info->bus, info->port);
+    stlink *stl = stlink_open_probe(w->usb_context, info);
+    if (stl == NULL) {
+        w->failed++;
+        return;
+    }
+    watch_add(w, info, stl);
+}
+
+/*
+ * Runs the job on the target just attached, as on a probe of its own.
+ * Returns 1 if the job queue has no board left for it.
+ */
+static int watch_target(WatchProbe *p)
+{
+    if (jobs != NULL) {
+        int failed = 0;
+        int ret = swim_board(p->stl, jobs, &p->board, &failed);
+        if (ret < 0)
+            board_released(p->stl, &p->board);
+        return (ret == 1) ? 1 : (ret == 0 && failed == 0) ? 0 : -1;
+    }
+    int ret;
+    if (image != NULL)
+        ret = swim_program(p->stl, image);
+    else if (patch_count > 0)
+        ret = swim_patch(p->stl);
+    else
+        ret = swim(p->stl);
+    board_released(p->stl, &p->board);
+    return ret;
+}
+
+// Looks for targets on every probe, running the job on each new one.
+static void watch_targets(WatchState *w)
+{
+    for (int i = w->count - 1; i >= 0; i--) {
+        WatchProbe *p = &w->probes[i];
+        int ret = board_arrived(p->stl, &p->board);
+        if (ret == 0)
+            continue;
+        if (ret < 0) {
+            printf("ST-Link %s: lost, replug it\n", watch_serial(&p->info));
+            watch_remove(w, i);
+            w->failed++;
+            continue;
+        }
+        printf("ST-Link %s: target attached\n", watch_serial(&p->info));
+        ret = watch_target(p);
+        if (ret == 1) {
+            printf("ST-Link %s: no board left for this target\n", watch_serial(&p->info));
+            continue;
+        }
+        w->jobs++;
+        if (ret != 0)
+            w->failed++;
+        printf("ST-Link %s: %s\n", watch_serial(&p->info), (ret == 0) ? "done" : "FAILED");
+        fflush(stdout);
+    }
+}
+
+/*
+ * Runs the job on each target as it is attached to any probe plugged in,
+ * until interrupted.  Without a USB context, on one emulated probe.
+ */
+static int watch(libusb_context *usb_context, const char *serial,
+                 const stlink_emu_config *emu_config)
+{
+    WatchState w = {
+        .usb_context = usb_context,
+        .serial = serial,
+    };
+    stlink_hotplug *hp = NULL;
+    if (usb_context != NULL) {
+        hp = stlink_hotplug_new(usb_context, watch_probe, &w);
+        if (hp == NULL)
+            return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    printf("Waiting for ST-Link devices and targets, ^C to stop...\n");
+    fflush(stdout);
+    if (hp == NULL) {
+        stlink *stl = stlink_emu_open_config(emu_config);
+        if (stl == NULL)
+            return -1;
+        stlink_probe_info info;
+        memset(&info, 0, sizeof(info));
+        snprintf(info.serial, sizeof(info.serial), "%s", stlink_get_serial(stl));
+        watch_add(&w, &info, stl);
+    }
+    int ret = 0;
+    while (!quit && ret == 0) {
+        if (hp != NULL)
+            ret = stlink_hotplug_poll(hp, BOARD_POLL_US / 1000);
+        else
+            usleep(BOARD_POLL_US);
+        watch_targets(&w);
+    }
+    while (w.count > 0) {
+        stlink_swim_exit(w.probes[w.count - 1].stl);
+        watch_remove(&w, w.count - 1);
+    }
+    stlink_hotplug_free(hp);
+    printf("%d jobs, %d failed\n", w.jobs, w.failed);
+    if (dump_job_stats() != 0)
+        ret = -1;
+    return (ret == 0 && w.failed == 0) ? 0 : -1;
+}
+
+static void list_devices(const char *name)
+{
+    fprintf(stderr, "Unknown part %s, known are:", name);
+    for (int i = 0; i < stlink_device_count(); i++) {
+        fprintf(stderr, " %s", stlink_device_get(i)->name);
+    }
+    fprintf(stderr, "\n");
+}
 
-    stlink_close(stl);
-    printf("done.\n");
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-e] [-l latency_us] [-p immediate|backoff|predict] [-s serial]\n"
+                    "       [-n count] [-q] [-v] [-c] [-C] [-d] [-w] [-b ms] [-F n] [-L] [-S]\n"
+                    "       [-P part] [-W addr=bytes]... [-f image | -j jobfile]\n"
+                    "  -b  swap the emulated board for a fresh one this long after\n"
+                    "      each is done\n"
+                    "  -c  verify with a checksum computed on the target\n"
+                    "  -C  keep target contents in a local cache across runs\n"
+                    "  -d  hand the job to a running stlinkd\n"
+                    "  -e  use an emulated ST-Link instead of USB\n"
+                    "  -F  make the emulated ST-Link fail every n-th transfer\n"
+                    "  -f  program a raw, Intel HEX, S-record or ELF image, skipping\n"
+                    "      unchanged blocks\n"
+                    "  -j  program the boards listed in a job file, see stlink-job.h,\n"
+                    "      one on each target attached in turn\n"
+                    "  -l  per-transfer latency of the emulated ST-Link\n"
+                    "  -L  program through a loader in target RAM\n"
+                    "  -n  program up to count probes in parallel (requires -f or -j)\n"
+                    "  -p  SWIM busy polling strategy\n"
+                    "  -P  target part, e.g. STM8S105K6, instead of detecting it;\n"
+                    "      with -e also the part emulated\n"
+                    "  -q  only log errors\n"
+                    "  -s  open the ST-Link with the given serial number\n"
+                    "  -S  use the fastest SWIM speed that passes a test pattern\n"
+                    "  -v  log every command, including CDB dumps\n"
+                    "  -W  write hex bytes to flash or EEPROM after any image, e.g.\n"
+                    "      -W 0x4000=00001234 for a serial number\n"
+                    "  -w  wait for probes and run the job on each target attached\n"
+                    "      to one, until interrupted\n", prog);
 }
 
-int main(void)
+int main(int argc, char **argv)
 {
     int ret;
+    bool emulate = false;
+    stlink_emu_config emu_config;
+    stlink_emu_get_default_config(&emu_config);
+    int count = 0;
+    const char *job_path = NULL;
+    bool use_daemon = false;
+    bool use_watch = false;
+    stlink_probe_info match;
+    memset(&match, 0, sizeof(match));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:cCdef:F:j:l:Ln:p:P:qs:SvwW:")) != -1) {
+        switch (opt) {
+        case 'b':
+            emu_config.swap_board_us = strtoul(optarg, NULL, 0) * 1000;
+            break;
+        case 'c':
+            verify_mode = STLINK_VERIFY_ON_TARGET;
+            break;
+        case 'C':
+            use_cache = true;
+            break;
+        case 'd':
+            use_daemon = true;
+            break;
+        case 'e':
+            emulate = true;
+            break;
+        case 'f':
+            image_path = optarg;
+            break;
+        case 'F':
+            emu_config.fault_every = strtoul(optarg, NULL, 0);
+            emu_config.fault_mask = STLINK_EMU_FAULT_STALL | STLINK_EMU_FAULT_TIMEOUT;
+            break;
+        case 'j':
+            job_path = optarg;
+            break;
+        case 'l':
+            emu_config.latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'L':
+            flash_mode = STLINK_FLASH_LOADER;
+            break;
+        case 'n':
+            count = strtol(optarg, NULL, 0);
+            break;
+        case 'P':
+            device = stlink_device_find(optarg);
+            if (device == NULL) {
+                list_devices(optarg);
+                return -1;
+            }
+            break;
+        case 'p':
+            if (strcmp(optarg, "immediate") == 0) {
+                poll_strategy = STLINK_POLL_IMMEDIATE;
+            } else if (strcmp(optarg, "backoff") == 0) {
+                poll_strategy = STLINK_POLL_BACKOFF;
+            } else if (strcmp(optarg, "predict") == 0) {
+                poll_strategy = STLINK_POLL_PREDICT;
+            } else {
+                usage(argv[0]);
+                return -1;
+            }
+            set_poll_strategy = true;
+            break;
+        case 'q':
+            stlink_log_set_level(STLINK_LOG_ERROR);
+            break;
+        case 's':
+            snprintf(match.serial, sizeof(match.serial), "%s", optarg);
+            break;
+        case 'S':
+            negotiate_speed = true;
+            break;
+        case 'v':
+            stlink_log_set_level(STLINK_LOG_DEBUG);
+            break;
+        case 'w':
+            use_watch = true;
+            break;
+        case 'W':
+            if (parse_patch(optarg) != 0) {
+                usage(argv[0]);
+                return -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    emu_config.device = device;
+    if (image_path != NULL) {
+        image = load_image(image_path);
+        if (image == NULL)
+            return -1;
+    }
+    if (job_path != NULL) {
+        jobs = stlink_jobqueue_load(job_path);
+        if (jobs == NULL)
+            return -1;
+    }
+    if ((count > 0 && image == NULL && jobs == NULL) || (image != NULL && jobs != NULL) ||
+        (use_daemon && (jobs != NULL || patch_count > 0)) ||
+        (jobs != NULL && patch_count > 0) || (use_watch && count > 0)) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (use_daemon)
+        return daemon_job(match.serial);
+
+    if (emulate && use_watch)
+        return watch(NULL, match.serial, &emu_config);
+    if (emulate && count > 0) {
+        stlink **probes = calloc(count, sizeof(stlink *));
+        if (probes == NULL)
+            return -1;
+        printf("Opening %d emulated ST-Link devices...\n", count);
+        int opened = 0;
+        while (opened < count) {
+            probes[opened] = stlink_emu_open_config(&emu_config);
+            if (probes[opened] == NULL)
+                break;
+            opened++;
+        }
+        ret = (opened == count) ? connect_all(probes, count) : -1;
+        for (int i = 0; i < opened; i++) {
+            stlink_close(probes[i]);
+        }
+        free(probes);
+        return ret;
+    }
+    if (emulate) {
+        printf("Opening emulated ST-Link device...\n");
+        stlink *stl = stlink_emu_open_config(&emu_config);
+        ret = -1;
+        if (stl != NULL) {
+            ret = connect(stl, NULL);
+            stlink_close(stl);
+            if (dump_job_stats() != 0)
+                ret = -1;
+            printf("done.\n");
+        }
+        return ret;
+    }
 
     libusb_context *usb_context;
     ret = libusb_init(&usb_context);
@@ -359,8 +1118,59 @@ int main(void)
     }
     //libusb_set_debug(usb_context, USB_DEBUGLEVEL_WARNING);
 
-    connect(usb_context);
+    if (use_watch) {
+        ret = watch(usb_context, match.serial, NULL);
+        libusb_exit(usb_context);
+        return ret;
+    }
+
+    if (count > 0) {
+        stlink_probe_info *infos;
+        int found = stlink_enumerate(usb_context, &infos);
+        if (found < 0) {
+            libusb_exit(usb_context);
+            return -1;
+        }
+        if (count > found)
+            count = found;
+        printf("Opening %d of %d ST-Link devices...\n", count, found);
+        // Each probe gets its own context, so that workers don't share events.
+        libusb_context **contexts = calloc(count, sizeof(libusb_context *));
+        stlink **probes = calloc(count, sizeof(stlink *));
+        int opened = 0;
+        for (int i = 0; contexts != NULL && probes != NULL && i < count; i++) {
+            if (libusb_init(&contexts[opened]) != 0)
+                break;
+            probes[opened] = stlink_open_probe(contexts[opened], &infos[i]);
+            if (probes[opened] == NULL) {
+                libusb_exit(contexts[opened]);
+                continue;
+            }
+            opened++;
+        }
+        ret = (opened > 0) ? connect_all(probes, opened) : -1;
+        for (int i = 0; i < opened; i++) {
+            stlink_close(probes[i]);
+            libusb_exit(contexts[i]);
+        }
+        free(probes);
+        free(contexts);
+        free(infos);
+        libusb_exit(usb_context);
+        return ret;
+    }
+
+    printf("Opening ST-Link device...\n");
+    stlink *stl = stlink_open_probe(usb_context, &match);
+    ret = -1;
+    if (stl != NULL) {
+        ret = connect(stl, NULL);
+        stlink_close(stl);
+        if (dump_job_stats() != 0)
+            ret = -1;
+        printf("done.\n");
+    }
 
     libusb_exit(usb_context);
-    return 0;
+    return ret;
 }
@@ -0,0 +1,753 @@
+/*
+ * GDB remote serial protocol server for STM8 over SWIM
+ *
+ * Copyright (c) 2011 Andreas Färber
+ *
+ * Licensed under the GNU General Public License (GPL) version 2, or
+ * at your option, any later version.
+ *
+ * Registers are read in one transfer whenever the core stops and served
+ * from that copy until it runs again; they are expedited in the stop reply
+ * as well.  Memory reads go through the libstlink memory cache, which
+ * tracks the core state itself.  Breakpoints map onto the two hardware
+ * comparators, which are only reprogrammed on resume and only if GDB
+ * changed them.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include "stlink.h"
+#include "stlink-libusb.h"
+#include "stlink-debug.h"
+#include "stlink-device.h"
+#include "stlink-emu.h"
+#include "stlink-flash.h"
+#include "stlink-log.h"
+#include "stlink-memcache.h"
+#include "stlink-poll.h"
+#include "stlink-session.h"
+#include "stm8.h"
+
+#define GDB_DEFAULT_PORT    3333
+#define GDB_PACKET_SIZE     4096
+#define GDB_POLL_MS         10
+
+typedef struct GdbConnection {
+    int fd;
+    bool no_ack;
+    uint8_t in[GDB_PACKET_SIZE];
+    size_t in_len;
+    size_t in_pos;
+} GdbConnection;
+
+static stlink *stl;
+static uint16_t swim_size;
+
+static stlink_stm8_regs regs;
+static bool regs_valid;
+
+static uint32_t breakpoints[STLINK_DEBUG_BREAKPOINTS];
+static int breakpoint_count;
+static bool breakpoints_dirty;
+
+static enum STLinkCoreState stop_state = STLINK_CORE_HALTED;
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+    "<target version=\"1.0\">\n"
+    "  <architecture>stm8</architecture>\n"
+    "  <feature name=\"org.gnu.gdb.stm8.core\">\n"
+    "    <reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\" regnum=\"0\"/>\n"
+    "    <reg name=\"a\" bitsize=\"8\" type=\"uint8\"/>\n"
+    "    <reg name=\"x\" bitsize=\"16\" type=\"uint16\"/>\n"
+    "    <reg name=\"y\" bitsize=\"16\" type=\"uint16\"/>\n"
+    "    <reg name=\"sp\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+    "    <reg name=\"cc\" bitsize=\"8\" type=\"uint8\"/>\n"
+    "  </feature>\n"
+    "</target>\n";
+
+// Register numbers and sizes as in target_xml, big-endian on the wire
+enum {
+    GDB_REG_PC,
+    GDB_REG_A,
+    GDB_REG_X,
+    GDB_REG_Y,
+    GDB_REG_SP,
+    GDB_REG_CC,
+    GDB_REGS,
+};
+
+static const int reg_sizes[GDB_REGS] = { 4, 1, 2, 2, 2, 1 };
+
+static uint32_t reg_get(int n)
+{
+    switch (n) {
+    case GDB_REG_PC: return regs.pc;
+    case GDB_REG_A:  return regs.a;
+    case GDB_REG_X:  return regs.x;
+    case GDB_REG_Y:  return regs.y;
+    case GDB_REG_SP: return regs.sp;
+    default:         return regs.cc;
+    }
+}
+
+static void reg_set(int n, uint32_t val)
+{
+    switch (n) {
+    case GDB_REG_PC: regs.pc = val & 0xffffff; break;
+    case GDB_REG_A:  regs.a = val; break;
+    case GDB_REG_X:  regs.x = val; break;
+    case GDB_REG_Y:  regs.y = val; break;
+    case GDB_REG_SP: regs.sp = val; break;
+    default:         regs.cc = val; break;
+    }
+}
+
+static int regs_fetch(void)
+{
+    if (!regs_valid && stlink_debug_read_regs(stl, &regs) == 0)
+        regs_valid = true;
+    return regs_valid ? 0 : -1;
+}
+
+static bool in_region(uint32_t addr, uint32_t start, uint32_t size)
+{
+    return addr >= start && addr < start + size;
+}
+
+static int mem_read(uint32_t addr, uint32_t len, uint8_t *buf)
+{
+    for (uint32_t off = 0; off < len; off += swim_size) {
+        uint16_t n = (len - off > swim_size) ? swim_size : len - off;
+        if (stlink_swim_read_wait(stl, addr + off, n, buf + off) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Flash and EEPROM are programmed, everything else is written directly.
+static int mem_write(uint32_t addr, uint32_t len, uint8_t *buf)
+{
+    int ret = 0;
+    const stlink_device *dev = stlink_get_device(stl);
+    if ((in_region(addr, dev->flash_start, dev->flash_size) &&
+         in_region(addr + len - 1, dev->flash_start, dev->flash_size)) ||
+        (in_region(addr, dev->eeprom_start, dev->eeprom_size) &&
+         in_region(addr + len - 1, dev->eeprom_start, dev->eeprom_size))) {
+        stlink_flash_stats stats;
+        ret = stlink_flash_write_delta(stl, addr, buf, len, &stats);
+    } else {
+        for (uint32_t off = 0; off < len && ret == 0; off += swim_size) {
+            uint16_t n = (len - off > swim_size) ? swim_size : len - off;
+            ret = stlink_swim_write_wait(stl, addr + off, n, buf + off);
+        }
+    }
+    if (in_region(addr, STM8S105_CPU_START, STM8S105_CPU_SIZE))
+        regs_valid = false;
+    return ret;
+}
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static int hex_decode(const char *hex, uint8_t *out, size_t len)
+{
+    for (size_t i = 0; i < len; i++) {
+        int hi = hex_nibble(hex[2 * i]);
+        int lo = (hi >= 0) ? hex_nibble(hex[2 * i + 1]) : -1;
+        if (lo < 0)
+            return -1;
+        out[i] = hi << 4 | lo;
+    }
+    return 0;
+}
+
+static char *hex_encode(char *out, const uint8_t *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+        *out++ = digits[data[i] >> 4];
+        *out++ = digits[data[i] & 0xf];
+    }
+    *out = '\0';
+    return out;
+}
+
+static char *hex_encode_reg(char *out, int n)
+{
+    uint8_t buf[4];
+    uint32_t val = reg_get(n);
+    for (int i = reg_sizes[n] - 1; i >= 0; i--, val >>= 8)
+        buf[i] = val;
+    return hex_encode(out, buf, reg_sizes[n]);
+}
+
+// Reads the next byte from GDB; -1 if the connection is gone.
+static int gdb_getc(GdbConnection *c)
+{
+    if (c->in_pos == c->in_len) {
+        ssize_t n;
+        do {
+            n = recv(c->fd, c->in, sizeof(c->in), 0);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return -1;
+        c->in_len = n;
+        c->in_pos = 0;
+    }
+    return c->in[c->in_pos++];
+}
+
+static bool gdb_pending(GdbConnection *c, int timeout_ms)
+{
+    if (c->in_pos < c->in_len)
+        return true;
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    return poll(&pfd, 1, timeout_ms) > 0;
+}
+
+static int gdb_send_raw(GdbConnection *c, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(c->fd, data, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Sends a packet, escaping as needed, and waits for it to be acknowledged.
+static int gdb_send(GdbConnection *c, const char *data, size_t len)
+{
+    static char packet[2 * GDB_PACKET_SIZE + 4];
+    size_t pos = 0;
+    uint8_t sum = 0;
+    packet[pos++] = '$';
+    for (size_t i = 0; i < len && pos < sizeof(packet) - 4; i++) {
+        char ch = data[i];
+        if (ch == '$' || ch == '#' || ch == '}' || ch == '*') {
+            packet[pos++] = '}';
+            sum += '}';
+            ch ^= 0x20;
+        }
+        packet[pos++] = ch;
+        sum += (uint8_t)ch;
+    }
+    pos += sprintf(&packet[pos], "#%02x", sum);
+
+    for (;;) {
+        if (gdb_send_raw(c, packet, pos) != 0)
+            return -1;
+        if (c->no_ack)
+            return 0;
+        int ack = gdb_getc(c);
+        if (ack == '+')
+            return 0;
+        if (ack != '-')
+            return -1;
+    }
+}
+
+static int gdb_reply(GdbConnection *c, const char *str)
+{
+    return gdb_send(c, str, strlen(str));
+}
+
+/*
+ * Receives the next packet into buf.  Returns its length, 0 for an
+ * interrupt request and -1 if the connection is gone.
+ */
+static int gdb_recv(GdbConnection *c, char *buf, size_t size)
+{
+    for (;;) {
+        int ch = gdb_getc(c);
+        if (ch < 0)
+            return -1;
+        if (ch == 0x03)
+            return 0;
+        if (ch != '$')
+            continue;
+
+        size_t len = 0;
+        uint8_t sum = 0;
+        while ((ch = gdb_getc(c)) >= 0 && ch != '#') {
+            sum += ch;
+            if (len < size - 1)
+                buf[len++] = ch;
+        }
+        int hi = gdb_getc(c);
+        int lo = gdb_getc(c);
+        if (ch < 0 || hi < 0 || lo < 0)
+            return -1;
+        buf[len] = '\0';
+        if (c->no_ack)
+            return len;
+        int sum_hi = hex_nibble(hi);
+        int sum_lo = hex_nibble(lo);
+        if (sum_hi < 0 || sum_lo < 0 || (sum_hi << 4 | sum_lo) != sum) {
+            gdb_send_raw(c, "-", 1);
+            continue;
+        }
+        gdb_send_raw(c, "+", 1);
+        return len;
+    }
+}
+
+static void stop_reply(char *out, int signal, enum STLinkCoreState state)
+{
+    out += sprintf(out, "T%02x", signal);
+    if (state == STLINK_CORE_BREAKPOINT)
+        out += sprintf(out, "hwbreak:;");
+    if (regs_valid) {
+        out += sprintf(out, "%02x:", GDB_REG_PC);
+        out = hex_encode_reg(out, GDB_REG_PC);
+        out += sprintf(out, ";%02x:", GDB_REG_SP);
+        out = hex_encode_reg(out, GDB_REG_SP);
+        strcpy(out, ";");
+    }
+}
+
+static int breakpoints_sync(void)
+{
+    if (!breakpoints_dirty)
+        return 0;
+    if (stlink_debug_set_breakpoints(stl, breakpoints, breakpoint_count) != 0)
+        return -1;
+    breakpoints_dirty = false;
+    return 0;
+}
+
+static int breakpoint_insert(uint32_t addr)
+{
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i] == addr)
+            return 0;
+    }
+    if (breakpoint_count == STLINK_DEBUG_BREAKPOINTS)
+        return -1;
+    breakpoints[breakpoint_count++] = addr;
+    breakpoints_dirty = true;
+    return 0;
+}
+
+static int breakpoint_remove(uint32_t addr)
+{
+    for (int i = 0; i < breakpoint_count; i++) {
+        if (breakpoints[i] == addr) {
+            breakpoints[i] = breakpoints[--breakpoint_count];
+            breakpoints_dirty = true;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void run_prepare(void)
+{
+    regs_valid = false;
+}
+
+// Resumes the core and reports when it stops again, or GDB interrupts.
+static int gdb_resume(GdbConnection *c, bool step, char *reply)
+{
+    run_prepare();
+    if (breakpoints_sync() != 0 || stlink_debug_resume(stl, step) != 0) {
+        strcpy(reply, "E01");
+        return 0;
+    }
+    int signal = 5; // SIGTRAP
+    enum STLinkCoreState state;
+    for (;;) {
+        if (stlink_debug_get_state(stl, &state) != 0) {
+            strcpy(reply, "E01");
+            return 0;
+        }
+        if (state != STLINK_CORE_RUNNING)
+            break;
+        if (!gdb_pending(c, GDB_POLL_MS))
+            continue;
+        int ch = gdb_getc(c);
+        if (ch == 0x03) {
+            signal = 2; // SIGINT
+            stlink_debug_halt(stl);
+        } else if (ch < 0) {
+            stlink_debug_halt(stl);
+            return -1;
+        }
+    }
+    stop_state = state;
+    regs_fetch();
+    stop_reply(reply, signal, state);
+    return 0;
+}
+
+static bool parse_addr_len(const char *p, uint32_t *addr, uint32_t *len, char **end)
+{
+    char *e;
+    *addr = strtoul(p, &e, 16);
+    if (*e != ',')
+        return false;
+    *len = strtoul(e + 1, &e, 16);
+    if (end != NULL)
+        *end = e;
+    return true;
+}
+
+#define XFER_TARGET_XML "qXfer:features:read:target.xml:"
+
+static void handle_query(GdbConnection *c, const char *packet, char *reply)
+{
+    uint32_t off, len;
+    if (strncmp(packet, "qSupported", 10) == 0) {
+        sprintf(reply, "PacketSize=%x;qXfer:features:read+;QStartNoAckMode+;hwbreak+",
+                GDB_PACKET_SIZE);
+    } else if (strncmp(packet, XFER_TARGET_XML, strlen(XFER_TARGET_XML)) == 0 &&
+               parse_addr_len(packet + strlen(XFER_TARGET_XML), &off, &len, NULL)) {
+        size_t size = sizeof(target_xml) - 1;
+        if (off >= size) {
+            strcpy(reply, "l");
+        } else {
+            if (len > size - off)
+                len = size - off;
+            if (len > GDB_PACKET_SIZE - 2)
+                len = GDB_PACKET_SIZE - 2;
+            reply[0] = (off + len < size) ? 'm' : 'l';
+            memcpy(reply + 1, target_xml + off, len);
+            reply[1 + len] = '\0';
+        }
+    } else if (strcmp(packet, "QStartNoAckMode") == 0) {
+        gdb_reply(c, "OK");
+        c->no_ack = true;
+        return;
+    } else if (strcmp(packet, "qAttached") == 0) {
+        strcpy(reply, "1");
+    } else if (strcmp(packet, "qC") == 0) {
+        strcpy(reply, "QC1");
+    } else if (strcmp(packet, "qfThreadInfo") == 0) {
+        strcpy(reply, "m1");
+    } else if (strcmp(packet, "qsThreadInfo") == 0) {
+        strcpy(reply, "l");
+    } else if (strncmp(packet, "qSymbol", 7) == 0) {
+        strcpy(reply, "OK");
+    } else {
+        reply[0] = '\0';
+    }
+    gdb_reply(c, reply);
+}
+
+// Serves one GDB connection; returns when it detaches or disconnects.
+static void gdb_serve(int fd)
+{
+    static char packet[GDB_PACKET_SIZE];
+    static char reply[2 * GDB_PACKET_SIZE];
+    static uint8_t data[GDB_PACKET_SIZE];
+    GdbConnection conn = { .fd = fd };
+    GdbConnection *c = &conn;
+    stlink_memcache_stats before, after;
+
+    run_prepare();
+    stlink_debug_halt(stl);
+    stop_state = STLINK_CORE_HALTED;
+    stlink_memcache_get_stats(stl, &before);
+
+    for (;;) {
+        int len = gdb_recv(c, packet, sizeof(packet));
+        if (len < 0)
+            break;
+        if (len == 0) {
+            // interrupt while already stopped
+            continue;
+        }
+
+        uint32_t addr, n;
+        char *p;
+        switch (packet[0]) {
+        case '?':
+            regs_fetch();
+            stop_reply(reply, 5, stop_state);
+            break;
+        case 'g':
+            if (regs_fetch() != 0) {
+                strcpy(reply, "E01");
+                break;
+            }
+            p = reply;
+            for (int i = 0; i < GDB_REGS; i++)
+                p = hex_encode_reg(p, i);
+            break;
+        case 'G':
+            p = packet + 1;
+            if (regs_fetch() != 0) {
+                strcpy(reply, "E01");
+                break;
+            }
+            for (int i = 0; i < GDB_REGS; i++) {
+                uint8_t buf[4];
+                uint32_t val = 0;
+                if (hex_decode(p, buf, reg_sizes[i]) != 0)
+                    break;
+                for (int j = 0; j < reg_sizes[i]; j++)
+                    val = val << 8 | buf[j];
+                reg_set(i, val);
+                p += 2 * reg_sizes[i];
+            }
+            strcpy(reply, (stlink_debug_write_regs(stl, &regs) == 0) ? "OK" : "E01");
+            break;
+        case 'p':
+            n = strtoul(packet + 1, NULL, 16);
+            if (n >= GDB_REGS || regs_fetch() != 0)
+                strcpy(reply, "E01");
+            else
+                hex_encode_reg(reply, n);
+            break;
+        case 'P': {
+            n = strtoul(packet + 1, &p, 16);
+            uint8_t buf[4];
+            uint32_t val = 0;
+            if (n >= GDB_REGS || *p != '=' || regs_fetch() != 0 ||
+                hex_decode(p + 1, buf, reg_sizes[n]) != 0) {
+                strcpy(reply, "E01");
+                break;
+            }
+            for (int j = 0; j < reg_sizes[n]; j++)
+                val = val << 8 | buf[j];
+            reg_set(n, val);
+            strcpy(reply, (stlink_debug_write_regs(stl, &regs) == 0) ? "OK" : "E01");
+            break;
+        }
+        case 'm':
+            if (!parse_addr_len(packet + 1, &addr, &n, NULL) || n > sizeof(data) / 2 ||
+                mem_read(addr, n, data) != 0)
+                strcpy(reply, "E01");
+            else
+                hex_encode(reply, data, n);
+            break;
+        case 'M':
+            if (!parse_addr_len(packet + 1, &addr, &n, &p) || *p != ':' ||
+                n > sizeof(data) || hex_decode(p + 1, data, n) != 0 ||
+                (n > 0 && mem_write(addr, n, data) != 0))
+                strcpy(reply, "E01");
+            else
+                strcpy(reply, "OK");
+            break;
+        case 'c':
+        case 's':
+            if (packet[1] != '\0') {
+                if (regs_fetch() != 0) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+                regs.pc = strtoul(packet + 1, NULL, 16) & 0xffffff;
+                if (stlink_debug_write_regs(stl, &regs) != 0) {
+                    strcpy(reply, "E01");
+                    break;
+                }
+            }
+            if (gdb_resume(c, packet[0] == 's', reply) != 0)
+                goto out;
+            break;
+        case 'Z':
+        case 'z':
+            if ((packet[1] != '0' && packet[1] != '1') || packet[2] != ',' ||
+                !parse_addr_len(packet + 3, &addr, &n, NULL)) {
+                reply[0] = '\0';
+                break;
+            }
+            if (packet[0] == 'Z')
+                strcpy(reply, (breakpoint_insert(addr) == 0) ? "OK" : "E0e");
+            else
+                strcpy(reply, (breakpoint_remove(addr) == 0) ? "OK" : "E01");
+            break;
+        case 'q':
+        case 'Q':
+            handle_query(c, packet, reply);
+            continue;
+        case 'H':
+        case 'T':
+            strcpy(reply, "OK");
+            break;
+        case 'D':
+            breakpoint_count = 0;
+            breakpoints_dirty = true;
+            run_prepare();
+            breakpoints_sync();
+            stlink_debug_resume(stl, false);
+            gdb_reply(c, "OK");
+            goto out;
+        case 'k':
+            goto out;
+        default:
+            reply[0] = '\0';
+            break;
+        }
+        if (gdb_reply(c, reply) != 0)
+            break;
+    }
+out:
+    stlink_memcache_get_stats(stl, &after);
+    printf("GDB disconnected, memory cache %" PRIu32 " hits, %" PRIu32 " lines read\n",
+           after.hits - before.hits, after.misses - before.misses);
+}
+
+static int attach(void)
+{
+    int mode = stlink_get_current_mode(stl);
+    if (mode == STLINK_DEV_DFU_MODE) {
+        stlink_exit_dfu_mode(stl);
+        mode = stlink_get_current_mode(stl);
+    }
+    if (mode != -1 && mode != STLINK_DEV_SWIM_MODE) {
+        stlink_swim_enter(stl);
+        mode = stlink_get_current_mode(stl);
+    }
+    if (mode != STLINK_DEV_SWIM_MODE)
+        return -1;
+    stlink_swim_target_info info;
+    if (stlink_swim_get_size(stl, &swim_size) != 0 || swim_size == 0 ||
+        stlink_swim_get_02(stl, 0x01) != 0 ||
+        stlink_swim_do_07(stl) != 0 || stlink_swim_wait(stl) != 0 ||
+        stlink_swim_prologue(stl, &info) != 0)
+        return -1;
+    const stlink_device *dev = stlink_device_detect(stl);
+    if (dev == NULL)
+        return -1;
+    stlink_set_device(stl, dev);
+    return stlink_memcache_enable(stl, true);
+}
+
+static int listen_tcp(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 || listen(fd, 1) != 0) {
+        fprintf(stderr, "port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-e] [-l latency_us] [-p port] [-s serial] [-q] [-v]\n"
+                    "  -e  use an emulated ST-Link instead of USB\n"
+                    "  -l  per-transfer latency of the emulated ST-Link\n"
+                    "  -p  TCP port on localhost to listen on (default %d)\n"
+                    "  -q  only log errors\n"
+                    "  -s  open the ST-Link with the given serial number\n"
+                    "  -v  log every command, including CDB dumps\n",
+                    prog, GDB_DEFAULT_PORT);
+}
+
+int main(int argc, char **argv)
+{
+    bool emulate = false;
+    unsigned int latency_us = 1000;
+    int port = GDB_DEFAULT_PORT;
+    stlink_probe_info match;
+    memset(&match, 0, sizeof(match));
+
+    int opt;
+    while ((opt = getopt(argc, argv, "el:p:qs:v")) != -1) {
+        switch (opt) {
+        case 'e':
+            emulate = true;
+            break;
+        case 'l':
+            latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            port = strtol(optarg, NULL, 0);
+            break;
+        case 'q':
+            stlink_log_set_level(STLINK_LOG_ERROR);
+            break;
+        case 's':
+            snprintf(match.serial, sizeof(match.serial), "%s", optarg);
+            break;
+        case 'v':
+            stlink_log_set_level(STLINK_LOG_DEBUG);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+
+    libusb_context *usb_context = NULL;
+    if (emulate) {
+        stl = stlink_emu_open(latency_us);
+    } else {
+        if (libusb_init(&usb_context) != 0) {
+            fprintf(stderr, "USB init failed, exiting.\n");
+            return -1;
+        }
+        stl = stlink_open_probe(usb_context, &match);
+    }
+    int ret = -1;
+    int fd = -1;
+    if (stl == NULL) {
+        fprintf(stderr, "Opening ST-Link device failed.\n");
+    } else if (attach() != 0) {
+        fprintf(stderr, "Attaching the target failed.\n");
+    } else if ((fd = listen_tcp(port)) >= 0) {
+        signal(SIGPIPE, SIG_IGN);
+        printf("Listening on localhost:%d\n", port);
+        fflush(stdout);
+        for (;;) {
+            int conn = accept(fd, NULL, NULL);
+            if (conn < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            int one = 1;
+            setsockopt(conn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            gdb_serve(conn);
+            close(conn);
+            fflush(stdout);
+        }
+        close(fd);
+        ret = 0;
+    }
+
+    if (stl != NULL) {
+        stlink_swim_epilogue(stl, NULL);
+        stlink_swim_exit(stl);
+        stlink_close(stl);
+    }
+    if (usb_context != NULL)
+        libusb_exit(usb_context);
+    return ret;
+}
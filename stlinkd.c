@@ -0,0 +1,533 @@
+/*
+ * ST-Link daemon
+ *
+ * Copyright (c) 2011 Andreas Färber
+ *
+ * Licensed under the GNU General Public License (GPL) version 2, or
+ * at your option, any later version.
+ *
+ * Owns the probes and keeps each of them in SWIM mode with the target in
+ * debug mode, serving jobs from stlink-daemon.h over a Unix-domain socket.
+ * A failed job drops the target, which is brought up again for the next.
+ * The part is detected each time the target is brought up, unless set,
+ * and reported to clients with the probe.
+ * Requests are taken in as far as each client has sent them, without
+ * blocking, so that a client stalling mid-request holds up nobody else;
+ * replies give up on a client not reading them after a timeout.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "stlink.h"
+#include "stlink-libusb.h"
+#include "stlink-cache.h"
+#include "stlink-daemon.h"
+#include "stlink-device.h"
+#include "stlink-emu.h"
+#include "stlink-flash.h"
+#include "stlink-log.h"
+#include "stlink-poll.h"
+#include "stlink-read.h"
+#include "stlink-recover.h"
+#include "stlink-session.h"
+#include "stlink-verify.h"
+
+#define MAX_CLIENTS 32
+#define CLIENT_SEND_TIMEOUT_S 5
+
+typedef struct DaemonProbe {
+    stlink *stl;
+    stlink_cache *cache;
+    uint16_t swim_size;     // bytes per SWIM write
+    bool connected;
+    uint32_t jobs;
+    uint32_t failures;
+} DaemonProbe;
+
+// A request as far as received
+typedef struct DaemonClient {
+    int fd;
+    stlink_daemon_request req;
+    uint8_t *payload;       // allocated on the first WRITE or FLASH
+    size_t received;        // header, then payload bytes
+} DaemonClient;
+
+static DaemonProbe *probes;
+static int probe_count;
+static bool use_cache;
+static const stlink_device *device; // detected if NULL
+static volatile sig_atomic_t quit;
+
+static void probe_detach(DaemonProbe *p)
+{
+    if (p->cache != NULL) {
+        stlink_set_cache(p->stl, NULL);
+        stlink_cache_close(p->cache);
+        p->cache = NULL;
+    }
+    if (p->connected)
+        stlink_swim_epilogue(p->stl, NULL);
+    p->connected = false;
+}
+
+static int probe_attach(DaemonProbe *p)
+{
+    int mode = stlink_get_current_mode(p->stl);
+    if (mode == STLINK_DEV_DFU_MODE) {
+        stlink_exit_dfu_mode(p->stl);
+        mode = stlink_get_current_mode(p->stl);
+    }
+    if (mode != -1 && mode != STLINK_DEV_SWIM_MODE) {
+        stlink_swim_enter(p->stl);
+        mode = stlink_get_current_mode(p->stl);
+    }
+    if (mode != STLINK_DEV_SWIM_MODE)
+        return -1;
+    stlink_recovery_set_reenter(p->stl, true);
+
+    stlink_swim_target_info info;
+    if (stlink_swim_get_size(p->stl, &p->swim_size) != 0 || p->swim_size == 0 ||
+        stlink_swim_get_02(p->stl, 0x01) != 0 ||
+        stlink_swim_do_07(p->stl) != 0 || stlink_swim_wait(p->stl) != 0 ||
+        stlink_swim_prologue(p->stl, &info) != 0)
+        return -1;
+    p->connected = true;
+
+    const stlink_device *dev = (device != NULL) ? device : stlink_device_detect(p->stl);
+    if (dev == NULL)
+        return -1;
+    stlink_set_device(p->stl, dev);
+
+    if (use_cache) {
+        p->cache = stlink_cache_open_target(p->stl, NULL);
+        if (p->cache != NULL && stlink_cache_validate(p->stl, p->cache, 4) < 0) {
+            stlink_cache_close(p->cache);
+            p->cache = NULL;
+        }
+        stlink_set_cache(p->stl, p->cache);
+    }
+    return 0;
+}
+
+static int probe_ensure(DaemonProbe *p)
+{
+    if (p->connected)
+        return 0;
+    if (probe_attach(p) == 0)
+        return 0;
+    fprintf(stderr, "%s: cannot attach target\n", stlink_get_serial(p->stl));
+    probe_detach(p);
+    return -1;
+}
+
+static int probe_write(DaemonProbe *p, uint32_t addr, uint32_t len, uint8_t *data)
+{
+    for (uint32_t off = 0; off < len; off += p->swim_size) {
+        uint16_t n = (len - off > p->swim_size) ? p->swim_size : len - off;
+        if (stlink_swim_write_wait(p->stl, addr + off, n, data + off) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int probe_flash(DaemonProbe *p, const stlink_daemon_request *req,
+                       const uint8_t *payload, stlink_daemon_flash *reply)
+{
+    stlink_flash_stats stats;
+    memset(reply, 0, sizeof(*reply));
+    if (stlink_flash_write_delta(p->stl, req->addr, payload, req->len, &stats) != 0)
+        return -1;
+    reply->blocks_total = stats.blocks_total;
+    reply->blocks_skipped = stats.blocks_skipped;
+    reply->blocks_programmed = stats.blocks_programmed;
+    reply->bytes_programmed = stats.bytes_programmed;
+
+    enum STLinkVerifyMode mode = (req->flags & STLINK_DAEMON_VERIFY_ON_TARGET) ?
+                                 STLINK_VERIFY_ON_TARGET : STLINK_VERIFY_READBACK;
+    stlink_verify_result result;
+    int ret = stlink_verify(p->stl, req->addr, payload, req->len, mode, &result);
+    reply->elapsed_us = stats.elapsed_us + result.elapsed_us;
+    reply->crc = result.crc_actual;
+    reply->verified = result.match;
+    reply->on_target = result.on_target;
+    return ret;
+}
+
+// Runs one job; returns the reply payload length, or -1.
+static int handle_job(const stlink_daemon_request *req, uint8_t *payload, void *reply)
+{
+    switch (req->cmd) {
+    case STLINK_DAEMON_HELLO: {
+        stlink_daemon_hello *hello = reply;
+        hello->version = STLINK_DAEMON_VERSION;
+        hello->probes = probe_count;
+        return sizeof(*hello);
+    }
+    case STLINK_DAEMON_PROBE: {
+        if (req->probe >= probe_count)
+            return -1;
+        DaemonProbe *p = &probes[req->probe];
+        stlink_daemon_probe *info = reply;
+        memset(info, 0, sizeof(*info));
+        snprintf(info->serial, sizeof(info->serial), "%s", stlink_get_serial(p->stl));
+        if (p->connected)
+            snprintf(info->part, sizeof(info->part), "%s", stlink_get_device(p->stl)->name);
+        info->connected = p->connected;
+        info->jobs = p->jobs;
+        info->failures = p->failures;
+        return sizeof(*info);
+    }
+    case STLINK_DAEMON_READ:
+    case STLINK_DAEMON_WRITE:
+    case STLINK_DAEMON_FLASH:
+    case STLINK_DAEMON_RECONNECT:
+        break;
+    default:
+        return -1;
+    }
+
+    if (req->probe >= probe_count)
+        return -1;
+    DaemonProbe *p = &probes[req->probe];
+    p->jobs++;
+    if (req->cmd == STLINK_DAEMON_RECONNECT)
+        probe_detach(p);
+    if (probe_ensure(p) != 0) {
+        p->failures++;
+        return -1;
+    }
+
+    int ret = 0;
+    switch (req->cmd) {
+    case STLINK_DAEMON_READ: {
+        stlink_memory_sink sink = {
+            .buffer = reply,
+            .base = req->addr,
+            .size = req->len,
+        };
+        if (stlink_cache_read(p->stl, req->addr, req->len, stlink_sink_memory, &sink) != 0)
+            ret = -1;
+        else
+            ret = req->len;
+        break;
+    }
+    case STLINK_DAEMON_WRITE:
+        ret = probe_write(p, req->addr, req->len, payload);
+        break;
+    case STLINK_DAEMON_FLASH:
+        ret = (probe_flash(p, req, payload, reply) == 0) ? sizeof(stlink_daemon_flash) : -1;
+        break;
+    }
+    if (ret < 0) {
+        p->failures++;
+        probe_detach(p);
+    }
+    return ret;
+}
+
+static bool request_has_payload(const stlink_daemon_request *req)
+{
+    return req->cmd == STLINK_DAEMON_WRITE || req->cmd == STLINK_DAEMON_FLASH;
+}
+
+/*
+ * Takes in what the client has sent so far.  Returns 1 once the request
+ * is complete, 0 while more is to come and -1 to drop the client.
+ */
+static int client_receive(DaemonClient *c)
+{
+    size_t want = sizeof(c->req);
+    if (c->received >= sizeof(c->req) && request_has_payload(&c->req))
+        want += c->req.len;
+    while (c->received < want) {
+        uint8_t *dst = (c->received < sizeof(c->req)) ?
+                       (uint8_t *)&c->req + c->received :
+                       c->payload + (c->received - sizeof(c->req));
+        ssize_t n = recv(c->fd, dst, want - c->received, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->received += n;
+        if (c->received != sizeof(c->req))
+            continue;
+        if (c->req.len > STLINK_DAEMON_MAX_PAYLOAD)
+            return -1;
+        if (request_has_payload(&c->req)) {
+            if (c->payload == NULL)
+                c->payload = malloc(STLINK_DAEMON_MAX_PAYLOAD);
+            if (c->payload == NULL)
+                return -1;
+            want += c->req.len;
+        }
+    }
+    return 1;
+}
+
+// Serves a request once complete; -1 drops the client.
+static int serve(DaemonClient *c)
+{
+    static uint8_t reply_data[STLINK_DAEMON_MAX_PAYLOAD];
+    int ret = client_receive(c);
+    if (ret <= 0)
+        return ret;
+    c->received = 0;
+
+    int len = handle_job(&c->req, c->payload, reply_data);
+    stlink_daemon_reply reply = {
+        .status = (len < 0) ? -1 : 0,
+        .len = (len < 0) ? 0 : len,
+    };
+    if (stlink_daemon_send(c->fd, &reply, sizeof(reply)) != 0 ||
+        (reply.len > 0 && stlink_daemon_send(c->fd, reply_data, reply.len) != 0))
+        return -1;
+    return 0;
+}
+
+static void client_close(DaemonClient *c)
+{
+    close(c->fd);
+    free(c->payload);
+}
+
+static int listen_socket(const char *path)
+{
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    // a stale socket is taken over, a live one is not
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == 0) {
+        fprintf(stderr, "%s: daemon already running\n", path);
+        close(fd);
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || listen(fd, 8) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+static void handle_signal(int sig)
+{
+    quit = 1;
+}
+
+static int run(int listen_fd)
+{
+    // fds[i + 1] belongs to client[i]
+    struct pollfd fds[1 + MAX_CLIENTS];
+    DaemonClient client[MAX_CLIENTS];
+    int clients = 0;
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+
+    while (!quit) {
+        if (poll(fds, 1 + clients, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        for (int i = 0; i < clients; i++) {
+            if (fds[i + 1].revents == 0)
+                continue;
+            if ((fds[i + 1].revents & POLLIN) && serve(&client[i]) == 0)
+                continue;
+            client_close(&client[i]);
+            clients--;
+            client[i] = client[clients];
+            fds[i + 1] = fds[clients + 1];
+            i--;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listen_fd, NULL, NULL);
+            if (fd < 0)
+                continue;
+            if (clients == MAX_CLIENTS) {
+                close(fd);
+                continue;
+            }
+            struct timeval timeout = { .tv_sec = CLIENT_SEND_TIMEOUT_S };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            memset(&client[clients], 0, sizeof(DaemonClient));
+            client[clients].fd = fd;
+            fds[clients + 1].fd = fd;
+            fds[clients + 1].events = POLLIN;
+            fds[clients + 1].revents = 0;
+            clients++;
+        }
+    }
+    for (int i = 0; i < clients; i++) {
+        client_close(&client[i]);
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-e] [-l latency_us] [-n count] [-s serial] [-S socket]\n"
+                    "       [-C] [-P part] [-q] [-v]\n"
+                    "  -C  keep target contents in a local cache across runs\n"
+                    "  -e  use emulated ST-Link devices instead of USB\n"
+                    "  -l  per-transfer latency of the emulated ST-Link\n"
+                    "  -n  number of probes to serve (default: all, or 1 emulated)\n"
+                    "  -P  target part, e.g. STM8S105K6, instead of detecting it;\n"
+                    "      with -e also the part emulated\n"
+                    "  -q  only log errors\n"
+                    "  -s  serve only the ST-Link with the given serial number\n"
+                    "  -S  socket path instead of the default\n"
+                    "  -v  log every command, including CDB dumps\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+    bool emulate = false;
+    stlink_emu_config emu_config;
+    stlink_emu_get_default_config(&emu_config);
+    int count = 0;
+    char path[108];
+    stlink_probe_info match;
+    memset(&match, 0, sizeof(match));
+    if (stlink_daemon_socket_path(path, sizeof(path)) != 0)
+        path[0] = '\0';
+
+    int opt;
+    while ((opt = getopt(argc, argv, "Cel:n:P:qs:S:v")) != -1) {
+        switch (opt) {
+        case 'C':
+            use_cache = true;
+            break;
+        case 'e':
+            emulate = true;
+            break;
+        case 'l':
+            emu_config.latency_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            count = strtol(optarg, NULL, 0);
+            break;
+        case 'P':
+            device = stlink_device_find(optarg);
+            if (device == NULL) {
+                fprintf(stderr, "Unknown part %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'q':
+            stlink_log_set_level(STLINK_LOG_ERROR);
+            break;
+        case 's':
+            snprintf(match.serial, sizeof(match.serial), "%s", optarg);
+            break;
+        case 'S':
+            snprintf(path, sizeof(path), "%s", optarg);
+            break;
+        case 'v':
+            stlink_log_set_level(STLINK_LOG_DEBUG);
+            break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (count < 0 || path[0] == '\0') {
+        usage(argv[0]);
+        return -1;
+    }
+    emu_config.device = device;
+
+    libusb_context *usb_context = NULL;
+    stlink_probe_info *infos = NULL;
+    int found;
+    if (emulate) {
+        found = (count > 0) ? count : 1;
+    } else {
+        if (libusb_init(&usb_context) != 0) {
+            fprintf(stderr, "USB init failed, exiting.\n");
+            return -1;
+        }
+        if (match.serial[0] != '\0') {
+            found = 1;
+        } else {
+            found = stlink_enumerate(usb_context, &infos);
+            if (found < 0)
+                found = 0;
+        }
+    }
+    if (count == 0 || count > found)
+        count = found;
+
+    // Jobs are served one at a time, so the probes can share a context.
+    probes = calloc((count > 0) ? count : 1, sizeof(DaemonProbe));
+    for (int i = 0; probes != NULL && i < count; i++) {
+        stlink *stl;
+        if (emulate)
+            stl = stlink_emu_open_config(&emu_config);
+        else
+            stl = stlink_open_probe(usb_context, (infos != NULL) ? &infos[i] : &match);
+        if (stl == NULL)
+            continue;
+        stlink_get_version(stl);
+        probes[probe_count].stl = stl;
+        if (probe_ensure(&probes[probe_count]) == 0)
+            printf("%s: ready\n", stlink_get_serial(stl));
+        probe_count++;
+    }
+    free(infos);
+
+    int ret = -1;
+    if (probe_count == 0) {
+        fprintf(stderr, "No ST-Link devices.\n");
+    } else {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        int fd = listen_socket(path);
+        if (fd >= 0) {
+            printf("Serving %d probes on %s\n", probe_count, path);
+            fflush(stdout);
+            ret = run(fd);
+            close(fd);
+            unlink(path);
+        }
+    }
+
+    for (int i = 0; i < probe_count; i++) {
+        probe_detach(&probes[i]);
+        stlink_swim_exit(probes[i].stl);
+        stlink_close(probes[i].stl);
+    }
+    free(probes);
+    if (usb_context != NULL)
+        libusb_exit(usb_context);
+    printf("done.\n");
+    return ret;
+}
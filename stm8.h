@@ -73,6 +73,23 @@ enum STM8DMRegisters {
     STM8_DM_ENFCTR  = 0x007f9a,
 };
 
+enum STM8DMControlRegister1Bits {
+    STM8_DM_CR1_WDGOFF      = 1 << 7,
+    STM8_DM_CR1_BC_MASK     = 7 << 3,
+    STM8_DM_CR1_BC_FETCH    = 5 << 3, // instruction fetch at BK1 or BK2
+    STM8_DM_CR1_BIR         = 1 << 2,
+    STM8_DM_CR1_BIW         = 1 << 1,
+};
+
+enum STM8DMControlStatusRegister1Bits {
+    STM8_DM_CSR1_STE    = 1 << 6,
+    STM8_DM_CSR1_STF    = 1 << 5,
+    STM8_DM_CSR1_RST    = 1 << 4,
+    STM8_DM_CSR1_BRW    = 1 << 3,
+    STM8_DM_CSR1_BK2F   = 1 << 2,
+    STM8_DM_CSR1_BK1F   = 1 << 1,
+};
+
 enum STM8DMControlStatusRegister2Bits {
     STM8_DM_CSR2_SWBKE  = 1 << 5,
     STM8_DM_CSR2_SWBKF  = 1 << 4,
@@ -112,5 +129,62 @@ enum STM8S105xxRegisters {
     STM8S105_CLK_SWIMCCR    = 0x0050cd,
 };
 
+enum STM8S105xxMemory {
+    STM8S105_RAM_START          = 0x000000,
+    STM8S105_RAM_SIZE           = 2 * 1024,
+    STM8S105_EEPROM_START       = 0x004000,
+    STM8S105_EEPROM_SIZE        = 1024,
+    STM8S105_OPTION_START       = 0x004800,
+    STM8S105_OPTION_SIZE        = 128,
+    STM8S105_IO_START           = 0x005000, // GPIO and peripheral registers
+    STM8S105_IO_SIZE            = 2 * 1024,
+    STM8S105_BOOT_ROM_START     = 0x006000,
+    STM8S105_BOOT_ROM_SIZE      = 2 * 1024,
+    STM8S105_CPU_START          = 0x007f00, // CPU, SWIM and debug module registers
+    STM8S105_CPU_SIZE           = 256,
+    STM8S105_FLASH_START        = 0x008000,
+    STM8S105_FLASH_SIZE         = 32 * 1024,
+    STM8S105_FLASH_BLOCK_SIZE   = 128,
+    STM8S105_FLASH_PROG_TIME_US = 6000, // standard block programming, incl. erase
+};
+
+// RM0016
+enum STM8FlashCR2Bits {
+    STM8_FLASH_CR2_OPT      = 1 << 7,
+    STM8_FLASH_CR2_WPRG     = 1 << 6,
+    STM8_FLASH_CR2_ERASE    = 1 << 5,
+    STM8_FLASH_CR2_FPRG     = 1 << 4,
+    STM8_FLASH_CR2_PRG      = 1 << 0,
+};
+
+#define STM8_FLASH_WORD_SIZE 4  // FLASH_CR2.WPRG, word aligned
+
+// RM0016
+enum STM8FlashIAPSRBits {
+    STM8_FLASH_IAPSR_HVOFF      = 1 << 6,
+    STM8_FLASH_IAPSR_DUL        = 1 << 3,
+    STM8_FLASH_IAPSR_EOP        = 1 << 2,
+    STM8_FLASH_IAPSR_PUL        = 1 << 1,
+    STM8_FLASH_IAPSR_WR_PG_DIS  = 1 << 0,
+};
+
+enum STM8FlashKeys {
+    STM8_FLASH_PUKR_KEY1    = 0x56,
+    STM8_FLASH_PUKR_KEY2    = 0xae,
+    STM8_FLASH_DUKR_KEY1    = 0xae,
+    STM8_FLASH_DUKR_KEY2    = 0x56,
+};
+
+// RM0016
+enum STM8ClockSWIMCCRBits {
+    STM8_CLK_SWIMCCR_SWIMCLK    = 1 << 0, // SWIM clock not divided by 2
+};
+
+enum STM8SWIMTiming {
+    STM8_HSI_HZ             = 16000000,
+    STM8_SWIM_HS_CYCLES     = 10, // SWIM clocks per bit, high speed
+    STM8_SWIM_LS_CYCLES     = 22, // low speed
+};
+
 
 #endif